@@ -0,0 +1,82 @@
+#include "adaptive_policy.h"
+
+#include <algorithm>
+#include <cmath>
+
+/**
+ * Drop all sketches once there are this many hosts.
+ */
+static const size_t MAX_HOSTS = 10000;
+
+/**
+ * Timeouts in a row stop doubling the timeout after this many.
+ */
+static const uint32_t MAX_BACKOFF_DOUBLINGS = 6;
+
+void AdaptiveTimeoutPolicy::LatencySketch::add(long long latency_us)
+{
+  int bucket = 0;
+  if (latency_us >= 1000) {
+    bucket = static_cast<int>(4 * std::log2(latency_us / 1000.0)) + 1;
+    bucket = bucket < BUCKETS ? bucket : BUCKETS - 1;
+  }
+  counts[bucket]++;
+  if (++total >= DECAY_TOTAL) {
+    total = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+      counts[i] /= 2;
+      total += counts[i];
+    }
+  }
+}
+
+double AdaptiveTimeoutPolicy::LatencySketch::upper_ms(double p) const
+{
+  uint32_t rank = static_cast<uint32_t>(std::ceil(p * total));
+  uint32_t seen = 0;
+  int bucket = 0;
+  for (; bucket < BUCKETS - 1; bucket++) {
+    seen += counts[bucket];
+    if (seen >= rank) {
+      break;
+    }
+  }
+  return std::exp2(bucket / 4.0);
+}
+
+long AdaptiveTimeoutPolicy::hop_timeout_ms(const std::string& host, long remaining_ms)
+{
+  auto it = sketches.find(host);
+  if (it == sketches.end() || it->second.total < min_samples) {
+    return remaining_ms;
+  }
+  const LatencySketch& sketch = it->second;
+  double timeout_ms = sketch.upper_ms(percentile) * factor + margin_ms;
+  if (timeout_ms < min_timeout_ms) {
+    timeout_ms = min_timeout_ms;
+  }
+  timeout_ms = std::ldexp(timeout_ms, std::min(sketch.timeouts_in_a_row, MAX_BACKOFF_DOUBLINGS));
+  return timeout_ms < remaining_ms ? static_cast<long>(timeout_ms) : remaining_ms;
+}
+
+void AdaptiveTimeoutPolicy::on_hop_complete(const std::string& host, CURLcode code, long long latency_us)
+{
+  // Other failures, e.g. refused connections or DNS errors, say nothing
+  // about how long a response takes.
+  if (code != CURLE_OK && code != CURLE_OPERATION_TIMEDOUT) {
+    return;
+  }
+  auto it = sketches.find(host);
+  if (it == sketches.end()) {
+    if (sketches.size() >= MAX_HOSTS) {
+      sketches.clear();
+    }
+    it = sketches.insert(std::make_pair(host, LatencySketch())).first;
+  }
+  if (code == CURLE_OPERATION_TIMEDOUT) {
+    it->second.timeouts_in_a_row++;
+  } else {
+    it->second.timeouts_in_a_row = 0;
+    it->second.add(latency_us);
+  }
+}
@@ -0,0 +1,102 @@
+#ifndef URL_EXPANDER_ADAPTIVE_POLICY_H
+#define URL_EXPANDER_ADAPTIVE_POLICY_H
+
+#include "engine.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+/**
+ * ExpansionPolicy that gives each hop about as long as its host usually
+ * needs, instead of the whole remaining budget. A fast shortener that has not
+ * answered within a few times its usual latency is most likely not going to,
+ * so a dead connection costs tens of ms rather than the budget, while slow
+ * hosts still get all of it.
+ *
+ * Each host has a sketch of its recent successful hop latencies, and the
+ * timeout is a high percentile of it times a factor plus a margin, within the
+ * remaining budget. Timed out hops are not sketched, since counting them as
+ * taking their timeout would let a host that drops a few percent of requests
+ * push its own percentile up to the budget. Instead, each timeout in a row
+ * doubles the host's timeout, so a host that became slower gets through
+ * again and its new latencies replace the old ones. Until a host has
+ * min_samples successful hops, it gets the remaining budget as with the base
+ * policy. With a RetryPolicy, follow_redirects retries hops that time out
+ * short of the budget on a new connection, so that the time saved goes into
+ * a fresh attempt.
+ */
+class AdaptiveTimeoutPolicy : public ExpansionPolicy {
+ public:
+  AdaptiveTimeoutPolicy()
+    : percentile(0.99), factor(1.5), margin_ms(20), min_timeout_ms(50), min_samples(20)
+  {
+  }
+
+  long hop_timeout_ms(const std::string& host, long remaining_ms);
+  void on_hop_complete(const std::string& host, CURLcode code, long long latency_us);
+
+  /**
+   * Timeouts are the given percentile (0.99 by default) of a host's
+   * latencies, times factor (1.5) plus margin_ms (20), and at least
+   * min_timeout_ms (50).
+   */
+  void set_timeout(double percentile, double factor, long margin_ms, long min_timeout_ms)
+  {
+    this->percentile = percentile;
+    this->factor = factor;
+    this->margin_ms = margin_ms;
+    this->min_timeout_ms = min_timeout_ms;
+  }
+
+  /**
+   * Successful hops a host needs before its timeouts adapt. 20 by default.
+   */
+  void set_min_samples(uint32_t min_samples)
+  {
+    this->min_samples = min_samples;
+  }
+
+ private:
+  /**
+   * Log-scale histogram of a host's hop latencies. Bucket 0 counts latencies
+   * under 1 ms, and bucket b > 0 those under 2^(b/4) ms, i.e. each bucket is
+   * 19% wider than the previous one, up to 55 s. Counts are halved whenever
+   * the total reaches DECAY_TOTAL, so old samples fade out.
+   */
+  struct LatencySketch {
+    static const int BUCKETS = 64;
+    static const uint32_t DECAY_TOTAL = 512;
+
+    LatencySketch() : total(0), timeouts_in_a_row(0)
+    {
+      for (int i = 0; i < BUCKETS; i++) {
+        counts[i] = 0;
+      }
+    }
+
+    void add(long long latency_us);
+
+    /**
+     * Upper bound in ms of the latency at fraction p of the samples.
+     */
+    double upper_ms(double p) const;
+
+    uint16_t counts[BUCKETS];
+    uint32_t total;
+
+    /**
+     * Hops that timed out since the last successful one.
+     */
+    uint32_t timeouts_in_a_row;
+  };
+
+  double percentile;
+  double factor;
+  long margin_ms;
+  long min_timeout_ms;
+  uint32_t min_samples;
+  std::unordered_map<std::string, LatencySketch> sketches;
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include "address_health.h"
+
+#include <netinet/in.h>
+
+#include <algorithm>
+
+/**
+ * Penalty for the first failure, doubled for each further one up to
+ * MAX_PENALTY_US.
+ */
+static const long long PENALTY_US = 1000000;
+static const long long MAX_PENALTY_US = 300 * 1000000LL;
+
+/**
+ * Drop all entries once there are this many.
+ */
+static const size_t MAX_ADDRESSES = 10000;
+
+static std::string address_key(const struct sockaddr_storage& address)
+{
+  if (address.ss_family == AF_INET6) {
+    const struct sockaddr_in6& ipv6 = reinterpret_cast<const struct sockaddr_in6&>(address);
+    return std::string("6").append(reinterpret_cast<const char*>(&ipv6.sin6_addr), sizeof(ipv6.sin6_addr));
+  }
+  const struct sockaddr_in& ipv4 = reinterpret_cast<const struct sockaddr_in&>(address);
+  return std::string("4").append(reinterpret_cast<const char*>(&ipv4.sin_addr), sizeof(ipv4.sin_addr));
+}
+
+void AddressHealth::record_success(const struct sockaddr_storage& address)
+{
+  if (!entries.empty()) {
+    entries.erase(address_key(address));
+  }
+}
+
+void AddressHealth::record_failure(const struct sockaddr_storage& address, long long now_us)
+{
+  std::string key = address_key(address);
+  auto it = entries.find(key);
+  if (it == entries.end()) {
+    if (entries.size() >= MAX_ADDRESSES) {
+      entries.clear();
+    }
+    it = entries.insert(std::make_pair(key, Entry{0, 0})).first;
+  }
+  Entry& entry = it->second;
+  long long penalty = entry.failures < 20 ? PENALTY_US << entry.failures : MAX_PENALTY_US;
+  entry.failures++;
+  entry.penalized_until_us = now_us + std::min(penalty, MAX_PENALTY_US);
+}
+
+long long AddressHealth::penalty_end(const struct sockaddr_storage& address, long long now_us) const
+{
+  auto it = entries.find(address_key(address));
+  return it != entries.end() && it->second.penalized_until_us > now_us ? it->second.penalized_until_us : 0;
+}
+
+void AddressHealth::order(std::vector<struct sockaddr_storage>& addresses, long long now_us) const
+{
+  if (entries.empty() || addresses.size() < 2) {
+    return;
+  }
+  std::stable_sort(addresses.begin(), addresses.end(),
+      [&](const struct sockaddr_storage& a, const struct sockaddr_storage& b) {
+        return penalty_end(a, now_us) < penalty_end(b, now_us);
+      });
+}
@@ -0,0 +1,55 @@
+#ifndef URL_EXPANDER_ADDRESS_HEALTH_H
+#define URL_EXPANDER_ADDRESS_HEALTH_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/socket.h>
+
+/**
+ * What connecting to each server address has been like recently. Shorteners
+ * publish several A and AAAA records, and one of them is occasionally dead or
+ * overloaded for a while. An address whose connection attempt failed or lost
+ * a race is tried after the others until its penalty runs out, which doubles
+ * with every further failure and ends with its next success. Addresses are
+ * only ever reordered, never skipped, so a host whose addresses are all
+ * penalized is still tried.
+ */
+class AddressHealth {
+ public:
+  /**
+   * Record a successful connection to address, without its port.
+   */
+  void record_success(const struct sockaddr_storage& address);
+
+  /**
+   * Record a failed or abandoned connection attempt to address, at now_us
+   * on a steady clock.
+   */
+  void record_failure(const struct sockaddr_storage& address, long long now_us);
+
+  /**
+   * Stably move addresses that are penalized at now_us behind the others,
+   * those whose penalty ends first ahead.
+   */
+  void order(std::vector<struct sockaddr_storage>& addresses, long long now_us) const;
+
+ private:
+  struct Entry {
+    int failures;
+    long long penalized_until_us;
+  };
+
+  /**
+   * When address stops being penalized, or 0 if it is not.
+   */
+  long long penalty_end(const struct sockaddr_storage& address, long long now_us) const;
+
+  /**
+   * Entries keyed by address family and bytes.
+   */
+  std::unordered_map<std::string, Entry> entries;
+};
+
+#endif
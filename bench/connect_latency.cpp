@@ -0,0 +1,226 @@
+#include "replay_harness.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * Measures how long new connections take with the expander's socket
+ * profiles. Runs the url-expander binary in stdin mode with MAX_CONNECTIONS=1
+ * over URLs that alternate between --hosts hosts, so that every request
+ * opens a new connection, against bench/replay-server. Does so with the
+ * default profile and with TCP Fast Open, over http and https, and prints
+ * the mean time per expansion and the share of connections that sent data in
+ * the SYN, as logged by the expander.
+ *
+ * Fast Open saves a round trip, which loopback does not have. --rtt-ms adds
+ * one with netem on the loopback interface for the duration of the run,
+ * which needs root and the sch_netem kernel module. Fast Open also needs
+ * both bits of net.ipv4.tcp_fastopen, i.e. 3, since the replay server runs
+ * on the same host:
+ *
+ *     sysctl -w net.ipv4.tcp_fastopen=3
+ */
+
+struct Config {
+  const char* name;
+  const char* fast_open;
+};
+
+static const Config configs[] = {
+  {"default", "0"},
+  {"fast_open", "1"},
+};
+
+/**
+ * The Fast Open share from the last connection statistics line the
+ * expander logged, or -1 if there is none.
+ */
+static double fast_open_rate(const std::string& path)
+{
+  std::ifstream log(path.c_str());
+  double rate = -1;
+  for (std::string line; std::getline(log, line);) {
+    size_t connects = 0, fast_open = 0;
+    if (sscanf(line.c_str(), "TCP connects: %zu, fast open: %zu", &connects, &fast_open) == 2 && connects > 0) {
+      rate = static_cast<double>(fast_open) / connects;
+    }
+  }
+  return rate;
+}
+
+/**
+ * Run command through the shell, returning whether it succeeded.
+ */
+static bool run(const std::string& command)
+{
+  return system(command.c_str()) == 0;
+}
+
+static void usage(const char* program)
+{
+  fprintf(stderr,
+      "Usage: %s --replay-server PATH --expander PATH [options]\n"
+      "\n"
+      "Options:\n"
+      "  --urls N       URLs per configuration and scheme. Default 1000.\n"
+      "  --hosts N      Hosts the URLs alternate between. Default 10.\n"
+      "  --rtt-ms N     Round trip time to emulate on loopback. Default 0.\n"
+      "  --client NAME  fast or curl. Default fast.\n"
+      "  --port N       Port for the replay server. Default 18086.\n"
+      "  --json         Print one JSON object per configuration and scheme.\n",
+      program);
+}
+
+int main(int argc, char** argv)
+{
+  const char* replay_server = NULL;
+  const char* expander = NULL;
+  int count = 1000;
+  int hosts = 10;
+  double rtt_ms = 0;
+  std::string client = "fast";
+  int port = 18086;
+  bool json = false;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--json") {
+      json = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    const char* value = argv[++i];
+    if (arg == "--replay-server") {
+      replay_server = value;
+    } else if (arg == "--expander") {
+      expander = value;
+    } else if (arg == "--urls") {
+      count = std::atoi(value);
+    } else if (arg == "--hosts") {
+      hosts = std::atoi(value);
+    } else if (arg == "--rtt-ms") {
+      rtt_ms = std::atof(value);
+    } else if (arg == "--client") {
+      client = value;
+    } else if (arg == "--port") {
+      port = std::atoi(value);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (replay_server == NULL || expander == NULL || count <= 0 || hosts < 2 || rtt_ms < 0 ||
+      (client != "fast" && client != "curl")) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  const char* schemes[] = {"http", "https"};
+  std::string trace_path = temp_path("connect-latency.trace");
+  std::string log_path = temp_path("connect-latency.log");
+  std::vector<TraceEntry> entries;
+  std::vector<std::string> urls_paths;
+  for (size_t s = 0; s < 2; s++) {
+    std::vector<std::string> urls;
+    for (int i = 0; i < count; i++) {
+      TraceEntry entry;
+      entry.url = std::string(schemes[s]) + "://c" + std::to_string(i % hosts) + ".test/" + std::to_string(i);
+      TraceHop hop;
+      hop.url = entry.url;
+      hop.protocol = "HTTP/1.1";
+      hop.status = 200;
+      entry.hops.push_back(hop);
+      entries.push_back(entry);
+      urls.push_back(entry.url);
+    }
+    urls_paths.push_back(temp_path(std::string("connect-latency.") + schemes[s]));
+    write_lines(urls_paths.back(), urls);
+  }
+  write_trace(trace_path, entries);
+
+  ReplayServerProcess server;
+  std::vector<std::string> server_args;
+  server_args.push_back("--trace");
+  server_args.push_back(trace_path);
+  server_args.push_back("--port");
+  server_args.push_back(std::to_string(port));
+  if (!server.start(replay_server, server_args, port)) {
+    unlink(trace_path.c_str());
+    return 1;
+  }
+  // netem delays packets as they leave an interface, which on loopback
+  // happens once in each direction.
+  if (rtt_ms > 0 && !run("tc qdisc add dev lo root netem delay " + std::to_string(rtt_ms / 2) + "ms")) {
+    fprintf(stderr, "Failed to add a delay to the loopback interface\n");
+    server.stop();
+    unlink(trace_path.c_str());
+    return 1;
+  }
+
+  std::string connect_to = "::127.0.0.1:" + std::to_string(port);
+  setenv("CONNECT_TO", connect_to.c_str(), 1);
+  setenv("HTTP_CLIENT", client.c_str(), 1);
+  setenv("MAX_CONNECTIONS", "1", 1);
+  unsetenv("AWS_LAMBDA_FUNCTION_NAME");
+
+  if (!json) {
+    printf("%-10s %-6s %10s %10s\n", "config", "scheme", "us/url", "fast_open");
+  }
+  int exit_code = 0;
+  for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+    setenv("TCP_FAST_OPEN", configs[c].fast_open, 1);
+    for (size_t s = 0; s < 2; s++) {
+      std::string command = std::string("'") + expander + "' < '" + urls_paths[s] + "' 2>'" + log_path + "'";
+      std::string destination = std::string("': ") + schemes[s] + "://c";
+      auto start = std::chrono::steady_clock::now();
+      FILE* output = popen(command.c_str(), "r");
+      int completed = 0;
+      char line[4096];
+      while (output != NULL && fgets(line, sizeof(line), output) != NULL) {
+        completed += strstr(line, destination.c_str()) != NULL;
+      }
+      int status = output != NULL ? pclose(output) : -1;
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      if (status != 0 || completed != count) {
+        fprintf(stderr, "Only %d of %d %s expansions succeeded with %s\n", completed, count, schemes[s],
+            configs[c].name);
+        exit_code = 1;
+        continue;
+      }
+      double ns_per_op = std::chrono::duration<double, std::nano>(elapsed).count() / count;
+      double rate = fast_open_rate(log_path);
+      if (json) {
+        printf("{\"name\": \"connect/%s/%s\", \"ns_per_op\": %.1f", configs[c].name, schemes[s], ns_per_op);
+        if (rate >= 0) {
+          printf(", \"fast_open_rate\": %.3f", rate);
+        }
+        printf("}\n");
+      } else {
+        char rate_text[16] = "-";
+        if (rate >= 0) {
+          snprintf(rate_text, sizeof(rate_text), "%.1f%%", 100 * rate);
+        }
+        printf("%-10s %-6s %10.1f %10s\n", configs[c].name, schemes[s], ns_per_op / 1000, rate_text);
+      }
+      fflush(stdout);
+    }
+  }
+
+  if (rtt_ms > 0) {
+    run("tc qdisc del dev lo root");
+  }
+  server.stop();
+  unlink(trace_path.c_str());
+  unlink(log_path.c_str());
+  for (size_t s = 0; s < urls_paths.size(); s++) {
+    unlink(urls_paths[s].c_str());
+  }
+  return exit_code;
+}
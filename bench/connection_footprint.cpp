@@ -0,0 +1,361 @@
+#include "replay_harness.h"
+
+#include <dirent.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Measures how much memory each connection in the expander's connection cache
+ * costs, so that MAX_CONNECTIONS can be sized for a Lambda memory size. For
+ * each configuration and each connection count N, the expander is started in
+ * stdin mode with a cache of at least N connections and expands N URLs on N
+ * distinct https hosts of bench/replay-server, which keeps every connection
+ * alive. While the expander still holds them, its resident set and anonymous
+ * memory (the heap, mostly) are read from /proc, along with the number of open
+ * sockets to confirm the connections were really cached.
+ *
+ * A least-squares line over the counts gives the base footprint and the cost
+ * per connection, from which a recommended MAX_CONNECTIONS is derived for
+ * every memory size: as many connections as fit into --memory-fraction of the
+ * memory, but no more than the Lambda file descriptor limit allows.
+ */
+
+struct Config {
+  std::string name;
+  std::string description;
+  std::vector<std::pair<std::string, std::string> > env;
+};
+
+static std::vector<Config> builtin_configs()
+{
+  std::vector<Config> configs;
+  configs.push_back(Config{"default", "curl defaults, TLS 1.3", {}});
+  configs.push_back(Config{"buffer_1k", "1 KB receive buffer", {{"BUFFER_SIZE", "1024"}}});
+  configs.push_back(Config{"buffer_512k", "512 KB receive buffer", {{"BUFFER_SIZE", "524288"}}});
+  configs.push_back(Config{"tls12", "TLS 1.2 at most", {{"TLS_MAX_VERSION", "1.2"}}});
+  configs.push_back(Config{"release_buffers", "OpenSSL frees idle connection buffers",
+      {{"TLS_RELEASE_BUFFERS", "1"}}});
+  configs.push_back(Config{"fast_client", "Purpose-built HEAD client", {{"HTTP_CLIENT", "fast"}}});
+  return configs;
+}
+
+struct Footprint {
+  int connections = 0;
+  long sockets = 0;
+  double rss_mb = 0;
+  double anon_mb = 0;
+  int errors = 0;
+};
+
+static std::vector<long> parse_list(const std::string& list)
+{
+  std::vector<long> values;
+  for (size_t start = 0; start < list.size();) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    values.push_back(std::atol(list.substr(start, end - start).c_str()));
+    start = end + 1;
+  }
+  return values;
+}
+
+/**
+ * A field of /proc/PID/status in KB, or -1 if it is missing.
+ */
+static long status_kb(pid_t pid, const char* field)
+{
+  std::string path = "/proc/" + std::to_string(pid) + "/status";
+  FILE* file = fopen(path.c_str(), "r");
+  if (file == NULL) {
+    return -1;
+  }
+  long value = -1;
+  size_t length = strlen(field);
+  char line[256];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (strncmp(line, field, length) == 0 && line[length] == ':') {
+      value = std::atol(line + length + 1);
+      break;
+    }
+  }
+  fclose(file);
+  return value;
+}
+
+static long open_sockets(pid_t pid)
+{
+  std::string dir_path = "/proc/" + std::to_string(pid) + "/fd";
+  DIR* dir = opendir(dir_path.c_str());
+  if (dir == NULL) {
+    return -1;
+  }
+  long sockets = 0;
+  while (struct dirent* entry = readdir(dir)) {
+    char target[64];
+    std::string path = dir_path + "/" + entry->d_name;
+    ssize_t length = readlink(path.c_str(), target, sizeof(target) - 1);
+    sockets += length > 0 && strncmp(target, "socket:", 7) == 0;
+  }
+  closedir(dir);
+  return sockets;
+}
+
+/**
+ * Run the expander over the first count URLs and measure it while it holds
+ * their connections.
+ */
+static Footprint measure(const char* expander, const Config& config, const std::vector<std::string>& urls,
+    int count)
+{
+  int input[2];
+  int output[2];
+  if (pipe(input) != 0 || pipe(output) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(input[0], STDIN_FILENO);
+    dup2(output[1], STDOUT_FILENO);
+    dup2(output[1], STDERR_FILENO);
+    close(input[1]);
+    close(output[0]);
+    setenv("MAX_CONNECTIONS", std::to_string(count + 10).c_str(), 1);
+    for (size_t i = 0; i < config.env.size(); i++) {
+      setenv(config.env[i].first.c_str(), config.env[i].second.c_str(), 1);
+    }
+    execl(expander, expander, static_cast<char*>(NULL));
+    _exit(127);
+  }
+  close(input[0]);
+  close(output[1]);
+  FILE* to_expander = fdopen(input[1], "w");
+  FILE* from_expander = fdopen(output[0], "r");
+
+  // One URL at a time, so the expander never has more than one result to
+  // write and both pipes stay small.
+  Footprint footprint;
+  footprint.connections = count;
+  char line[4096];
+  for (int i = 0; i < count; i++) {
+    fprintf(to_expander, "%s 5000\n", urls[i].c_str());
+    fflush(to_expander);
+    bool answered = false;
+    while (!answered && fgets(line, sizeof(line), from_expander) != NULL) {
+      if (strncmp(line, "URL '", 5) == 0) {
+        answered = true;
+        footprint.errors += strstr(line, " completed in ") == NULL;
+      }
+    }
+    if (!answered) {
+      fprintf(stderr, "Expander exited after %d of %d URLs\n", i, count);
+      exit(1);
+    }
+  }
+  // Let curl settle any connections it is closing.
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  footprint.sockets = open_sockets(pid);
+  footprint.rss_mb = status_kb(pid, "VmRSS") / 1024.0;
+  footprint.anon_mb = status_kb(pid, "RssAnon") / 1024.0;
+
+  fclose(to_expander);
+  while (fgets(line, sizeof(line), from_expander) != NULL) {
+  }
+  fclose(from_expander);
+  waitpid(pid, NULL, 0);
+  return footprint;
+}
+
+/**
+ * Least-squares fit of y = base + slope * x.
+ */
+static void fit_line(const std::vector<double>& x, const std::vector<double>& y, double& base, double& slope)
+{
+  double n = x.size();
+  double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+  for (size_t i = 0; i < x.size(); i++) {
+    sum_x += x[i];
+    sum_y += y[i];
+    sum_xx += x[i] * x[i];
+    sum_xy += x[i] * y[i];
+  }
+  double denominator = n * sum_xx - sum_x * sum_x;
+  slope = denominator != 0 ? (n * sum_xy - sum_x * sum_y) / denominator : 0;
+  base = n > 0 ? (sum_y - slope * sum_x) / n : 0;
+}
+
+static void usage(const char* program)
+{
+  fprintf(stderr,
+      "Usage: %s --replay-server PATH --expander PATH [options]\n"
+      "\n"
+      "Options:\n"
+      "  --connections LIST     Connection counts. Default 10,100,500,1000,2000,5000.\n"
+      "  --configs LIST         Configurations to measure. Default all of them.\n"
+      "  --memory-sizes LIST    Lambda memory sizes in MB to recommend MAX_CONNECTIONS\n"
+      "                         for. Default 128,256,512,1024,1769,3008.\n"
+      "  --memory-fraction F    Share of the memory the connection cache may use.\n"
+      "                         Default 0.5.\n"
+      "  --fd-limit N           File descriptor limit of the function. Default 1024,\n"
+      "                         that of Lambda.\n"
+      "  --port N               Port for the replay server. Default 18083.\n",
+      program);
+}
+
+int main(int argc, char** argv)
+{
+  const char* replay_server = NULL;
+  const char* expander = NULL;
+  std::vector<long> counts = parse_list("10,100,500,1000,2000,5000");
+  std::vector<long> memory_sizes = parse_list("128,256,512,1024,1769,3008");
+  std::string only;
+  double memory_fraction = 0.5;
+  long fd_limit = 1024;
+  int port = 18083;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    const char* value = argv[i + 1];
+    if (arg == "--replay-server") {
+      replay_server = value;
+    } else if (arg == "--expander") {
+      expander = value;
+    } else if (arg == "--connections") {
+      counts = parse_list(value);
+    } else if (arg == "--configs") {
+      only = std::string(",") + value + ",";
+    } else if (arg == "--memory-sizes") {
+      memory_sizes = parse_list(value);
+    } else if (arg == "--memory-fraction") {
+      memory_fraction = std::atof(value);
+    } else if (arg == "--fd-limit") {
+      fd_limit = std::atol(value);
+    } else if (arg == "--port") {
+      port = std::atoi(value);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (replay_server == NULL || expander == NULL || counts.empty() || memory_fraction <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  std::sort(counts.begin(), counts.end());
+  std::vector<Config> configs;
+  std::vector<Config> all_configs = builtin_configs();
+  for (size_t c = 0; c < all_configs.size(); c++) {
+    if (only.empty() || only.find("," + all_configs[c].name + ",") != std::string::npos) {
+      configs.push_back(all_configs[c]);
+    }
+  }
+
+  // Both the expander and the replay server hold one descriptor per
+  // connection, and inherit this limit.
+  long max_count = counts.back();
+  struct rlimit files;
+  getrlimit(RLIMIT_NOFILE, &files);
+  files.rlim_cur = files.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &files);
+  if (files.rlim_cur != RLIM_INFINITY && static_cast<long>(files.rlim_cur) < max_count + 64) {
+    fprintf(stderr, "The file descriptor limit of %ld is too low for %ld connections\n",
+        static_cast<long>(files.rlim_cur), max_count);
+    return 1;
+  }
+
+  // One host per connection, each answering 200 directly.
+  std::string trace_path = temp_path("connection-footprint.trace");
+  std::vector<TraceEntry> entries;
+  std::vector<std::string> urls;
+  for (long i = 0; i < max_count; i++) {
+    TraceEntry entry;
+    entry.url = "https://c" + std::to_string(i) + ".test/";
+    TraceHop hop;
+    hop.url = entry.url;
+    hop.protocol = "HTTP/1.1";
+    hop.status = 200;
+    entry.hops.push_back(hop);
+    entries.push_back(entry);
+    urls.push_back(entry.url);
+  }
+  write_trace(trace_path, entries);
+
+  ReplayServerProcess server;
+  std::vector<std::string> server_args;
+  server_args.push_back("--trace");
+  server_args.push_back(trace_path);
+  server_args.push_back("--port");
+  server_args.push_back(std::to_string(port));
+  if (!server.start(replay_server, server_args, port)) {
+    unlink(trace_path.c_str());
+    return 1;
+  }
+  std::string connect_to = "::127.0.0.1:" + std::to_string(port);
+  setenv("CONNECT_TO", connect_to.c_str(), 1);
+  unsetenv("AWS_LAMBDA_FUNCTION_NAME");
+
+  std::vector<double> bases_mb;
+  std::vector<double> slopes_kb;
+  printf("%-16s %8s %8s %9s %9s %8s\n", "config", "conns", "sockets", "rss_mb", "anon_mb", "errors");
+  for (size_t c = 0; c < configs.size(); c++) {
+    std::vector<double> sockets;
+    std::vector<double> rss_mb;
+    for (size_t i = 0; i < counts.size(); i++) {
+      Footprint footprint = measure(expander, configs[c], urls, counts[i]);
+      printf("%-16s %8d %8ld %9.1f %9.1f %8d\n", configs[c].name.c_str(), footprint.connections,
+          footprint.sockets, footprint.rss_mb, footprint.anon_mb, footprint.errors);
+      fflush(stdout);
+      if (footprint.sockets < footprint.connections - footprint.errors) {
+        fprintf(stderr, "Warning: only %ld of %d connections stayed open\n", footprint.sockets,
+            footprint.connections);
+      }
+      sockets.push_back(footprint.sockets);
+      rss_mb.push_back(footprint.rss_mb);
+    }
+    double base_mb;
+    double slope_mb;
+    fit_line(sockets, rss_mb, base_mb, slope_mb);
+    bases_mb.push_back(base_mb);
+    slopes_kb.push_back(slope_mb * 1024);
+  }
+  server.stop();
+  unlink(trace_path.c_str());
+
+  printf("\n%-16s %9s %12s  %s\n", "config", "base_mb", "kb_per_conn", "description");
+  for (size_t c = 0; c < configs.size(); c++) {
+    printf("%-16s %9.1f %12.1f  %s\n", configs[c].name.c_str(), bases_mb[c], slopes_kb[c],
+        configs[c].description.c_str());
+  }
+
+  // Leave descriptors for stdio, the runtime's connection and DNS.
+  long fd_connections = fd_limit - 24;
+  printf("\nRecommended MAX_CONNECTIONS using %.0f%% of memory (* = bound by the %ld descriptor limit)\n",
+      memory_fraction * 100, fd_limit);
+  printf("%-10s", "memory_mb");
+  for (size_t c = 0; c < configs.size(); c++) {
+    printf(" %16s", configs[c].name.c_str());
+  }
+  printf("\n");
+  for (size_t m = 0; m < memory_sizes.size(); m++) {
+    printf("%-10ld", memory_sizes[m]);
+    for (size_t c = 0; c < configs.size(); c++) {
+      double budget_kb = (memory_sizes[m] * memory_fraction - bases_mb[c]) * 1024;
+      long connections = slopes_kb[c] > 0 ? static_cast<long>(budget_kb / slopes_kb[c]) : fd_connections;
+      connections = std::max(0L, connections);
+      bool fd_bound = connections > fd_connections;
+      connections = std::min(connections, fd_connections);
+      printf(" %15ld%s", connections, fd_bound ? "*" : " ");
+    }
+    printf("\n");
+  }
+  return 0;
+}
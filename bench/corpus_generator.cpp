@@ -0,0 +1,479 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * Generates synthetic URL corpora that resemble production traffic, together
+ * with everything needed to benchmark them without the internet:
+ *
+ *     PREFIX.urls     One URL per line, for stdin mode, the fan-out client and
+ *                     bench/load-generator.
+ *     PREFIX.batches  One {"urls": [...]} invocation payload per line, if
+ *                     --batch-size is set.
+ *     PREFIX.trace    The redirect chain of every URL, in the trace format
+ *                     (see trace.h), for bench/replay-server and
+ *                     bench/network-simulator. It has one line per URL of the
+ *                     corpus, like a recording of it would.
+ *     PREFIX.model    Per-host network models for bench/network-simulator,
+ *                     consistent with the latencies in the trace.
+ *
+ * The corpus draws from a fixed set of unique chains with Zipf distributed
+ * popularity, so that caches and connection reuse see realistic skew. Hosts
+ * are also picked with Zipf popularity. Chains start at a shortener, pass
+ * through intermediate redirectors and end at a destination; some are wrapped
+ * in a link wrapper that carries the short URL in its query, and some share
+ * their tail with earlier chains, e.g. a common tracking redirect. The same
+ * options and seed always generate the same files.
+ */
+
+struct Options {
+  size_t urls = 10000;
+  size_t unique = 2000;
+  double zipf_s = 1.0;
+  size_t shortener_hosts = 20;
+  size_t intermediate_hosts = 50;
+  size_t destination_hosts = 1000;
+  size_t wrapper_hosts = 3;
+  std::vector<std::pair<int, double> > chain_lengths;
+  double shared_tail_rate = 0.2;
+  double wrapper_rate = 0.1;
+  double error_rate = 0.02;
+  double dead_host_rate = 0.01;
+  double https_rate = 0.9;
+  size_t batch_size = 0;
+  unsigned long long seed = 1;
+};
+
+/**
+ * Samples ranks 0..n-1 with probability proportional to 1 / (rank + 1)^s.
+ */
+class ZipfDistribution {
+ public:
+  ZipfDistribution(size_t n, double s)
+  {
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+      sum += 1 / std::pow(i + 1, s);
+      cdf.push_back(sum);
+    }
+    for (size_t i = 0; i < n; i++) {
+      cdf[i] /= sum;
+    }
+  }
+
+  size_t operator()(std::mt19937_64& rng)
+  {
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    size_t rank = std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    return std::min(rank, cdf.size() - 1);
+  }
+
+ private:
+  std::vector<double> cdf;
+};
+
+/**
+ * A group of hosts with Zipf popularity and a network profile per host.
+ */
+struct HostPool {
+  std::vector<std::string> names;
+  std::vector<double> rtt_ms;
+  std::vector<double> server_ms;
+  ZipfDistribution popularity;
+
+  HostPool(const std::string& kind, size_t count, double zipf_s, std::mt19937_64& rng)
+    : popularity(count, zipf_s)
+  {
+    // Round trip times spread over a continent and beyond, server times
+    // between fast redirectors and slow CMSs.
+    std::lognormal_distribution<double> rtt(std::log(30.0), 0.7);
+    std::lognormal_distribution<double> server(std::log(15.0), 0.8);
+    for (size_t i = 0; i < count; i++) {
+      names.push_back(kind + std::to_string(i) + ".test");
+      rtt_ms.push_back(std::min(400.0, rtt(rng)));
+      server_ms.push_back(std::min(1000.0, server(rng)));
+    }
+  }
+
+  size_t pick(std::mt19937_64& rng)
+  {
+    return popularity(rng);
+  }
+};
+
+static std::string random_token(std::mt19937_64& rng, size_t length)
+{
+  static const char alphabet[] = "abcdefghijkmnopqrstuvwxyzABCDEFGHJKLMNPQRSTUVWXYZ23456789";
+  std::string token;
+  for (size_t i = 0; i < length; i++) {
+    token += alphabet[rng() % (sizeof(alphabet) - 1)];
+  }
+  return token;
+}
+
+static std::string percent_encode(const std::string& s)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  std::string encoded;
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    if (std::isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+      encoded += c;
+    } else {
+      encoded += '%';
+      encoded += hex[c >> 4];
+      encoded += hex[c & 15];
+    }
+  }
+  return encoded;
+}
+
+class CorpusGenerator {
+ public:
+  explicit CorpusGenerator(const Options& options)
+    : options(options),
+      rng(options.seed),
+      shorteners("short", options.shortener_hosts, options.zipf_s, rng),
+      intermediates("redirect", options.intermediate_hosts, options.zipf_s, rng),
+      destinations("site", options.destination_hosts, options.zipf_s, rng),
+      wrappers("wrap", options.wrapper_hosts, options.zipf_s, rng)
+  {
+  }
+
+  /**
+   * Build the unique chains.
+   */
+  std::vector<TraceEntry> chains()
+  {
+    std::vector<double> weights;
+    for (size_t i = 0; i < options.chain_lengths.size(); i++) {
+      weights.push_back(options.chain_lengths[i].second);
+    }
+    std::discrete_distribution<size_t> chain_length(weights.begin(), weights.end());
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    std::vector<TraceEntry> entries;
+    for (size_t i = 0; i < options.unique; i++) {
+      int redirects = options.chain_lengths[chain_length(rng)].first;
+      TraceEntry entry;
+      size_t shortener = shorteners.pick(rng);
+      std::string url = scheme() + host_url(shorteners, shortener) + random_token(rng, 7);
+      if (uniform(rng) < options.wrapper_rate) {
+        size_t wrapper = wrappers.pick(rng);
+        std::string wrapped = scheme() + host_url(wrappers, wrapper) + "l?u=" + percent_encode(url);
+        add_hop(entry, wrappers, wrapper, wrapped, 302, url);
+      }
+      add_hop(entry, shorteners, shortener, url, redirects > 0 ? redirect_status() : final_status(), "");
+
+      size_t tail_start = entry.hops.size();
+      bool shared = false;
+      for (int hop = 1; hop <= redirects; hop++) {
+        if (!tails.empty() && uniform(rng) < options.shared_tail_rate) {
+          size_t tail = rng() % tails.size();
+          fix_location(entry, tails[tail].front().url);
+          entry.hops.insert(entry.hops.end(), tails[tail].begin(), tails[tail].end());
+          entry.error_code = tail_errors[tail];
+          shared = true;
+          break;
+        }
+        bool last = hop == redirects;
+        HostPool& pool = last ? destinations : intermediates;
+        size_t host = pool.pick(rng);
+        if (last && uniform(rng) < options.dead_host_rate) {
+          // The destination does not resolve, so there is no hop for it.
+          fix_location(entry, scheme() + "gone" + std::to_string(i) + ".test/" + path(true));
+          entry.error_code = CURLE_COULDNT_RESOLVE_HOST;
+          break;
+        }
+        url = scheme() + host_url(pool, host) + path(last);
+        fix_location(entry, url);
+        add_hop(entry, pool, host, url, last ? final_status() : redirect_status(), "");
+      }
+      // Tails start at an intermediate redirector, which later chains can
+      // join.
+      if (!shared && redirects >= 2 && tail_start < entry.hops.size()) {
+        tails.push_back(std::vector<TraceHop>(entry.hops.begin() + tail_start, entry.hops.end()));
+        tail_errors.push_back(entry.error_code);
+      }
+      entry.url = entry.hops.front().url;
+      entries.push_back(entry);
+    }
+    return entries;
+  }
+
+  /**
+   * The corpus, as indices into the unique chains.
+   */
+  std::vector<size_t> corpus()
+  {
+    // Popularity ranks are assigned in a random order, so that the popular
+    // chains are not all generated first.
+    std::vector<size_t> ranked(options.unique);
+    for (size_t i = 0; i < ranked.size(); i++) {
+      ranked[i] = i;
+    }
+    std::shuffle(ranked.begin(), ranked.end(), rng);
+    ZipfDistribution popularity(options.unique, options.zipf_s);
+    std::vector<size_t> corpus;
+    for (size_t i = 0; i < options.urls; i++) {
+      corpus.push_back(ranked[popularity(rng)]);
+    }
+    return corpus;
+  }
+
+  void write_model(FILE* file)
+  {
+    fprintf(file, "{\"host\": \"*\", \"rtt_ms\": 30, \"dns_ms\": 5, \"server_ms\": 15}\n");
+    HostPool* pools[] = {&shorteners, &intermediates, &destinations, &wrappers};
+    for (size_t p = 0; p < 4; p++) {
+      for (size_t i = 0; i < pools[p]->names.size(); i++) {
+        fprintf(file, "{\"host\": \"%s\", \"rtt_ms\": %.1f, \"server_ms\": %.1f}\n",
+            pools[p]->names[i].c_str(), pools[p]->rtt_ms[i], pools[p]->server_ms[i]);
+      }
+    }
+  }
+
+ private:
+  std::string scheme()
+  {
+    return std::uniform_real_distribution<double>(0, 1)(rng) < options.https_rate ? "https://" : "http://";
+  }
+
+  static std::string host_url(const HostPool& pool, size_t host)
+  {
+    return pool.names[host] + "/";
+  }
+
+  std::string path(bool destination)
+  {
+    if (!destination) {
+      return "r/" + random_token(rng, 12);
+    }
+    std::string path = random_token(rng, 6) + "/" + random_token(rng, 20);
+    if (std::uniform_real_distribution<double>(0, 1)(rng) < 0.5) {
+      path += "?utm_source=" + random_token(rng, 6) + "&utm_medium=social";
+    }
+    return path;
+  }
+
+  long redirect_status()
+  {
+    return std::uniform_real_distribution<double>(0, 1)(rng) < 0.7 ? 301 : 302;
+  }
+
+  long final_status()
+  {
+    static const long errors[] = {404, 404, 410, 500, 503};
+    if (std::uniform_real_distribution<double>(0, 1)(rng) < options.error_rate) {
+      return errors[rng() % 5];
+    }
+    return 200;
+  }
+
+  /**
+   * Point the Location of the last hop of entry at url.
+   */
+  static void fix_location(TraceEntry& entry, const std::string& url)
+  {
+    TraceHop& previous = entry.hops.back();
+    for (size_t i = 0; i < previous.headers.size(); i++) {
+      if (previous.headers[i].first == "Location") {
+        previous.headers[i].second = url;
+        return;
+      }
+    }
+    previous.headers.push_back(std::make_pair("Location", url));
+  }
+
+  void add_hop(TraceEntry& entry, const HostPool& pool, size_t host, const std::string& url,
+      long status, const std::string& location)
+  {
+    TraceHop hop;
+    hop.url = url;
+    hop.protocol = url.compare(0, 8, "https://") == 0 ? "HTTP/2" : "HTTP/1.1";
+    hop.status = status;
+    if (status >= 300 && status < 400) {
+      hop.headers.push_back(std::make_pair("Location", location));
+    }
+    hop.headers.push_back(std::make_pair("Content-Type", "text/html; charset=utf-8"));
+    std::lognormal_distribution<double> server(std::log(pool.server_ms[host]), 0.5);
+    hop.latency_us = static_cast<long>(1000 * (pool.rtt_ms[host] + server(rng)));
+    entry.hops.push_back(hop);
+  }
+
+  Options options;
+  std::mt19937_64 rng;
+  HostPool shorteners;
+  HostPool intermediates;
+  HostPool destinations;
+  HostPool wrappers;
+
+  /**
+   * Chain tails starting at an intermediate redirector, which later chains
+   * may share, and the error code each of them ends with.
+   */
+  std::vector<std::vector<TraceHop> > tails;
+  std::vector<long> tail_errors;
+};
+
+static bool parse_chain_lengths(const std::string& spec, std::vector<std::pair<int, double> >& lengths)
+{
+  lengths.clear();
+  size_t start = 0;
+  while (start < spec.size()) {
+    size_t end = spec.find(',', start);
+    std::string item = spec.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    size_t colon = item.find(':');
+    if (colon == std::string::npos) {
+      return false;
+    }
+    int redirects = std::atoi(item.substr(0, colon).c_str());
+    double weight = std::atof(item.substr(colon + 1).c_str());
+    if (redirects < 0 || weight <= 0) {
+      return false;
+    }
+    lengths.push_back(std::make_pair(redirects, weight));
+    start = end == std::string::npos ? spec.size() : end + 1;
+  }
+  return !lengths.empty();
+}
+
+static FILE* open_output(const std::string& path)
+{
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == NULL) {
+    fprintf(stderr, "Failed to open %s for writing\n", path.c_str());
+    exit(1);
+  }
+  return file;
+}
+
+static void usage(const char* program)
+{
+  fprintf(stderr,
+      "Usage: %s --out PREFIX [options]\n"
+      "\n"
+      "Options:\n"
+      "  --urls N                 URLs in the corpus. Default 10000.\n"
+      "  --unique N               Distinct redirect chains. Default 2000.\n"
+      "  --zipf S                 Zipf exponent of chain and host popularity. Default 1.0.\n"
+      "  --shortener-hosts N      Default 20.\n"
+      "  --intermediate-hosts N   Default 50.\n"
+      "  --destination-hosts N    Default 1000.\n"
+      "  --chain-lengths LIST     Weighted redirect counts, e.g. 1:50,2:30,3:15,5:5\n"
+      "                           (the default).\n"
+      "  --shared-tail-rate P     Chance that a chain joins the tail of an earlier\n"
+      "                           one after its first hop. Default 0.2.\n"
+      "  --wrapper-rate P         Fraction of chains behind a link wrapper. Default 0.1.\n"
+      "  --error-rate P           Fraction of chains ending in an HTTP error. Default 0.02.\n"
+      "  --dead-host-rate P       Fraction of chains ending at a host that does not\n"
+      "                           resolve. Default 0.01.\n"
+      "  --https-rate P           Fraction of https URLs. Default 0.9.\n"
+      "  --batch-size N           Also write invocation payloads of N URLs.\n"
+      "  --seed N                 Random seed. Default 1.\n",
+      program);
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+  parse_chain_lengths("1:50,2:30,3:15,5:5", options.chain_lengths);
+  std::string prefix;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    const char* value = argv[++i];
+    if (arg == "--out") {
+      prefix = value;
+    } else if (arg == "--urls") {
+      options.urls = std::strtoul(value, NULL, 10);
+    } else if (arg == "--unique") {
+      options.unique = std::strtoul(value, NULL, 10);
+    } else if (arg == "--zipf") {
+      options.zipf_s = std::atof(value);
+    } else if (arg == "--shortener-hosts") {
+      options.shortener_hosts = std::strtoul(value, NULL, 10);
+    } else if (arg == "--intermediate-hosts") {
+      options.intermediate_hosts = std::strtoul(value, NULL, 10);
+    } else if (arg == "--destination-hosts") {
+      options.destination_hosts = std::strtoul(value, NULL, 10);
+    } else if (arg == "--chain-lengths") {
+      if (!parse_chain_lengths(value, options.chain_lengths)) {
+        fprintf(stderr, "Invalid chain lengths: %s\n", value);
+        return 1;
+      }
+    } else if (arg == "--shared-tail-rate") {
+      options.shared_tail_rate = std::atof(value);
+    } else if (arg == "--wrapper-rate") {
+      options.wrapper_rate = std::atof(value);
+    } else if (arg == "--error-rate") {
+      options.error_rate = std::atof(value);
+    } else if (arg == "--dead-host-rate") {
+      options.dead_host_rate = std::atof(value);
+    } else if (arg == "--https-rate") {
+      options.https_rate = std::atof(value);
+    } else if (arg == "--batch-size") {
+      options.batch_size = std::strtoul(value, NULL, 10);
+    } else if (arg == "--seed") {
+      options.seed = std::strtoull(value, NULL, 10);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (prefix.empty() || options.unique == 0 || options.shortener_hosts == 0 ||
+      options.intermediate_hosts == 0 || options.destination_hosts == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  CorpusGenerator generator(options);
+  std::vector<TraceEntry> chains = generator.chains();
+  std::vector<std::string> lines;
+  for (size_t i = 0; i < chains.size(); i++) {
+    lines.push_back(trace_entry_to_json(chains[i]));
+  }
+  std::vector<size_t> corpus = generator.corpus();
+
+  FILE* urls = open_output(prefix + ".urls");
+  FILE* trace = open_output(prefix + ".trace");
+  FILE* batches = options.batch_size ? open_output(prefix + ".batches") : NULL;
+  for (size_t i = 0; i < corpus.size(); i++) {
+    const std::string& url = chains[corpus[i]].url;
+    fprintf(urls, "%s\n", url.c_str());
+    fprintf(trace, "%s\n", lines[corpus[i]].c_str());
+    if (batches != NULL) {
+      bool first = i % options.batch_size == 0;
+      bool last = (i + 1) % options.batch_size == 0 || i + 1 == corpus.size();
+      // The URLs are generated, so they never need escaping.
+      fprintf(batches, "%s\"%s\"%s", first ? "{\"urls\": [" : ", ", url.c_str(), last ? "]}\n" : "");
+    }
+  }
+  fclose(urls);
+  fclose(trace);
+  if (batches != NULL) {
+    fclose(batches);
+  }
+  FILE* model = open_output(prefix + ".model");
+  generator.write_model(model);
+  fclose(model);
+
+  std::vector<bool> seen(chains.size());
+  size_t distinct = 0;
+  for (size_t i = 0; i < corpus.size(); i++) {
+    distinct += !seen[corpus[i]];
+    seen[corpus[i]] = true;
+  }
+  fprintf(stderr, "Wrote %zu URLs (%zu distinct) to %s.*\n", corpus.size(), distinct, prefix.c_str());
+  return 0;
+}
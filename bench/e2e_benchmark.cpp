@@ -0,0 +1,139 @@
+#include "perf_counters.h"
+#include "replay_harness.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * End-to-end benchmark of the url-expander binary in stdin mode against
+ * bench/replay-server, so the full request path including libcurl and TLS is
+ * measured without depending on the internet. Generates a synthetic trace of
+ * redirect chains, starts the replay server on it, expands every chain once
+ * and prints the mean time per expansion as a JSON line for bench/perf-gate,
+ * along with the expander's hardware counters and CPU time per expansion.
+ *
+ * --client fast runs the expander with its purpose-built HEAD client instead
+ * of curl, and --client both runs one after the other for a head-to-head
+ * comparison.
+ */
+
+static void usage(const char* program)
+{
+  fprintf(stderr,
+      "Usage: %s --replay-server PATH --expander PATH [--urls N] [--hops N] [--port N]\n"
+      "          [--client curl|fast|both]\n",
+      program);
+}
+
+int main(int argc, char** argv)
+{
+  const char* replay_server = NULL;
+  const char* expander = NULL;
+  int count = 2000;
+  int hops = 2;
+  int port = 18080;
+  std::string client = "curl";
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--replay-server") {
+      replay_server = argv[i + 1];
+    } else if (arg == "--expander") {
+      expander = argv[i + 1];
+    } else if (arg == "--urls") {
+      count = std::atoi(argv[i + 1]);
+    } else if (arg == "--hops") {
+      hops = std::atoi(argv[i + 1]);
+    } else if (arg == "--port") {
+      port = std::atoi(argv[i + 1]);
+    } else if (arg == "--client") {
+      client = argv[i + 1];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (replay_server == NULL || expander == NULL || count <= 0 || hops < 1 ||
+      (client != "curl" && client != "fast" && client != "both")) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::string trace_path = temp_path("e2e-benchmark.trace");
+  std::string urls_path = temp_path("e2e-benchmark.urls");
+  std::vector<TraceEntry> entries = chain_trace(count, hops);
+  std::vector<std::string> urls;
+  for (size_t i = 0; i < entries.size(); i++) {
+    urls.push_back(entries[i].url);
+  }
+  write_trace(trace_path, entries);
+  write_lines(urls_path, urls);
+
+  ReplayServerProcess server;
+  std::vector<std::string> server_args;
+  server_args.push_back("--trace");
+  server_args.push_back(trace_path);
+  server_args.push_back("--port");
+  server_args.push_back(std::to_string(port));
+  if (!server.start(replay_server, server_args, port)) {
+    return 1;
+  }
+
+  std::string connect_to = "::127.0.0.1:" + std::to_string(port);
+  setenv("CONNECT_TO", connect_to.c_str(), 1);
+  unsetenv("AWS_LAMBDA_FUNCTION_NAME");
+  std::string command = std::string("'") + expander + "' < '" + urls_path + "' 2>/dev/null";
+  std::string destination = "': https://hop" + std::to_string(hops) + ".test/";
+  std::vector<std::string> clients;
+  if (client == "both") {
+    clients.push_back("curl");
+    clients.push_back("fast");
+  } else {
+    clients.push_back(client);
+  }
+
+  int exit_code = 0;
+  for (size_t c = 0; c < clients.size(); c++) {
+    // Run the expander over every URL once, counting expansions that reached
+    // the end of their chain.
+    setenv("HTTP_CLIENT", clients[c].c_str(), 1);
+    // Opened after starting the replay server, so that only the expander is counted.
+    PerfCounters counters(true);
+    counters.start();
+    auto start = std::chrono::steady_clock::now();
+    FILE* output = popen(command.c_str(), "r");
+    int completed = 0;
+    char line[4096];
+    while (output != NULL && fgets(line, sizeof(line), output) != NULL) {
+      completed += strstr(line, destination.c_str()) != NULL;
+    }
+    int status = output != NULL ? pclose(output) : -1;
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    counters.stop();
+
+    if (status != 0 || completed != count) {
+      fprintf(stderr, "Only %d of %d expansions succeeded with the %s client\n", completed, count,
+          clients[c].c_str());
+      exit_code = 1;
+      continue;
+    }
+    // The curl client keeps the original name, which baselines refer to.
+    printf("{\"name\": \"e2e/replay_%d_hops%s\", \"ns_per_op\": %.1f", hops,
+        clients[c] == "fast" ? "/fast_client" : "",
+        std::chrono::duration<double, std::nano>(elapsed).count() / count);
+    std::vector<std::pair<std::string, double> > values = counters.per_op(count);
+    for (size_t i = 0; i < values.size(); i++) {
+      printf(", \"%s\": %.2f", values[i].first.c_str(), values[i].second);
+    }
+    printf("}\n");
+    fflush(stdout);
+  }
+
+  server.stop();
+  unlink(trace_path.c_str());
+  unlink(urls_path.c_str());
+  return exit_code;
+}
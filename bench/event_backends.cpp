@@ -0,0 +1,276 @@
+#include "event_loop.h"
+#include "perf_counters.h"
+#include "replay_harness.h"
+
+#include <curl/curl.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Compares the event backends of client/event_loop.h on the fan-out client's
+ * workload shape: many concurrent transfers on one curl multi handle, each
+ * lane of transfers reusing a kept-alive connection to its own host. Keeps
+ * --concurrency HEAD requests in flight against bench/replay-server until
+ * --requests have completed, once per backend, plus once with the
+ * curl_multi_perform and curl_multi_poll loop the client used before
+ * ("curl_poll"). Reports throughput, the system calls the backend made per
+ * request and the process's CPU time per request. curl's own sends and
+ * receives are the same for every backend and are not counted; run under
+ * strace -c -f for a full breakdown.
+ */
+
+static size_t discard(char* data, size_t size, size_t nmemb, void* userp)
+{
+  return size * nmemb;
+}
+
+struct RunResult {
+  size_t completed = 0;
+  size_t errors = 0;
+  double seconds = 0;
+  long backend_syscalls = -1;
+  std::vector<std::pair<std::string, double> > counters;
+};
+
+static RunResult run(const std::string& backend_name, const std::vector<std::string>& urls, int concurrency,
+    struct curl_slist* connect_to)
+{
+  RunResult result;
+  std::unique_ptr<EventBackend> backend;
+  if (backend_name != "curl_poll") {
+    backend.reset(create_event_backend(backend_name));
+    if (!backend || backend_name != backend->name()) {
+      fprintf(stderr, "The %s backend is unavailable here\n", backend_name.c_str());
+      return result;
+    }
+  }
+  CURLM* multi = curl_multi_init();
+  curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, static_cast<long>(concurrency));
+  std::unique_ptr<CurlMultiDriver> driver;
+  if (backend) {
+    driver.reset(new CurlMultiDriver(multi, *backend));
+  }
+
+  // Handle i requests urls i, i + concurrency, ..., which share a host.
+  std::vector<size_t> next(concurrency);
+  auto start_request = [&](CURL* handle, size_t lane) {
+    curl_easy_setopt(handle, CURLOPT_URL, urls[next[lane]].c_str());
+    curl_easy_setopt(handle, CURLOPT_PRIVATE, reinterpret_cast<void*>(lane));
+    next[lane] += concurrency;
+    curl_multi_add_handle(multi, handle);
+  };
+  std::vector<CURL*> handles;
+  for (int i = 0; i < concurrency && static_cast<size_t>(i) < urls.size(); i++) {
+    CURL* handle = curl_easy_init();
+    curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, discard);
+    curl_easy_setopt(handle, CURLOPT_CONNECT_TO, connect_to);
+    curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, 10000L);
+    handles.push_back(handle);
+    next[i] = i;
+    start_request(handle, i);
+  }
+
+  PerfCounters counters;
+  counters.start();
+  auto start = std::chrono::steady_clock::now();
+  size_t syscalls_before = backend ? backend->syscalls() : 0;
+  while (result.completed + result.errors < urls.size()) {
+    if (driver) {
+      driver->run_once(1000);
+    } else {
+      int running;
+      curl_multi_perform(multi, &running);
+      if (running > 0) {
+        curl_multi_poll(multi, NULL, 0, 1000, NULL);
+      }
+    }
+    int queued;
+    CURLMsg* msg;
+    while ((msg = curl_multi_info_read(multi, &queued)) != NULL) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      CURL* handle = msg->easy_handle;
+      long status = 0;
+      curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+      if (msg->data.result == CURLE_OK && status == 200) {
+        result.completed++;
+      } else {
+        result.errors++;
+      }
+      curl_multi_remove_handle(multi, handle);
+      void* lane;
+      curl_easy_getinfo(handle, CURLINFO_PRIVATE, &lane);
+      if (next[reinterpret_cast<size_t>(lane)] < urls.size()) {
+        start_request(handle, reinterpret_cast<size_t>(lane));
+      }
+    }
+  }
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  counters.stop();
+  if (backend) {
+    result.backend_syscalls = backend->syscalls() - syscalls_before;
+  }
+  result.counters = counters.per_op(urls.size());
+
+  curl_multi_cleanup(multi);
+  for (size_t i = 0; i < handles.size(); i++) {
+    curl_easy_cleanup(handles[i]);
+  }
+  return result;
+}
+
+static double counter(const RunResult& result, const std::string& name)
+{
+  for (size_t i = 0; i < result.counters.size(); i++) {
+    if (result.counters[i].first == name) {
+      return result.counters[i].second;
+    }
+  }
+  return 0;
+}
+
+static void usage(const char* program)
+{
+  fprintf(stderr,
+      "Usage: %s --replay-server PATH [options]\n"
+      "\n"
+      "Options:\n"
+      "  --requests N      Requests per backend. Default 20000.\n"
+      "  --concurrency N   Requests in flight. Default 256.\n"
+      "  --hosts N         Distinct hosts, i.e. connections. Default and at most\n"
+      "                    the concurrency.\n"
+      "  --backends LIST   Default curl_poll,epoll,io_uring.\n"
+      "  --port N          Port for the replay server. Default 18084.\n"
+      "  --json            Print one JSON object per backend.\n",
+      program);
+}
+
+int main(int argc, char** argv)
+{
+  const char* replay_server = NULL;
+  int count = 20000;
+  int concurrency = 256;
+  int hosts = 0;
+  std::string backend_list = "curl_poll,epoll,io_uring";
+  int port = 18084;
+  bool json = false;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--json") {
+      json = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    const char* value = argv[++i];
+    if (arg == "--replay-server") {
+      replay_server = value;
+    } else if (arg == "--requests") {
+      count = std::atoi(value);
+    } else if (arg == "--concurrency") {
+      concurrency = std::atoi(value);
+    } else if (arg == "--hosts") {
+      hosts = std::atoi(value);
+    } else if (arg == "--backends") {
+      backend_list = value;
+    } else if (arg == "--port") {
+      port = std::atoi(value);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (replay_server == NULL || count <= 0 || concurrency <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (hosts <= 0 || hosts > concurrency) {
+    hosts = concurrency;
+  }
+
+  std::string trace_path = temp_path("event-backends.trace");
+  std::vector<TraceEntry> entries;
+  std::vector<std::string> urls;
+  for (int i = 0; i < count; i++) {
+    TraceEntry entry;
+    entry.url = "http://e" + std::to_string(i % concurrency % hosts) + ".test/" + std::to_string(i);
+    TraceHop hop;
+    hop.url = entry.url;
+    hop.protocol = "HTTP/1.1";
+    hop.status = 200;
+    entry.hops.push_back(hop);
+    entries.push_back(entry);
+    urls.push_back(entry.url);
+  }
+  write_trace(trace_path, entries);
+
+  ReplayServerProcess server;
+  std::vector<std::string> server_args;
+  server_args.push_back("--trace");
+  server_args.push_back(trace_path);
+  server_args.push_back("--port");
+  server_args.push_back(std::to_string(port));
+  if (!server.start(replay_server, server_args, port)) {
+    unlink(trace_path.c_str());
+    return 1;
+  }
+  curl_global_init(CURL_GLOBAL_ALL);
+  std::string connect_to_value = "::127.0.0.1:" + std::to_string(port);
+  struct curl_slist* connect_to = curl_slist_append(NULL, connect_to_value.c_str());
+
+  if (!json) {
+    printf("%-10s %12s %8s %14s %12s %12s %10s\n", "backend", "requests/s", "errors", "syscalls/req",
+        "user_us/req", "sys_us/req", "ctxsw/req");
+  }
+  int exit_code = 0;
+  for (size_t start = 0; start < backend_list.size();) {
+    size_t end = backend_list.find(',', start);
+    if (end == std::string::npos) {
+      end = backend_list.size();
+    }
+    std::string name = backend_list.substr(start, end - start);
+    start = end + 1;
+
+    RunResult result = run(name, urls, concurrency, connect_to);
+    if (result.seconds == 0) {
+      continue;
+    }
+    exit_code |= result.errors > 0;
+    double per_request = result.backend_syscalls >= 0 ? static_cast<double>(result.backend_syscalls) / count : -1;
+    if (json) {
+      printf("{\"name\": \"event_backend/%s\", \"ns_per_op\": %.1f, \"requests_per_second\": %.1f, "
+          "\"errors\": %zu", name.c_str(), result.seconds * 1e9 / count, count / result.seconds, result.errors);
+      if (per_request >= 0) {
+        printf(", \"syscalls_per_op\": %.3f", per_request);
+      }
+      for (size_t i = 0; i < result.counters.size(); i++) {
+        printf(", \"%s\": %.2f", result.counters[i].first.c_str(), result.counters[i].second);
+      }
+      printf("}\n");
+    } else {
+      char syscalls[32] = "-";
+      if (per_request >= 0) {
+        snprintf(syscalls, sizeof(syscalls), "%.3f", per_request);
+      }
+      printf("%-10s %12.0f %8zu %14s %12.2f %12.2f %10.3f\n", name.c_str(), count / result.seconds,
+          result.errors, syscalls, counter(result, "user_ns_per_op") / 1000,
+          counter(result, "sys_ns_per_op") / 1000, counter(result, "context_switches_per_op"));
+    }
+    fflush(stdout);
+  }
+
+  curl_slist_free_all(connect_to);
+  curl_global_cleanup();
+  server.stop();
+  unlink(trace_path.c_str());
+  return exit_code;
+}
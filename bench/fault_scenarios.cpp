@@ -0,0 +1,271 @@
+#include "replay_harness.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Measures how the expander copes with network faults, by running it in stdin
+ * mode against bench/replay-server with one set of injected faults (see
+ * FaultRule in replay_server.cpp) per scenario. For each scenario it reports
+ * how many expansions reached their destination, the errors returned, the
+ * latency distribution and how many expansions overran their budget, which
+ * is where timeout handling, retries and hedging show.
+ *
+ * Every URL redirects twice: http://shortN.test -> https://hop1.test ->
+ * https://hop2.test.
+ */
+
+struct Scenario {
+  std::string name;
+  std::string description;
+  std::vector<std::string> faults;
+};
+
+static std::vector<Scenario> builtin_scenarios()
+{
+  std::vector<Scenario> scenarios;
+  scenarios.push_back(Scenario{"baseline", "No faults", {}});
+  scenarios.push_back(Scenario{"slow_connect", "New connections to hop1 take 300 ms",
+      {"{\"host\": \"hop1.test\", \"fault\": \"connect_delay\", \"duration_ms\": 300}"}});
+  scenarios.push_back(Scenario{"tls_stall", "The first 3 handshakes with hop2 stall for 5 s",
+      {"{\"host\": \"hop2.test\", \"fault\": \"tls_stall\", \"duration_ms\": 5000, \"times\": 3}"}});
+  scenarios.push_back(Scenario{"reset_reused", "30% of requests on reused connections are reset",
+      {"{\"fault\": \"reset_reused\", \"probability\": 0.3}"}});
+  scenarios.push_back(Scenario{"reset", "5% of requests to hop1 are reset",
+      {"{\"host\": \"hop1.test\", \"fault\": \"reset\", \"probability\": 0.05}"}});
+  scenarios.push_back(Scenario{"slowloris", "10% of hop2 responses trickle in at 50 bytes/s",
+      {"{\"host\": \"hop2.test\", \"fault\": \"slow_headers\", \"interval_ms\": 20, \"probability\": 0.1}"}});
+  scenarios.push_back(Scenario{"hang", "5% of hop1 requests never get a response",
+      {"{\"host\": \"hop1.test\", \"fault\": \"hang\", \"duration_ms\": -1, \"probability\": 0.05}"}});
+  scenarios.push_back(Scenario{"tail_delay", "2% of all requests take 2 s longer",
+      {"{\"fault\": \"delay\", \"duration_ms\": 2000, \"probability\": 0.02}"}});
+  scenarios.push_back(Scenario{"unavailable", "10% of hop1 requests get a 503 with Retry-After",
+      {"{\"host\": \"hop1.test\", \"fault\": \"status\", \"status\": 503, \"retry_after\": \"1\", \"probability\": 0.1}"}});
+  scenarios.push_back(Scenario{"throttled", "hop1 allows 50 requests per second, then refuses all for 1 s",
+      {"{\"host\": \"hop1.test\", \"fault\": \"rate_limit\", \"rate\": 50, \"duration_ms\": 1000, "
+       "\"retry_after\": \"1\"}"}});
+  return scenarios;
+}
+
+struct ScenarioResult {
+  size_t reached = 0;
+  size_t wrong_url = 0;
+  std::map<int, size_t> errors;
+  std::vector<long> latencies_ms;
+  size_t over_budget = 0;
+};
+
+static long percentile(std::vector<long> values, double p)
+{
+  if (values.empty()) {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  size_t index = std::min(values.size() - 1, static_cast<size_t>(p / 100 * values.size()));
+  return values[index];
+}
+
+/**
+ * Parse one line of the expander's stdin mode output into result.
+ */
+static void parse_output(const std::string& line, const std::vector<TraceEntry>& chains, int hops,
+    long max_time_ms, ScenarioResult& result)
+{
+  static const std::string completed = " completed in ";
+  static const std::string failed = "calling curl: ";
+  static const std::string detected = "Error detected in ";
+  if (line.compare(0, 5, "URL '") != 0) {
+    return;
+  }
+  size_t url_end = line.find("': ");
+  if (url_end == std::string::npos) {
+    return;
+  }
+  long latency_ms;
+  size_t pos;
+  if ((pos = line.rfind(completed)) != std::string::npos) {
+    latency_ms = std::atol(line.c_str() + pos + completed.size());
+    // Chain URLs end with their index.
+    std::string url = line.substr(5, url_end - 5);
+    int index = std::atoi(url.c_str() + url.rfind('/') + 1);
+    std::string expanded = line.substr(url_end + 3, pos - url_end - 3);
+    if (index < static_cast<int>(chains.size()) && expanded == chain_destination(index, hops)) {
+      result.reached++;
+    } else {
+      result.wrong_url++;
+    }
+  } else if ((pos = line.find(failed)) != std::string::npos && line.find(detected) != std::string::npos) {
+    result.errors[std::atoi(line.c_str() + pos + failed.size())]++;
+    latency_ms = std::atol(line.c_str() + line.find(detected) + detected.size());
+  } else {
+    return;
+  }
+  result.latencies_ms.push_back(latency_ms);
+  // Allow for the granularity of curl's timers.
+  if (latency_ms > max_time_ms + max_time_ms / 10 + 10) {
+    result.over_budget++;
+  }
+}
+
+static void usage(const char* program)
+{
+  fprintf(stderr,
+      "Usage: %s --replay-server PATH --expander PATH [options]\n"
+      "\n"
+      "Options:\n"
+      "  --urls N           URLs per scenario. Default 500.\n"
+      "  --max-time-ms N    Budget per expansion. Default 1000.\n"
+      "  --scenario NAME    Only run this scenario.\n"
+      "  --faults FILE      Run the faults in FILE as scenario \"custom\" instead.\n"
+      "  --port N           Port for the replay server. Default 18081.\n"
+      "  --json             Print one JSON object per scenario.\n",
+      program);
+}
+
+int main(int argc, char** argv)
+{
+  const char* replay_server = NULL;
+  const char* expander = NULL;
+  const char* faults_path = NULL;
+  std::string only;
+  int count = 500;
+  long max_time_ms = 1000;
+  int port = 18081;
+  bool json = false;
+  const int hops = 2;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--json") {
+      json = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    const char* value = argv[++i];
+    if (arg == "--replay-server") {
+      replay_server = value;
+    } else if (arg == "--expander") {
+      expander = value;
+    } else if (arg == "--urls") {
+      count = std::atoi(value);
+    } else if (arg == "--max-time-ms") {
+      max_time_ms = std::atol(value);
+    } else if (arg == "--scenario") {
+      only = value;
+    } else if (arg == "--faults") {
+      faults_path = value;
+    } else if (arg == "--port") {
+      port = std::atoi(value);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (replay_server == NULL || expander == NULL || count <= 0 || max_time_ms <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<Scenario> scenarios;
+  if (faults_path != NULL) {
+    Scenario custom;
+    custom.name = "custom";
+    custom.description = faults_path;
+    std::ifstream file(faults_path);
+    for (std::string line; std::getline(file, line);) {
+      custom.faults.push_back(line);
+    }
+    scenarios.push_back(custom);
+  } else {
+    scenarios = builtin_scenarios();
+  }
+
+  std::string trace_path = temp_path("fault-scenarios.trace");
+  std::string urls_path = temp_path("fault-scenarios.urls");
+  std::string faults_file = temp_path("fault-scenarios.faults");
+  std::vector<TraceEntry> chains = chain_trace(count, hops);
+  std::vector<std::string> commands;
+  for (size_t i = 0; i < chains.size(); i++) {
+    commands.push_back(chains[i].url + " " + std::to_string(max_time_ms) + " 5");
+  }
+  write_trace(trace_path, chains);
+  write_lines(urls_path, commands);
+
+  std::string connect_to = "::127.0.0.1:" + std::to_string(port);
+  setenv("CONNECT_TO", connect_to.c_str(), 1);
+  unsetenv("AWS_LAMBDA_FUNCTION_NAME");
+  std::string command = std::string("'") + expander + "' < '" + urls_path + "' 2>&1";
+
+  if (!json) {
+    for (size_t s = 0; s < scenarios.size(); s++) {
+      if (only.empty() || scenarios[s].name == only) {
+        printf("%-14s %s\n", scenarios[s].name.c_str(), scenarios[s].description.c_str());
+      }
+    }
+    printf("\n%-14s %8s %8s %8s %8s %8s %8s %8s  %s\n", "scenario", "reached", "wrong", "errors",
+        "p50_ms", "p99_ms", "max_ms", "overrun", "error codes");
+  }
+  int exit_code = 0;
+  for (size_t s = 0; s < scenarios.size(); s++) {
+    const Scenario& scenario = scenarios[s];
+    if (!only.empty() && scenario.name != only) {
+      continue;
+    }
+    write_lines(faults_file, scenario.faults);
+    ReplayServerProcess server;
+    std::vector<std::string> server_args;
+    server_args.push_back("--trace");
+    server_args.push_back(trace_path);
+    server_args.push_back("--port");
+    server_args.push_back(std::to_string(port));
+    server_args.push_back("--faults");
+    server_args.push_back(faults_file);
+    if (!server.start(replay_server, server_args, port)) {
+      exit_code = 1;
+      break;
+    }
+
+    ScenarioResult result;
+    FILE* output = popen(command.c_str(), "r");
+    char line[8192];
+    while (output != NULL && fgets(line, sizeof(line), output) != NULL) {
+      parse_output(line, chains, hops, max_time_ms, result);
+    }
+    if (output != NULL) {
+      pclose(output);
+    }
+    server.stop();
+
+    size_t errors = 0;
+    std::string codes;
+    for (auto it = result.errors.begin(); it != result.errors.end(); ++it) {
+      errors += it->second;
+      codes += (codes.empty() ? "" : " ") + std::to_string(it->first) + ":" + std::to_string(it->second);
+    }
+    long p50 = percentile(result.latencies_ms, 50);
+    long p99 = percentile(result.latencies_ms, 99);
+    long max = percentile(result.latencies_ms, 100);
+    if (json) {
+      printf("{\"name\": \"faults/%s\", \"reached\": %zu, \"wrong_url\": %zu, \"errors\": %zu, "
+          "\"p50_ms\": %ld, \"p99_ms\": %ld, \"max_ms\": %ld, \"over_budget\": %zu}\n",
+          scenario.name.c_str(), result.reached, result.wrong_url, errors, p50, p99, max, result.over_budget);
+    } else {
+      printf("%-14s %8zu %8zu %8zu %8ld %8ld %8ld %8zu  %s\n", scenario.name.c_str(), result.reached,
+          result.wrong_url, errors, p50, p99, max, result.over_budget, codes.c_str());
+    }
+    fflush(stdout);
+  }
+
+  unlink(trace_path.c_str());
+  unlink(urls_path.c_str());
+  unlink(faults_file.c_str());
+  return exit_code;
+}
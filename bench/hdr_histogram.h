@@ -0,0 +1,126 @@
+#ifndef URL_EXPANDER_HDR_HISTOGRAM_H
+#define URL_EXPANDER_HDR_HISTOGRAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Minimal HDR histogram: records non-negative integer values with a fixed
+ * relative precision (three significant digits) using log-linear buckets, so
+ * recording is constant time and memory only grows with log(max value).
+ * Follows the bucket layout of HdrHistogram by Gil Tene.
+ */
+class HdrHistogram {
+ public:
+  /**
+   * highest_value is the largest value that can be recorded. Larger values are
+   * clamped to it.
+   */
+  explicit HdrHistogram(int64_t highest_value)
+    : highest_value(highest_value)
+  {
+    int buckets = 1;
+    int64_t smallest_untrackable = static_cast<int64_t>(sub_bucket_count);
+    while (smallest_untrackable <= highest_value) {
+      smallest_untrackable <<= 1;
+      buckets++;
+    }
+    counts.assign((buckets + 1) * sub_bucket_half_count, 0);
+  }
+
+  void record(int64_t value, int64_t count = 1)
+  {
+    if (value < 0) {
+      value = 0;
+    }
+    if (value > highest_value) {
+      value = highest_value;
+    }
+    counts[index_of(value)] += count;
+    total += count;
+    sum += value * count;
+    if (value > max_value) {
+      max_value = value;
+    }
+  }
+
+  void add(const HdrHistogram& other)
+  {
+    for (size_t i = 0; i < other.counts.size() && i < counts.size(); i++) {
+      counts[i] += other.counts[i];
+    }
+    total += other.total;
+    sum += other.sum;
+    if (other.max_value > max_value) {
+      max_value = other.max_value;
+    }
+  }
+
+  /**
+   * The value at percentile p in [0, 100], reported as the highest value that
+   * is equivalent to it at the histogram's precision.
+   */
+  int64_t percentile(double p) const
+  {
+    if (total == 0) {
+      return 0;
+    }
+    int64_t target = static_cast<int64_t>(p / 100.0 * total + 0.5);
+    if (target < 1) {
+      target = 1;
+    }
+    int64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= target) {
+        int64_t highest = value_of(i) + bucket_size(i) - 1;
+        return highest < max_value ? highest : max_value;
+      }
+    }
+    return max_value;
+  }
+
+  int64_t count() const { return total; }
+  int64_t max() const { return max_value; }
+  double mean() const { return total ? static_cast<double>(sum) / total : 0.0; }
+
+ private:
+  // Three significant digits need 2 * 10^3 sub-buckets, rounded up to 2^11.
+  static const int sub_bucket_half_count_magnitude = 10;
+  static const int sub_bucket_half_count = 1 << sub_bucket_half_count_magnitude;
+  static const int sub_bucket_count = 2 * sub_bucket_half_count;
+
+  size_t index_of(int64_t value) const
+  {
+    int bucket = 63 - __builtin_clzll(static_cast<uint64_t>(value) | (sub_bucket_count - 1)) -
+      sub_bucket_half_count_magnitude;
+    int sub_bucket = static_cast<int>(value >> bucket);
+    return ((bucket + 1) << sub_bucket_half_count_magnitude) + (sub_bucket - sub_bucket_half_count);
+  }
+
+  int64_t value_of(size_t index) const
+  {
+    int bucket = static_cast<int>(index >> sub_bucket_half_count_magnitude) - 1;
+    int64_t sub_bucket = (index & (sub_bucket_half_count - 1)) + sub_bucket_half_count;
+    if (bucket < 0) {
+      sub_bucket -= sub_bucket_half_count;
+      bucket = 0;
+    }
+    return sub_bucket << bucket;
+  }
+
+  int64_t bucket_size(size_t index) const
+  {
+    int bucket = static_cast<int>(index >> sub_bucket_half_count_magnitude) - 1;
+    return bucket < 0 ? 1 : static_cast<int64_t>(1) << bucket;
+  }
+
+  int64_t highest_value;
+  std::vector<int64_t> counts;
+  int64_t total = 0;
+  int64_t sum = 0;
+  int64_t max_value = 0;
+};
+
+#endif
@@ -0,0 +1,424 @@
+#include "hdr_histogram.h"
+
+#include <curl/curl.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * Open-loop load generator. Issues expansions at a fixed arrival rate,
+ * independent of how fast earlier ones complete, and measures each latency
+ * from the time the request was scheduled to be sent rather than from when it
+ * actually was. A stalled target therefore shows up as queueing delay in the
+ * tail instead of silently lowering the request rate (coordinated omission).
+ *
+ * Two kinds of targets are supported:
+ *     --cli CMD: Runs CMD (e.g. ./url-expander) and feeds it one URL per line
+ *                on stdin, matching result lines to requests in order.
+ *     --endpoint URL: POSTs {"url": ...} to URL, e.g. the invocation URL of
+ *                     the local runtime emulator.
+ *
+ * With several --rates, each rate is run in turn and the saturation knee is
+ * reported as the first rate at which the target cannot keep up.
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * Latencies are recorded in microseconds, up to one hour.
+ */
+static const int64_t max_latency_us = 3600LL * 1000 * 1000;
+
+struct StepResult {
+  double offered_rate;
+  double achieved_rate;
+  HdrHistogram latency_us;
+  size_t errors;
+  size_t incomplete;
+
+  StepResult() : latency_us(max_latency_us), errors(0), incomplete(0) {}
+};
+
+/**
+ * Send times, relative to the start of the step, of count requests arriving
+ * at rate per second.
+ */
+static std::vector<Clock::duration> schedule(double rate, size_t count, bool poisson, std::mt19937_64& rng)
+{
+  std::vector<Clock::duration> times;
+  std::exponential_distribution<double> gap(rate);
+  double t = 0;
+  for (size_t i = 0; i < count; i++) {
+    times.push_back(std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(t)));
+    t += poisson ? gap(rng) : 1.0 / rate;
+  }
+  return times;
+}
+
+static int poll_timeout_ms(Clock::time_point deadline)
+{
+  auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+  return static_cast<int>(std::max<long long>(0, std::min<long long>(remaining, 100)));
+}
+
+/**
+ * A running url-expander process in local (stdin) mode.
+ */
+class CliTarget {
+ public:
+  explicit CliTarget(const std::string& command)
+  {
+    int in[2];
+    int out[2];
+    if (pipe(in) != 0 || pipe(out) != 0) {
+      perror("pipe");
+      exit(1);
+    }
+    pid = fork();
+    if (pid == 0) {
+      dup2(in[0], STDIN_FILENO);
+      // Results are printed to stdout and failures to stderr, so read both
+      // from one pipe to keep their relative order.
+      dup2(out[1], STDOUT_FILENO);
+      dup2(out[1], STDERR_FILENO);
+      close(in[1]);
+      close(out[0]);
+      execl("/bin/sh", "sh", "-c", command.c_str(), (char*) NULL);
+      _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    input = in[1];
+    output = out[0];
+    fcntl(input, F_SETFL, O_NONBLOCK);
+    fcntl(output, F_SETFL, O_NONBLOCK);
+  }
+
+  ~CliTarget()
+  {
+    close(input);
+    close(output);
+    waitpid(pid, NULL, 0);
+  }
+
+  void run(const std::vector<std::string>& urls, const std::vector<Clock::duration>& times,
+      Clock::duration drain_timeout, StepResult& result)
+  {
+    std::deque<Clock::time_point> outstanding;
+    std::string pending_input;
+    std::string pending_output;
+    Clock::time_point start = Clock::now();
+    size_t next = 0;
+    Clock::time_point drain_deadline = start + times.back() + drain_timeout;
+    while ((next < times.size() || !outstanding.empty()) && Clock::now() < drain_deadline) {
+      Clock::time_point now = Clock::now();
+      while (next < times.size() && start + times[next] <= now) {
+        pending_input += urls[next % urls.size()] + "\n";
+        outstanding.push_back(start + times[next]);
+        next++;
+      }
+      if (!pending_input.empty()) {
+        ssize_t n = write(input, pending_input.data(), pending_input.size());
+        if (n > 0) {
+          pending_input.erase(0, n);
+        }
+      }
+
+      struct pollfd fds[2];
+      fds[0].fd = output;
+      fds[0].events = POLLIN;
+      fds[1].fd = input;
+      fds[1].events = pending_input.empty() ? 0 : POLLOUT;
+      Clock::time_point wake = next < times.size() ? start + times[next] : drain_deadline;
+      poll(fds, 2, poll_timeout_ms(wake));
+
+      char buffer[65536];
+      ssize_t n;
+      while ((n = read(output, buffer, sizeof(buffer))) > 0) {
+        pending_output.append(buffer, n);
+      }
+      Clock::time_point completed = Clock::now();
+      size_t end;
+      while ((end = pending_output.find('\n')) != std::string::npos) {
+        std::string line = pending_output.substr(0, end);
+        pending_output.erase(0, end + 1);
+        // Every expansion ends with exactly one line starting with "URL '".
+        if (line.compare(0, 5, "URL '") != 0 || outstanding.empty()) {
+          continue;
+        }
+        result.latency_us.record(std::chrono::duration_cast<std::chrono::microseconds>(
+              completed - outstanding.front()).count());
+        if (line.find("An error occurred") != std::string::npos) {
+          result.errors++;
+        }
+        outstanding.pop_front();
+      }
+    }
+    result.incomplete = outstanding.size() + (times.size() - next);
+  }
+
+ private:
+  pid_t pid;
+  int input;
+  int output;
+};
+
+static size_t append_to_string(char* data, size_t size, size_t nmemb, void* userp)
+{
+  static_cast<std::string*>(userp)->append(data, size * nmemb);
+  return size * nmemb;
+}
+
+static std::string json_escape(const std::string& s)
+{
+  std::string escaped;
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '"' || s[i] == '\\') {
+      escaped += '\\';
+    }
+    escaped += s[i];
+  }
+  return escaped;
+}
+
+/**
+ * An invocation endpoint such as the runtime interface emulator.
+ */
+class EndpointTarget {
+ public:
+  explicit EndpointTarget(const std::string& endpoint)
+    : endpoint(endpoint)
+  {
+    multi = curl_multi_init();
+  }
+
+  ~EndpointTarget()
+  {
+    curl_multi_cleanup(multi);
+  }
+
+  void run(const std::vector<std::string>& urls, const std::vector<Clock::duration>& times,
+      Clock::duration drain_timeout, StepResult& result)
+  {
+    struct Request {
+      Clock::time_point intended;
+      std::string body;
+      std::string response;
+    };
+    Clock::time_point start = Clock::now();
+    Clock::time_point drain_deadline = start + times.back() + drain_timeout;
+    size_t next = 0;
+    int running = 0;
+    std::set<CURL*> in_flight;
+    while ((next < times.size() || !in_flight.empty()) && Clock::now() < drain_deadline) {
+      Clock::time_point now = Clock::now();
+      while (next < times.size() && start + times[next] <= now) {
+        Request* request = new Request();
+        request->intended = start + times[next];
+        request->body = "{\"url\": \"" + json_escape(urls[next % urls.size()]) + "\"}";
+        CURL* handle = curl_easy_init();
+        curl_easy_setopt(handle, CURLOPT_URL, endpoint.c_str());
+        curl_easy_setopt(handle, CURLOPT_POSTFIELDS, request->body.c_str());
+        curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, append_to_string);
+        curl_easy_setopt(handle, CURLOPT_WRITEDATA, &request->response);
+        curl_easy_setopt(handle, CURLOPT_PRIVATE, request);
+        curl_multi_add_handle(multi, handle);
+        in_flight.insert(handle);
+        next++;
+      }
+
+      curl_multi_perform(multi, &running);
+      CURLMsg* msg;
+      int queued;
+      while ((msg = curl_multi_info_read(multi, &queued)) != NULL) {
+        if (msg->msg != CURLMSG_DONE) {
+          continue;
+        }
+        Request* request;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &request);
+        long status = 0;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+        result.latency_us.record(std::chrono::duration_cast<std::chrono::microseconds>(
+              Clock::now() - request->intended).count());
+        if (msg->data.result != CURLE_OK || status != 200 ||
+            request->response.find("\"error_code\":0") == std::string::npos) {
+          result.errors++;
+        }
+        in_flight.erase(msg->easy_handle);
+        curl_multi_remove_handle(multi, msg->easy_handle);
+        curl_easy_cleanup(msg->easy_handle);
+        delete request;
+      }
+      Clock::time_point wake = next < times.size() ? start + times[next] : drain_deadline;
+      curl_multi_poll(multi, NULL, 0, poll_timeout_ms(wake), NULL);
+    }
+
+    // Abandon whatever did not complete in time.
+    for (auto it = in_flight.begin(); it != in_flight.end(); ++it) {
+      Request* request;
+      curl_easy_getinfo(*it, CURLINFO_PRIVATE, &request);
+      curl_multi_remove_handle(multi, *it);
+      curl_easy_cleanup(*it);
+      delete request;
+      result.incomplete++;
+    }
+    in_flight.clear();
+    result.incomplete += times.size() - next;
+  }
+
+ private:
+  std::string endpoint;
+  CURLM* multi;
+};
+
+static void usage(const char* program)
+{
+  fprintf(stderr,
+      "Usage: %s (--cli CMD | --endpoint URL) --urls FILE [options]\n"
+      "\n"
+      "Options:\n"
+      "  --rates R1,R2,...      Arrival rates to sweep, in requests/s. Default 10.\n"
+      "  --duration S           Seconds to run each rate for. Default 10.\n"
+      "  --arrivals MODE        poisson or constant. Default poisson.\n"
+      "  --drain-timeout S      Seconds to wait for stragglers. Default 30.\n"
+      "  --knee-factor F        Saturated once p99 exceeds F times the p99 of the\n"
+      "                         first rate. Default 5.\n"
+      "  --seed N               Random seed for Poisson arrivals. Default 1.\n",
+      program);
+}
+
+int main(int argc, char** argv)
+{
+  std::string cli;
+  std::string endpoint;
+  const char* urls_path = NULL;
+  std::vector<double> rates;
+  double duration_s = 10;
+  bool poisson = true;
+  double drain_timeout_s = 30;
+  double knee_factor = 5;
+  unsigned long long seed = 1;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    const char* value = argv[i + 1];
+    if (arg == "--cli") {
+      cli = value;
+    } else if (arg == "--endpoint") {
+      endpoint = value;
+    } else if (arg == "--urls") {
+      urls_path = value;
+    } else if (arg == "--rates") {
+      std::string list = value;
+      for (size_t start = 0; start < list.size();) {
+        size_t comma = list.find(',', start);
+        if (comma == std::string::npos) {
+          comma = list.size();
+        }
+        rates.push_back(std::atof(list.substr(start, comma - start).c_str()));
+        start = comma + 1;
+      }
+    } else if (arg == "--duration") {
+      duration_s = std::atof(value);
+    } else if (arg == "--arrivals") {
+      poisson = std::string(value) == "poisson";
+    } else if (arg == "--drain-timeout") {
+      drain_timeout_s = std::atof(value);
+    } else if (arg == "--knee-factor") {
+      knee_factor = std::atof(value);
+    } else if (arg == "--seed") {
+      seed = std::strtoull(value, NULL, 10);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc % 2 == 0 || urls_path == NULL || cli.empty() == endpoint.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (rates.empty()) {
+    rates.push_back(10);
+  }
+
+  std::vector<std::string> urls;
+  std::ifstream file(urls_path);
+  for (std::string line; std::getline(file, line);) {
+    if (!line.empty()) {
+      urls.push_back(line);
+    }
+  }
+  if (urls.empty()) {
+    fprintf(stderr, "No URLs in %s\n", urls_path);
+    exit(1);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  curl_global_init(CURL_GLOBAL_ALL);
+  CliTarget* cli_target = cli.empty() ? NULL : new CliTarget(cli);
+  EndpointTarget* endpoint_target = endpoint.empty() ? NULL : new EndpointTarget(endpoint);
+  auto drain_timeout = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(drain_timeout_s));
+
+  std::mt19937_64 rng(seed);
+  std::vector<StepResult> results(rates.size());
+  printf("%10s %10s %10s %10s %10s %10s %10s %8s %10s\n",
+      "offered/s", "achieved/s", "p50_ms", "p90_ms", "p99_ms", "p99.9_ms", "max_ms", "errors", "incomplete");
+  double knee = 0;
+  for (size_t step = 0; step < rates.size(); step++) {
+    StepResult& result = results[step];
+    result.offered_rate = rates[step];
+    size_t count = std::max<size_t>(1, static_cast<size_t>(rates[step] * duration_s));
+    std::vector<Clock::duration> times = schedule(rates[step], count, poisson, rng);
+    Clock::time_point start = Clock::now();
+    if (cli_target) {
+      cli_target->run(urls, times, drain_timeout, result);
+    } else {
+      endpoint_target->run(urls, times, drain_timeout, result);
+    }
+    double elapsed_s = std::chrono::duration<double>(Clock::now() - start).count();
+    result.achieved_rate = result.latency_us.count() / elapsed_s;
+    const HdrHistogram& h = result.latency_us;
+    printf("%10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %8zu %10zu\n",
+        result.offered_rate, result.achieved_rate, h.percentile(50) / 1000.0, h.percentile(90) / 1000.0,
+        h.percentile(99) / 1000.0, h.percentile(99.9) / 1000.0, h.max() / 1000.0,
+        result.errors, result.incomplete);
+    fflush(stdout);
+
+    // The knee is the first rate the target cannot sustain: completions fall
+    // behind arrivals or the tail blows up relative to the lightest load.
+    bool saturated = result.incomplete > 0 || result.achieved_rate < 0.9 * result.offered_rate ||
+      (step > 0 && h.percentile(99) > knee_factor * results[0].latency_us.percentile(99));
+    if (saturated && knee == 0) {
+      knee = result.offered_rate;
+    }
+    // Stragglers would be attributed to the next rate's requests.
+    if (result.incomplete > 0) {
+      break;
+    }
+  }
+  if (rates.size() > 1) {
+    if (knee > 0) {
+      printf("saturation knee: %.1f/s\n", knee);
+    } else {
+      printf("saturation knee: not reached\n");
+    }
+  }
+
+  delete cli_target;
+  delete endpoint_target;
+  curl_global_cleanup();
+  return 0;
+}
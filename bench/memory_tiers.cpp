@@ -0,0 +1,353 @@
+#include "replay_harness.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+/**
+ * Emulates Lambda memory sizes by running the expander in stdin mode against
+ * bench/replay-server inside a cgroup with the CPU quota and memory limit of
+ * each size. Lambda allocates CPU in proportion to memory, with one full vCPU
+ * at 1769 MB, so TLS-heavy workloads get faster with memory up to that point.
+ * Reports throughput, latency and the estimated cost per million URLs of each
+ * combination of memory size and MAX_CONNECTIONS.
+ *
+ * Needs permission to create cgroups, i.e. root or a delegated subtree, and
+ * supports both cgroup v2 and the v1 cpu and memory hierarchies.
+ */
+
+/**
+ * Memory in MB at which Lambda allocates one full vCPU.
+ */
+static const double mb_per_vcpu = 1769;
+
+/**
+ * A cgroup limiting the CPU time and memory of the processes moved into it,
+ * removed on destruction.
+ */
+class LimitCgroup {
+ public:
+  /**
+   * Create the cgroup name below the hierarchy root at root. Returns NULL if
+   * cgroups are not available or not writable.
+   */
+  static LimitCgroup* create(const std::string& root, const std::string& name)
+  {
+    LimitCgroup* cgroup = new LimitCgroup();
+    cgroup->v2 = file_exists(root + "/cgroup.controllers");
+    if (cgroup->v2) {
+      // Controllers must be enabled in the parent to be usable in children.
+      write_file(root + "/cgroup.subtree_control", "+cpu +memory");
+      cgroup->cpu_dir = cgroup->memory_dir = root + "/" + name;
+    } else {
+      cgroup->cpu_dir = root + "/cpu/" + name;
+      cgroup->memory_dir = root + "/memory/" + name;
+    }
+    bool created = mkdir(cgroup->cpu_dir.c_str(), 0755) == 0 || errno == EEXIST;
+    if (created && cgroup->memory_dir != cgroup->cpu_dir) {
+      created = mkdir(cgroup->memory_dir.c_str(), 0755) == 0 || errno == EEXIST;
+    }
+    if (!created) {
+      delete cgroup;
+      return NULL;
+    }
+    return cgroup;
+  }
+
+  ~LimitCgroup()
+  {
+    rmdir(cpu_dir.c_str());
+    if (memory_dir != cpu_dir) {
+      rmdir(memory_dir.c_str());
+    }
+  }
+
+  /**
+   * Limit to cpus CPUs worth of time and memory_mb of memory, without swap.
+   */
+  bool limit(double cpus, long memory_mb)
+  {
+    const long period_us = 100000;
+    long quota_us = static_cast<long>(cpus * period_us);
+    long long bytes = static_cast<long long>(memory_mb) << 20;
+    if (v2) {
+      write_file(memory_dir + "/memory.swap.max", "0");
+      return write_file(cpu_dir + "/cpu.max", std::to_string(quota_us) + " " + std::to_string(period_us)) &&
+        write_file(memory_dir + "/memory.max", std::to_string(bytes));
+    }
+    write_file(memory_dir + "/memory.memsw.limit_in_bytes", std::to_string(bytes));
+    return write_file(cpu_dir + "/cpu.cfs_period_us", std::to_string(period_us)) &&
+      write_file(cpu_dir + "/cpu.cfs_quota_us", std::to_string(quota_us)) &&
+      write_file(memory_dir + "/memory.limit_in_bytes", std::to_string(bytes));
+  }
+
+  /**
+   * Shell commands that move the shell running them into the cgroup, to
+   * prefix a command with.
+   */
+  std::string join_command() const
+  {
+    std::string command = "echo $$ > '" + cpu_dir + "/cgroup.procs' && ";
+    if (memory_dir != cpu_dir) {
+      command += "echo $$ > '" + memory_dir + "/cgroup.procs' && ";
+    }
+    return command;
+  }
+
+  /**
+   * Highest memory use of the cgroup in bytes, or -1 if unknown.
+   */
+  long long peak_memory() const
+  {
+    std::string value = read_file(memory_dir + (v2 ? "/memory.peak" : "/memory.max_usage_in_bytes"));
+    return value.empty() ? -1 : std::atoll(value.c_str());
+  }
+
+  /**
+   * Number of processes killed for exceeding the memory limit.
+   */
+  long oom_kills() const
+  {
+    std::string events = read_file(memory_dir + (v2 ? "/memory.events" : "/memory.oom_control"));
+    size_t pos = events.find("oom_kill ");
+    return pos == std::string::npos ? 0 : std::atol(events.c_str() + pos + 9);
+  }
+
+ private:
+  static bool file_exists(const std::string& path)
+  {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0;
+  }
+
+  static bool write_file(const std::string& path, const std::string& value)
+  {
+    std::ofstream file(path.c_str());
+    file << value;
+    file.close();
+    return static_cast<bool>(file);
+  }
+
+  static std::string read_file(const std::string& path)
+  {
+    std::ifstream file(path.c_str());
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  }
+
+  bool v2 = false;
+  std::string cpu_dir;
+  std::string memory_dir;
+};
+
+struct RunResult {
+  size_t completed = 0;
+  size_t errors = 0;
+  std::vector<long> latencies_ms;
+  double seconds = 0;
+};
+
+/**
+ * Run command and collect the results of the expansions it prints.
+ */
+static RunResult run(const std::string& command)
+{
+  static const std::string completed = " completed in ";
+  static const std::string detected = "Error detected in ";
+  RunResult result;
+  auto start = std::chrono::steady_clock::now();
+  FILE* output = popen(command.c_str(), "r");
+  char buffer[8192];
+  while (output != NULL && fgets(buffer, sizeof(buffer), output) != NULL) {
+    std::string line = buffer;
+    size_t pos;
+    if (line.compare(0, 5, "URL '") != 0) {
+      continue;
+    }
+    if ((pos = line.rfind(completed)) != std::string::npos) {
+      result.completed++;
+      result.latencies_ms.push_back(std::atol(line.c_str() + pos + completed.size()));
+    } else if ((pos = line.rfind(detected)) != std::string::npos) {
+      result.errors++;
+      result.latencies_ms.push_back(std::atol(line.c_str() + pos + detected.size()));
+    }
+  }
+  if (output != NULL) {
+    pclose(output);
+  }
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::sort(result.latencies_ms.begin(), result.latencies_ms.end());
+  return result;
+}
+
+static long percentile(const std::vector<long>& sorted, double p)
+{
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p / 100 * sorted.size()))];
+}
+
+static std::vector<long> parse_list(const std::string& list)
+{
+  std::vector<long> values;
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    values.push_back(std::atol(list.substr(start, end == std::string::npos ? std::string::npos : end - start).c_str()));
+    start = end == std::string::npos ? list.size() : end + 1;
+  }
+  return values;
+}
+
+static void usage(const char* program)
+{
+  fprintf(stderr,
+      "Usage: %s --replay-server PATH --expander PATH [options]\n"
+      "\n"
+      "Options:\n"
+      "  --memory-sizes LIST       Lambda memory sizes in MB.\n"
+      "                            Default 128,256,512,1024,1769,3008.\n"
+      "  --max-connections LIST    MAX_CONNECTIONS values to try. Default 500.\n"
+      "  --trace FILE              Trace to replay, e.g. from bench/corpus-generator.\n"
+      "  --urls FILE               Input for the expander, with --trace.\n"
+      "                            Default: 2000 generated two-hop chains.\n"
+      "  --speed FACTOR            Replay speed, see bench/replay-server. Default 1.\n"
+      "  --urls-per-invocation N   URLs per invocation, for the request price. Default 1.\n"
+      "  --price-gb-second P       Default 0.0000166667 (x86).\n"
+      "  --price-request P         Default 0.0000002.\n"
+      "  --cgroup-root DIR         Default /sys/fs/cgroup.\n"
+      "  --port N                  Default 18082.\n",
+      program);
+}
+
+int main(int argc, char** argv)
+{
+  const char* replay_server = NULL;
+  const char* expander = NULL;
+  std::string trace_path;
+  std::string urls_path;
+  std::string speed = "1";
+  std::vector<long> memory_sizes = parse_list("128,256,512,1024,1769,3008");
+  std::vector<long> max_connections = parse_list("500");
+  double urls_per_invocation = 1;
+  double price_gb_second = 0.0000166667;
+  double price_request = 0.0000002;
+  std::string cgroup_root = "/sys/fs/cgroup";
+  int port = 18082;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    const char* value = argv[i + 1];
+    if (arg == "--replay-server") {
+      replay_server = value;
+    } else if (arg == "--expander") {
+      expander = value;
+    } else if (arg == "--memory-sizes") {
+      memory_sizes = parse_list(value);
+    } else if (arg == "--max-connections") {
+      max_connections = parse_list(value);
+    } else if (arg == "--trace") {
+      trace_path = value;
+    } else if (arg == "--urls") {
+      urls_path = value;
+    } else if (arg == "--speed") {
+      speed = value;
+    } else if (arg == "--urls-per-invocation") {
+      urls_per_invocation = std::max(1.0, std::atof(value));
+    } else if (arg == "--price-gb-second") {
+      price_gb_second = std::atof(value);
+    } else if (arg == "--price-request") {
+      price_request = std::atof(value);
+    } else if (arg == "--cgroup-root") {
+      cgroup_root = value;
+    } else if (arg == "--port") {
+      port = std::atoi(value);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (replay_server == NULL || expander == NULL || trace_path.empty() != urls_path.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  bool generated = trace_path.empty();
+  if (generated) {
+    trace_path = temp_path("memory-tiers.trace");
+    urls_path = temp_path("memory-tiers.urls");
+    std::vector<TraceEntry> chains = chain_trace(2000, 2);
+    std::vector<std::string> urls;
+    for (size_t i = 0; i < chains.size(); i++) {
+      urls.push_back(chains[i].url);
+    }
+    write_trace(trace_path, chains);
+    write_lines(urls_path, urls);
+  }
+
+  ReplayServerProcess server;
+  std::vector<std::string> server_args;
+  server_args.push_back("--trace");
+  server_args.push_back(trace_path);
+  server_args.push_back("--port");
+  server_args.push_back(std::to_string(port));
+  server_args.push_back("--speed");
+  server_args.push_back(speed);
+  if (!server.start(replay_server, server_args, port)) {
+    return 1;
+  }
+  std::string connect_to = "::127.0.0.1:" + std::to_string(port);
+  setenv("CONNECT_TO", connect_to.c_str(), 1);
+  unsetenv("AWS_LAMBDA_FUNCTION_NAME");
+
+  printf("%9s %6s %9s %9s %8s %8s %7s %8s %9s\n", "memory_mb", "vcpu", "max_conn", "urls/s",
+      "p50_ms", "p99_ms", "errors", "peak_mb", "$/M urls");
+  int exit_code = 0;
+  for (size_t m = 0; m < memory_sizes.size(); m++) {
+    for (size_t c = 0; c < max_connections.size(); c++) {
+      long memory_mb = memory_sizes[m];
+      double vcpu = std::min(6.0, memory_mb / mb_per_vcpu);
+      LimitCgroup* cgroup = LimitCgroup::create(cgroup_root, "url-expander-tier-" + std::to_string(memory_mb));
+      if (cgroup == NULL || !cgroup->limit(vcpu, memory_mb)) {
+        fprintf(stderr, "Failed to set up a cgroup below %s; this needs root or a delegated cgroup.\n",
+            cgroup_root.c_str());
+        delete cgroup;
+        exit_code = 1;
+        break;
+      }
+      setenv("MAX_CONNECTIONS", std::to_string(max_connections[c]).c_str(), 1);
+      RunResult result = run(cgroup->join_command() + "exec '" + expander + "' < '" + urls_path + "' 2>&1");
+      size_t urls = result.completed + result.errors;
+      long long peak = cgroup->peak_memory();
+      long oom_kills = cgroup->oom_kills();
+      delete cgroup;
+
+      // Billed duration per URL, at one instance processing URLs in turn.
+      double gb_seconds = urls ? result.seconds / urls * memory_mb / 1024 : 0;
+      double cost = 1e6 * (gb_seconds * price_gb_second + price_request / urls_per_invocation);
+      printf("%9ld %6.2f %9ld %9.1f %8ld %8ld %7zu %8s %9.3f%s\n", memory_mb, vcpu, max_connections[c],
+          urls / result.seconds, percentile(result.latencies_ms, 50), percentile(result.latencies_ms, 99),
+          result.errors, peak < 0 ? "-" : std::to_string(peak >> 20).c_str(), cost,
+          oom_kills ? "  OOM killed" : "");
+      fflush(stdout);
+    }
+    if (exit_code != 0) {
+      break;
+    }
+  }
+
+  server.stop();
+  if (generated) {
+    unlink(trace_path.c_str());
+    unlink(urls_path.c_str());
+  }
+  return exit_code;
+}
@@ -0,0 +1,365 @@
+#include "perf_counters.h"
+
+#include "engine.h"
+#include "head_client.h"
+#include "host.h"
+#include "request.h"
+#include "trace.h"
+
+#include <aws/core/utils/json/JsonSerializer.h>
+#include <curl/curl.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Microbenchmarks for the CPU-bound stages of the request path, i.e.
+ * everything an invocation does besides waiting on the network. Each benchmark
+ * reports the time and the number of heap allocations per operation.
+ *
+ * Allocations are counted by interposing malloc, so they include those made
+ * by libcurl and the AWS SDK, not just by operator new. This relies on glibc
+ * exporting __libc_malloc and friends.
+ *
+ * Where the kernel allows it, each benchmark also reports hardware counters
+ * per operation (see perf_counters.h), to tell whether a change helped by
+ * executing fewer instructions or by missing the cache less.
+ */
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+}
+
+static size_t allocations = 0;
+
+extern "C" void* malloc(size_t size)
+{
+  allocations++;
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+  allocations++;
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void* ptr)
+{
+  __libc_free(ptr);
+}
+
+/**
+ * Keep the compiler from optimizing away a computed value.
+ */
+template <typename T>
+static void do_not_optimize(T const& value)
+{
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+typedef std::chrono::steady_clock Clock;
+
+struct Benchmark {
+  std::string name;
+  std::function<void()> op;
+};
+
+struct Measurement {
+  size_t iterations;
+  double ns_per_op;
+  double allocations_per_op;
+  std::vector<std::pair<std::string, double> > counters;
+};
+
+/**
+ * Value of the counter called name in m, or -1 if it is unavailable.
+ */
+static double counter(const Measurement& m, const std::string& name)
+{
+  for (size_t i = 0; i < m.counters.size(); i++) {
+    if (m.counters[i].first == name) {
+      return m.counters[i].second;
+    }
+  }
+  return -1;
+}
+
+static std::string format_counter(const char* format, double value)
+{
+  if (value < 0) {
+    return "-";
+  }
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), format, value);
+  return buffer;
+}
+
+/**
+ * Run op until at least min_time has passed, after a short warm up.
+ */
+static Measurement measure(const std::function<void()>& op, Clock::duration min_time, PerfCounters& counters)
+{
+  for (int i = 0; i < 100; i++) {
+    op();
+  }
+  size_t iterations = 1;
+  for (;;) {
+    size_t allocations_before = allocations;
+    counters.start();
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+      op();
+    }
+    Clock::duration elapsed = Clock::now() - start;
+    counters.stop();
+    size_t allocated = allocations - allocations_before;
+    if (elapsed >= min_time) {
+      Measurement m;
+      m.iterations = iterations;
+      m.ns_per_op = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+      m.allocations_per_op = static_cast<double>(allocated) / iterations;
+      m.counters = counters.per_op(iterations);
+      return m;
+    }
+    // Aim for min_time on the next attempt, but grow by at most 10x.
+    double scale = elapsed.count() > 0 ? 1.2 * min_time.count() / elapsed.count() : 10;
+    iterations = static_cast<size_t>(iterations * std::min(10.0, std::max(2.0, scale)));
+  }
+}
+
+/**
+ * HopTransport that answers from memory, to measure the engine's own cost.
+ */
+class MemoryTransport : public HopTransport {
+ public:
+  void perform(const std::string& url, long timeout_ms, bool fresh_connection, const TransferStrategy& strategy,
+      HopResponse& response)
+  {
+    auto it = responses.find(url);
+    if (it == responses.end()) {
+      response.code = CURLE_COULDNT_RESOLVE_HOST;
+      return;
+    }
+    response = it->second;
+  }
+
+  long long now_us()
+  {
+    return 0;
+  }
+
+  std::unordered_map<std::string, HopResponse> responses;
+};
+
+static std::string batch_payload(size_t count)
+{
+  std::string payload = "{\"urls\": [";
+  for (size_t i = 0; i < count; i++) {
+    payload += (i ? ", " : "") + std::string("\"https://bit.ly/3") + std::to_string(100000 + i) + "xQz\"";
+  }
+  return payload + "], \"max_time_ms\": 1000, \"max_redirects\": 5}";
+}
+
+static void usage(const char* program)
+{
+  fprintf(stderr,
+      "Usage: %s [--filter SUBSTRING] [--min-time-ms N] [--json]\n"
+      "\n"
+      "--json prints one JSON object per benchmark instead of a table.\n",
+      program);
+}
+
+int main(int argc, char** argv)
+{
+  std::string filter;
+  long min_time_ms = 200;
+  bool json = false;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--json") {
+      json = true;
+    } else if (arg == "--filter" && i + 1 < argc) {
+      filter = argv[++i];
+    } else if (arg == "--min-time-ms" && i + 1 < argc) {
+      min_time_ms = std::atol(argv[++i]);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  curl_global_init(CURL_GLOBAL_ALL);
+  CURL* curl = curl_easy_init();
+
+  // Realistic inputs: a shortener URL, a typical destination URL with
+  // tracking parameters, and a three hop chain between them.
+  const std::string short_url = "https://bit.ly/3xQz9Lk";
+  const std::string long_url = "https://www.example-news.co.uk/world/2022/06/14/"
+    "some-long-article-slug-about-current-events?utm_source=twitter&utm_medium=social&utm_campaign=share";
+  const std::string single_payload = "{\"url\": \"" + short_url + "\", \"max_time_ms\": 1000, \"max_redirects\": 5}";
+  const std::string batch50_payload = batch_payload(50);
+  const std::string stdin_line = short_url + " 1000 5";
+
+  ExpansionRequest single_request;
+  parse_request(single_payload, 500, 5, single_request);
+  ExpansionRequest batch_request;
+  parse_request(batch50_payload, 500, 5, batch_request);
+
+  MemoryTransport transport;
+  HopResponse hop;
+  hop.effective_url = "http://bit.ly/3xQz9Lk";
+  hop.redirect_url = "https://bit.ly/3xQz9Lk";
+  transport.responses[short_url] = hop;
+  transport.responses["bit.ly/3xQz9Lk"] = hop;
+  hop.effective_url = "https://bit.ly/3xQz9Lk";
+  hop.redirect_url = "https://example-news.co.uk/a?id=1";
+  transport.responses[hop.effective_url] = hop;
+  hop.effective_url = hop.redirect_url;
+  hop.redirect_url = long_url;
+  transport.responses[hop.effective_url] = hop;
+  hop.effective_url = long_url;
+  hop.redirect_url.clear();
+  transport.responses[long_url] = hop;
+  ExpansionPolicy policy;
+
+  TraceEntry trace_entry;
+  trace_entry.url = short_url;
+  for (int i = 0; i < 3; i++) {
+    TraceHop trace_hop;
+    trace_hop.url = i == 0 ? short_url : long_url;
+    trace_hop.protocol = "HTTP/2";
+    trace_hop.status = i < 2 ? 301 : 200;
+    trace_hop.latency_us = 23456;
+    trace_hop.headers.push_back(std::make_pair("location", long_url));
+    trace_hop.headers.push_back(std::make_pair("content-type", "text/html; charset=utf-8"));
+    trace_hop.headers.push_back(std::make_pair("date", "Tue, 14 Jun 2022 10:00:00 GMT"));
+    trace_hop.headers.push_back(std::make_pair("server", "nginx"));
+    trace_entry.hops.push_back(trace_hop);
+  }
+
+  // A typical shortener response, as the purpose-built HEAD client parses it
+  // where curl's header callback and redirect handling would run.
+  std::string response_head = "HTTP/1.1 301 Moved Permanently\r\n"
+      "Server: nginx\r\n"
+      "Date: Tue, 14 Jun 2022 10:00:00 GMT\r\n"
+      "Content-Type: text/html; charset=utf-8\r\n"
+      "Content-Length: 162\r\n"
+      "Connection: keep-alive\r\n"
+      "Cache-Control: private, max-age=90\r\n"
+      "Location: " + long_url + "\r\n"
+      "\r\n";
+
+  std::vector<Benchmark> benchmarks;
+  benchmarks.push_back(Benchmark{"parse_request/single", [&]() {
+    ExpansionRequest request;
+    do_not_optimize(parse_request(single_payload, 500, 5, request));
+  }});
+  benchmarks.push_back(Benchmark{"parse_request/batch_50", [&]() {
+    ExpansionRequest request;
+    do_not_optimize(parse_request(batch50_payload, 500, 5, request));
+  }});
+  benchmarks.push_back(Benchmark{"split/stdin_line", [&]() {
+    do_not_optimize(split(stdin_line));
+  }});
+  benchmarks.push_back(Benchmark{"url_host/short_url", [&]() {
+    do_not_optimize(url_host(short_url));
+  }});
+  benchmarks.push_back(Benchmark{"url_host/long_url", [&]() {
+    do_not_optimize(url_host(long_url));
+  }});
+  const std::string long_host = url_host(long_url);
+  benchmarks.push_back(Benchmark{"registrable_domain/short_host", [&]() {
+    do_not_optimize(registrable_domain_offset("bit.ly", 6));
+  }});
+  benchmarks.push_back(Benchmark{"registrable_domain/long_host", [&]() {
+    do_not_optimize(registrable_domain_offset(long_host.data(), long_host.size()));
+  }});
+  benchmarks.push_back(Benchmark{"url_site/long_url", [&]() {
+    do_not_optimize(url_site(long_url));
+  }});
+  benchmarks.push_back(Benchmark{"set_hop_options", [&]() {
+    set_hop_options(curl, long_url, 1000);
+  }});
+  benchmarks.push_back(Benchmark{"head_client/parse_response_head", [&]() {
+    ResponseHead head;
+    do_not_optimize(parse_response_head(response_head.data(), response_head.size(), head));
+    do_not_optimize(head.location);
+  }});
+  benchmarks.push_back(Benchmark{"follow_redirects/3_hops", [&]() {
+    std::string expanded_url;
+    bool reached_redirect_limit;
+    do_not_optimize(follow_redirects(transport, policy, expanded_url, reached_redirect_limit,
+          "bit.ly/3xQz9Lk", 1000, 5));
+  }});
+  benchmarks.push_back(Benchmark{"serialize/single_success", [&]() {
+    Aws::Utils::Array<Aws::Utils::Json::JsonValue> results(1);
+    results[0] = expansion_result_to_json(CURLE_OK, long_url, false, 123);
+    do_not_optimize(serialize_response(single_request, std::move(results)));
+  }});
+  benchmarks.push_back(Benchmark{"serialize/single_error", [&]() {
+    Aws::Utils::Array<Aws::Utils::Json::JsonValue> results(1);
+    results[0] = expansion_result_to_json(CURLE_OPERATION_TIMEDOUT, "", false, 500);
+    do_not_optimize(serialize_response(single_request, std::move(results)));
+  }});
+  benchmarks.push_back(Benchmark{"serialize/batch_50", [&]() {
+    Aws::Utils::Array<Aws::Utils::Json::JsonValue> results(batch_request.urls.size());
+    for (size_t i = 0; i < batch_request.urls.size(); i++) {
+      results[i] = expansion_result_to_json(CURLE_OK, long_url, false, 123);
+    }
+    do_not_optimize(serialize_response(batch_request, std::move(results)));
+  }});
+  benchmarks.push_back(Benchmark{"trace/entry_to_json", [&]() {
+    do_not_optimize(trace_entry_to_json(trace_entry));
+  }});
+
+  PerfCounters counters;
+  if (!counters.has_hardware_events()) {
+    fprintf(stderr, "Hardware counters are unavailable, leaving them out.\n");
+  }
+  if (!json) {
+    printf("%-32s %12s %12s %12s %8s %12s %12s\n", "benchmark", "ns/op", "allocs/op", "cycles/op", "IPC",
+        "misses/op", "iterations");
+  }
+  for (size_t i = 0; i < benchmarks.size(); i++) {
+    const Benchmark& benchmark = benchmarks[i];
+    if (!filter.empty() && benchmark.name.find(filter) == std::string::npos) {
+      continue;
+    }
+    Measurement m = measure(benchmark.op, std::chrono::milliseconds(min_time_ms), counters);
+    if (json) {
+      printf("{\"name\": \"%s\", \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f",
+          benchmark.name.c_str(), m.ns_per_op, m.allocations_per_op);
+      for (size_t c = 0; c < m.counters.size(); c++) {
+        printf(", \"%s\": %.2f", m.counters[c].first.c_str(), m.counters[c].second);
+      }
+      printf(", \"iterations\": %zu}\n", m.iterations);
+    } else {
+      double cycles = counter(m, "cycles_per_op");
+      double instructions = counter(m, "instructions_per_op");
+      double ipc = cycles > 0 && instructions >= 0 ? instructions / cycles : -1;
+      printf("%-32s %12.1f %12.2f %12s %8s %12s %12zu\n", benchmark.name.c_str(), m.ns_per_op,
+          m.allocations_per_op, format_counter("%.0f", cycles).c_str(), format_counter("%.2f", ipc).c_str(),
+          format_counter("%.2f", counter(m, "cache_misses_per_op")).c_str(), m.iterations);
+    }
+    fflush(stdout);
+  }
+
+  curl_easy_cleanup(curl);
+  curl_global_cleanup();
+  return 0;
+}
@@ -0,0 +1,538 @@
+#include "adaptive_policy.h"
+#include "engine.h"
+#include "expander_client.h"
+#include "host.h"
+#include "retry_policy.h"
+#include "trace.h"
+
+#include <aws/core/utils/json/JsonSerializer.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Deterministic simulator that runs the expansion engine (follow_redirects and
+ * ExpansionPolicy, see engine.h) against a modeled network in virtual time.
+ *
+ * Redirect chains come from a trace file (see trace.h), so a recorded or
+ * generated workload drives the simulation. Latencies and failures come from a
+ * per-host network model instead of the recorded timings, so that policies can
+ * be compared under controlled conditions. The same inputs and seed always
+ * produce the same results.
+ */
+
+/**
+ * Network behavior of one host. All times are in ms.
+ */
+struct HostModel {
+  /**
+   * Round trip time between the expander and the host.
+   */
+  double rtt_ms = 20;
+
+  /**
+   * Time to resolve the host, paid once per new connection.
+   */
+  double dns_ms = 5;
+
+  /**
+   * Median and log-space standard deviation of the log-normally distributed
+   * server processing time of one request.
+   */
+  double server_ms = 10;
+  double server_sigma = 0.5;
+
+  /**
+   * Probability that a request fails with a connection error after one round
+   * trip, and probability that it never receives a response.
+   */
+  double failure_rate = 0;
+  double hang_rate = 0;
+};
+
+/**
+ * The recorded response to one URL, with everything the simulation needs per
+ * hop resolved up front.
+ */
+struct SimResponse {
+  std::string effective_url;
+  std::string redirect_url;
+  std::string origin;
+  const HostModel* model;
+};
+
+static std::unordered_map<std::string, SimResponse> responses;
+static std::unordered_map<std::string, HostModel> host_models;
+static HostModel default_model;
+
+static const HostModel& model_for(const std::string& host)
+{
+  auto it = host_models.find(host);
+  return it == host_models.end() ? default_model : it->second;
+}
+
+/**
+ * scheme://host[:port] of an absolute URL, which identifies its connection.
+ */
+static std::string origin_of(const std::string& url)
+{
+  size_t scheme_end = url.find("://");
+  size_t path = url.find_first_of("/?#", scheme_end == std::string::npos ? 0 : scheme_end + 3);
+  return url.substr(0, path);
+}
+
+/**
+ * HopTransport over the modeled network. Keeps its own virtual clock and an
+ * LRU connection cache that mirrors curl's CURLOPT_MAXCONNECTS behavior.
+ */
+class SimTransport : public HopTransport {
+ public:
+  SimTransport(std::mt19937_64& rng, size_t max_connections)
+    : rng(rng)
+    , max_connections(max_connections)
+  {
+  }
+
+  void perform(const std::string& url, long timeout_ms, bool fresh_connection, const TransferStrategy& strategy,
+      HopResponse& response)
+  {
+    hops++;
+    response.effective_url.clear();
+    response.redirect_url.clear();
+    response.reused_connection = false;
+    double latency_ms = 0;
+    auto it = responses.find(url);
+    if (it == responses.end()) {
+      // Never observed in the trace, which is how failed DNS lookups look.
+      latency_ms = model_for(url_host(url)).dns_ms;
+      response.code = CURLE_COULDNT_RESOLVE_HOST;
+    } else {
+      const HostModel& model = *it->second.model;
+      const std::string& origin = it->second.origin;
+      auto connection = cached.find(origin);
+      if (fresh_connection && connection != cached.end()) {
+        connections.erase(connection->second);
+        cached.erase(connection);
+        connection = cached.end();
+      }
+      response.reused_connection = connection != cached.end();
+      if (connection == cached.end()) {
+        new_connections++;
+        // TCP handshake, plus a full TLS 1.2 handshake for https.
+        int handshake_rtts = origin.compare(0, 8, "https://") == 0 ? 3 : 1;
+        latency_ms += model.dns_ms + model.rtt_ms * handshake_rtts;
+      }
+      double outcome = uniform(rng);
+      if (outcome < model.failure_rate) {
+        latency_ms += model.rtt_ms;
+        response.code = CURLE_RECV_ERROR;
+      } else if (outcome < model.failure_rate + model.hang_rate) {
+        latency_ms = std::numeric_limits<double>::infinity();
+      } else {
+        std::lognormal_distribution<double> server(std::log(model.server_ms), model.server_sigma);
+        latency_ms += model.rtt_ms + server(rng);
+        response.code = CURLE_OK;
+      }
+      // curl closes the connection of failed and timed out transfers.
+      if (response.code == CURLE_OK && latency_ms <= timeout_ms) {
+        response.effective_url = it->second.effective_url;
+        response.redirect_url = it->second.redirect_url;
+        cache_connection(origin, connection);
+      } else if (connection != cached.end()) {
+        connections.erase(connection->second);
+        cached.erase(connection);
+      }
+    }
+    if (latency_ms > timeout_ms) {
+      clock_us += timeout_ms * 1000LL;
+      response.code = CURLE_OPERATION_TIMEDOUT;
+      return;
+    }
+    clock_us += static_cast<long long>(latency_ms * 1000);
+  }
+
+  long long now_us()
+  {
+    return clock_us;
+  }
+
+  void wait_us(long long us)
+  {
+    clock_us += us;
+  }
+
+  long long clock_us = 0;
+  size_t hops = 0;
+  size_t new_connections = 0;
+
+ private:
+  typedef std::unordered_map<std::string, std::list<std::string>::iterator> ConnectionMap;
+
+  /**
+   * Mark origin's connection as most recently used, first adding it and
+   * closing the least recently used one if it was not cached yet.
+   */
+  void cache_connection(const std::string& origin, ConnectionMap::iterator connection)
+  {
+    if (connection != cached.end()) {
+      connections.splice(connections.begin(), connections, connection->second);
+      return;
+    }
+    if (max_connections == 0) {
+      return;
+    }
+    if (connections.size() >= max_connections) {
+      cached.erase(connections.back());
+      connections.pop_back();
+    }
+    connections.push_front(origin);
+    cached[origin] = connections.begin();
+  }
+
+  std::mt19937_64& rng;
+  std::uniform_real_distribution<double> uniform;
+  size_t max_connections;
+  std::list<std::string> connections;
+  ConnectionMap cached;
+};
+
+/**
+ * One simulated Lambda instance, which processes its expansions sequentially
+ * and keeps its own policy state and random stream. Instances are independent,
+ * so they can be simulated on any thread without affecting the results.
+ */
+struct SimInstance {
+  SimInstance(unsigned long long seed, size_t max_connections, const std::string& policy_name, int max_retries)
+    : rng(seed)
+    , transport(rng, max_connections)
+    , policy(policy_name == "adaptive" ? new AdaptiveTimeoutPolicy() : new ExpansionPolicy())
+    , retry_policy(max_retries)
+  {
+    retry_policy.seed(seed);
+  }
+
+  /**
+   * Run the assigned expansions.
+   */
+  void run(const std::vector<std::string>& workload, long max_time_ms, long max_redirects)
+  {
+    std::string expanded_url;
+    bool reached_redirect_limit;
+    for (size_t i = 0; i < assigned.size(); i++) {
+      long long before = transport.now_us();
+      int expansion_retries = 0;
+      CURLcode res = follow_redirects(transport, *policy, expanded_url, reached_redirect_limit,
+          workload[assigned[i]], max_time_ms, max_redirects, NULL, &retry_policy, &expansion_retries);
+      latencies.push_back(transport.now_us() - before);
+      retries += expansion_retries;
+      if (res == CURLE_OK) {
+        successes++;
+      } else {
+        errors[res]++;
+      }
+    }
+  }
+
+  std::mt19937_64 rng;
+  SimTransport transport;
+  std::unique_ptr<ExpansionPolicy> policy;
+  RetryPolicy retry_policy;
+
+  /**
+   * Indices into the workload, in processing order.
+   */
+  std::vector<uint32_t> assigned;
+
+  std::vector<long long> latencies;
+  std::map<int, size_t> errors;
+  size_t successes = 0;
+  size_t retries = 0;
+};
+
+static void read_model(const Aws::Utils::Json::JsonView& v, HostModel& model)
+{
+  if (v.ValueExists("rtt_ms")) {
+    model.rtt_ms = v.GetDouble("rtt_ms");
+  }
+  if (v.ValueExists("dns_ms")) {
+    model.dns_ms = v.GetDouble("dns_ms");
+  }
+  if (v.ValueExists("server_ms")) {
+    model.server_ms = v.GetDouble("server_ms");
+  }
+  if (v.ValueExists("server_sigma")) {
+    model.server_sigma = v.GetDouble("server_sigma");
+  }
+  if (v.ValueExists("failure_rate")) {
+    model.failure_rate = v.GetDouble("failure_rate");
+  }
+  if (v.ValueExists("hang_rate")) {
+    model.hang_rate = v.GetDouble("hang_rate");
+  }
+}
+
+/**
+ * Load the trace and return the input URLs of its expansions.
+ */
+static std::vector<std::string> load_trace(const char* path)
+{
+  std::vector<std::string> workload;
+  std::ifstream trace(path);
+  if (!trace) {
+    fprintf(stderr, "Failed to open trace file %s\n", path);
+    exit(1);
+  }
+  for (std::string line; std::getline(trace, line);) {
+    TraceEntry entry;
+    if (line.empty() || !trace_entry_from_json(line, entry)) {
+      continue;
+    }
+    workload.push_back(entry.url);
+    for (size_t i = 0; i < entry.hops.size(); i++) {
+      const TraceHop& hop = entry.hops[i];
+      if (hop.status < 200) {
+        continue;
+      }
+      SimResponse response;
+      response.effective_url = hop.url;
+      response.origin = origin_of(hop.url);
+      response.model = &model_for(url_host(hop.url));
+      if (hop.status >= 300 && hop.status < 400) {
+        if (i + 1 < entry.hops.size()) {
+          response.redirect_url = entry.hops[i + 1].url;
+        } else {
+          // The recording stopped here, e.g. at its redirect limit.
+          for (size_t j = 0; j < hop.headers.size(); j++) {
+            if (strcasecmp(hop.headers[j].first.c_str(), "location") == 0 &&
+                hop.headers[j].second.find("://") != std::string::npos) {
+              response.redirect_url = hop.headers[j].second;
+            }
+          }
+        }
+      }
+      responses[hop.url] = response;
+      if (i == 0) {
+        responses[entry.url] = response;
+      }
+    }
+  }
+  return workload;
+}
+
+/**
+ * Load per-host models from a file with one JSON object per line, e.g.
+ *     {"host": "bit.ly", "rtt_ms": 30, "server_ms": 15, "failure_rate": 0.01}
+ * The host "*" sets the default for unlisted hosts.
+ */
+static void load_models(const char* path)
+{
+  using namespace Aws::Utils::Json;
+  std::ifstream file(path);
+  if (!file) {
+    fprintf(stderr, "Failed to open model file %s\n", path);
+    exit(1);
+  }
+  for (std::string line; std::getline(file, line);) {
+    JsonValue json(line);
+    if (line.empty() || !json.WasParseSuccessful() || !json.View().ValueExists("host")) {
+      continue;
+    }
+    std::string host = json.View().GetString("host");
+    if (host == "*") {
+      read_model(json.View(), default_model);
+    } else {
+      HostModel model = default_model;
+      read_model(json.View(), model);
+      host_models[host] = model;
+    }
+  }
+}
+
+static void usage(const char* program)
+{
+  fprintf(stderr,
+      "Usage: %s --trace FILE [options]\n"
+      "\n"
+      "Options:\n"
+      "  --model FILE          Per-host network models, one JSON object per line.\n"
+      "  --repeat N            Run the trace's expansions N times. Default 1.\n"
+      "  --instances N         Number of simulated Lambda instances. Default 1.\n"
+      "  --routing MODE        random or host (fan-out client lanes). Default random.\n"
+      "  --policy NAME         fixed (every hop may use the remaining budget) or\n"
+      "                        adaptive (per-host timeouts). Default fixed.\n"
+      "  --retries N           Failed hops to retry per expansion (RetryPolicy).\n"
+      "                        Default 0.\n"
+      "  --max-connections N   Connection cache size per instance. Default 500.\n"
+      "  --max-time-ms N       Budget per expansion. Default 500.\n"
+      "  --max-redirects N     Redirect limit per expansion. Default 5.\n"
+      "  --seed N              Random seed. Default 1.\n"
+      "  --threads N           Threads to simulate instances on. Does not affect\n"
+      "                        results. Default 1.\n",
+      program);
+}
+
+static long long percentile(const std::vector<long long>& sorted, double p)
+{
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+int main(int argc, char** argv)
+{
+  const char* trace_path = NULL;
+  const char* model_path = NULL;
+  long repeat = 1;
+  size_t instance_count = 1;
+  std::string routing = "random";
+  std::string policy = "fixed";
+  int max_retries = 0;
+  size_t max_connections = 500;
+  long max_time_ms = 500;
+  long max_redirects = 5;
+  unsigned long long seed = 1;
+  size_t thread_count = 1;
+  for (int i = 1; i < argc; i += 2) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    const char* value = argv[i + 1];
+    if (arg == "--trace") {
+      trace_path = value;
+    } else if (arg == "--model") {
+      model_path = value;
+    } else if (arg == "--repeat") {
+      repeat = std::atol(value);
+    } else if (arg == "--instances") {
+      instance_count = std::max(1LL, std::atoll(value));
+    } else if (arg == "--routing") {
+      routing = value;
+    } else if (arg == "--policy") {
+      policy = value;
+    } else if (arg == "--retries") {
+      max_retries = std::atoi(value);
+    } else if (arg == "--max-connections") {
+      max_connections = std::atoll(value);
+    } else if (arg == "--max-time-ms") {
+      max_time_ms = std::atol(value);
+    } else if (arg == "--max-redirects") {
+      max_redirects = std::atol(value);
+    } else if (arg == "--seed") {
+      seed = std::strtoull(value, NULL, 10);
+    } else if (arg == "--threads") {
+      thread_count = std::max(1LL, std::atoll(value));
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (trace_path == NULL || (routing != "random" && routing != "host") ||
+      (policy != "fixed" && policy != "adaptive")) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (model_path) {
+    load_models(model_path);
+  }
+  std::vector<std::string> workload = load_trace(trace_path);
+
+  std::vector<SimInstance*> instances;
+  FanoutOptions lanes;
+  for (size_t i = 0; i < instance_count; i++) {
+    instances.push_back(new SimInstance(seed + i * 0x9E3779B97F4A7C15ULL, max_connections, policy, max_retries));
+    lanes.endpoints.push_back("instance-" + std::to_string(i));
+  }
+
+  // Route the whole workload up front.
+  FanoutClient router(lanes);
+  std::vector<size_t> host_lanes(workload.size());
+  for (size_t i = 0; i < workload.size(); i++) {
+    host_lanes[i] = router.lane_for_host(url_host(workload[i]));
+  }
+  std::mt19937_64 routing_rng(seed);
+  std::uniform_int_distribution<size_t> random_instance(0, instance_count - 1);
+  for (long r = 0; r < repeat; r++) {
+    for (size_t i = 0; i < workload.size(); i++) {
+      size_t instance = routing == "host" ? host_lanes[i] : random_instance(routing_rng);
+      instances[instance]->assigned.push_back(i);
+    }
+  }
+
+  auto wall_start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < thread_count; t++) {
+    threads.push_back(std::thread([&, t]() {
+      for (size_t i = t; i < instances.size(); i += thread_count) {
+        instances[i]->run(workload, max_time_ms, max_redirects);
+      }
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+  double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+  std::vector<long long> latencies;
+  std::map<int, size_t> errors;
+  size_t successes = 0;
+  size_t retries = 0;
+  long long makespan_us = 0;
+  size_t hops = 0;
+  size_t new_connections = 0;
+  long long spent_us = 0;
+  for (size_t i = 0; i < instances.size(); i++) {
+    SimInstance* instance = instances[i];
+    latencies.insert(latencies.end(), instance->latencies.begin(), instance->latencies.end());
+    for (size_t j = 0; j < instance->latencies.size(); j++) {
+      spent_us += instance->latencies[j];
+    }
+    for (auto it = instance->errors.begin(); it != instance->errors.end(); ++it) {
+      errors[it->first] += it->second;
+    }
+    successes += instance->successes;
+    retries += instance->retries;
+    makespan_us = std::max(makespan_us, instance->transport.clock_us);
+    hops += instance->transport.hops;
+    new_connections += instance->transport.new_connections;
+    delete instance;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  size_t expansions = latencies.size();
+
+  printf("expansions: %zu\n", expansions);
+  printf("succeeded: %zu (%.2f%%)\n", successes, expansions ? 100.0 * successes / expansions : 0.0);
+  for (auto it = errors.begin(); it != errors.end(); ++it) {
+    printf("  error %d (%s): %zu\n", it->first, curl_easy_strerror(static_cast<CURLcode>(it->first)), it->second);
+  }
+  printf("retries: %zu\n", retries);
+  printf("latency ms: p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+      percentile(latencies, 0.5) / 1000.0, percentile(latencies, 0.9) / 1000.0,
+      percentile(latencies, 0.99) / 1000.0, latencies.empty() ? 0.0 : latencies.back() / 1000.0);
+  // The yield of the time spent, which timeouts trade off against the
+  // success rate.
+  printf("successes per s spent: %.2f\n", spent_us ? successes / (spent_us / 1e6) : 0.0);
+  printf("hops: %zu, new connections: %zu (reuse %.2f%%)\n", hops, new_connections,
+      hops ? 100.0 * (hops - new_connections) / hops : 0.0);
+  printf("simulated time: %.3f s (%.1f expansions/s)\n", makespan_us / 1e6,
+      makespan_us ? expansions / (makespan_us / 1e6) : 0.0);
+  printf("wall time: %.3f s (%.0f simulated expansions/s)\n", wall_s, wall_s > 0 ? expansions / wall_s : 0.0);
+  return 0;
+}
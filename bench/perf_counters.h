@@ -0,0 +1,164 @@
+#ifndef URL_EXPANDER_PERF_COUNTERS_H
+#define URL_EXPANDER_PERF_COUNTERS_H
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Hardware and kernel counters for a measured region: cycles, instructions,
+ * cache misses and context switches from perf_event_open, and CPU time and
+ * voluntary context switches from getrusage.
+ *
+ * Counters the kernel refuses to open, e.g. in containers, VMs without a
+ * virtual PMU or with kernel.perf_event_paranoid > 2, are left out of the
+ * results instead of failing. getrusage is always available.
+ *
+ * With inherit, the counters and rusage include child processes started after
+ * construction, so that the cost of running another binary can be measured.
+ * Their counts are only added once they have exited and been waited for.
+ */
+class PerfCounters {
+ public:
+  explicit PerfCounters(bool inherit = false)
+    : inherit(inherit)
+  {
+    add_event("cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    add_event("instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    add_event("cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    add_event("context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+  }
+
+  ~PerfCounters()
+  {
+    for (size_t i = 0; i < events.size(); i++) {
+      close(events[i].fd);
+    }
+  }
+
+  /**
+   * Whether the CPU's counters could be opened, as opposed to only the
+   * kernel's software counters.
+   */
+  bool has_hardware_events() const
+  {
+    for (size_t i = 0; i < events.size(); i++) {
+      if (events[i].type == PERF_TYPE_HARDWARE) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void start()
+  {
+    for (size_t i = 0; i < events.size(); i++) {
+      ioctl(events[i].fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(events[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    usage_before = usage();
+  }
+
+  void stop()
+  {
+    for (size_t i = 0; i < events.size(); i++) {
+      ioctl(events[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+    usage_after = usage();
+  }
+
+  /**
+   * The counts of the last region divided by ops, as (name, value) pairs. Names
+   * are suffixed with _per_op, CPU times are in ns.
+   */
+  std::vector<std::pair<std::string, double> > per_op(size_t ops) const
+  {
+    std::vector<std::pair<std::string, double> > values;
+    double n = ops > 0 ? static_cast<double>(ops) : 1;
+    for (size_t i = 0; i < events.size(); i++) {
+      // Scale up for the time the counter was not scheduled, in case the
+      // kernel had to multiplex more counters than the CPU has.
+      uint64_t data[3];
+      if (read(events[i].fd, data, sizeof(data)) != sizeof(data) || data[2] == 0) {
+        continue;
+      }
+      double count = static_cast<double>(data[0]) * data[1] / data[2];
+      values.push_back(std::make_pair(events[i].name + "_per_op", count / n));
+    }
+    values.push_back(std::make_pair("user_ns_per_op",
+          1e3 * (usage_after.user_us - usage_before.user_us) / n));
+    values.push_back(std::make_pair("sys_ns_per_op",
+          1e3 * (usage_after.sys_us - usage_before.sys_us) / n));
+    values.push_back(std::make_pair("voluntary_yields_per_op",
+          (usage_after.voluntary_yields - usage_before.voluntary_yields) / n));
+    return values;
+  }
+
+ private:
+  struct Event {
+    std::string name;
+    uint32_t type;
+    int fd;
+  };
+
+  struct Usage {
+    double user_us = 0;
+    double sys_us = 0;
+    double voluntary_yields = 0;
+  };
+
+  void add_event(const char* name, uint32_t type, uint64_t config)
+  {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = inherit;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+      // Unprivileged processes may only count user space.
+      attr.exclude_kernel = 1;
+      fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    if (fd >= 0) {
+      Event event;
+      event.name = name;
+      event.type = type;
+      event.fd = fd;
+      events.push_back(event);
+    }
+  }
+
+  Usage usage() const
+  {
+    Usage result;
+    int targets[] = {RUSAGE_SELF, RUSAGE_CHILDREN};
+    for (int i = 0; i < (inherit ? 2 : 1); i++) {
+      struct rusage ru;
+      getrusage(targets[i], &ru);
+      result.user_us += ru.ru_utime.tv_sec * 1e6 + ru.ru_utime.tv_usec;
+      result.sys_us += ru.ru_stime.tv_sec * 1e6 + ru.ru_stime.tv_usec;
+      result.voluntary_yields += ru.ru_nvcsw;
+    }
+    return result;
+  }
+
+  bool inherit;
+  std::vector<Event> events;
+  Usage usage_before;
+  Usage usage_after;
+};
+
+#endif
@@ -0,0 +1,280 @@
+#include <aws/core/utils/json/JsonSerializer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Performance regression gate. Runs a benchmark command several times,
+ * compares the medians of its metrics against a baseline file and exits with
+ * a failure if any metric regressed significantly.
+ *
+ * The benchmark command must print one JSON object per line with a "name" key
+ * and numeric metrics, like bench/microbenchmarks --json. Lower is better for
+ * every metric. "iterations" is ignored. Only the metrics passed to --metrics
+ * can fail the gate; the others, like counts of rare kernel events, are too
+ * noisy and are only reported.
+ *
+ * A timing metric only counts as regressed when its median grew by more than
+ * the relative threshold and by more than noise_factor times the noise (the
+ * scaled median absolute deviation) of the baseline or the current run, so
+ * that noisy benchmarks do not fail spuriously. Allocation counts are
+ * deterministic, so any increase beyond rounding is a regression. A metric
+ * in the baseline that the benchmark no longer reports also fails the gate,
+ * as does a missing or empty baseline unless --update is given.
+ *
+ * Baseline files contain one JSON object per line:
+ *     {"name": "parse_request/single", "metric": "ns_per_op", "median": 812.0, "noise": 9.3}
+ */
+
+struct Stats {
+  double median = 0;
+  double noise = 0;
+};
+
+typedef std::pair<std::string, std::string> MetricKey;
+
+static Stats summarize(std::vector<double> samples)
+{
+  Stats stats;
+  if (samples.empty()) {
+    return stats;
+  }
+  std::sort(samples.begin(), samples.end());
+  size_t n = samples.size();
+  stats.median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+  std::vector<double> deviations;
+  for (size_t i = 0; i < n; i++) {
+    deviations.push_back(std::fabs(samples[i] - stats.median));
+  }
+  std::sort(deviations.begin(), deviations.end());
+  double mad = n % 2 ? deviations[n / 2] : (deviations[n / 2 - 1] + deviations[n / 2]) / 2;
+  // Scale the MAD to be comparable to a standard deviation.
+  stats.noise = 1.4826 * mad;
+  return stats;
+}
+
+static std::string shell_quote(const std::string& arg)
+{
+  std::string quoted = "'";
+  for (size_t i = 0; i < arg.size(); i++) {
+    if (arg[i] == '\'') {
+      quoted += "'\\''";
+    } else {
+      quoted += arg[i];
+    }
+  }
+  return quoted + "'";
+}
+
+/**
+ * Run command once and append every numeric metric it prints to samples.
+ * Returns false if the command failed.
+ */
+static bool run_benchmark(const std::string& command, std::map<MetricKey, std::vector<double> >& samples)
+{
+  using namespace Aws::Utils::Json;
+  FILE* output = popen(command.c_str(), "r");
+  if (output == NULL) {
+    return false;
+  }
+  char buffer[4096];
+  std::string line;
+  while (fgets(buffer, sizeof(buffer), output) != NULL) {
+    line += buffer;
+    if (line.empty() || line[line.size() - 1] != '\n') {
+      continue;
+    }
+    JsonValue json(line);
+    line.clear();
+    if (!json.WasParseSuccessful() || !json.View().ValueExists("name")) {
+      continue;
+    }
+    std::string name = json.View().GetString("name");
+    auto fields = json.View().GetAllObjects();
+    for (auto it = fields.begin(); it != fields.end(); ++it) {
+      if (it->first == "name" || it->first == "iterations") {
+        continue;
+      }
+      if (it->second.IsFloatingPointType() || it->second.IsIntegerType()) {
+        samples[MetricKey(name, it->first)].push_back(it->second.AsDouble());
+      }
+    }
+  }
+  return pclose(output) == 0;
+}
+
+static std::map<MetricKey, Stats> load_baseline(const char* path)
+{
+  using namespace Aws::Utils::Json;
+  std::map<MetricKey, Stats> baseline;
+  std::ifstream file(path);
+  for (std::string line; std::getline(file, line);) {
+    JsonValue json(line);
+    if (line.empty() || !json.WasParseSuccessful()) {
+      continue;
+    }
+    auto v = json.View();
+    Stats stats;
+    stats.median = v.GetDouble("median");
+    stats.noise = v.GetDouble("noise");
+    baseline[MetricKey(v.GetString("name"), v.GetString("metric"))] = stats;
+  }
+  return baseline;
+}
+
+static std::string json_escape(const std::string& s)
+{
+  std::string escaped;
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '"' || s[i] == '\\') {
+      escaped += '\\';
+    }
+    escaped += s[i];
+  }
+  return escaped;
+}
+
+/**
+ * Write current as a baseline. Numbers are written with 6 significant
+ * digits, well beyond the noise, so that updated baselines diff readably.
+ */
+static bool write_baseline(const char* path, const std::map<MetricKey, Stats>& current)
+{
+  std::ofstream file(path);
+  for (auto it = current.begin(); it != current.end(); ++it) {
+    char numbers[64];
+    snprintf(numbers, sizeof(numbers), "\"median\":%.6g,\"noise\":%.6g", it->second.median, it->second.noise);
+    file << "{\"name\":\"" << json_escape(it->first.first) << "\",\"metric\":\"" << json_escape(it->first.second)
+         << "\"," << numbers << "}\n";
+  }
+  return static_cast<bool>(file);
+}
+
+static void usage(const char* program)
+{
+  fprintf(stderr,
+      "Usage: %s --baseline FILE [options] -- BENCHMARK [ARGS...]\n"
+      "\n"
+      "Options:\n"
+      "  --repetitions N     Times to run the benchmark. Default 5.\n"
+      "  --threshold PCT     Minimum relative regression to fail on. Default 10.\n"
+      "  --noise-factor F    Minimum regression in units of noise. Default 3.\n"
+      "  --metrics LIST      Comma separated metrics that can fail the gate.\n"
+      "                      Default ns_per_op,allocs_per_op,instructions_per_op.\n"
+      "  --update            Write the current results as the new baseline.\n"
+      "                      Without it, a missing or empty baseline fails.\n",
+      program);
+}
+
+int main(int argc, char** argv)
+{
+  const char* baseline_path = NULL;
+  int repetitions = 5;
+  double threshold = 0.10;
+  double noise_factor = 3;
+  bool update = false;
+  std::string gated_metrics = "ns_per_op,allocs_per_op,instructions_per_op";
+  std::string command;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--") {
+      for (i++; i < argc; i++) {
+        command += (command.empty() ? "" : " ") + shell_quote(argv[i]);
+      }
+    } else if (arg == "--update") {
+      update = true;
+    } else if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
+    } else if (arg == "--baseline") {
+      baseline_path = argv[++i];
+    } else if (arg == "--repetitions") {
+      repetitions = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--threshold") {
+      threshold = std::atof(argv[++i]) / 100;
+    } else if (arg == "--noise-factor") {
+      noise_factor = std::atof(argv[++i]);
+    } else if (arg == "--metrics") {
+      gated_metrics = argv[++i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (baseline_path == NULL || command.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::map<MetricKey, std::vector<double> > samples;
+  for (int r = 0; r < repetitions; r++) {
+    if (!run_benchmark(command, samples)) {
+      fprintf(stderr, "Benchmark failed: %s\n", command.c_str());
+      return 1;
+    }
+  }
+  std::map<MetricKey, Stats> current;
+  for (auto it = samples.begin(); it != samples.end(); ++it) {
+    current[it->first] = summarize(it->second);
+  }
+
+  if (update) {
+    if (!write_baseline(baseline_path, current)) {
+      fprintf(stderr, "Failed to write baseline %s\n", baseline_path);
+      return 1;
+    }
+    printf("Wrote %zu metrics to %s\n", current.size(), baseline_path);
+    return 0;
+  }
+
+  std::map<MetricKey, Stats> baseline = load_baseline(baseline_path);
+  if (baseline.empty()) {
+    fprintf(stderr, "No baseline in %s; run with --update to record one.\n", baseline_path);
+    return 1;
+  }
+  size_t regressions = 0;
+  size_t missing = 0;
+  printf("%-32s %-14s %12s %12s %9s  %s\n", "benchmark", "metric", "baseline", "current", "change", "verdict");
+  for (auto it = current.begin(); it != current.end(); ++it) {
+    auto base = baseline.find(it->first);
+    if (base == baseline.end()) {
+      printf("%-32s %-14s %12s %12.2f %9s  new\n", it->first.first.c_str(), it->first.second.c_str(),
+          "-", it->second.median, "-");
+      continue;
+    }
+    double before = base->second.median;
+    double after = it->second.median;
+    double change = before != 0 ? (after - before) / before : 0;
+    bool gated = ("," + gated_metrics + ",").find("," + it->first.second + ",") != std::string::npos;
+    bool deterministic = it->first.second.find("allocs") != std::string::npos;
+    bool regressed;
+    if (!gated) {
+      regressed = false;
+    } else if (deterministic) {
+      regressed = after - before > 0.5;
+    } else {
+      double noise = std::max(base->second.noise, it->second.noise);
+      regressed = change > threshold && after - before > noise_factor * noise;
+    }
+    const char* verdict = !gated ? "info" : regressed ? "REGRESSED" : (change < -threshold ? "improved" : "ok");
+    regressions += regressed;
+    printf("%-32s %-14s %12.2f %12.2f %+8.1f%%  %s\n", it->first.first.c_str(), it->first.second.c_str(),
+        before, after, 100 * change, verdict);
+  }
+  for (auto it = baseline.begin(); it != baseline.end(); ++it) {
+    if (current.find(it->first) == current.end()) {
+      // A renamed or dropped benchmark would otherwise stop being gated.
+      printf("%-32s %-14s %12.2f %12s %9s  MISSING\n", it->first.first.c_str(), it->first.second.c_str(),
+          it->second.median, "-", "-");
+      missing++;
+    }
+  }
+  printf("%zu regression%s, %zu missing\n", regressions, regressions == 1 ? "" : "s", missing);
+  return regressions == 0 && missing == 0 ? 0 : 1;
+}
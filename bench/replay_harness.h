@@ -0,0 +1,155 @@
+#ifndef URL_EXPANDER_REPLAY_HARNESS_H
+#define URL_EXPANDER_REPLAY_HARNESS_H
+
+#include "trace.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Helpers for benchmarks that run the url-expander binary against
+ * bench/replay-server.
+ */
+
+/**
+ * A path in the temporary directory that is unique to this process.
+ */
+static inline std::string temp_path(const std::string& name)
+{
+  const char* dir = std::getenv("TMPDIR");
+  return std::string(dir ? dir : "/tmp") + "/" + name + "-" + std::to_string(getpid());
+}
+
+/**
+ * The final URL of chain i of chain_trace.
+ */
+static inline std::string chain_destination(int i, int hops)
+{
+  return "https://hop" + std::to_string(hops) + ".test/" + std::to_string(i);
+}
+
+/**
+ * count redirect chains of hops redirects each: http on the first hop to
+ * exercise plain connections, https after it.
+ */
+static inline std::vector<TraceEntry> chain_trace(int count, int hops)
+{
+  std::vector<TraceEntry> entries;
+  for (int i = 0; i < count; i++) {
+    TraceEntry entry;
+    entry.url = "http://short" + std::to_string(i % 10) + ".test/" + std::to_string(i);
+    for (int h = 0; h <= hops; h++) {
+      TraceHop hop;
+      hop.url = h == 0 ? entry.url : chain_destination(i, h);
+      hop.protocol = "HTTP/1.1";
+      hop.status = h < hops ? 301 : 200;
+      if (h < hops) {
+        hop.headers.push_back(std::make_pair("Location", chain_destination(i, h + 1)));
+      }
+      entry.hops.push_back(hop);
+    }
+    entries.push_back(entry);
+  }
+  return entries;
+}
+
+static inline void write_lines(const std::string& path, const std::vector<std::string>& lines)
+{
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == NULL) {
+    fprintf(stderr, "Failed to write %s\n", path.c_str());
+    exit(1);
+  }
+  for (size_t i = 0; i < lines.size(); i++) {
+    fprintf(file, "%s\n", lines[i].c_str());
+  }
+  fclose(file);
+}
+
+static inline void write_trace(const std::string& path, const std::vector<TraceEntry>& entries)
+{
+  std::vector<std::string> lines;
+  for (size_t i = 0; i < entries.size(); i++) {
+    lines.push_back(trace_entry_to_json(entries[i]));
+  }
+  write_lines(path, lines);
+}
+
+/**
+ * A replay server child process, stopped on destruction.
+ */
+class ReplayServerProcess {
+ public:
+  ReplayServerProcess() : pid(-1) {}
+
+  ~ReplayServerProcess()
+  {
+    stop();
+  }
+
+  /**
+   * Start binary with args and wait until it accepts connections on port.
+   */
+  bool start(const char* binary, const std::vector<std::string>& args, int port)
+  {
+    pid = fork();
+    if (pid == 0) {
+      std::vector<char*> argv;
+      argv.push_back(const_cast<char*>(binary));
+      for (size_t i = 0; i < args.size(); i++) {
+        argv.push_back(const_cast<char*>(args[i].c_str()));
+      }
+      argv.push_back(NULL);
+      execv(binary, argv.data());
+      _exit(127);
+    }
+    for (int attempt = 0; attempt < 100; attempt++) {
+      if (port_open(port)) {
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    fprintf(stderr, "Replay server did not start on port %d\n", port);
+    stop();
+    return false;
+  }
+
+  void stop()
+  {
+    if (pid > 0) {
+      kill(pid, SIGTERM);
+      waitpid(pid, NULL, 0);
+      pid = -1;
+    }
+  }
+
+ private:
+  static bool port_open(int port)
+  {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    bool open = connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0;
+    close(fd);
+    return open;
+  }
+
+  pid_t pid;
+};
+
+#endif
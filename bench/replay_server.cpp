@@ -0,0 +1,744 @@
+#include "clock.h"
+#include "host.h"
+#include "trace.h"
+
+#include <aws/core/utils/json/JsonSerializer.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Local stand-in for the internet that serves the responses captured in a
+ * trace file (see trace.h) with their recorded latencies. Point the expander
+ * at it with CONNECT_TO="::127.0.0.1:<port>". The same port serves plain HTTP
+ * and HTTPS with certificates issued for each host by a certificate authority
+ * of its own. The expander does not verify peers by default, and otherwise
+ * can be made to trust the authority with --ca-cert and TLS_CA_FILE.
+ *
+ * Requests are matched on their absolute URL. When a URL was recorded several
+ * times, the recordings are served round robin so that the latency
+ * distribution is preserved. Unknown URLs get a 404.
+ *
+ * Faults such as stalled handshakes, resets and slow or missing responses can
+ * be injected per host or per URL with --faults, see FaultRule.
+ */
+
+/**
+ * All recordings of one URL.
+ */
+struct Recording {
+  std::vector<TraceHop> hops;
+  size_t next = 0;
+};
+
+static std::map<std::string, Recording> recordings;
+static std::mutex recordings_mutex;
+
+/**
+ * Recorded latencies are divided by this factor before being served.
+ */
+static double speed = 1.0;
+
+/**
+ * Bytes of TLS 1.3 early data accepted on resumed connections, set with
+ * --max-early-data. 0 rejects early data.
+ */
+static unsigned max_early_data = 0;
+
+static SSL_CTX* ssl_ctx;
+
+enum FaultType {
+  // Per connection, matched on the host only.
+  FAULT_CONNECT_DELAY,
+  FAULT_TLS_STALL,
+  // Per request.
+  FAULT_DELAY,
+  FAULT_RESET,
+  FAULT_RESET_REUSED,
+  FAULT_CLOSE,
+  FAULT_HANG,
+  FAULT_SLOW_HEADERS,
+  FAULT_STATUS,
+  FAULT_RATE_LIMIT,
+};
+
+/**
+ * A fault to inject, read from the --faults file. The file has one rule per
+ * line, e.g.
+ *     {"host": "bit.ly", "fault": "tls_stall", "duration_ms": 5000, "probability": 0.1}
+ * and the first rule that matches and passes its probability roll applies.
+ *
+ * Faults:
+ *     connect_delay  Wait duration_ms before the TLS handshake, or before the
+ *                    first response of a plain connection. Stands in for slow
+ *                    DNS and connects, which cannot be injected server side.
+ *     tls_stall      Stall the TLS handshake for duration_ms, then abort it.
+ *     delay          Wait duration_ms on top of the recorded latency.
+ *     reset          Reset the connection instead of responding.
+ *     reset_reused   Reset only requests on reused connections, like a server
+ *                    that dropped an idle keep-alive connection.
+ *     close          Close the connection without responding.
+ *     hang           Never respond, and keep the connection open for
+ *                    duration_ms or until the client closes it if negative.
+ *     slow_headers   Send the response one byte every interval_ms.
+ *     status         Respond with status, and a Retry-After of retry_after if
+ *                    given, instead of the recording.
+ *     rate_limit     Respond like status, with a status of 429 by default, to
+ *                    requests beyond rate per second to a host, in bursts of up
+ *                    to a second's worth, and to all of its requests for
+ *                    duration_ms after that.
+ */
+struct FaultRule {
+  /**
+   * Host and absolute URL to match. Empty matches everything.
+   */
+  std::string host;
+  std::string url;
+
+  FaultType type = FAULT_DELAY;
+  double probability = 1;
+
+  /**
+   * Number of times the rule may still apply, or negative for no limit.
+   */
+  long remaining = -1;
+
+  long duration_ms = 10000;
+  long interval_ms = 100;
+  long status = 503;
+  std::string retry_after;
+  double rate = 10;
+};
+
+/**
+ * Token bucket of a rate_limit rule for one host.
+ */
+struct RateLimitState {
+  double tokens = -1;
+  long long refilled_us = 0;
+  long long banned_until_us = 0;
+};
+
+static std::vector<FaultRule> fault_rules;
+static std::mutex faults_mutex;
+static std::mt19937_64 fault_rng;
+static std::map<std::pair<size_t, std::string>, RateLimitState> rate_limits;
+
+/**
+ * Whether a request to host now exceeds rule i, a rate_limit rule.
+ */
+static bool exceeds_rate_limit(size_t i, const std::string& host)
+{
+  const FaultRule& rule = fault_rules[i];
+  RateLimitState& state = rate_limits[std::make_pair(i, host)];
+  long long now_us = steady_now_us();
+  double burst = std::max(rule.rate, 1.0);
+  if (state.tokens < 0) {
+    state.tokens = burst;
+  }
+  state.tokens = std::min(burst, state.tokens + rule.rate * (now_us - state.refilled_us) / 1e6);
+  state.refilled_us = now_us;
+  if (now_us < state.banned_until_us) {
+    return true;
+  }
+  if (state.tokens < 1) {
+    state.banned_until_us = now_us + rule.duration_ms * 1000LL;
+    return true;
+  }
+  state.tokens--;
+  return false;
+}
+
+/**
+ * Find the fault to inject for a connection (url empty) or a request to url
+ * on host. reused tells whether the connection served requests before.
+ */
+static bool find_fault(const std::string& host, const std::string& url, bool reused, FaultRule& fault)
+{
+  std::lock_guard<std::mutex> lock(faults_mutex);
+  for (size_t i = 0; i < fault_rules.size(); i++) {
+    FaultRule& rule = fault_rules[i];
+    bool connection_fault = rule.type == FAULT_CONNECT_DELAY || rule.type == FAULT_TLS_STALL;
+    if (connection_fault != url.empty() || rule.remaining == 0 ||
+        (!rule.host.empty() && rule.host != host) ||
+        (!rule.url.empty() && rule.url != url) ||
+        (rule.type == FAULT_RESET_REUSED && !reused)) {
+      continue;
+    }
+    if (rule.probability < 1 && std::uniform_real_distribution<double>(0, 1)(fault_rng) >= rule.probability) {
+      continue;
+    }
+    if (rule.type == FAULT_RATE_LIMIT && !exceeds_rate_limit(i, host)) {
+      continue;
+    }
+    if (rule.remaining > 0) {
+      rule.remaining--;
+    }
+    fault = rule;
+    return true;
+  }
+  return false;
+}
+
+static void load_faults(const char* path)
+{
+  using namespace Aws::Utils::Json;
+  static const char* names[] = {
+    "connect_delay", "tls_stall", "delay", "reset", "reset_reused", "close", "hang", "slow_headers", "status", "rate_limit", NULL
+  };
+  std::ifstream file(path);
+  if (!file) {
+    fprintf(stderr, "Failed to open fault file %s\n", path);
+    exit(1);
+  }
+  for (std::string line; std::getline(file, line);) {
+    JsonValue json(line);
+    if (line.empty() || !json.WasParseSuccessful()) {
+      continue;
+    }
+    JsonView v = json.View();
+    FaultRule rule;
+    std::string name = v.GetString("fault");
+    size_t type = 0;
+    while (names[type] != NULL && name != names[type]) {
+      type++;
+    }
+    if (names[type] == NULL) {
+      fprintf(stderr, "Unknown fault %s in %s\n", name.c_str(), path);
+      exit(1);
+    }
+    rule.type = static_cast<FaultType>(type);
+    if (v.ValueExists("host")) {
+      rule.host = url_host(v.GetString("host"));
+    }
+    if (v.ValueExists("url")) {
+      rule.url = v.GetString("url");
+    }
+    if (v.ValueExists("probability")) {
+      rule.probability = v.GetDouble("probability");
+    }
+    if (v.ValueExists("times")) {
+      rule.remaining = v.GetInt64("times");
+    }
+    if (v.ValueExists("duration_ms")) {
+      rule.duration_ms = v.GetInt64("duration_ms");
+    }
+    if (v.ValueExists("interval_ms")) {
+      rule.interval_ms = v.GetInt64("interval_ms");
+    }
+    if (v.ValueExists("status")) {
+      rule.status = v.GetInt64("status");
+    } else if (rule.type == FAULT_RATE_LIMIT) {
+      rule.status = 429;
+    }
+    if (v.ValueExists("rate")) {
+      rule.rate = v.GetDouble("rate");
+    }
+    if (v.ValueExists("retry_after")) {
+      rule.retry_after = v.GetString("retry_after");
+    }
+    fault_rules.push_back(rule);
+  }
+  fprintf(stderr, "Loaded %zu fault rules\n", fault_rules.size());
+}
+
+/**
+ * Headers describing the original body or connection, which do not apply to
+ * the empty bodies served here.
+ */
+static bool is_hop_by_hop(const std::string& name)
+{
+  static const char* skipped[] = {
+    "content-length", "transfer-encoding", "connection", "keep-alive", NULL
+  };
+  std::string lower = name;
+  for (size_t i = 0; i < lower.size(); i++) {
+    lower[i] = std::tolower(static_cast<unsigned char>(lower[i]));
+  }
+  for (size_t i = 0; skipped[i] != NULL; i++) {
+    if (lower == skipped[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Key of the replay server's certificate authority and of every certificate
+ * it issues.
+ */
+static EVP_PKEY* key;
+static X509* ca_certificate;
+
+/**
+ * Certificates issued so far, by hostname.
+ */
+static std::map<std::string, X509*> certificates;
+static std::mutex certificates_mutex;
+static long next_serial = 1;
+
+/**
+ * Issue a certificate for name, or the authority's own if ca is set. Returns
+ * NULL if name cannot be put in a certificate.
+ */
+static X509* issue_certificate(const std::string& name, bool ca)
+{
+  X509* cert = X509_new();
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), next_serial++);
+  X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 365L * 24 * 3600);
+  X509_set_pubkey(cert, key);
+  X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+      reinterpret_cast<const unsigned char*>(name.c_str()), -1, -1, 0);
+  X509_set_issuer_name(cert, X509_get_subject_name(ca ? cert : ca_certificate));
+  X509V3_CTX ext_ctx;
+  X509V3_set_ctx(&ext_ctx, ca ? cert : ca_certificate, cert, NULL, NULL, 0);
+  struct in_addr ip;
+  std::string alt_name = (inet_pton(AF_INET, name.c_str(), &ip) == 1 ? "IP:" : "DNS:") + name;
+  X509_EXTENSION* extensions[] = {
+    X509V3_EXT_conf_nid(NULL, &ext_ctx, NID_basic_constraints, ca ? "critical,CA:TRUE" : "CA:FALSE"),
+    ca ? X509V3_EXT_conf_nid(NULL, &ext_ctx, NID_key_usage, "critical,keyCertSign,cRLSign") :
+        X509V3_EXT_conf_nid(NULL, &ext_ctx, NID_subject_alt_name, alt_name.c_str()),
+  };
+  bool valid = true;
+  for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+    valid = valid && extensions[i] != NULL && X509_add_ext(cert, extensions[i], -1) == 1;
+    X509_EXTENSION_free(extensions[i]);
+  }
+  if (!valid || X509_sign(cert, key, EVP_sha256()) == 0) {
+    X509_free(cert);
+    return NULL;
+  }
+  return cert;
+}
+
+/**
+ * The certificate for name, issued on first use.
+ */
+static X509* certificate_for(const std::string& name)
+{
+  std::lock_guard<std::mutex> lock(certificates_mutex);
+  auto it = certificates.find(name);
+  if (it == certificates.end()) {
+    it = certificates.insert(std::make_pair(name, issue_certificate(name, false))).first;
+  }
+  return it->second;
+}
+
+/**
+ * Called during the TLS handshake once the client named the host, which is
+ * the first point at which a TLS connection can be matched against faults.
+ * Presents a certificate for the host.
+ */
+static int on_server_name(SSL* ssl, int* alert, void* arg)
+{
+  const char* name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  if (name == NULL) {
+    return SSL_TLSEXT_ERR_OK;
+  }
+  X509* cert = certificate_for(name);
+  if (cert != NULL) {
+    SSL_use_certificate(ssl, cert);
+    SSL_use_PrivateKey(ssl, key);
+  }
+  FaultRule fault;
+  if (!find_fault(url_host(name), "", false, fault)) {
+    return SSL_TLSEXT_ERR_OK;
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(fault.duration_ms));
+  return fault.type == FAULT_TLS_STALL ? SSL_TLSEXT_ERR_ALERT_FATAL : SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Create the certificate authority and a context presenting a certificate
+ * it issued for whatever hostname the client asks for, so that clients
+ * trusting the authority can verify every host.
+ */
+static SSL_CTX* create_ssl_ctx()
+{
+  SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+  EVP_PKEY_CTX* key_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+  if (!ctx || !key_ctx || EVP_PKEY_keygen_init(key_ctx) <= 0 ||
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(key_ctx, NID_X9_62_prime256v1) <= 0 ||
+      EVP_PKEY_keygen(key_ctx, &key) <= 0) {
+    return NULL;
+  }
+  EVP_PKEY_CTX_free(key_ctx);
+
+  ca_certificate = issue_certificate("replay-server CA", true);
+  X509* cert = ca_certificate ? issue_certificate("replay-server", false) : NULL;
+  if (cert == NULL || SSL_CTX_use_certificate(ctx, cert) != 1 || SSL_CTX_use_PrivateKey(ctx, key) != 1) {
+    return NULL;
+  }
+  X509_free(cert);
+  SSL_CTX_set_tlsext_servername_callback(ctx, on_server_name);
+  return ctx;
+}
+
+/**
+ * A client connection, either plain or TLS.
+ */
+struct Connection {
+  int fd;
+  SSL* ssl = NULL;
+
+  /**
+   * Requests served so far.
+   */
+  size_t requests = 0;
+
+  /**
+   * Whether to close with a reset rather than gracefully.
+   */
+  bool reset = false;
+
+  /**
+   * Early data received with the handshake, which is read first.
+   */
+  std::string early_data;
+
+  ssize_t read(char* buffer, size_t length) {
+    if (!early_data.empty()) {
+      size_t n = std::min(length, early_data.size());
+      memcpy(buffer, early_data.data(), n);
+      early_data.erase(0, n);
+      return n;
+    }
+    if (ssl) {
+      int n = SSL_read(ssl, buffer, length);
+      return n > 0 ? n : -1;
+    }
+    return recv(fd, buffer, length, 0);
+  }
+
+  bool write(const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+      ssize_t n;
+      if (ssl) {
+        n = SSL_write(ssl, data.data() + written, data.size() - written);
+      } else {
+        n = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+      }
+      if (n <= 0) {
+        return false;
+      }
+      written += n;
+    }
+    return true;
+  }
+};
+
+static bool lookup(const std::string& url, TraceHop& hop)
+{
+  std::lock_guard<std::mutex> lock(recordings_mutex);
+  auto it = recordings.find(url);
+  if (it == recordings.end()) {
+    return false;
+  }
+  Recording& recording = it->second;
+  hop = recording.hops[recording.next];
+  recording.next = (recording.next + 1) % recording.hops.size();
+  return true;
+}
+
+/**
+ * Serve requests on an established connection until the client closes it.
+ */
+static void serve_requests(Connection& connection)
+{
+  std::string scheme = connection.ssl ? "https://" : "http://";
+  std::string buffer;
+  char chunk[4096];
+  for (;;) {
+    size_t end;
+    while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+      ssize_t n = connection.read(chunk, sizeof(chunk));
+      if (n <= 0) {
+        return;
+      }
+      buffer.append(chunk, n);
+    }
+    std::string request = buffer.substr(0, end + 2);
+    buffer.erase(0, end + 4);
+
+    // Request line: METHOD target HTTP/1.1
+    size_t method_end = request.find(' ');
+    size_t target_end = request.find(' ', method_end + 1);
+    if (method_end == std::string::npos || target_end == std::string::npos) {
+      return;
+    }
+    std::string target = request.substr(method_end + 1, target_end - method_end - 1);
+    std::string url = target;
+    if (target.find("://") == std::string::npos) {
+      std::string host;
+      for (size_t pos = request.find("\r\n"); pos != std::string::npos && pos + 2 < request.size();) {
+        size_t next = request.find("\r\n", pos + 2);
+        std::string line = request.substr(pos + 2, next - pos - 2);
+        if (strncasecmp(line.c_str(), "host:", 5) == 0) {
+          size_t value = line.find_first_not_of(" \t", 5);
+          host = value == std::string::npos ? "" : line.substr(value);
+        }
+        pos = next;
+      }
+      url = scheme + host + target;
+    }
+
+    std::string host = url_host(url);
+    FaultRule fault;
+    if (connection.requests == 0 && !connection.ssl && find_fault(host, "", false, fault) &&
+        fault.type == FAULT_CONNECT_DELAY) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(fault.duration_ms));
+    }
+    bool faulted = find_fault(host, url, connection.requests > 0, fault);
+    connection.requests++;
+    if (faulted) {
+      switch (fault.type) {
+        case FAULT_RESET:
+        case FAULT_RESET_REUSED:
+          connection.reset = true;
+          return;
+        case FAULT_CLOSE:
+          return;
+        case FAULT_HANG: {
+          // Wait for the client to give up, discarding anything it sends.
+          struct pollfd client = {connection.fd, POLLIN, 0};
+          while (poll(&client, 1, fault.duration_ms < 0 ? -1 : fault.duration_ms) > 0 &&
+              connection.read(chunk, sizeof(chunk)) > 0) {
+          }
+          return;
+        }
+        case FAULT_DELAY:
+          std::this_thread::sleep_for(std::chrono::milliseconds(fault.duration_ms));
+          break;
+        default:
+          break;
+      }
+    }
+
+    TraceHop hop;
+    std::string response;
+    if (faulted && (fault.type == FAULT_STATUS || fault.type == FAULT_RATE_LIMIT)) {
+      response = "HTTP/1.1 " + std::to_string(fault.status) + " Injected\r\n";
+      if (!fault.retry_after.empty()) {
+        response += "Retry-After: " + fault.retry_after + "\r\n";
+      }
+    } else if (lookup(url, hop)) {
+      if (hop.latency_us > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(static_cast<long>(hop.latency_us / speed)));
+      }
+      response = "HTTP/1.1 " + std::to_string(hop.status) + " Replayed\r\n";
+      for (size_t i = 0; i < hop.headers.size(); i++) {
+        if (!is_hop_by_hop(hop.headers[i].first)) {
+          response += hop.headers[i].first + ": " + hop.headers[i].second + "\r\n";
+        }
+      }
+    } else {
+      fprintf(stderr, "No recording for %s\n", url.c_str());
+      response = "HTTP/1.1 404 Not Recorded\r\nX-Replay-Miss: 1\r\n";
+    }
+    response += "Content-Length: 0\r\n\r\n";
+    if (faulted && fault.type == FAULT_SLOW_HEADERS) {
+      for (size_t i = 0; i < response.size(); i++) {
+        if (!connection.write(response.substr(i, 1))) {
+          return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(fault.interval_ms));
+      }
+    } else if (!connection.write(response)) {
+      return;
+    }
+  }
+}
+
+/**
+ * Serve one accepted connection, detecting whether it speaks TLS.
+ */
+static void serve(int fd)
+{
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  Connection connection;
+  connection.fd = fd;
+  unsigned char first_byte;
+  // 0x16 is the TLS handshake record type, which no HTTP method starts with.
+  if (recv(fd, &first_byte, 1, MSG_PEEK) == 1) {
+    if (first_byte == 0x16) {
+      connection.ssl = SSL_new(ssl_ctx);
+      SSL_set_fd(connection.ssl, fd);
+      // SSL_read_early_data completes the handshake unless it fails.
+      bool early_data_done = max_early_data == 0;
+      bool handshake_failed = false;
+      while (!early_data_done) {
+        char chunk[4096];
+        size_t read = 0;
+        switch (SSL_read_early_data(connection.ssl, chunk, sizeof(chunk), &read)) {
+          case SSL_READ_EARLY_DATA_SUCCESS:
+            connection.early_data.append(chunk, read);
+            break;
+          case SSL_READ_EARLY_DATA_FINISH:
+            connection.early_data.append(chunk, read);
+            early_data_done = true;
+            break;
+          default:
+            early_data_done = true;
+            handshake_failed = true;
+        }
+      }
+      if (!handshake_failed && SSL_accept(connection.ssl) == 1) {
+        serve_requests(connection);
+      }
+    } else {
+      serve_requests(connection);
+    }
+  }
+  if (connection.reset) {
+    struct linger linger = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  } else if (connection.ssl) {
+    SSL_shutdown(connection.ssl);
+  }
+  SSL_free(connection.ssl);
+  close(fd);
+}
+
+static void usage(const char* program)
+{
+  fprintf(stderr, "Usage: %s --trace FILE [--port PORT] [--speed FACTOR] [--faults FILE] [--seed N]\n"
+      "          [--max-early-data BYTES] [--ca-cert FILE]\n", program);
+}
+
+int main(int argc, char** argv)
+{
+  const char* trace_path = NULL;
+  const char* faults_path = NULL;
+  const char* ca_path = NULL;
+  int port = 8080;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--trace") {
+      trace_path = argv[i + 1];
+    } else if (arg == "--port") {
+      port = std::atoi(argv[i + 1]);
+    } else if (arg == "--speed") {
+      speed = std::atof(argv[i + 1]);
+    } else if (arg == "--faults") {
+      faults_path = argv[i + 1];
+    } else if (arg == "--seed") {
+      fault_rng.seed(std::strtoull(argv[i + 1], NULL, 10));
+    } else if (arg == "--ca-cert") {
+      ca_path = argv[i + 1];
+    } else if (arg == "--max-early-data") {
+      max_early_data = std::strtoul(argv[i + 1], NULL, 10);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (trace_path == NULL || speed <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::ifstream trace(trace_path);
+  if (!trace) {
+    fprintf(stderr, "Failed to open trace file %s\n", trace_path);
+    exit(1);
+  }
+  size_t entries = 0;
+  size_t line_number = 0;
+  for (std::string line; std::getline(trace, line);) {
+    line_number++;
+    TraceEntry entry;
+    if (line.empty()) {
+      continue;
+    }
+    if (!trace_entry_from_json(line, entry)) {
+      fprintf(stderr, "Skipping malformed trace line %zu\n", line_number);
+      continue;
+    }
+    entries++;
+    for (size_t i = 0; i < entry.hops.size(); i++) {
+      // Interim responses are produced by curl itself on replay.
+      if (entry.hops[i].status >= 200) {
+        recordings[entry.hops[i].url].hops.push_back(entry.hops[i]);
+      }
+    }
+  }
+  fprintf(stderr, "Loaded %zu expansions covering %zu urls\n", entries, recordings.size());
+  if (faults_path != NULL) {
+    load_faults(faults_path);
+  }
+
+  // SSL_write cannot be told to use MSG_NOSIGNAL, so writing to a client
+  // that gave up must not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+  ssl_ctx = create_ssl_ctx();
+  if (!ssl_ctx) {
+    fprintf(stderr, "Failed to create TLS context\n");
+    ERR_print_errors_fp(stderr);
+    exit(1);
+  }
+  SSL_CTX_set_max_early_data(ssl_ctx, max_early_data);
+  if (ca_path != NULL) {
+    FILE* ca_file = fopen(ca_path, "w");
+    if (ca_file == NULL || PEM_write_X509(ca_file, ca_certificate) != 1) {
+      fprintf(stderr, "Failed to write the CA certificate to %s\n", ca_path);
+      exit(1);
+    }
+    fclose(ca_file);
+  }
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  // Accept data in the SYN from clients using TCP Fast Open, if the server
+  // bit (2) of net.ipv4.tcp_fastopen is set.
+  int fast_open_queue = SOMAXCONN;
+  setsockopt(listener, IPPROTO_TCP, TCP_FASTOPEN, &fast_open_queue, sizeof(fast_open_queue));
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  if (bind(listener, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0 ||
+      listen(listener, SOMAXCONN) != 0) {
+    perror("Failed to listen");
+    exit(1);
+  }
+  fprintf(stderr, "Replaying on 127.0.0.1:%d\n", port);
+
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+    std::thread(serve, fd).detach();
+  }
+}
@@ -0,0 +1,243 @@
+#include "perf_counters.h"
+#include "replay_harness.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * Measures the cost of TLS handshakes on reconnects. Runs the url-expander
+ * binary in stdin mode with MAX_CONNECTIONS=1 over https URLs that alternate
+ * between --hosts hosts, so that every request opens a new connection,
+ * against bench/replay-server accepting early data. Each configuration sets
+ * the expander's TLS env variables:
+ *
+ *     full_handshake     Full handshakes without verification, the default
+ *                        before session resumption.
+ *     resumption         Resumed sessions.
+ *     early_data         Resumed sessions with the request as early data.
+ *     verified_uncached  Full handshakes verifying every certificate chain
+ *                        against the replay server's CA.
+ *     verified           Full handshakes with cached verifications.
+ *
+ * Prints the mean time and CPU time per expansion, along with the
+ * resumption, early data acceptance and verification cache hit rates the
+ * expander logged. Resumption and early data only apply to the fast client,
+ * verification to both.
+ *
+ * Over loopback this only shows the CPU cost of handshakes. On a real network
+ * resumption also saves a round trip of TLS 1.2 handshakes, and accepted early
+ * data the round trip of the request.
+ */
+
+struct Config {
+  const char* name;
+  const char* session_cache;
+  const char* early_data;
+  const char* verify;
+  const char* verify_cache;
+};
+
+static const Config configs[] = {
+  {"full_handshake", "0", "0", "0", "0"},
+  {"resumption", "1", "0", "0", "0"},
+  {"early_data", "1", "1", "0", "0"},
+  {"verified_uncached", "0", "0", "1", "0"},
+  {"verified", "0", "0", "1", "1"},
+};
+
+/**
+ * The last TLS statistics line the expander logged, or an empty string.
+ */
+static std::string last_stats_line(const std::string& path)
+{
+  std::ifstream log(path.c_str());
+  std::string last;
+  for (std::string line; std::getline(log, line);) {
+    if (line.compare(0, 15, "TLS handshakes:") == 0) {
+      last = line;
+    }
+  }
+  return last;
+}
+
+static void usage(const char* program)
+{
+  fprintf(stderr,
+      "Usage: %s --replay-server PATH --expander PATH [options]\n"
+      "\n"
+      "Options:\n"
+      "  --urls N          URLs per configuration. Default 2000.\n"
+      "  --hosts N         Hosts the URLs alternate between. Default 10.\n"
+      "  --client NAME     fast or curl. Default fast.\n"
+      "  --configs LIST    Default full_handshake,resumption,early_data,\n"
+      "                    verified_uncached,verified.\n"
+      "  --port N          Port for the replay server. Default 18085.\n"
+      "  --json            Print one JSON object per configuration.\n",
+      program);
+}
+
+int main(int argc, char** argv)
+{
+  const char* replay_server = NULL;
+  const char* expander = NULL;
+  int count = 2000;
+  int hosts = 10;
+  int port = 18085;
+  std::string client = "fast";
+  std::string config_list = "full_handshake,resumption,early_data,verified_uncached,verified";
+  bool json = false;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--json") {
+      json = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    const char* value = argv[++i];
+    if (arg == "--replay-server") {
+      replay_server = value;
+    } else if (arg == "--expander") {
+      expander = value;
+    } else if (arg == "--urls") {
+      count = std::atoi(value);
+    } else if (arg == "--hosts") {
+      hosts = std::atoi(value);
+    } else if (arg == "--port") {
+      port = std::atoi(value);
+    } else if (arg == "--client") {
+      client = value;
+    } else if (arg == "--configs") {
+      config_list = value;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (replay_server == NULL || expander == NULL || count <= 0 || hosts < 2 ||
+      (client != "fast" && client != "curl")) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::string trace_path = temp_path("tls-handshakes.trace");
+  std::string urls_path = temp_path("tls-handshakes.urls");
+  std::string log_path = temp_path("tls-handshakes.log");
+  std::string ca_path = temp_path("tls-handshakes.ca");
+  std::vector<TraceEntry> entries;
+  std::vector<std::string> urls;
+  for (int i = 0; i < count; i++) {
+    TraceEntry entry;
+    entry.url = "https://r" + std::to_string(i % hosts) + ".test/" + std::to_string(i);
+    TraceHop hop;
+    hop.url = entry.url;
+    hop.protocol = "HTTP/1.1";
+    hop.status = 200;
+    entry.hops.push_back(hop);
+    entries.push_back(entry);
+    urls.push_back(entry.url);
+  }
+  write_trace(trace_path, entries);
+  write_lines(urls_path, urls);
+
+  ReplayServerProcess server;
+  std::vector<std::string> server_args;
+  server_args.push_back("--trace");
+  server_args.push_back(trace_path);
+  server_args.push_back("--port");
+  server_args.push_back(std::to_string(port));
+  server_args.push_back("--max-early-data");
+  server_args.push_back("16384");
+  server_args.push_back("--ca-cert");
+  server_args.push_back(ca_path);
+  if (!server.start(replay_server, server_args, port)) {
+    return 1;
+  }
+
+  std::string connect_to = "::127.0.0.1:" + std::to_string(port);
+  setenv("CONNECT_TO", connect_to.c_str(), 1);
+  setenv("HTTP_CLIENT", client.c_str(), 1);
+  setenv("MAX_CONNECTIONS", "1", 1);
+  setenv("TLS_CA_FILE", ca_path.c_str(), 1);
+  unsetenv("AWS_LAMBDA_FUNCTION_NAME");
+  std::string command = std::string("'") + expander + "' < '" + urls_path + "' 2>'" + log_path + "'";
+
+  if (!json) {
+    printf("%-18s %10s %12s %10s %12s %14s %12s\n", "config", "us/url", "cpu_us/url", "resumed", "early_sent",
+        "early_accepted", "verify_hits");
+  }
+  int exit_code = 0;
+  for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+    const Config& config = configs[c];
+    if (("," + config_list + ",").find(std::string(",") + config.name + ",") == std::string::npos) {
+      continue;
+    }
+    setenv("TLS_SESSION_CACHE", config.session_cache, 1);
+    setenv("TLS_EARLY_DATA", config.early_data, 1);
+    setenv("TLS_VERIFY", config.verify, 1);
+    setenv("TLS_VERIFY_CACHE", config.verify_cache, 1);
+    PerfCounters counters(true);
+    counters.start();
+    auto start = std::chrono::steady_clock::now();
+    FILE* output = popen(command.c_str(), "r");
+    int completed = 0;
+    char line[4096];
+    while (output != NULL && fgets(line, sizeof(line), output) != NULL) {
+      completed += strstr(line, "': https://r") != NULL;
+    }
+    int status = output != NULL ? pclose(output) : -1;
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    counters.stop();
+    if (status != 0 || completed != count) {
+      fprintf(stderr, "Only %d of %d expansions succeeded with %s\n", completed, count, config.name);
+      exit_code = 1;
+      continue;
+    }
+
+    size_t handshakes = 0, resumed = 0, early_sent = 0, early_accepted = 0, verify_hits = 0, verify_misses = 0;
+    std::string stats = last_stats_line(log_path);
+    sscanf(stats.c_str(), "TLS handshakes: %zu, resumed: %zu (%*f%%), early data sent: %zu, accepted: %zu (%*f%%), "
+        "verification cache hits: %zu, misses: %zu", &handshakes, &resumed, &early_sent, &early_accepted,
+        &verify_hits, &verify_misses);
+    double ns_per_op = std::chrono::duration<double, std::nano>(elapsed).count() / count;
+    double resumed_rate = handshakes > 0 ? static_cast<double>(resumed) / handshakes : 0;
+    double accepted_rate = early_sent > 0 ? static_cast<double>(early_accepted) / early_sent : 0;
+    size_t verifications = verify_hits + verify_misses;
+    double hit_rate = verifications > 0 ? static_cast<double>(verify_hits) / verifications : 0;
+    std::vector<std::pair<std::string, double> > values = counters.per_op(count);
+    double cpu_ns_per_op = 0;
+    for (size_t i = 0; i < values.size(); i++) {
+      if (values[i].first == "user_ns_per_op" || values[i].first == "sys_ns_per_op") {
+        cpu_ns_per_op += values[i].second;
+      }
+    }
+    const char* name_suffix = client == "curl" ? "/curl" : "";
+    if (json) {
+      printf("{\"name\": \"tls/%s%s\", \"ns_per_op\": %.1f, \"resumption_rate\": %.3f, "
+          "\"early_data_acceptance_rate\": %.3f, \"verification_cache_hit_rate\": %.3f", config.name, name_suffix,
+          ns_per_op, resumed_rate, accepted_rate, hit_rate);
+      for (size_t i = 0; i < values.size(); i++) {
+        printf(", \"%s\": %.2f", values[i].first.c_str(), values[i].second);
+      }
+      printf("}\n");
+    } else {
+      printf("%-18s %10.1f %12.1f %9.1f%% %12zu %13.1f%% %11.1f%%\n", config.name, ns_per_op / 1000,
+          cpu_ns_per_op / 1000, 100 * resumed_rate, early_sent, 100 * accepted_rate, 100 * hit_rate);
+    }
+    fflush(stdout);
+  }
+
+  server.stop();
+  unlink(trace_path.c_str());
+  unlink(urls_path.c_str());
+  unlink(log_path.c_str());
+  unlink(ca_path.c_str());
+  return exit_code;
+}
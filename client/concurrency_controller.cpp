@@ -0,0 +1,106 @@
+#include "concurrency_controller.h"
+
+#include <algorithm>
+
+/**
+ * Factor the window shrinks by on a backoff, as in CUBIC.
+ */
+static const double BACKOFF_FACTOR = 0.7;
+
+/**
+ * An epoch's timeout rate spikes when it exceeds the usual one by this
+ * factor plus this many percentage points. Dead hosts time out at any
+ * concurrency, which the usual rate absorbs.
+ */
+static const double TIMEOUT_SPIKE_FACTOR = 2;
+static const double TIMEOUT_SPIKE_MARGIN = 0.01;
+
+/**
+ * Weight of an epoch in the usual timeout rate.
+ */
+static const double TIMEOUT_RATE_WEIGHT = 0.2;
+
+/**
+ * Share of one CPU the client may use before it counts as saturated. Its
+ * event loop runs on one thread.
+ */
+static const double CPU_SATURATION = 0.9;
+
+/**
+ * Latency per url that still counts as holding, relative to the lowest seen.
+ * The lowest seen creeps up by MIN_LATENCY_DRIFT per epoch, so that a
+ * workload that became slower for good does not freeze the window.
+ */
+static const double LATENCY_TOLERANCE = 1.25;
+static const double MIN_LATENCY_DRIFT = 1.01;
+
+/**
+ * Throughput that still counts as keeping up, relative to the last epoch's.
+ */
+static const double THROUGHPUT_TOLERANCE = 0.95;
+
+ConcurrencyController::ConcurrencyController(size_t initial_window, size_t min_window, size_t max_window)
+  : min_window(std::max<size_t>(min_window, 1)), max_window(std::max(max_window, this->min_window)),
+    slow_start(true), epoch_invocations(0), epoch_urls(0), epoch_timeouts(0), epoch_latency_us(0),
+    epoch_start_us(-1), epoch_start_cpu_us(0), last_throughput(-1), min_url_latency_us(-1), usual_timeout_rate(-1)
+{
+  stats.window = std::min(std::max(initial_window, this->min_window), this->max_window);
+  stats.peak_window = stats.window;
+}
+
+void ConcurrencyController::on_invocation_complete(size_t urls, size_t timeouts, long long latency_us,
+    long long now_us, long long cpu_us)
+{
+  if (epoch_start_us < 0) {
+    // The first epoch starts when the first invocation was sent.
+    epoch_start_us = now_us - latency_us;
+    epoch_start_cpu_us = cpu_us;
+  }
+  epoch_invocations++;
+  epoch_urls += urls;
+  epoch_timeouts += timeouts;
+  epoch_latency_us += latency_us;
+  if (epoch_invocations >= stats.window) {
+    end_epoch(now_us, cpu_us);
+  }
+}
+
+void ConcurrencyController::end_epoch(long long now_us, long long cpu_us)
+{
+  long long elapsed_us = std::max(now_us - epoch_start_us, 1LL);
+  double throughput = epoch_urls * 1e6 / elapsed_us;
+  double timeout_rate = epoch_urls > 0 ? static_cast<double>(epoch_timeouts) / epoch_urls : 0;
+  double url_latency_us = static_cast<double>(epoch_latency_us) / std::max<size_t>(epoch_urls, 1);
+  double cpu = static_cast<double>(cpu_us - epoch_start_cpu_us) / elapsed_us;
+
+  bool timeout_spike = usual_timeout_rate >= 0 &&
+      timeout_rate > usual_timeout_rate * TIMEOUT_SPIKE_FACTOR + TIMEOUT_SPIKE_MARGIN;
+  if (!timeout_spike) {
+    usual_timeout_rate = usual_timeout_rate < 0 ? timeout_rate :
+        usual_timeout_rate + TIMEOUT_RATE_WEIGHT * (timeout_rate - usual_timeout_rate);
+  }
+  bool latency_holds = min_url_latency_us < 0 || url_latency_us <= min_url_latency_us * LATENCY_TOLERANCE;
+  min_url_latency_us = min_url_latency_us < 0 ? url_latency_us :
+      std::min(min_url_latency_us * MIN_LATENCY_DRIFT, url_latency_us);
+
+  size_t window = stats.window;
+  if (timeout_spike || cpu >= CPU_SATURATION) {
+    window = std::max(min_window, static_cast<size_t>(window * BACKOFF_FACTOR));
+    slow_start = false;
+    stats.backoffs++;
+  } else if (!latency_holds) {
+    slow_start = false;
+  } else if (last_throughput < 0 || throughput >= last_throughput * THROUGHPUT_TOLERANCE) {
+    window = std::min(max_window, slow_start ? window * 2 : window + 1);
+  }
+  stats.window = window;
+  stats.peak_window = std::max(stats.peak_window, window);
+
+  last_throughput = throughput;
+  epoch_invocations = 0;
+  epoch_urls = 0;
+  epoch_timeouts = 0;
+  epoch_latency_us = 0;
+  epoch_start_us = now_us;
+  epoch_start_cpu_us = cpu_us;
+}
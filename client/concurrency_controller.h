@@ -0,0 +1,81 @@
+#ifndef URL_EXPANDER_CONCURRENCY_CONTROLLER_H
+#define URL_EXPANDER_CONCURRENCY_CONTROLLER_H
+
+#include <cstddef>
+
+/**
+ * How ConcurrencyController's window moved, cumulative since it was created.
+ */
+struct ConcurrencyStats {
+  size_t window = 0;
+  size_t peak_window = 0;
+
+  /**
+   * Multiplicative decreases, because of a timeout spike or saturated CPU.
+   */
+  size_t backoffs = 0;
+};
+
+/**
+ * Additive-increase, multiplicative-decrease control of how many invocations
+ * the fan-out client keeps in flight. Too few leave instances idle, while too
+ * many make the functions or the client itself contend for CPU and sockets
+ * until expansions time out, and where that happens depends on the memory
+ * tier and the workload.
+ *
+ * Completions are evaluated in epochs of one window's worth of invocations,
+ * i.e. about one round trip. After an epoch whose share of timed out urls
+ * spikes above its usual level, or in which the client used most of a CPU,
+ * the window shrinks by a factor. Otherwise it grows by one while throughput
+ * keeps up and the latency per url stays near the lowest seen, and holds when
+ * latency rises. Until the first backoff or latency rise, it doubles instead,
+ * like TCP slow start, so large windows are reached in a few epochs.
+ */
+class ConcurrencyController {
+ public:
+  ConcurrencyController(size_t initial_window, size_t min_window, size_t max_window);
+
+  size_t window() const
+  {
+    return stats.window;
+  }
+
+  const ConcurrencyStats& concurrency_stats() const
+  {
+    return stats;
+  }
+
+  /**
+   * Record a finished invocation of urls urls, timeouts of which timed out,
+   * that took latency_us. now_us is a steady clock and cpu_us the process's
+   * CPU time.
+   */
+  void on_invocation_complete(size_t urls, size_t timeouts, long long latency_us, long long now_us,
+      long long cpu_us);
+
+ private:
+  void end_epoch(long long now_us, long long cpu_us);
+
+  size_t min_window;
+  size_t max_window;
+  bool slow_start;
+  ConcurrencyStats stats;
+
+  size_t epoch_invocations;
+  size_t epoch_urls;
+  size_t epoch_timeouts;
+  long long epoch_latency_us;
+  long long epoch_start_us;
+  long long epoch_start_cpu_us;
+
+  /**
+   * Urls per second of the last epoch, the lowest mean latency per url of
+   * an epoch, and the usual share of timed out urls, or -1 before the first
+   * epoch.
+   */
+  double last_throughput;
+  double min_url_latency_us;
+  double usual_timeout_rate;
+};
+
+#endif
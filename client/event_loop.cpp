@@ -0,0 +1,429 @@
+#include "event_loop.h"
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+#define URL_EXPANDER_HAVE_IO_URING 1
+#endif
+
+namespace {
+
+class EpollBackend : public EventBackend {
+ public:
+  EpollBackend() : epoll_fd(epoll_create1(EPOLL_CLOEXEC)), events(256)
+  {
+    syscall_count++;
+  }
+
+  ~EpollBackend()
+  {
+    if (epoll_fd >= 0) {
+      close(epoll_fd);
+    }
+  }
+
+  bool valid() const
+  {
+    return epoll_fd >= 0;
+  }
+
+  void watch(int fd, int interest)
+  {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = (interest & EVENT_READ ? static_cast<uint32_t>(EPOLLIN) : 0) |
+        (interest & EVENT_WRITE ? static_cast<uint32_t>(EPOLLOUT) : 0);
+    event.data.fd = fd;
+    syscall_count++;
+    epoll_ctl(epoll_fd, watched.insert(fd).second ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event);
+  }
+
+  void unwatch(int fd)
+  {
+    if (watched.erase(fd) > 0) {
+      syscall_count++;
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+  }
+
+  bool wait(long timeout_ms, std::vector<ReadyEvent>& ready)
+  {
+    syscall_count++;
+    int count = epoll_wait(epoll_fd, events.data(), events.size(), timeout_ms < 0 ? -1 : timeout_ms);
+    if (count < 0) {
+      return errno == EINTR;
+    }
+    for (int i = 0; i < count; i++) {
+      uint32_t flags = events[i].events;
+      ReadyEvent event;
+      event.fd = events[i].data.fd;
+      event.events = (flags & (EPOLLIN | EPOLLHUP | EPOLLRDHUP) ? EVENT_READ : 0) |
+          (flags & EPOLLOUT ? EVENT_WRITE : 0) | (flags & EPOLLERR ? EVENT_ERROR : 0);
+      ready.push_back(event);
+    }
+    return true;
+  }
+
+  const char* name() const
+  {
+    return "epoll";
+  }
+
+ private:
+  int epoll_fd;
+  std::vector<struct epoll_event> events;
+  std::unordered_set<int> watched;
+};
+
+#ifdef URL_EXPANDER_HAVE_IO_URING
+
+/**
+ * io_uring on raw system calls, so that liburing is not a dependency.
+ *
+ * Interest is registered with one-shot IORING_OP_POLL_ADD requests, which
+ * complete immediately if the fd is already ready, and are re-armed after
+ * every completion. This gives the level-triggered behavior curl's socket API
+ * requires; multishot polls only report new wakeups, so a socket with data
+ * curl left unread would stall. Registrations, removals and re-arms are
+ * queued and submitted together with the wait, so each loop iteration costs
+ * one io_uring_enter however many sockets changed, where epoll needs an
+ * epoll_ctl per change. Buffer registration and multishot receives do not
+ * apply, since curl does its own reads.
+ */
+class IoUringBackend : public EventBackend {
+ public:
+  IoUringBackend() : ring_fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes(NULL), pending(0), generation(0) {}
+
+  ~IoUringBackend()
+  {
+    if (sqes != NULL) {
+      munmap(sqes, sqes_size);
+    }
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+      munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != MAP_FAILED) {
+      munmap(sq_ring, sq_ring_size);
+    }
+    if (ring_fd >= 0) {
+      close(ring_fd);
+    }
+  }
+
+  /**
+   * Set up the ring. Returns false if io_uring is unavailable or lacks
+   * IORING_FEAT_EXT_ARG (Linux 5.11), needed to wait with a timeout.
+   */
+  bool init(unsigned entries)
+  {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    syscall_count++;
+    ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0 || !(params.features & IORING_FEAT_EXT_ARG)) {
+      return false;
+    }
+    sq_entries = params.sq_entries;
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+        IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+      return false;
+    }
+    cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? sq_ring :
+        mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      return false;
+    }
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes_memory = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+        IORING_OFF_SQES);
+    if (sqes_memory == MAP_FAILED) {
+      return false;
+    }
+    sqes = static_cast<struct io_uring_sqe*>(sqes_memory);
+
+    char* sq = static_cast<char*>(sq_ring);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    unsigned* sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries; i++) {
+      sq_array[i] = i;
+    }
+    char* cq = static_cast<char*>(cq_ring);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  void watch(int fd, int interest)
+  {
+    Registration& registration = registrations[fd];
+    if (registration.armed && registration.interest == interest) {
+      return;
+    }
+    if (registration.armed) {
+      remove(registration);
+    }
+    registration.fd = fd;
+    registration.interest = interest;
+    arm(registration);
+  }
+
+  void unwatch(int fd)
+  {
+    auto it = registrations.find(fd);
+    if (it == registrations.end()) {
+      return;
+    }
+    if (it->second.armed) {
+      remove(it->second);
+    }
+    registrations.erase(it);
+  }
+
+  bool wait(long timeout_ms, std::vector<ReadyEvent>& ready)
+  {
+    for (size_t i = 0; i < disarmed.size(); i++) {
+      auto it = registrations.find(disarmed[i]);
+      if (it != registrations.end() && !it->second.armed) {
+        arm(it->second);
+      }
+    }
+    disarmed.clear();
+
+    struct __kernel_timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = timeout_ms < 0 ? 0 : reinterpret_cast<uint64_t>(&timeout);
+    bool completed = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) != *cq_head;
+    unsigned wait_for = completed || timeout_ms == 0 ? 0 : 1;
+    if (!enter(wait_for, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) &&
+        errno != ETIME && errno != EINTR) {
+      return false;
+    }
+
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      const struct io_uring_cqe& cqe = cqes[head & cq_mask];
+      int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+      uint32_t registration_generation = static_cast<uint32_t>(cqe.user_data >> 32);
+      auto it = registrations.find(fd);
+      // Completions of removals and of replaced or removed polls.
+      if (cqe.user_data == REMOVAL || it == registrations.end() || !it->second.armed ||
+          it->second.generation != registration_generation) {
+        continue;
+      }
+      it->second.armed = false;
+      disarmed.push_back(fd);
+      ReadyEvent event;
+      event.fd = fd;
+      if (cqe.res < 0) {
+        event.events = EVENT_ERROR;
+      } else {
+        event.events = (cqe.res & (POLLIN | POLLHUP | POLLRDHUP) ? EVENT_READ : 0) |
+            (cqe.res & POLLOUT ? EVENT_WRITE : 0) | (cqe.res & POLLERR ? EVENT_ERROR : 0);
+      }
+      ready.push_back(event);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  const char* name() const
+  {
+    return "io_uring";
+  }
+
+ private:
+  struct Registration {
+    int fd = -1;
+    int interest = 0;
+    bool armed = false;
+    uint32_t generation = 0;
+  };
+
+  /**
+   * user_data of poll removals, whose completions are ignored.
+   */
+  static const uint64_t REMOVAL = ~0ULL;
+
+  bool enter(unsigned min_complete, unsigned flags, const void* arg, size_t arg_size)
+  {
+    syscall_count++;
+    long submitted = syscall(__NR_io_uring_enter, ring_fd, pending, min_complete, flags, arg, arg_size);
+    if (submitted >= 0) {
+      pending -= std::min<unsigned>(pending, submitted);
+    }
+    return submitted >= 0;
+  }
+
+  struct io_uring_sqe* next_sqe()
+  {
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+      // The submission queue is full, so submit without waiting.
+      enter(0, 0, NULL, 0);
+    }
+    struct io_uring_sqe* sqe = &sqes[tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    pending++;
+    return sqe;
+  }
+
+  void arm(Registration& registration)
+  {
+    registration.generation = ++generation;
+    registration.armed = true;
+    struct io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = registration.fd;
+    sqe->poll32_events = (registration.interest & EVENT_READ ? POLLIN : 0) |
+        (registration.interest & EVENT_WRITE ? POLLOUT : 0);
+    sqe->user_data = user_data(registration);
+  }
+
+  void remove(Registration& registration)
+  {
+    registration.armed = false;
+    struct io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = user_data(registration);
+    sqe->user_data = REMOVAL;
+  }
+
+  static uint64_t user_data(const Registration& registration)
+  {
+    return (static_cast<uint64_t>(registration.generation) << 32) | static_cast<uint32_t>(registration.fd);
+  }
+
+  int ring_fd;
+  void* sq_ring;
+  void* cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  unsigned sq_entries;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+
+  /**
+   * Queued submissions not yet passed to the kernel.
+   */
+  unsigned pending;
+  uint32_t generation;
+  std::unordered_map<int, Registration> registrations;
+
+  /**
+   * fds whose poll completed, to re-arm on the next wait.
+   */
+  std::vector<int> disarmed;
+};
+
+#endif
+
+}  // namespace
+
+EventBackend* create_event_backend(const std::string& name)
+{
+  if (name != "epoll" && name != "io_uring" && name != "auto") {
+    return NULL;
+  }
+#ifdef URL_EXPANDER_HAVE_IO_URING
+  if (name != "epoll") {
+    IoUringBackend* backend = new IoUringBackend();
+    if (backend->init(1024)) {
+      return backend;
+    }
+    delete backend;
+  }
+#endif
+  EpollBackend* backend = new EpollBackend();
+  if (!backend->valid()) {
+    delete backend;
+    return NULL;
+  }
+  return backend;
+}
+
+CurlMultiDriver::CurlMultiDriver(CURLM* multi, EventBackend& backend)
+  : multi(multi), backend(backend), timer_set(false), running(0)
+{
+  curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+  curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+  curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+  curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+}
+
+int CurlMultiDriver::socket_callback(CURL* easy, curl_socket_t fd, int what, void* userp, void* socketp)
+{
+  CurlMultiDriver* driver = static_cast<CurlMultiDriver*>(userp);
+  if (what == CURL_POLL_REMOVE) {
+    driver->backend.unwatch(fd);
+  } else {
+    driver->backend.watch(fd, (what & CURL_POLL_IN ? EVENT_READ : 0) | (what & CURL_POLL_OUT ? EVENT_WRITE : 0));
+  }
+  return 0;
+}
+
+int CurlMultiDriver::timer_callback(CURLM* multi, long timeout_ms, void* userp)
+{
+  CurlMultiDriver* driver = static_cast<CurlMultiDriver*>(userp);
+  driver->timer_set = timeout_ms >= 0;
+  driver->timer_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+  return 0;
+}
+
+int CurlMultiDriver::run_once(long max_wait_ms)
+{
+  long wait_ms = max_wait_ms;
+  if (timer_set) {
+    // Round up, so as not to spin until a sub-millisecond timeout expires.
+    long timer_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        timer_deadline - std::chrono::steady_clock::now()).count();
+    wait_ms = std::max(0L, std::min(wait_ms, (timer_us + 999) / 1000));
+  }
+  ready.clear();
+  backend.wait(wait_ms, ready);
+  for (size_t i = 0; i < ready.size(); i++) {
+    int flags = (ready[i].events & EVENT_READ ? CURL_CSELECT_IN : 0) |
+        (ready[i].events & EVENT_WRITE ? CURL_CSELECT_OUT : 0) |
+        (ready[i].events & EVENT_ERROR ? CURL_CSELECT_ERR : 0);
+    curl_multi_socket_action(multi, ready[i].fd, flags, &running);
+  }
+  if (timer_set && std::chrono::steady_clock::now() >= timer_deadline) {
+    timer_set = false;
+    curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+  }
+  return running;
+}
@@ -0,0 +1,105 @@
+#ifndef URL_EXPANDER_EVENT_LOOP_H
+#define URL_EXPANDER_EVENT_LOOP_H
+
+#include <curl/curl.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+/**
+ * Readiness flags of EventBackend.
+ */
+enum {
+  EVENT_READ = 1,
+  EVENT_WRITE = 2,
+  EVENT_ERROR = 4,
+};
+
+struct ReadyEvent {
+  int fd;
+  int events;
+};
+
+/**
+ * Level-triggered readiness notification for the sockets of a curl multi
+ * handle. Implemented with epoll, and with io_uring where the kernel allows
+ * it, which applies interest changes and waits in a single system call.
+ */
+class EventBackend {
+ public:
+  virtual ~EventBackend() {}
+
+  /**
+   * Watch fd for events, a combination of EVENT_READ and EVENT_WRITE,
+   * replacing any earlier interest in it.
+   */
+  virtual void watch(int fd, int events) = 0;
+
+  /**
+   * Stop watching fd. Must be called before fd is closed.
+   */
+  virtual void unwatch(int fd) = 0;
+
+  /**
+   * Wait up to timeout_ms, or indefinitely if it is negative, for watched
+   * fds to become ready and append them to ready. Returns false if waiting
+   * failed.
+   */
+  virtual bool wait(long timeout_ms, std::vector<ReadyEvent>& ready) = 0;
+
+  virtual const char* name() const = 0;
+
+  /**
+   * System calls the backend made so far, for benchmarks.
+   */
+  size_t syscalls() const
+  {
+    return syscall_count;
+  }
+
+ protected:
+  size_t syscall_count = 0;
+};
+
+/**
+ * Create the backend called name: "epoll", "io_uring" or "auto". io_uring
+ * and auto fall back to epoll when io_uring is unavailable, e.g. on kernels
+ * older than 5.11 or where seccomp blocks it. Returns NULL for an unknown
+ * name or if no backend could be created.
+ */
+EventBackend* create_event_backend(const std::string& name);
+
+/**
+ * Drives a curl multi handle with its socket API on an EventBackend, instead
+ * of curl_multi_perform and curl_multi_poll rescanning every transfer on each
+ * wakeup.
+ */
+class CurlMultiDriver {
+ public:
+  /**
+   * Installs socket and timer callbacks on multi, so multi must be cleaned up
+   * before the driver and backend are destroyed.
+   */
+  CurlMultiDriver(CURLM* multi, EventBackend& backend);
+
+  /**
+   * Wait for socket activity or curl's next timeout, for at most
+   * max_wait_ms, and let curl act on it. Returns the number of running
+   * transfers.
+   */
+  int run_once(long max_wait_ms);
+
+ private:
+  static int socket_callback(CURL* easy, curl_socket_t fd, int what, void* userp, void* socketp);
+  static int timer_callback(CURLM* multi, long timeout_ms, void* userp);
+
+  CURLM* multi;
+  EventBackend& backend;
+  bool timer_set;
+  std::chrono::steady_clock::time_point timer_deadline;
+  int running;
+  std::vector<ReadyEvent> ready;
+};
+
+#endif
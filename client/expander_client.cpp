@@ -0,0 +1,344 @@
+#include "expander_client.h"
+#include "clock.h"
+#include "event_loop.h"
+#include "host.h"
+
+#include <aws/core/utils/json/JsonSerializer.h>
+#include <curl/curl.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+
+namespace {
+
+/**
+ * State of a single in-flight batch invocation.
+ */
+struct Invocation {
+  size_t lane;
+  std::vector<size_t> indices;
+  std::string body;
+  std::string response;
+  bool function_error = false;
+  struct curl_slist* headers = NULL;
+  long long start_us = 0;
+};
+
+/**
+ * User and system CPU time of the process.
+ */
+long long cpu_time_us()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL + usage.ru_utime.tv_usec +
+      usage.ru_stime.tv_usec;
+}
+
+size_t append_to_string(char* data, size_t size, size_t nmemb, void* userp)
+{
+  static_cast<std::string*>(userp)->append(data, size * nmemb);
+  return size * nmemb;
+}
+
+/**
+ * Lambda reports unhandled errors in the function with a 200 status and this
+ * header, so it has to be checked in addition to the status code.
+ */
+size_t detect_function_error(char* data, size_t size, size_t nmemb, void* userp)
+{
+  static const std::string header = "x-amz-function-error:";
+  size_t length = size * nmemb;
+  if (length >= header.size()) {
+    bool match = true;
+    for (size_t i = 0; i < header.size() && match; i++) {
+      match = std::tolower(static_cast<unsigned char>(data[i])) == header[i];
+    }
+    if (match) {
+      static_cast<Invocation*>(userp)->function_error = true;
+    }
+  }
+  return length;
+}
+
+/**
+ * 64-bit FNV-1a. Used instead of std::hash because lane assignment must be
+ * identical across processes, compilers and machines.
+ */
+uint64_t fnv1a(const std::string& s, uint64_t hash = 14695981039346656037ULL)
+{
+  for (size_t i = 0; i < s.size(); i++) {
+    hash ^= static_cast<unsigned char>(s[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+}  // namespace
+
+FanoutClient::FanoutClient(const FanoutOptions& options)
+  : options(options)
+  , requeued(0)
+{
+  if (options.endpoints.empty()) {
+    throw std::invalid_argument("FanoutClient requires at least one endpoint");
+  }
+  if (this->options.chunk_size == 0) {
+    this->options.chunk_size = 1;
+  }
+  if (this->options.max_in_flight == 0) {
+    this->options.max_in_flight = 1;
+  }
+  if (this->options.max_in_flight_per_lane == 0) {
+    this->options.max_in_flight_per_lane = 1;
+  }
+  resources.load_limits(false);
+}
+
+size_t FanoutClient::lane_for_host(const std::string& host) const
+{
+  // Rendezvous hashing: the lane with the highest score for the host wins.
+  size_t best_lane = 0;
+  uint64_t best_score = 0;
+  uint64_t host_hash = fnv1a(registrable_domain(host));
+  for (size_t i = 0; i < options.endpoints.size(); i++) {
+    uint64_t score = fnv1a(options.endpoints[i], host_hash);
+    if (i == 0 || score > best_score) {
+      best_score = score;
+      best_lane = i;
+    }
+  }
+  return best_lane;
+}
+
+std::vector<FanoutResult> FanoutClient::expand(const std::vector<std::string>& urls)
+{
+  using namespace Aws::Utils::Json;
+
+  std::vector<FanoutResult> results(urls.size());
+  requeued = 0;
+  std::vector<std::deque<size_t> > pending(options.endpoints.size());
+  for (size_t i = 0; i < urls.size(); i++) {
+    results[i].url = urls[i];
+    results[i].lane = lane_for_host(url_host(urls[i]));
+    pending[results[i].lane].push_back(i);
+  }
+
+  std::string credentials;
+  std::string session_token_header;
+  if (!options.sigv4.empty()) {
+    const char* key = std::getenv("AWS_ACCESS_KEY_ID");
+    const char* secret = std::getenv("AWS_SECRET_ACCESS_KEY");
+    const char* token = std::getenv("AWS_SESSION_TOKEN");
+    if (key == NULL || secret == NULL) {
+      throw std::runtime_error("SigV4 signing requires AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY");
+    }
+    credentials = std::string(key) + ":" + secret;
+    if (token != NULL) {
+      session_token_header = std::string("X-Amz-Security-Token: ") + token;
+    }
+  }
+
+  std::unique_ptr<EventBackend> backend(create_event_backend(options.event_backend));
+  if (!backend) {
+    throw std::invalid_argument("Unknown or unavailable event backend " + options.event_backend);
+  }
+  used_event_backend = backend->name();
+  CURLM* multi = curl_multi_init();
+  if (!multi) {
+    throw std::runtime_error("Failed to create curl multi handle");
+  }
+  CurlMultiDriver driver(multi, *backend);
+  // Keep one connection per lane alive between invocations.
+  curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS,
+      static_cast<long>(options.endpoints.size() * options.max_in_flight_per_lane));
+
+  std::vector<size_t> lane_in_flight(options.endpoints.size(), 0);
+  size_t in_flight = 0;
+  size_t next_lane = 0;
+  std::unique_ptr<ConcurrencyController> controller;
+  if (options.adaptive_in_flight) {
+    controller.reset(new ConcurrencyController(options.initial_in_flight, 1, options.max_in_flight));
+  }
+  auto in_flight_limit = [&]() {
+    return controller ? controller->window() : options.max_in_flight;
+  };
+  // Whether another invocation may start, which at worst opens a connection.
+  // curl only opens the connections of invocations started since the driver
+  // last ran once it runs again. The first invocation always may start, so
+  // that expansions go on.
+  size_t unopened = 0;
+  lowest = resources.headroom(steady_now_us());
+  auto admit_invocation = [&]() {
+    long long now_us = steady_now_us();
+    ResourceHeadroom headroom = resources.headroom(now_us);
+    if (headroom.fds() < lowest.fds()) {
+      lowest = headroom;
+    }
+    return in_flight == 0 || resources.admit(static_cast<long>(unopened) + 1, now_us);
+  };
+
+  // Start the next chunk of the given lane.
+  auto start_invocation = [&](size_t lane) {
+    Invocation* invocation = new Invocation();
+    invocation->lane = lane;
+    Aws::Utils::Array<JsonValue> chunk(std::min(options.chunk_size, pending[lane].size()));
+    for (size_t i = 0; i < chunk.GetLength(); i++) {
+      invocation->indices.push_back(pending[lane].front());
+      pending[lane].pop_front();
+      chunk[i].AsString(urls[invocation->indices.back()]);
+    }
+    JsonValue request;
+    request.WithArray("urls", std::move(chunk));
+    if (options.max_time_ms >= 0) {
+      request.WithInt64("max_time_ms", options.max_time_ms);
+    }
+    if (options.max_redirects >= 0) {
+      request.WithInt64("max_redirects", options.max_redirects);
+    }
+    invocation->body = request.View().WriteCompact();
+
+    invocation->headers = curl_slist_append(invocation->headers, "Content-Type: application/json");
+    if (!session_token_header.empty()) {
+      invocation->headers = curl_slist_append(invocation->headers, session_token_header.c_str());
+    }
+
+    CURL* handle = curl_easy_init();
+    curl_easy_setopt(handle, CURLOPT_URL, options.endpoints[lane].c_str());
+    curl_easy_setopt(handle, CURLOPT_POSTFIELDS, invocation->body.c_str());
+    curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, static_cast<long>(invocation->body.size()));
+    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, invocation->headers);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, append_to_string);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, &invocation->response);
+    curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, detect_function_error);
+    curl_easy_setopt(handle, CURLOPT_HEADERDATA, invocation);
+    curl_easy_setopt(handle, CURLOPT_PRIVATE, invocation);
+    curl_easy_setopt(handle, CURLOPT_OPENSOCKETFUNCTION, curl_open_socket_callback);
+    curl_easy_setopt(handle, CURLOPT_OPENSOCKETDATA, &resources);
+    curl_easy_setopt(handle, CURLOPT_CLOSESOCKETFUNCTION, curl_close_socket_callback);
+    curl_easy_setopt(handle, CURLOPT_CLOSESOCKETDATA, &resources);
+    if (options.invocation_timeout_ms > 0) {
+      curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, options.invocation_timeout_ms);
+    }
+    if (!options.sigv4.empty()) {
+      curl_easy_setopt(handle, CURLOPT_AWS_SIGV4, options.sigv4.c_str());
+      curl_easy_setopt(handle, CURLOPT_USERPWD, credentials.c_str());
+    }
+    invocation->start_us = steady_now_us();
+    curl_multi_add_handle(multi, handle);
+    lane_in_flight[lane]++;
+    in_flight++;
+    unopened++;
+  };
+
+  // Record the outcome of a finished invocation into results.
+  auto finish_invocation = [&](CURL* handle, CURLcode code) {
+    Invocation* invocation;
+    curl_easy_getinfo(handle, CURLINFO_PRIVATE, &invocation);
+    long status = 0;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+
+    std::string error;
+    size_t timeouts = 0;
+    if (code != CURLE_OK) {
+      error = std::string("Invocation failed: ") + curl_easy_strerror(code);
+    } else if (status != 200) {
+      error = "Invocation returned HTTP status " + std::to_string(status) + ": " + invocation->response;
+    } else if (invocation->function_error) {
+      error = "Function error: " + invocation->response;
+    }
+    if (error.empty()) {
+      JsonValue json(invocation->response);
+      auto v = json.View();
+      if (!json.WasParseSuccessful() || !v.ValueExists("results")) {
+        error = "Malformed invocation response: " + invocation->response;
+      } else {
+        auto batch = v.GetArray("results");
+        if (batch.GetLength() != invocation->indices.size()) {
+          error = "Invocation returned " + std::to_string(batch.GetLength()) +
+            " results for " + std::to_string(invocation->indices.size()) + " urls";
+        } else {
+          // Urls the function was short of memory for go back to the front
+          // of the lane, and like timeouts, tell the controller to back off.
+          std::deque<size_t>& lane_pending = pending[invocation->lane];
+          for (size_t i = batch.GetLength(); i-- > 0;) {
+            int error_code = batch[i].GetInteger("error_code");
+            if (error_code == CURLE_OUT_OF_MEMORY) {
+              lane_pending.push_front(invocation->indices[i]);
+              requeued++;
+            } else {
+              results[invocation->indices[i]].response = batch[i].WriteCompact();
+            }
+            timeouts += error_code == CURLE_OPERATION_TIMEDOUT || error_code == CURLE_OUT_OF_MEMORY;
+          }
+        }
+      }
+    }
+    if (!error.empty()) {
+      for (size_t i = 0; i < invocation->indices.size(); i++) {
+        results[invocation->indices[i]].invocation_error = error;
+      }
+    }
+    if (controller) {
+      if (code == CURLE_OPERATION_TIMEDOUT) {
+        timeouts = invocation->indices.size();
+      }
+      long long now_us = steady_now_us();
+      controller->on_invocation_complete(invocation->indices.size(), timeouts, now_us - invocation->start_us,
+          now_us, cpu_time_us());
+    }
+
+    curl_multi_remove_handle(multi, handle);
+    curl_easy_cleanup(handle);
+    curl_slist_free_all(invocation->headers);
+    lane_in_flight[invocation->lane]--;
+    in_flight--;
+    delete invocation;
+  };
+
+  for (;;) {
+    // Pipeline: refill every lane with spare capacity, round robin across
+    // lanes so one hot host cannot starve the others.
+    bool started = true;
+    while (started && in_flight < in_flight_limit() && admit_invocation()) {
+      started = false;
+      for (size_t n = 0; n < pending.size() && in_flight < in_flight_limit() && admit_invocation(); n++) {
+        size_t lane = next_lane;
+        next_lane = (next_lane + 1) % pending.size();
+        if (!pending[lane].empty() && lane_in_flight[lane] < options.max_in_flight_per_lane) {
+          start_invocation(lane);
+          started = true;
+        }
+      }
+    }
+    if (in_flight == 0) {
+      break;
+    }
+
+    driver.run_once(1000);
+    unopened = 0;
+    int queued;
+    CURLMsg* msg;
+    while ((msg = curl_multi_info_read(multi, &queued)) != NULL) {
+      if (msg->msg == CURLMSG_DONE) {
+        finish_invocation(msg->easy_handle, msg->data.result);
+      }
+    }
+  }
+
+  curl_multi_cleanup(multi);
+  if (controller) {
+    used_concurrency = controller->concurrency_stats();
+  } else {
+    used_concurrency = ConcurrencyStats();
+    used_concurrency.window = options.max_in_flight;
+    used_concurrency.peak_window = options.max_in_flight;
+  }
+  return results;
+}
@@ -0,0 +1,169 @@
+#ifndef URL_EXPANDER_CLIENT_H
+#define URL_EXPANDER_CLIENT_H
+
+#include "concurrency_controller.h"
+#include "resource_governor.h"
+
+#include <string>
+#include <vector>
+
+/**
+ * Options for a FanoutClient.
+ */
+struct FanoutOptions {
+  /**
+   * One invocation endpoint per lane. Each endpoint is a URL accepting a POST
+   * of the url-expander request JSON, such as the local runtime emulator's
+   * http://localhost:9000/2015-03-31/functions/function/invocations or the
+   * Lambda Invoke API for one function or alias. URLs with the same host are
+   * always routed to the same lane, so each instance behind a lane only opens
+   * connections to its own share of the hosts.
+   */
+  std::vector<std::string> endpoints;
+
+  /**
+   * The maximum number of urls sent in a single invocation.
+   */
+  size_t chunk_size = 50;
+
+  /**
+   * The maximum number of invocations in flight across all lanes.
+   */
+  size_t max_in_flight = 16;
+
+  /**
+   * The maximum number of invocations in flight on a single lane. Keeping
+   * this at 1 means a lane only ever needs one warm instance.
+   */
+  size_t max_in_flight_per_lane = 1;
+
+  /**
+   * Adapt the number of invocations in flight between 1 and max_in_flight
+   * with a ConcurrencyController, starting at initial_in_flight, instead of
+   * always filling max_in_flight.
+   */
+  bool adaptive_in_flight = false;
+  size_t initial_in_flight = 2;
+
+  /**
+   * Passed through as the max_time_ms and max_redirects request keys when
+   * non-negative. Otherwise the function defaults apply.
+   */
+  long max_time_ms = -1;
+  long max_redirects = -1;
+
+  /**
+   * Timeout for a whole invocation, including the expansion of every url in
+   * its chunk. 0 means no timeout.
+   */
+  long invocation_timeout_ms = 0;
+
+  /**
+   * When non-empty, sign requests with AWS SigV4 using the credentials in
+   * AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY and AWS_SESSION_TOKEN. The value
+   * is passed to CURLOPT_AWS_SIGV4, e.g. "aws:amz:us-east-1:lambda".
+   */
+  std::string sigv4;
+
+  /**
+   * How to wait for the sockets of in-flight invocations: "auto", "io_uring"
+   * or "epoll". See create_event_backend.
+   */
+  std::string event_backend = "auto";
+};
+
+/**
+ * Outcome of expanding one url through the fan-out client.
+ */
+struct FanoutResult {
+  /**
+   * The url as given by the caller.
+   */
+  std::string url;
+
+  /**
+   * Index into FanoutOptions::endpoints of the lane that handled the url.
+   */
+  size_t lane;
+
+  /**
+   * The JSON object the function returned for this url, with the output keys
+   * documented in the README. Empty iff the invocation itself failed.
+   */
+  std::string response;
+
+  /**
+   * Description of the invocation failure. Empty iff response is set.
+   */
+  std::string invocation_error;
+};
+
+/**
+ * Client that expands large url sets by chunking them into batch invocations
+ * of the url-expander function. Urls are routed to lanes by rendezvous hashing
+ * of their host's registrable domain, so the routing of a host is stable
+ * across runs and only moves for hosts owned by lanes that are added or
+ * removed, and the hosts of one site share a lane and its rate limits.
+ */
+class FanoutClient {
+ public:
+  explicit FanoutClient(const FanoutOptions& options);
+
+  /**
+   * Expand all urls. Returns one result per url, in input order.
+   */
+  std::vector<FanoutResult> expand(const std::vector<std::string>& urls);
+
+  /**
+   * Return the lane that urls with the given host, or another host with the
+   * same registrable domain, are routed to.
+   */
+  size_t lane_for_host(const std::string& host) const;
+
+  /**
+   * The name of the event backend the last call to expand used, which may be
+   * epoll if io_uring was asked for but is unavailable.
+   */
+  const std::string& event_backend() const
+  {
+    return used_event_backend;
+  }
+
+  /**
+   * The window of invocations in flight as of the end of the last call to
+   * expand. Fixed at max_in_flight unless adaptive_in_flight is set.
+   */
+  const ConcurrencyStats& concurrency_stats() const
+  {
+    return used_concurrency;
+  }
+
+  /**
+   * The headroom when descriptors ran shortest during the last call to
+   * expand. Invocations beyond the first are only started while the
+   * ResourceGovernor admits another socket.
+   */
+  const ResourceHeadroom& lowest_headroom() const
+  {
+    return lowest;
+  }
+
+  /**
+   * Urls that the function was short of memory for during the last call to
+   * expand and that were sent again.
+   */
+  size_t requeued_urls() const
+  {
+    return requeued;
+  }
+
+ private:
+  FanoutOptions options;
+  std::string used_event_backend;
+  ConcurrencyStats used_concurrency;
+  ResourceGovernor resources;
+  ResourceHeadroom lowest;
+  size_t requeued;
+};
+
+#endif
@@ -0,0 +1,154 @@
+#include "expander_client.h"
+#include "host.h"
+
+#include <curl/curl.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+static void usage(const char* program)
+{
+  fprintf(stderr,
+      "Usage: %s --endpoint URL [--endpoint URL ...] [options] < urls.txt\n"
+      "\n"
+      "Reads one URL per line from stdin, expands them through the url-expander\n"
+      "function behind the given endpoints and prints one JSON result per line,\n"
+      "in input order. Each endpoint is one lane; all URLs of a host go to the\n"
+      "same lane.\n"
+      "\n"
+      "Options:\n"
+      "  --endpoint URL             Invocation URL of one lane. Repeatable.\n"
+      "  --chunk-size N             URLs per invocation. Default 50.\n"
+      "  --max-in-flight N          Concurrent invocations in total. Default 16.\n"
+      "  --max-in-flight-per-lane N Concurrent invocations per lane. Default 1.\n"
+      "  --adaptive-in-flight       Adapt the concurrent invocations between 1 and\n"
+      "                             --max-in-flight to throughput, latency, timeouts\n"
+      "                             and the client's CPU use.\n"
+      "  --max-time-ms N            Passed through as max_time_ms.\n"
+      "  --max-redirects N          Passed through as max_redirects.\n"
+      "  --invocation-timeout-ms N  Timeout for one whole invocation.\n"
+      "  --sigv4 PROVIDER           Sign with AWS SigV4, e.g. aws:amz:us-east-1:lambda.\n"
+      "  --event-backend NAME       auto, io_uring or epoll. Default auto, which uses\n"
+      "                             io_uring where available.\n",
+      program);
+}
+
+/**
+ * Entry point of the fan-out client CLI.
+ */
+int main(int argc, char** argv)
+{
+  FanoutOptions options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h") {
+      usage(argv[0]);
+      return 0;
+    }
+    if (arg == "--adaptive-in-flight") {
+      options.adaptive_in_flight = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    const char* value = argv[++i];
+    if (arg == "--endpoint") {
+      options.endpoints.push_back(value);
+    } else if (arg == "--chunk-size") {
+      options.chunk_size = std::atoll(value);
+    } else if (arg == "--max-in-flight") {
+      options.max_in_flight = std::atoll(value);
+    } else if (arg == "--max-in-flight-per-lane") {
+      options.max_in_flight_per_lane = std::atoll(value);
+    } else if (arg == "--max-time-ms") {
+      options.max_time_ms = std::atoll(value);
+    } else if (arg == "--max-redirects") {
+      options.max_redirects = std::atoll(value);
+    } else if (arg == "--invocation-timeout-ms") {
+      options.invocation_timeout_ms = std::atoll(value);
+    } else if (arg == "--sigv4") {
+      options.sigv4 = value;
+    } else if (arg == "--event-backend") {
+      options.event_backend = value;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (options.endpoints.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<std::string> urls;
+  for (std::string line; std::getline(std::cin, line);) {
+    size_t start = line.find_first_not_of(" \t\r");
+    if (start == std::string::npos) {
+      continue;
+    }
+    size_t end = line.find_first_of(" \t\r", start);
+    urls.push_back(line.substr(start, end == std::string::npos ? end : end - start));
+  }
+
+  CURLcode res = curl_global_init(CURL_GLOBAL_ALL);
+  if (res != CURLE_OK) {
+    fprintf(stderr, "Failed global curl init with error code %d: %s\n", res, curl_easy_strerror(res));
+    exit(1);
+  }
+
+  std::vector<FanoutResult> results;
+  std::string event_backend;
+  ConcurrencyStats concurrency;
+  ResourceHeadroom headroom;
+  size_t requeued = 0;
+  try {
+    FanoutClient client(options);
+    results = client.expand(urls);
+    event_backend = client.event_backend();
+    concurrency = client.concurrency_stats();
+    headroom = client.lowest_headroom();
+    requeued = client.requeued_urls();
+  } catch (const std::exception& e) {
+    fprintf(stderr, "%s\n", e.what());
+    exit(1);
+  }
+
+  int failures = 0;
+  std::vector<size_t> lane_urls(options.endpoints.size(), 0);
+  std::vector<std::set<std::string> > lane_hosts(options.endpoints.size());
+  for (size_t i = 0; i < results.size(); i++) {
+    const FanoutResult& result = results[i];
+    lane_urls[result.lane]++;
+    lane_hosts[result.lane].insert(url_host(result.url));
+    if (result.invocation_error.empty()) {
+      printf("%s\n", result.response.c_str());
+    } else {
+      failures++;
+      fprintf(stderr, "URL '%s': %s\n", result.url.c_str(), result.invocation_error.c_str());
+    }
+  }
+  for (size_t lane = 0; lane < options.endpoints.size(); lane++) {
+    fprintf(stderr, "Lane %zu (%s): %zu urls, %zu hosts\n", lane, options.endpoints[lane].c_str(),
+        lane_urls[lane], lane_hosts[lane].size());
+  }
+  fprintf(stderr, "Event backend: %s\n", event_backend.c_str());
+  fprintf(stderr, "Invocations in flight: %zu (peak %zu, %zu backoffs)\n", concurrency.window,
+      concurrency.peak_window, concurrency.backoffs);
+  if (headroom.fd_limit > 0) {
+    fprintf(stderr, "Lowest headroom: %ld of %ld descriptors, %ld of %ld local ports\n", headroom.fds(),
+        headroom.fd_limit, headroom.ports(), headroom.port_limit);
+  }
+  if (requeued > 0) {
+    fprintf(stderr, "Urls sent again after the function was short of memory: %zu\n", requeued);
+  }
+
+  curl_global_cleanup();
+  return failures == 0 ? 0 : 2;
+}
@@ -0,0 +1,9 @@
+#include "clock.h"
+
+#include <chrono>
+
+long long steady_now_us()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
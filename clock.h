@@ -0,0 +1,10 @@
+#ifndef URL_EXPANDER_CLOCK_H
+#define URL_EXPANDER_CLOCK_H
+
+/**
+ * Microseconds on the monotonic clock that latencies, budgets and rate
+ * limits are measured with.
+ */
+long long steady_now_us();
+
+#endif
@@ -0,0 +1,207 @@
+#include "engine.h"
+#include "clock.h"
+#include "host.h"
+#include "host_profiles.h"
+#include "retry_policy.h"
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+void HopTransport::wait_us(long long us)
+{
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+const char* const BROWSER_USER_AGENT =
+    "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/124.0.0.0 Safari/537.36";
+
+void set_hop_options(CURL* curl, const std::string& url, long timeout_ms, const TransferStrategy& strategy)
+{
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, timeout_ms);
+  // curl does not reuse connections that were made with another address
+  // family or HTTP version than the transfer asks for.
+  curl_easy_setopt(curl, CURLOPT_IPRESOLVE, strategy.ipv4_only ? CURL_IPRESOLVE_V4 : CURL_IPRESOLVE_WHATEVER);
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, strategy.http1_only ? CURL_HTTP_VERSION_1_1 : CURL_HTTP_VERSION_NONE);
+  curl_easy_setopt(curl, CURLOPT_USERAGENT, strategy.browser_user_agent ? BROWSER_USER_AGENT : NULL);
+}
+
+void CurlHopTransport::perform(const std::string& url, long timeout_ms, bool fresh_connection,
+    const TransferStrategy& strategy, HopResponse& response)
+{
+  set_hop_options(curl, url, timeout_ms, strategy);
+  curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, fresh_connection ? 1L : 0L);
+  response.code = curl_easy_perform(curl);
+  response.effective_url.clear();
+  response.redirect_url.clear();
+  response.status = 0;
+  response.retry_after_ms = -1;
+  long new_connections = 0;
+  curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &new_connections);
+  response.reused_connection = new_connections == 0;
+  // On failed connects, curl reports the last address it tried.
+  char* primary_ip = NULL;
+  curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &primary_ip);
+  response.ipv6 = primary_ip != NULL && strchr(primary_ip, ':') != NULL;
+  response.connect_us = -1;
+#if LIBCURL_VERSION_NUM >= 0x073d00
+  curl_off_t name_lookup_us = 0;
+  curl_off_t connected_us = 0;
+  curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &name_lookup_us);
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connected_us);
+  if (new_connections > 0 && connected_us > 0) {
+    response.connect_us = connected_us - name_lookup_us;
+  }
+#endif
+  long http_version = 0;
+  curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &http_version);
+  response.http2 = http_version == CURL_HTTP_VERSION_2_0;
+  if (response.code != CURLE_OK) {
+    return;
+  }
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.status);
+#if LIBCURL_VERSION_NUM >= 0x074200
+  if (response.status == 429 || response.status == 503) {
+    // curl parses both the delay in seconds and the HTTP date forms.
+    curl_off_t retry_after = 0;
+    if (curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after) == CURLE_OK && retry_after > 0) {
+      response.retry_after_ms = retry_after * 1000;
+    }
+  }
+#endif
+
+  char* extracted_url = NULL;
+  curl_easy_getinfo(curl, CURLINFO_REDIRECT_URL, &extracted_url);
+  if (extracted_url != NULL) {
+    response.redirect_url = extracted_url;
+  }
+  extracted_url = NULL;
+  curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &extracted_url);
+  if (extracted_url != NULL) {
+    response.effective_url = extracted_url;
+  } else {
+    // Arbitrary choice of error code here, but it's accurate enough to describe the problem.
+    response.code = CURLE_FAILED_INIT;
+  }
+}
+
+long long CurlHopTransport::now_us()
+{
+  return steady_now_us();
+}
+
+long ExpansionPolicy::hop_timeout_ms(const std::string& host, long remaining_ms)
+{
+  return remaining_ms;
+}
+
+void ExpansionPolicy::on_hop_complete(const std::string& host, CURLcode code, long long latency_us)
+{
+}
+
+CURLcode follow_redirects(HopTransport& transport, ExpansionPolicy& policy,
+    std::string& output_url, bool& reached_redirect_limit,
+    const std::string& url, long max_time_ms, long max_redirects, HostRateLimiter* rate_limiter,
+    RetryPolicy* retry_policy, int* retries, HostProfiles* profiles)
+{
+  long long start_us = transport.now_us();
+  std::string current_url = url;
+  HopResponse response;
+  int retried = 0;
+  bool fresh_connection = false;
+  if (retries) {
+    *retries = 0;
+  }
+  for (long redirects = 0;;) {
+    long remaining_ms = max_time_ms - (transport.now_us() - start_us) / 1000;
+    if (remaining_ms <= 0) {
+      return CURLE_OPERATION_TIMEDOUT;
+    }
+    // Rate limits and timeouts are learned per site rather than per host.
+    std::string site = url_site(current_url);
+    long timeout_ms = policy.hop_timeout_ms(site, remaining_ms);
+
+    if (rate_limiter) {
+      long long now_us = transport.now_us();
+      long long wait_us = rate_limiter->ready_us(site, now_us) - now_us;
+      if (wait_us >= remaining_ms * 1000LL) {
+        return CURLE_HTTP_RETURNED_ERROR;
+      }
+      if (wait_us > 0) {
+        transport.wait_us(wait_us);
+        remaining_ms -= wait_us / 1000;
+        timeout_ms = policy.hop_timeout_ms(site, remaining_ms);
+      }
+    }
+    long long hop_start_us = transport.now_us();
+    if (rate_limiter) {
+      rate_limiter->on_request(site, hop_start_us);
+    }
+    // Strategies are learned per host, since they are about its servers.
+    std::string host = profiles ? url_host(current_url) : std::string();
+    TransferStrategy strategy = profiles ? profiles->strategy(host) : TransferStrategy();
+    transport.perform(current_url, timeout_ms, fresh_connection, strategy, response);
+    long long hop_end_us = transport.now_us();
+    policy.on_hop_complete(site, response.code, hop_end_us - hop_start_us);
+    if (profiles && profiles->on_hop_complete(host, strategy, response) && retry_policy &&
+        retry_policy->allows_retry(retried, max_time_ms * 1000LL - (hop_end_us - start_us))) {
+      profiles->on_retried();
+      retried++;
+      if (retries) {
+        *retries = retried;
+      }
+      fresh_connection = false;
+      continue;
+    }
+    if (response.code != CURLE_OK) {
+      long long delay_us = retry_policy ? retry_policy->retry_delay_us(response, retried,
+          max_time_ms * 1000LL - (hop_end_us - start_us), timeout_ms < remaining_ms) : -1;
+      if (delay_us < 0) {
+        return response.code;
+      }
+      if (delay_us > 0) {
+        transport.wait_us(delay_us);
+      }
+      retried++;
+      if (retries) {
+        *retries = retried;
+      }
+      // A timed out hop may have gone to a connection that went silent, so
+      // it is not retried on another one from the same cache.
+      fresh_connection = response.reused_connection || response.code == CURLE_OPERATION_TIMEDOUT;
+      continue;
+    }
+    fresh_connection = false;
+    if (is_throttled(response)) {
+      // A 503 tells about the server rather than about our rate, and is
+      // often limited to some of its backends or paths.
+      if (rate_limiter && response.status == 429) {
+        rate_limiter->on_throttled(site, response.retry_after_ms, hop_end_us);
+      }
+      return CURLE_HTTP_RETURNED_ERROR;
+    }
+    if (rate_limiter) {
+      rate_limiter->on_response(site);
+    }
+
+    // 1. If there is no further redirect, then we can be certain this is a
+    //    final URL.
+    // 2. If there is one but we hit our limit, return it. In this scenario,
+    //    there could be additional hops but we do not know.
+    if (response.redirect_url.empty()) {
+      output_url = response.effective_url;
+      reached_redirect_limit = false;
+      return CURLE_OK;
+    }
+    if (redirects >= max_redirects) {
+      output_url = response.redirect_url;
+      reached_redirect_limit = true;
+      return CURLE_OK;
+    }
+    current_url = response.redirect_url;
+    redirects++;
+  }
+}
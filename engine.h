@@ -0,0 +1,208 @@
+#ifndef URL_EXPANDER_ENGINE_H
+#define URL_EXPANDER_ENGINE_H
+
+#include "host_rate_limiter.h"
+
+#include <curl/curl.h>
+
+#include <string>
+
+class HostProfiles;
+class RetryPolicy;
+
+/**
+ * How to transfer hops to a host, where the defaults are what curl does on
+ * its own. HostProfiles learns these from outcomes.
+ */
+struct TransferStrategy {
+  /**
+   * Connect over IPv4 only, for hosts whose IPv6 addresses fail or connect
+   * slowly.
+   */
+  bool ipv4_only = false;
+
+  /**
+   * Do not negotiate HTTP/2, for hosts that misbehave with it.
+   */
+  bool http1_only = false;
+
+  /**
+   * Send BROWSER_USER_AGENT, for hosts that answer other clients with a 200
+   * interstitial page instead of their redirect.
+   */
+  bool browser_user_agent = false;
+};
+
+/**
+ * The User-Agent sent with TransferStrategy::browser_user_agent. Requests
+ * carry none otherwise.
+ */
+extern const char* const BROWSER_USER_AGENT;
+
+/**
+ * Outcome of requesting a single URL without following its redirect.
+ */
+struct HopResponse {
+  /**
+   * CURLE_OK iff a response was received.
+   */
+  CURLcode code = CURLE_OK;
+
+  /**
+   * The URL that was requested, normalized by curl (e.g. with a scheme).
+   */
+  std::string effective_url;
+
+  /**
+   * The absolute URL the response redirects to, or empty if it does not.
+   */
+  std::string redirect_url;
+
+  /**
+   * HTTP status of the response, or 0 if there was none.
+   */
+  long status = 0;
+
+  /**
+   * How long the response's Retry-After header asks to wait in ms, or -1 if
+   * it has none.
+   */
+  long long retry_after_ms = -1;
+
+  /**
+   * Whether the hop was sent on a connection that served earlier hops. Only
+   * meaningful if it got as far as sending.
+   */
+  bool reused_connection = false;
+
+  /**
+   * Whether the hop was sent, or its connection attempted, over IPv6.
+   */
+  bool ipv6 = false;
+
+  /**
+   * How long the TCP connect of the hop's new connection took, or -1 if it
+   * reused one or did not connect.
+   */
+  long long connect_us = -1;
+
+  /**
+   * Whether the response came over HTTP/2.
+   */
+  bool http2 = false;
+};
+
+/**
+ * Whether response means that the host throttled the request rather than
+ * answering it: a 429, or a 503 with Retry-After.
+ */
+inline bool is_throttled(const HopResponse& response)
+{
+  return response.code == CURLE_OK &&
+      (response.status == 429 || (response.status == 503 && response.retry_after_ms >= 0));
+}
+
+/**
+ * Performs single hops of an expansion. The lambda uses CurlHopTransport,
+ * while bench/network_simulator substitutes a modeled network running in
+ * virtual time, so that everything above this interface is the same code in
+ * both.
+ */
+class HopTransport {
+ public:
+  virtual ~HopTransport() {}
+
+  /**
+   * Request url, giving up after timeout_ms. With fresh_connection set, the
+   * request must not go over a cached connection. strategy says how, as far
+   * as the transport supports it.
+   */
+  virtual void perform(const std::string& url, long timeout_ms, bool fresh_connection,
+      const TransferStrategy& strategy, HopResponse& response) = 0;
+
+  /**
+   * Monotonic clock that hop latencies and budgets are measured with.
+   */
+  virtual long long now_us() = 0;
+
+  /**
+   * Wait for us microseconds of now_us()'s clock. Sleeps by default.
+   */
+  virtual void wait_us(long long us);
+};
+
+/**
+ * Performs hops on a curl easy handle, reusing its connection cache.
+ */
+class CurlHopTransport : public HopTransport {
+ public:
+  explicit CurlHopTransport(CURL* curl) : curl(curl) {}
+  void perform(const std::string& url, long timeout_ms, bool fresh_connection, const TransferStrategy& strategy,
+      HopResponse& response);
+  long long now_us();
+
+ private:
+  CURL* curl;
+};
+
+/**
+ * Set the per-transfer options of one hop on curl.
+ */
+void set_hop_options(CURL* curl, const std::string& url, long timeout_ms,
+    const TransferStrategy& strategy = TransferStrategy());
+
+/**
+ * Decisions the engine makes while following redirects. The base class
+ * reproduces plain curl behavior, where every hop may use the entire
+ * remaining budget.
+ */
+class ExpansionPolicy {
+ public:
+  virtual ~ExpansionPolicy() {}
+
+  /**
+   * Timeout for the next hop to host, given the remaining budget of the
+   * expansion in ms. Must not exceed remaining_ms. follow_redirects passes
+   * the site of the hop's url as host, as url_site returns it.
+   */
+  virtual long hop_timeout_ms(const std::string& host, long remaining_ms);
+
+  /**
+   * Called after every hop so that policies can learn from traffic.
+   */
+  virtual void on_hop_complete(const std::string& host, CURLcode code, long long latency_us);
+};
+
+/**
+ * Expand url by following redirects one hop at a time on transport.
+ *
+ * Output parameters
+ *     output_url: The expanded URL, after following redirects up to
+ *                 max_redirects. Value is not valid if an error is returned.
+ *     reached_redirect_limit: True means that we do not know whether
+ *                 output_url has further redirects.
+ * Input parameters
+ *     url: The URL to expand.
+ *     max_time_ms: The total amount of time we are willing to spend on the URL expansion.
+ *     max_redirects: The maximum number of redirects we are willing to follow.
+ *     rate_limiter: Optional. Told about every hop, and about sites that
+ *                 throttle, keyed by url_site. Hops wait until their site is
+ *                 ready, or are not sent if it will not be within the
+ *                 budget.
+ *     retry_policy: Optional. Decides which failed hops are retried.
+ *     retries: Optional. Set to the number of hops that were retried.
+ *     profiles: Optional. Chooses the transfer strategy of every hop by its
+ *                 host, and learns from the outcome. Hops that it wants to
+ *                 try again with a new strategy are retried at once, if
+ *                 retry_policy allows another retry.
+ * Returns the code of the first failed hop, or CURLE_OK, or
+ * CURLE_HTTP_RETURNED_ERROR if a host throttled the request or would have,
+ * since its response says nothing about where the URL leads. Will never return
+ * CURLE_TOO_MANY_REDIRECTS.
+ */
+CURLcode follow_redirects(HopTransport& transport, ExpansionPolicy& policy,
+    std::string& output_url, bool& reached_redirect_limit,
+    const std::string& url, long max_time_ms, long max_redirects, HostRateLimiter* rate_limiter = NULL,
+    RetryPolicy* retry_policy = NULL, int* retries = NULL, HostProfiles* profiles = NULL);
+
+#endif
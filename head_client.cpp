@@ -0,0 +1,1023 @@
+#include "head_client.h"
+#include "clock.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+/**
+ * How long resolved addresses are reused, the default of curl's DNS cache.
+ */
+static const long long DNS_CACHE_US = 60 * 1000000LL;
+
+/**
+ * Drop the whole DNS cache once it holds this many hosts.
+ */
+static const size_t DNS_CACHE_MAX_HOSTS = 10000;
+
+/**
+ * Drop all cached TLS sessions once there are this many.
+ */
+static const size_t SESSION_CACHE_MAX_HOSTS = 10000;
+
+/**
+ * Rough sizes of cache entries, including their keys: a session with its
+ * ticket and certificate references, and a host with a couple of addresses.
+ */
+static const size_t SESSION_ENTRY_BYTES = 2048;
+static const size_t DNS_ENTRY_BYTES = 512;
+
+/**
+ * Start connecting to one address after another when none has connected
+ * within this long, like the Connection Attempt Delay of RFC 8305.
+ */
+static const long long DEFAULT_ATTEMPT_DELAY_US = 250000;
+
+static bool name_equals(const char* name, size_t length, const char* expected)
+{
+  return strlen(expected) == length && strncasecmp(name, expected, length) == 0;
+}
+
+/**
+ * Whether the comma separated header value contains token, ignoring case.
+ */
+static bool has_token(const char* value, size_t length, const char* token)
+{
+  size_t token_length = strlen(token);
+  for (size_t i = 0; i + token_length <= length; i++) {
+    if (strncasecmp(value + i, token, token_length) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int parse_response_head(const char* data, size_t size, ResponseHead& head)
+{
+  head = ResponseHead();
+  const char* end = data + size;
+  const char* line = data;
+  for (bool first = true;; first = false) {
+    const char* newline = static_cast<const char*>(memchr(line, '\n', end - line));
+    if (newline == NULL) {
+      return 0;
+    }
+    const char* line_end = newline > line && newline[-1] == '\r' ? newline - 1 : newline;
+    size_t length = line_end - line;
+    if (first) {
+      // HTTP/1.x SSS [reason]
+      if (length < 12 || memcmp(line, "HTTP/1.", 7) != 0 || (line[7] != '0' && line[7] != '1') ||
+          line[8] != ' ' || !isdigit(static_cast<unsigned char>(line[9])) ||
+          !isdigit(static_cast<unsigned char>(line[10])) || !isdigit(static_cast<unsigned char>(line[11])) ||
+          (length > 12 && line[12] != ' ')) {
+        return -1;
+      }
+      head.status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+      if (head.status < 200) {
+        return -1;
+      }
+      head.keep_alive = line[7] == '1';
+    } else if (length == 0) {
+      head.length = newline + 1 - data;
+      return 1;
+    } else {
+      if (line[0] == ' ' || line[0] == '\t') {
+        return -1;
+      }
+      const char* colon = static_cast<const char*>(memchr(line, ':', length));
+      if (colon == NULL) {
+        return -1;
+      }
+      const char* value = colon + 1;
+      const char* value_end = line_end;
+      while (value < value_end && (*value == ' ' || *value == '\t')) {
+        value++;
+      }
+      while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+        value_end--;
+      }
+      size_t name_length = colon - line;
+      if (name_equals(line, name_length, "location")) {
+        if (head.location == NULL) {
+          head.location = value;
+          head.location_length = value_end - value;
+        }
+      } else if (name_equals(line, name_length, "retry-after")) {
+        head.retry_after = value;
+        head.retry_after_length = value_end - value;
+      } else if (name_equals(line, name_length, "connection")) {
+        if (has_token(value, value_end - value, "close")) {
+          head.keep_alive = false;
+        } else if (has_token(value, value_end - value, "keep-alive")) {
+          head.keep_alive = true;
+        }
+      }
+    }
+    line = newline + 1;
+  }
+}
+
+/**
+ * A Retry-After value, either a delay in seconds or an HTTP date, in ms, or
+ * -1 if it is malformed.
+ */
+static long long retry_after_ms(const char* value, size_t length)
+{
+  if (length > 0 && length < 10 && isdigit(static_cast<unsigned char>(value[0]))) {
+    long long seconds = 0;
+    for (size_t i = 0; i < length; i++) {
+      if (!isdigit(static_cast<unsigned char>(value[i]))) {
+        return -1;
+      }
+      seconds = seconds * 10 + (value[i] - '0');
+    }
+    return seconds * 1000;
+  }
+  time_t date = curl_getdate(std::string(value, length).c_str(), NULL);
+  if (date < 0) {
+    return -1;
+  }
+  time_t now = time(NULL);
+  return date > now ? (date - now) * 1000LL : 0;
+}
+
+/**
+ * Offsets into an http or https URL that the fast path can request.
+ */
+struct UrlParts {
+  bool tls;
+  int port;
+  size_t host_start;
+  size_t host_end;
+  size_t authority_end;
+
+  /**
+   * The path and query, without the fragment.
+   */
+  size_t target_end;
+};
+
+static bool split_url(const std::string& url, UrlParts& parts)
+{
+  size_t start;
+  if (strncasecmp(url.c_str(), "http://", 7) == 0) {
+    parts.tls = false;
+    parts.port = 80;
+    start = 7;
+  } else if (strncasecmp(url.c_str(), "https://", 8) == 0) {
+    parts.tls = true;
+    parts.port = 443;
+    start = 8;
+  } else {
+    return false;
+  }
+  parts.host_start = start;
+  parts.authority_end = url.find_first_of("/?#", start);
+  if (parts.authority_end == std::string::npos) {
+    parts.authority_end = url.size();
+  }
+  parts.host_end = parts.authority_end;
+  for (size_t i = start; i < parts.authority_end; i++) {
+    char c = url[i];
+    if (c == ':') {
+      parts.host_end = i;
+      size_t digits = parts.authority_end - i - 1;
+      if (digits == 0 || digits > 5) {
+        return false;
+      }
+      parts.port = 0;
+      for (size_t j = i + 1; j < parts.authority_end; j++) {
+        if (!isdigit(static_cast<unsigned char>(url[j]))) {
+          return false;
+        }
+        parts.port = parts.port * 10 + (url[j] - '0');
+      }
+      if (parts.port == 0 || parts.port > 65535) {
+        return false;
+      }
+      break;
+    }
+    // Excludes userinfo, IPv6 literals and international names.
+    if (!isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-' && c != '_') {
+      return false;
+    }
+  }
+  if (parts.host_end == start) {
+    return false;
+  }
+  parts.target_end = url.find('#', parts.authority_end);
+  if (parts.target_end == std::string::npos) {
+    parts.target_end = url.size();
+  }
+  // curl escapes these, so leave them to it.
+  for (size_t i = parts.authority_end; i < parts.target_end; i++) {
+    unsigned char c = url[i];
+    if (c <= 0x20 || c >= 0x7f) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool resolve_location(const std::string& base, size_t path_start, const char* location,
+    size_t length, std::string& resolved)
+{
+  if (length == 0) {
+    return false;
+  }
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = location[i];
+    if (c <= 0x20 || c >= 0x7f || c == '#') {
+      return false;
+    }
+  }
+  size_t scheme_end = 0;
+  while (scheme_end < length && (isalnum(static_cast<unsigned char>(location[scheme_end])) ||
+      location[scheme_end] == '+' || location[scheme_end] == '-' || location[scheme_end] == '.')) {
+    scheme_end++;
+  }
+  if (scheme_end > 0 && scheme_end < length && location[scheme_end] == ':' &&
+      isalpha(static_cast<unsigned char>(location[0]))) {
+    if (length < scheme_end + 3 || location[scheme_end + 1] != '/' || location[scheme_end + 2] != '/') {
+      return false;
+    }
+    resolved.assign(location, length);
+    return true;
+  }
+  if (length >= 2 && location[0] == '/' && location[1] == '/') {
+    resolved.assign(base, 0, base.find(':') + 1).append(location, length);
+    return true;
+  }
+  // Dot segments need normalizing.
+  for (size_t i = 0; i < length; i++) {
+    if (location[i] == '.' && (i == 0 || location[i - 1] == '/') &&
+        (i + 1 == length || location[i + 1] == '/' || location[i + 1] == '?' ||
+        (location[i + 1] == '.' && (i + 2 == length || location[i + 2] == '/' || location[i + 2] == '?')))) {
+      return false;
+    }
+  }
+  size_t query = base.find('?', path_start);
+  if (location[0] == '/') {
+    resolved.assign(base, 0, path_start);
+  } else if (location[0] == '?') {
+    resolved.assign(base, 0, query == std::string::npos ? base.size() : query);
+  } else {
+    size_t slash = base.rfind('/', query == std::string::npos ? std::string::npos : query);
+    resolved.assign(base, 0, slash + 1);
+  }
+  resolved.append(location, length);
+  return true;
+}
+
+static void free_session_key(void* parent, void* key, CRYPTO_EX_DATA* data, int index, long argl, void* argp)
+{
+  delete static_cast<std::string*>(key);
+}
+
+/**
+ * Index of the SSL ex_data slot holding the session cache key of a
+ * connection, which on_new_session needs since TLS 1.3 tickets arrive after
+ * the handshake.
+ */
+static int session_key_index()
+{
+  static int index = SSL_get_ex_new_index(0, NULL, NULL, NULL, free_session_key);
+  return index;
+}
+
+/**
+ * Wait until fd is ready for events or deadline_us passes.
+ */
+static CURLcode wait_for(int fd, short events, long long deadline_us, CURLcode error)
+{
+  for (;;) {
+    long long remaining_us = deadline_us - steady_now_us();
+    if (remaining_us <= 0) {
+      return CURLE_OPERATION_TIMEDOUT;
+    }
+    struct pollfd poll_fd;
+    poll_fd.fd = fd;
+    poll_fd.events = events;
+    poll_fd.revents = 0;
+    int ready = poll(&poll_fd, 1, static_cast<int>((remaining_us + 999) / 1000));
+    if (ready > 0) {
+      return CURLE_OK;
+    }
+    if (ready < 0 && errno != EINTR) {
+      return error;
+    }
+  }
+}
+
+/**
+ * Wait for what an SSL call that returned result wants, or return error if it
+ * failed for good.
+ */
+static CURLcode wait_for_tls(SSL* ssl, int fd, int result, long long deadline_us, CURLcode error)
+{
+  switch (SSL_get_error(ssl, result)) {
+    case SSL_ERROR_WANT_READ:
+      return wait_for(fd, POLLIN, deadline_us, error);
+    case SSL_ERROR_WANT_WRITE:
+      return wait_for(fd, POLLOUT, deadline_us, error);
+    default:
+      return error;
+  }
+}
+
+static CURLcode send_all(int fd, SSL* ssl, const char* data, size_t size, long long deadline_us)
+{
+  while (size > 0) {
+    CURLcode code = CURLE_OK;
+    if (ssl != NULL) {
+      ERR_clear_error();
+      int sent = SSL_write(ssl, data, static_cast<int>(size));
+      if (sent > 0) {
+        data += sent;
+        size -= sent;
+        continue;
+      }
+      code = wait_for_tls(ssl, fd, sent, deadline_us, CURLE_SEND_ERROR);
+    } else {
+      ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+      if (sent >= 0) {
+        data += sent;
+        size -= sent;
+        continue;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      // EINPROGRESS means a Fast Open connection without a cookie is still
+      // being established.
+      code = errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS ?
+          wait_for(fd, POLLOUT, deadline_us, CURLE_SEND_ERROR) : CURLE_SEND_ERROR;
+    }
+    if (code != CURLE_OK) {
+      return code;
+    }
+  }
+  return CURLE_OK;
+}
+
+/**
+ * Read what is available into data, waiting for at least one byte. Sets
+ * received to 0 at the end of the stream.
+ */
+static CURLcode receive_some(int fd, SSL* ssl, char* data, size_t size, long long deadline_us, size_t& received)
+{
+  for (;;) {
+    CURLcode code = CURLE_OK;
+    if (ssl != NULL) {
+      ERR_clear_error();
+      int read = SSL_read(ssl, data, static_cast<int>(size));
+      if (read > 0) {
+        received = read;
+        return CURLE_OK;
+      }
+      if (SSL_get_error(ssl, read) == SSL_ERROR_ZERO_RETURN) {
+        received = 0;
+        return CURLE_OK;
+      }
+      code = wait_for_tls(ssl, fd, read, deadline_us, CURLE_RECV_ERROR);
+    } else {
+      ssize_t read = recv(fd, data, size, 0);
+      if (read >= 0) {
+        received = read;
+        return CURLE_OK;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      code = errno == EAGAIN || errno == EWOULDBLOCK ?
+          wait_for(fd, POLLIN, deadline_us, CURLE_RECV_ERROR) : CURLE_RECV_ERROR;
+    }
+    if (code != CURLE_OK) {
+      return code;
+    }
+  }
+}
+
+HeadClientTransport::HeadClientTransport(CURL* curl, int max_connections, const char* connect_to)
+  : fallback(curl), max_connections(max_connections), fast_path_enabled(true), connect_port(0),
+    ssl_ctx(SSL_CTX_new(TLS_client_method())), session_cache(true), early_data(false),
+    attempt_delay_us(DEFAULT_ATTEMPT_DELAY_US), governor(NULL), ipv4_only(false)
+{
+  // curl honors these, the fast path does not.
+  static const char* proxy_variables[] = {"http_proxy", "https_proxy", "HTTPS_PROXY", "all_proxy", "ALL_PROXY"};
+  for (size_t i = 0; i < sizeof(proxy_variables) / sizeof(proxy_variables[0]); i++) {
+    if (std::getenv(proxy_variables[i]) != NULL) {
+      fast_path_enabled = false;
+    }
+  }
+  if (connect_to != NULL) {
+    std::string value = connect_to;
+    size_t colon = value.rfind(':');
+    if (value.compare(0, 2, "::") != 0 || colon < 2 || std::atoi(value.c_str() + colon + 1) <= 0) {
+      fast_path_enabled = false;
+    } else {
+      connect_host = value.substr(2, colon - 2);
+      connect_port = std::atoi(value.c_str() + colon + 1);
+      if (connect_host.size() > 2 && connect_host[0] == '[') {
+        connect_host = connect_host.substr(1, connect_host.size() - 2);
+      }
+    }
+  }
+  if (ssl_ctx == NULL) {
+    fast_path_enabled = false;
+    return;
+  }
+  SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+  SSL_CTX_set_alpn_protos(ssl_ctx, reinterpret_cast<const unsigned char*>("\x08http/1.1"), 9);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  SSL_CTX_set_options(ssl_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+  // Sessions are handed to on_new_session rather than OpenSSL's cache, which
+  // is not keyed by host on clients.
+  SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ssl_ctx, on_new_session);
+  SSL_CTX_set_app_data(ssl_ctx, this);
+  // OpenSSL writes to the socket itself, so a peer that went away would
+  // otherwise kill the process. curl does the same around its transfers.
+  signal(SIGPIPE, SIG_IGN);
+}
+
+HeadClientTransport::~HeadClientTransport()
+{
+  for (auto it = connections.begin(); it != connections.end(); ++it) {
+    close_connection(it->second);
+  }
+  clear_sessions();
+  SSL_CTX_free(ssl_ctx);
+}
+
+void HeadClientTransport::set_session_cache(bool enabled)
+{
+  session_cache = enabled;
+  if (!enabled) {
+    clear_sessions();
+  }
+}
+
+void HeadClientTransport::clear_sessions()
+{
+  for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+    SSL_SESSION_free(it->second);
+  }
+  sessions.clear();
+}
+
+SSL_SESSION* HeadClientTransport::take_session(const std::string& key)
+{
+  auto it = sessions.find(key);
+  if (it == sessions.end()) {
+    return NULL;
+  }
+  SSL_SESSION* session = it->second;
+  if (SSL_SESSION_get_protocol_version(session) >= TLS1_3_VERSION) {
+    sessions.erase(it);
+  } else {
+    SSL_SESSION_up_ref(session);
+  }
+  return session;
+}
+
+int HeadClientTransport::on_new_session(SSL* ssl, SSL_SESSION* session)
+{
+  HeadClientTransport* transport = static_cast<HeadClientTransport*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+  const std::string* key = static_cast<const std::string*>(SSL_get_ex_data(ssl, session_key_index()));
+  if (!transport->session_cache || key == NULL || !SSL_SESSION_is_resumable(session)) {
+    return 0;
+  }
+  auto it = transport->sessions.find(*key);
+  if (it != transport->sessions.end()) {
+    SSL_SESSION_free(it->second);
+    it->second = session;
+  } else {
+    if (transport->sessions.size() >= SESSION_CACHE_MAX_HOSTS) {
+      transport->clear_sessions();
+    }
+    transport->sessions[*key] = session;
+  }
+  // Keeps the reference OpenSSL passed in.
+  return 1;
+}
+
+long long HeadClientTransport::now_us()
+{
+  return steady_now_us();
+}
+
+void HeadClientTransport::perform(const std::string& url, long timeout_ms, bool fresh_connection,
+    const TransferStrategy& strategy, HopResponse& response)
+{
+  long long deadline_us = steady_now_us() + timeout_ms * 1000LL;
+  if (fast_path_enabled && perform_fast(url, deadline_us, fresh_connection, strategy, response)) {
+    return;
+  }
+  long remaining_ms = (deadline_us - steady_now_us()) / 1000;
+  if (remaining_ms <= 0) {
+    response.code = CURLE_OPERATION_TIMEDOUT;
+    response.effective_url.clear();
+    response.redirect_url.clear();
+    return;
+  }
+  fallback.perform(url, remaining_ms, fresh_connection, strategy, response);
+}
+
+bool HeadClientTransport::perform_fast(const std::string& url, long long deadline_us, bool fresh_connection,
+    const TransferStrategy& strategy, HopResponse& response)
+{
+  UrlParts parts;
+  if (!split_url(url, parts)) {
+    return false;
+  }
+  const char* authority = url.data() + parts.host_start;
+  int authority_length = static_cast<int>(parts.authority_end - parts.host_start);
+  const char* target = url.data() + parts.authority_end;
+  int target_length = static_cast<int>(parts.target_end - parts.authority_end);
+  const char* slash = target_length == 0 || target[0] != '/' ? "/" : "";
+  const char* user_agent = strategy.browser_user_agent ? BROWSER_USER_AGENT : NULL;
+  int request_length = snprintf(request, sizeof(request),
+      "HEAD %s%.*s HTTP/1.1\r\nHost: %.*s\r\n%s%s%sAccept: */*\r\n\r\n",
+      slash, target_length, target, authority_length, authority, user_agent ? "User-Agent: " : "",
+      user_agent ? user_agent : "", user_agent ? "\r\n" : "");
+  if (request_length < 0 || request_length >= static_cast<int>(sizeof(request))) {
+    return false;
+  }
+
+  // The URL as curl reports it, e.g. with a path of / if it had none.
+  response.effective_url.assign(parts.tls ? "https://" : "http://");
+  response.effective_url.append(authority, authority_length);
+  size_t path_start = response.effective_url.size();
+  response.effective_url.append(slash).append(target, target_length);
+  response.redirect_url.clear();
+  response.status = 0;
+  response.retry_after_ms = -1;
+  response.reused_connection = false;
+  response.ipv6 = false;
+  response.connect_us = -1;
+  response.http2 = false;
+  ipv4_only = strategy.ipv4_only;
+
+  host.assign(url, parts.host_start, parts.host_end - parts.host_start);
+  for (size_t i = 0; i < host.size(); i++) {
+    host[i] = std::tolower(static_cast<unsigned char>(host[i]));
+  }
+  char port_text[16];
+  snprintf(port_text, sizeof(port_text), ":%d", parts.port);
+  key.assign(parts.tls ? "https://" : "http://").append(host).append(port_text);
+
+  for (;;) {
+    auto it = connections.find(key);
+    bool reused = it != connections.end();
+    if (reused) {
+      // An idle connection with something to read was closed by the server.
+      struct pollfd poll_fd;
+      poll_fd.fd = it->second.fd;
+      poll_fd.events = POLLIN;
+      poll_fd.revents = 0;
+      if (fresh_connection || poll(&poll_fd, 1, 0) != 0) {
+        close_connection(it->second);
+        connections.erase(it);
+        reused = false;
+      }
+    }
+    bool request_sent = false;
+    if (!reused) {
+      if (static_cast<int>(connections.size()) >= max_connections) {
+        evict_oldest();
+      }
+      if (governor != NULL) {
+        long long now = steady_now_us();
+        long excess = governor->excess_connections(now);
+        if (excess > 0) {
+          governor->on_evicted(evict_idle(excess));
+        }
+        if (!governor->admit(1, now)) {
+          governor->on_refused();
+          response.code = CURLE_COULDNT_CONNECT;
+          return true;
+        }
+      }
+      Connection connection;
+      CURLcode code = open_connection(host, parts.port, parts.tls, request, request_length, deadline_us,
+          connection, request_sent);
+      if (code != CURLE_OK) {
+        response.code = code;
+        return true;
+      }
+      it = connections.insert(std::make_pair(key, connection)).first;
+    }
+
+    Connection& connection = it->second;
+    size_t received = 0;
+    int parsed = 0;
+    ResponseHead head;
+    CURLcode code = request_sent ? CURLE_OK :
+        send_all(connection.fd, connection.ssl, request, request_length, deadline_us);
+    while (code == CURLE_OK && parsed == 0) {
+      if (received == sizeof(buffer)) {
+        parsed = -1;
+        break;
+      }
+      size_t read = 0;
+      code = receive_some(connection.fd, connection.ssl, buffer + received, sizeof(buffer) - received,
+          deadline_us, read);
+      if (code == CURLE_OK && read == 0) {
+        code = received == 0 ? CURLE_GOT_NOTHING : CURLE_RECV_ERROR;
+      }
+      received += read;
+      if (code == CURLE_OK) {
+        parsed = parse_response_head(buffer, received, head);
+      }
+    }
+
+    response.reused_connection = reused;
+    if (!reused && socket_profile.fast_open && received > 0) {
+      connect_counts.fast_open += used_fast_open(connection.fd);
+    }
+    if (code != CURLE_OK || parsed < 0 || received > head.length || !head.keep_alive) {
+      close_connection(connection);
+      connections.erase(it);
+    } else {
+      connection.last_used_us = steady_now_us();
+    }
+    if (code != CURLE_OK) {
+      // The server may have closed a kept-alive connection just as it was
+      // reused, in which case curl retries once on a new connection.
+      if (reused && received == 0 && code != CURLE_OPERATION_TIMEDOUT) {
+        continue;
+      }
+      response.code = code;
+      return true;
+    }
+    if (parsed < 0) {
+      return false;
+    }
+    response.status = head.status;
+    if (head.retry_after != NULL && (head.status == 429 || head.status == 503)) {
+      response.retry_after_ms = retry_after_ms(head.retry_after, head.retry_after_length);
+    }
+    if (head.status >= 300 && head.status < 400 && head.location != NULL &&
+        !resolve_location(response.effective_url, path_start, head.location, head.location_length,
+            response.redirect_url)) {
+      return false;
+    }
+    response.code = CURLE_OK;
+    return true;
+  }
+}
+
+CURLcode HeadClientTransport::open_connection(const std::string& host, int port, bool tls, const char* request,
+    size_t request_length, long long deadline_us, Connection& connection, bool& request_sent)
+{
+  const std::string& address_host = connect_host.empty() ? host : connect_host;
+  int address_port = connect_port > 0 ? connect_port : port;
+  const Resolved* resolved;
+  CURLcode code = resolve(address_host, resolved);
+  if (code != CURLE_OK) {
+    return code;
+  }
+
+  int fd = -1;
+  struct sockaddr_storage peer;
+  code = connect_any(*resolved, address_port, deadline_us, fd, peer);
+  if (code != CURLE_OK) {
+    return code;
+  }
+  connect_counts.connects++;
+  connection.fd = fd;
+  connection.ssl = NULL;
+  connection.last_used_us = steady_now_us();
+  if (!tls) {
+    return CURLE_OK;
+  }
+
+  SSL* ssl = SSL_new(ssl_ctx);
+  if (ssl == NULL) {
+    close_socket(fd);
+    return CURLE_SSL_CONNECT_ERROR;
+  }
+  SSL_set_fd(ssl, fd);
+  // Like curl, send no SNI for IP addresses.
+  struct in_addr ip;
+  if (inet_pton(AF_INET, host.c_str(), &ip) != 1) {
+    SSL_set_tlsext_host_name(ssl, host.c_str());
+  }
+  bool verify_peer = (SSL_CTX_get_verify_mode(ssl_ctx) & SSL_VERIFY_PEER) != 0;
+  if (verify_peer) {
+    SSL_set1_host(ssl, host.c_str());
+  }
+  SSL_set_connect_state(ssl);
+  SSL_set_ex_data(ssl, session_key_index(), new std::string(key));
+  SSL_SESSION* session = session_cache ? take_session(key) : NULL;
+  bool send_early = false;
+  if (session != NULL) {
+    SSL_set_session(ssl, session);
+    send_early = early_data && request != NULL && SSL_SESSION_get_max_early_data(session) >= request_length;
+    SSL_SESSION_free(session);
+  }
+  // SSL_write_early_data starts the handshake, and SSL_do_handshake
+  // completes it once the early data is written.
+  size_t early_written = 0;
+  for (;;) {
+    ERR_clear_error();
+    int result;
+    if (send_early && early_written < request_length) {
+      size_t written = 0;
+      result = SSL_write_early_data(ssl, request + early_written, request_length - early_written, &written);
+      if (result == 1) {
+        early_written += written;
+        continue;
+      }
+    } else {
+      result = SSL_do_handshake(ssl);
+      if (result == 1) {
+        break;
+      }
+    }
+    code = wait_for_tls(ssl, fd, result, deadline_us, CURLE_SSL_CONNECT_ERROR);
+    if (code == CURLE_SSL_CONNECT_ERROR && verify_peer && SSL_get_verify_result(ssl) != X509_V_OK) {
+      code = CURLE_PEER_FAILED_VERIFICATION;
+    }
+    if (code != CURLE_OK) {
+      SSL_free(ssl);
+      close_socket(fd);
+      // A node that cannot complete handshakes is as good as dead, while a
+      // certificate the others would present too is not its fault.
+      if (code != CURLE_PEER_FAILED_VERIFICATION && !(send_early && code == CURLE_SSL_CONNECT_ERROR)) {
+        address_health.record_failure(peer, steady_now_us());
+      }
+      // OpenSSL 3.0 clients offering ALPN fail the handshake with an internal
+      // error when the server rejects the ticket that early data was sent
+      // with, e.g. because it was already used. Count that as rejected early
+      // data and start over without it.
+      if (send_early && code == CURLE_SSL_CONNECT_ERROR) {
+        stats.early_data_sent++;
+        return open_connection(host, port, tls, NULL, 0, deadline_us, connection, request_sent);
+      }
+      return code;
+    }
+  }
+  stats.handshakes++;
+  stats.resumed += SSL_session_reused(ssl);
+  if (send_early) {
+    stats.early_data_sent++;
+    // Rejected early data has to be sent again as a normal request.
+    request_sent = SSL_get_early_data_status(ssl) == SSL_EARLY_DATA_ACCEPTED;
+    stats.early_data_accepted += request_sent;
+  }
+  connection.ssl = ssl;
+  return CURLE_OK;
+}
+
+/**
+ * Start connecting a new non-blocking socket for profile to address. Returns
+ * the socket, or -1 if the attempt failed at once. Sets connected if it
+ * needs no waiting, which is also the case with Fast Open, which defers the
+ * SYN to the first write.
+ */
+static int start_connect(struct sockaddr_storage address, int port, const SocketProfile& profile, bool& connected)
+{
+  socklen_t address_length;
+  if (address.ss_family == AF_INET) {
+    reinterpret_cast<struct sockaddr_in*>(&address)->sin_port = htons(port);
+    address_length = sizeof(struct sockaddr_in);
+  } else {
+    reinterpret_cast<struct sockaddr_in6*>(&address)->sin6_port = htons(port);
+    address_length = sizeof(struct sockaddr_in6);
+  }
+  int fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  apply_socket_profile(fd, profile);
+  connected = connect(fd, reinterpret_cast<struct sockaddr*>(&address), address_length) == 0;
+  if (!connected && errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+CURLcode HeadClientTransport::connect_any(const Resolved& resolved, int port, long long deadline_us, int& fd,
+    struct sockaddr_storage& peer)
+{
+  candidates = resolved.addresses;
+  if (ipv4_only) {
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [](const struct sockaddr_storage& address) {
+      return address.ss_family != AF_INET;
+    }), candidates.end());
+    // Like curl with CURL_IPRESOLVE_V4.
+    if (candidates.empty()) {
+      return CURLE_COULDNT_RESOLVE_HOST;
+    }
+  }
+  address_health.order(candidates, steady_now_us());
+  // Pending attempts, with the index of their address in attempt_indices.
+  std::vector<struct pollfd> attempts;
+  std::vector<size_t> attempt_indices;
+  size_t next = 0;
+  long long next_attempt_us = 0;
+  size_t winner = candidates.size();
+  CURLcode code = CURLE_COULDNT_CONNECT;
+  while (winner == candidates.size()) {
+    long long now = steady_now_us();
+    if (now >= deadline_us) {
+      code = CURLE_OPERATION_TIMEDOUT;
+      break;
+    }
+    if (next < candidates.size() && (attempts.empty() || now >= next_attempt_us)) {
+      if (!attempts.empty() && governor != NULL && !governor->admit(1, now)) {
+        // Short of sockets, so give the pending attempts longer instead.
+        next_attempt_us = now + attempt_delay_us;
+        continue;
+      }
+      bool connected = false;
+      int attempt = start_connect(candidates[next], port, socket_profile, connected);
+      if (attempt >= 0 && governor != NULL) {
+        governor->on_socket_open();
+      }
+      if (attempt < 0) {
+        address_health.record_failure(candidates[next], now);
+        connect_counts.failed_attempts++;
+      } else if (connected) {
+        fd = attempt;
+        winner = next;
+      } else {
+        struct pollfd poll_fd;
+        poll_fd.fd = attempt;
+        poll_fd.events = POLLOUT;
+        poll_fd.revents = 0;
+        attempts.push_back(poll_fd);
+        attempt_indices.push_back(next);
+        next_attempt_us = now + attempt_delay_us;
+      }
+      next++;
+      continue;
+    }
+    if (attempts.empty()) {
+      break;
+    }
+    long long wait_until = next < candidates.size() && next_attempt_us < deadline_us ? next_attempt_us : deadline_us;
+    int ready = poll(attempts.data(), attempts.size(), static_cast<int>((wait_until - now + 999) / 1000));
+    if (ready < 0 && errno != EINTR) {
+      break;
+    }
+    for (size_t i = 0; ready > 0 && i < attempts.size();) {
+      if (attempts[i].revents == 0) {
+        i++;
+        continue;
+      }
+      int error = 0;
+      socklen_t error_length = sizeof(error);
+      if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == 0 && error == 0) {
+        fd = attempts[i].fd;
+        winner = attempt_indices[i];
+      } else {
+        close_socket(attempts[i].fd);
+        address_health.record_failure(candidates[attempt_indices[i]], now);
+        connect_counts.failed_attempts++;
+        // Go on with the next address right away.
+        next_attempt_us = now;
+      }
+      attempts.erase(attempts.begin() + i);
+      attempt_indices.erase(attempt_indices.begin() + i);
+      if (winner != candidates.size()) {
+        break;
+      }
+    }
+  }
+  // Attempts started before the winner were slower than it, and those still
+  // pending at the deadline too slow.
+  long long now = steady_now_us();
+  for (size_t i = 0; i < attempts.size(); i++) {
+    close_socket(attempts[i].fd);
+    if (attempt_indices[i] < winner) {
+      address_health.record_failure(candidates[attempt_indices[i]], now);
+      connect_counts.failed_attempts++;
+    }
+  }
+  if (winner == candidates.size()) {
+    return code;
+  }
+  address_health.record_success(candidates[winner]);
+  peer = candidates[winner];
+  return CURLE_OK;
+}
+
+CURLcode HeadClientTransport::resolve(const std::string& name, const Resolved*& resolved)
+{
+  long long now = steady_now_us();
+  auto it = dns_cache.find(name);
+  if (it != dns_cache.end() && it->second.expires_us > now) {
+    resolved = &it->second;
+    return CURLE_OK;
+  }
+  // Blocks like curl's synchronous resolver, so slow DNS can overrun the
+  // hop's timeout.
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* result = NULL;
+  if (getaddrinfo(name.c_str(), NULL, &hints, &result) != 0) {
+    return CURLE_COULDNT_RESOLVE_HOST;
+  }
+  if (it == dns_cache.end() && dns_cache.size() >= DNS_CACHE_MAX_HOSTS) {
+    dns_cache.clear();
+  }
+  Resolved& entry = dns_cache[name];
+  entry.addresses.clear();
+  for (struct addrinfo* info = result; info != NULL; info = info->ai_next) {
+    if (info->ai_family == AF_INET || info->ai_family == AF_INET6) {
+      struct sockaddr_storage address;
+      memset(&address, 0, sizeof(address));
+      memcpy(&address, info->ai_addr, info->ai_addrlen);
+      entry.addresses.push_back(address);
+    }
+  }
+  freeaddrinfo(result);
+  // Alternate address families, starting with the resolver's first choice,
+  // so that a broken IPv6 or IPv4 path costs one attempt delay at most.
+  sa_family_t family = entry.addresses.empty() ? AF_UNSPEC : entry.addresses[0].ss_family;
+  size_t first_family = std::stable_partition(entry.addresses.begin(), entry.addresses.end(),
+      [&](const struct sockaddr_storage& address) { return address.ss_family == family; }) - entry.addresses.begin();
+  for (size_t i = 1, other = first_family; i < other && other < entry.addresses.size(); i += 2, other++) {
+    std::rotate(entry.addresses.begin() + i, entry.addresses.begin() + other, entry.addresses.begin() + other + 1);
+  }
+  entry.expires_us = now + DNS_CACHE_US;
+  resolved = &entry;
+  return entry.addresses.empty() ? CURLE_COULDNT_RESOLVE_HOST : CURLE_OK;
+}
+
+void HeadClientTransport::close_connection(Connection& connection)
+{
+  if (connection.ssl != NULL) {
+    // Like curl, send close_notify without waiting for the reply. OpenSSL
+    // servers that accept early data invalidate the session of a connection
+    // closed without it, along with the ticket the client was last given.
+    ERR_clear_error();
+    SSL_shutdown(connection.ssl);
+    SSL_free(connection.ssl);
+    connection.ssl = NULL;
+  }
+  close_socket(connection.fd);
+}
+
+void HeadClientTransport::close_socket(int fd)
+{
+  close(fd);
+  if (governor != NULL) {
+    governor->on_socket_close(steady_now_us());
+  }
+}
+
+void HeadClientTransport::evict_oldest()
+{
+  auto oldest = connections.end();
+  for (auto it = connections.begin(); it != connections.end(); ++it) {
+    if (oldest == connections.end() || it->second.last_used_us < oldest->second.last_used_us) {
+      oldest = it;
+    }
+  }
+  if (oldest != connections.end()) {
+    close_connection(oldest->second);
+    connections.erase(oldest);
+  }
+}
+
+size_t HeadClientTransport::evict_idle(size_t count)
+{
+  size_t evicted = 0;
+  for (; evicted < count && !connections.empty(); evicted++) {
+    evict_oldest();
+  }
+  return evicted;
+}
+
+size_t HeadClientTransport::cache_bytes() const
+{
+  return sessions.size() * SESSION_ENTRY_BYTES + dns_cache.size() * DNS_ENTRY_BYTES;
+}
+
+void HeadClientTransport::clear_caches()
+{
+  clear_sessions();
+  dns_cache.clear();
+}
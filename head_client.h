@@ -0,0 +1,303 @@
+#ifndef URL_EXPANDER_HEAD_CLIENT_H
+#define URL_EXPANDER_HEAD_CLIENT_H
+
+#include "address_health.h"
+#include "engine.h"
+#include "resource_governor.h"
+#include "socket_profile.h"
+
+#include <openssl/ssl.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/socket.h>
+
+/**
+ * The parts of an HTTP/1.x response head that following a redirect needs.
+ */
+struct ResponseHead {
+  int status = 0;
+
+  /**
+   * Whether the server lets the connection be reused.
+   */
+  bool keep_alive = false;
+
+  /**
+   * The Location header value, pointing into the parsed data, or NULL.
+   */
+  const char* location = NULL;
+  size_t location_length = 0;
+
+  /**
+   * The Retry-After header value, pointing into the parsed data, or NULL.
+   */
+  const char* retry_after = NULL;
+  size_t retry_after_length = 0;
+
+  /**
+   * Bytes of the head, including the empty line that ends it.
+   */
+  size_t length = 0;
+};
+
+/**
+ * Parse the response head at the start of data without copying or
+ * allocating. Returns 1 when the head is complete, 0 if more data is needed,
+ * and -1 if it is malformed or uses something the fast path does not handle,
+ * such as an interim 1xx response or obsolete header folding.
+ */
+int parse_response_head(const char* data, size_t size, ResponseHead& head);
+
+/**
+ * Resolve location against base, an effective URL whose path starts at
+ * path_start, into resolved. Returns false for references that need more
+ * than concatenation, i.e. dot segments, fragments and characters that curl
+ * would escape, which are left to curl.
+ */
+bool resolve_location(const std::string& base, size_t path_start, const char* location, size_t length,
+    std::string& resolved);
+
+/**
+ * TLS handshake counters of HeadClientTransport, cumulative since it was
+ * created.
+ */
+struct TlsStats {
+  size_t handshakes = 0;
+
+  /**
+   * Handshakes that resumed a cached session.
+   */
+  size_t resumed = 0;
+
+  /**
+   * Handshakes that sent the request as early data, and those of them where
+   * the server accepted it, saving the round trip of the request.
+   */
+  size_t early_data_sent = 0;
+  size_t early_data_accepted = 0;
+};
+
+/**
+ * TCP connection counters of HeadClientTransport, cumulative since it was
+ * created.
+ */
+struct ConnectStats {
+  size_t connects = 0;
+
+  /**
+   * Connections whose first data the server accepted in the SYN.
+   */
+  size_t fast_open = 0;
+
+  /**
+   * Connection attempts that failed, or lost a race to an address tried
+   * later.
+   */
+  size_t failed_attempts = 0;
+};
+
+/**
+ * A specialized HTTP/1.1 client for the redirect-following hot path. It only
+ * sends HEAD requests, reads the status line and Location header and keeps
+ * connections alive, on non-blocking sockets and OpenSSL, without libcurl's
+ * per-transfer option processing and header buffering.
+ *
+ * Anything unusual goes through libcurl on the given handle instead, e.g.
+ * other schemes, userinfo, IPv6 literals, proxies, oversized or malformed
+ * responses and relative redirects with dot segments, so results match those
+ * of CurlHopTransport. Like on main's curl handle, certificates are only
+ * verified if verification is set up on ssl_context(), in which case the
+ * fast path checks hostnames too.
+ *
+ * TLS sessions are cached per host and port, so that reconnecting after a
+ * connection was evicted or closed resumes the session instead of repeating
+ * the full handshake. With early data enabled, reconnects with a TLS 1.3
+ * ticket that allows it send the request as 0-RTT data along with the
+ * handshake. HEAD requests are idempotent, so a replay of that data does no
+ * harm.
+ *
+ * New connections race the host's addresses: when an attempt has not
+ * connected within the attempt delay, the next address is tried alongside it,
+ * and the first to connect wins. Addresses that failed or lost recently are
+ * tried last (AddressHealth). Since that covers failing IPv6 addresses too,
+ * hops report neither their address family nor connect time, and as the fast
+ * path only speaks HTTP/1.1, of a TransferStrategy only ipv4_only and
+ * browser_user_agent make a difference to it.
+ */
+class HeadClientTransport : public HopTransport {
+ public:
+  /**
+   * connect_to follows the format of curl's --connect-to option, of which only
+   * "::HOST:PORT" is supported on the fast path. max_connections bounds the
+   * connection cache.
+   */
+  HeadClientTransport(CURL* curl, int max_connections, const char* connect_to);
+  ~HeadClientTransport();
+
+  void perform(const std::string& url, long timeout_ms, bool fresh_connection, const TransferStrategy& strategy,
+      HopResponse& response);
+  long long now_us();
+
+  /**
+   * The context new TLS connections are created from, for further settings.
+   */
+  SSL_CTX* ssl_context()
+  {
+    return ssl_ctx;
+  }
+
+  /**
+   * Whether to resume cached TLS sessions. Enabled by default.
+   */
+  void set_session_cache(bool enabled);
+
+  /**
+   * Whether to send requests as TLS 1.3 early data when resuming a session
+   * that allows it. Disabled by default.
+   */
+  void set_early_data(bool enabled)
+  {
+    early_data = enabled;
+  }
+
+  const TlsStats& tls_stats() const
+  {
+    return stats;
+  }
+
+  /**
+   * Options for new sockets. Defaults to SocketProfile's defaults.
+   */
+  void set_socket_profile(const SocketProfile& profile)
+  {
+    socket_profile = profile;
+  }
+
+  /**
+   * How long to wait for a connection attempt before starting one to the next
+   * address. Defaults to 250 ms.
+   */
+  void set_attempt_delay(long long delay_us)
+  {
+    attempt_delay_us = delay_us;
+  }
+
+  const ConnectStats& connect_stats() const
+  {
+    return connect_counts;
+  }
+
+  /**
+   * Count sockets with governor, close idle connections when it runs short
+   * of descriptors and fail connections it does not admit with
+   * CURLE_COULDNT_CONNECT. Racing attempts beyond the first wait for its
+   * admission too. None by default.
+   */
+  void set_resource_governor(ResourceGovernor* governor)
+  {
+    this->governor = governor;
+  }
+
+  /**
+   * Close up to count of the least recently used idle connections. Returns
+   * how many were closed.
+   */
+  size_t evict_idle(size_t count);
+
+  /**
+   * Estimated bytes held by the DNS and TLS session caches.
+   */
+  size_t cache_bytes() const;
+
+  /**
+   * Empty the DNS and TLS session caches.
+   */
+  void clear_caches();
+
+ private:
+  struct Connection {
+    int fd;
+    SSL* ssl;
+    long long last_used_us;
+  };
+
+  struct Resolved {
+    std::vector<struct sockaddr_storage> addresses;
+    long long expires_us;
+  };
+
+  /**
+   * Perform the hop on the fast path. Returns false if it has to be left to
+   * curl.
+   */
+  bool perform_fast(const std::string& url, long long deadline_us, bool fresh_connection,
+      const TransferStrategy& strategy, HopResponse& response);
+  /**
+   * Connect to host. On TLS connections that can send early data, request is
+   * sent with the handshake, in which case request_sent is set.
+   */
+  CURLcode open_connection(const std::string& host, int port, bool tls, const char* request,
+      size_t request_length, long long deadline_us, Connection& connection, bool& request_sent);
+  /**
+   * Connect fd to one of resolved's addresses, racing them, and set peer to
+   * that address. Only IPv4 addresses are tried while ipv4_only is set.
+   */
+  CURLcode connect_any(const Resolved& resolved, int port, long long deadline_us, int& fd,
+      struct sockaddr_storage& peer);
+  CURLcode resolve(const std::string& name, const Resolved*& resolved);
+  void close_connection(Connection& connection);
+  void close_socket(int fd);
+  void evict_oldest();
+
+  /**
+   * The cached session for key, or NULL. The caller owns the returned
+   * reference. TLS 1.3 tickets are removed, since they should only be used
+   * once, and replaced by the tickets the resumed connection receives.
+   */
+  SSL_SESSION* take_session(const std::string& key);
+  void clear_sessions();
+  static int on_new_session(SSL* ssl, SSL_SESSION* session);
+
+  CurlHopTransport fallback;
+  int max_connections;
+  bool fast_path_enabled;
+  std::string connect_host;
+  int connect_port;
+  SSL_CTX* ssl_ctx;
+  bool session_cache;
+  bool early_data;
+  TlsStats stats;
+  SocketProfile socket_profile;
+  ConnectStats connect_counts;
+  long long attempt_delay_us;
+  AddressHealth address_health;
+  ResourceGovernor* governor;
+
+  /**
+   * Whether the current hop connects over IPv4 only.
+   */
+  bool ipv4_only;
+
+  /**
+   * Idle connections keyed by scheme, host and port.
+   */
+  std::unordered_map<std::string, Connection> connections;
+  std::unordered_map<std::string, Resolved> dns_cache;
+
+  /**
+   * Resumable TLS sessions keyed like connections.
+   */
+  std::unordered_map<std::string, SSL_SESSION*> sessions;
+
+  // Reused across hops so that steady state hops do not allocate.
+  std::string key;
+  std::string host;
+  std::vector<struct sockaddr_storage> candidates;
+  char request[8192];
+  char buffer[16384];
+};
+
+#endif
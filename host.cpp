@@ -0,0 +1,144 @@
+#include "host.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+
+// PUBLIC_SUFFIX_LABELS and PUBLIC_SUFFIX_NODES, which the build generates
+// with public_suffix_compiler.
+#include "public_suffix_data.inc"
+
+std::string url_host(const std::string& url)
+{
+  size_t start = url.find("://");
+  start = start == std::string::npos ? 0 : start + 3;
+  size_t end = url.find_first_of("/?#", start);
+  if (end == std::string::npos) {
+    end = url.size();
+  }
+  // Drop userinfo and port.
+  size_t at = url.rfind('@', end);
+  if (at != std::string::npos && at >= start) {
+    start = at + 1;
+  }
+  size_t colon = url.find(':', start);
+  if (colon != std::string::npos && colon < end && url[start] != '[') {
+    end = colon;
+  }
+  std::string host = url.substr(start, end - start);
+  for (size_t i = 0; i < host.size(); i++) {
+    host[i] = std::tolower(static_cast<unsigned char>(host[i]));
+  }
+  return host;
+}
+
+namespace {
+
+// Node flags, as written by public_suffix_compiler.
+const uint32_t PUBLIC_SUFFIX_RULE = 1;
+const uint32_t PUBLIC_SUFFIX_EXCEPTION = 2;
+const uint32_t PUBLIC_SUFFIX_WILDCARD = 4;
+
+/**
+ * The child of node with the given label, or 0 if there is none.
+ */
+uint32_t find_child(uint32_t node, const char* label, size_t length)
+{
+  uint32_t low = PUBLIC_SUFFIX_NODES[node][1] >> 12;
+  uint32_t high = low + (PUBLIC_SUFFIX_NODES[node][1] & 0xfff);
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    uint32_t word = PUBLIC_SUFFIX_NODES[middle][0];
+    const char* child_label = PUBLIC_SUFFIX_LABELS + (word >> 9);
+    size_t child_length = (word >> 3) & 0x3f;
+    int order = memcmp(child_label, label, std::min(child_length, length));
+    if (order == 0) {
+      order = child_length < length ? -1 : child_length > length ? 1 : 0;
+    }
+    if (order == 0) {
+      return middle;
+    }
+    if (order < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return 0;
+}
+
+}  // namespace
+
+size_t public_suffix_length(const char* host, size_t length)
+{
+  // A trailing dot belongs to the suffix.
+  size_t end = length > 0 && host[length - 1] == '.' ? length - 1 : length;
+  size_t label_end = end;
+  size_t label_start = end;
+  while (label_start > 0 && host[label_start - 1] != '.') {
+    label_start--;
+  }
+  // Without a matching rule, the suffix is the last label.
+  size_t suffix_start = label_start;
+  uint32_t node = 0;
+  for (;;) {
+    if (PUBLIC_SUFFIX_NODES[node][0] & PUBLIC_SUFFIX_WILDCARD) {
+      suffix_start = label_start;
+    }
+    uint32_t child = find_child(node, host + label_start, label_end - label_start);
+    if (child == 0) {
+      break;
+    }
+    uint32_t flags = PUBLIC_SUFFIX_NODES[child][0];
+    if (flags & PUBLIC_SUFFIX_EXCEPTION) {
+      // Exceptions win, and leave out their leftmost label.
+      suffix_start = label_end + 1;
+      break;
+    }
+    if (flags & PUBLIC_SUFFIX_RULE) {
+      suffix_start = label_start;
+    }
+    if (label_start == 0) {
+      break;
+    }
+    node = child;
+    label_end = label_start - 1;
+    label_start = label_end;
+    while (label_start > 0 && host[label_start - 1] != '.') {
+      label_start--;
+    }
+  }
+  return length - suffix_start;
+}
+
+size_t registrable_domain_offset(const char* host, size_t length)
+{
+  // IPv4 addresses end in digits, IPv6 literals in a bracket, and top-level
+  // domains in neither.
+  size_t end = length > 0 && host[length - 1] == '.' ? length - 1 : length;
+  if (end == 0 || std::isdigit(static_cast<unsigned char>(host[end - 1])) || host[end - 1] == ']') {
+    return 0;
+  }
+  size_t suffix = public_suffix_length(host, length);
+  if (suffix + 1 >= length) {
+    return 0;
+  }
+  size_t start = length - suffix - 1;
+  while (start > 0 && host[start - 1] != '.') {
+    start--;
+  }
+  return start;
+}
+
+std::string registrable_domain(const std::string& host)
+{
+  return host.substr(registrable_domain_offset(host.data(), host.size()));
+}
+
+std::string url_site(const std::string& url)
+{
+  std::string host = url_host(url);
+  host.erase(0, registrable_domain_offset(host.data(), host.size()));
+  return host;
+}
@@ -0,0 +1,43 @@
+#ifndef URL_EXPANDER_HOST_H
+#define URL_EXPANDER_HOST_H
+
+#include <cstddef>
+#include <string>
+
+/**
+ * Extract the lowercased host from a url, which may omit the scheme.
+ * Connections, DNS entries and TLS sessions are keyed by this value.
+ */
+std::string url_host(const std::string& url);
+
+/**
+ * The length of the public suffix that host, lowercased as url_host returns
+ * it, ends with, according to the Public Suffix List compiled in, e.g. 5 for
+ * "a.b.cdn.example.co.uk" ("co.uk"). Hosts no rule matches end with a
+ * single-label suffix. The list includes its private section, so that e.g.
+ * the subdomains of github.io count as separate sites, as in browsers. Does
+ * not allocate.
+ */
+size_t public_suffix_length(const char* host, size_t length);
+
+/**
+ * Where the registrable domain (eTLD+1) of host starts, e.g. 8 for
+ * "a.b.cdn.example.co.uk" ("example.co.uk"). 0 for hosts that are a public
+ * suffix themselves or IP addresses. Does not allocate.
+ */
+size_t registrable_domain_offset(const char* host, size_t length);
+
+/**
+ * The registrable domain of host, or host itself if it has none.
+ */
+std::string registrable_domain(const std::string& host);
+
+/**
+ * The registrable domain of a url's host. Per-host state that is about the
+ * operator rather than the server, i.e. rate limits, learned timeouts and the
+ * fan-out client's lanes, is keyed by this value, so that it is not split
+ * across the many hostnames of e.g. a CDN.
+ */
+std::string url_site(const std::string& url);
+
+#endif
@@ -0,0 +1,257 @@
+#include "host_profiles.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+/**
+ * Redirects after which a host counts as a redirector, whose other responses
+ * may be interstitials.
+ */
+static const int REDIRECTOR_REDIRECTS = 3;
+
+/**
+ * Slow connects in a row after which a host is connected to over IPv4 only.
+ */
+static const int SLOW_CONNECTS = 2;
+
+/**
+ * Failures in a row over IPv4 after which IPv4 only is undone.
+ */
+static const int IPV4_FAILURES = 3;
+
+/**
+ * Responses without a redirect to wait before trying the browser User-Agent
+ * again after it did not help, doubling with every further miss up to
+ * 8 << MAX_BROWSER_MISSES.
+ */
+static const int BROWSER_RETRY_RESPONSES = 8;
+static const int MAX_BROWSER_MISSES = 10;
+
+HostProfiles::HostProfiles()
+  : slow_connect_us(250000)
+  , max_hosts(10000)
+  , retry_count(0)
+  , dirty(false)
+{
+}
+
+TransferStrategy HostProfiles::strategy(const std::string& host) const
+{
+  auto it = profiles.find(host);
+  return it == profiles.end() ? TransferStrategy() : it->second.strategy;
+}
+
+HostProfiles::Profile* HostProfiles::profile(const std::string& host)
+{
+  auto it = profiles.find(host);
+  if (it != profiles.end()) {
+    return &it->second;
+  }
+  if (profiles.size() >= max_hosts) {
+    // Make room by forgetting hosts that only redirected.
+    for (auto it = profiles.begin(); it != profiles.end();) {
+      const Profile& profile = it->second;
+      bool learned = profile.strategy.ipv4_only || profile.strategy.http1_only ||
+          profile.strategy.browser_user_agent || profile.browser_misses > 0;
+      it = learned ? std::next(it) : profiles.erase(it);
+    }
+    if (profiles.size() >= max_hosts) {
+      return NULL;
+    }
+  }
+  return &profiles[host];
+}
+
+bool HostProfiles::on_hop_complete(const std::string& host, const TransferStrategy& used,
+    const HopResponse& response)
+{
+  auto it = profiles.find(host);
+  Profile* profile = it == profiles.end() ? NULL : &it->second;
+  CURLcode code = response.code;
+  bool connected = code == CURLE_OK || response.connect_us >= 0;
+  if (profile != NULL && connected) {
+    profile->unreachable = false;
+  }
+
+  if (used.ipv4_only) {
+    if (profile != NULL && profile->strategy.ipv4_only) {
+      if (code == CURLE_COULDNT_RESOLVE_HOST || code == CURLE_COULDNT_CONNECT) {
+        if (!profile->ipv4_confirmed) {
+          profile->strategy.ipv4_only = false;
+          profile->unreachable = true;
+        } else if (++profile->ipv4_failures >= IPV4_FAILURES) {
+          // The host may have lost its IPv4 addresses.
+          profile->strategy.ipv4_only = false;
+          profile->ipv4_confirmed = false;
+          profile->ipv4_failures = 0;
+          dirty = true;
+        }
+        return false;
+      }
+      if (connected) {
+        profile->ipv4_failures = 0;
+        if (!profile->ipv4_confirmed) {
+          profile->ipv4_confirmed = true;
+          dirty = true;
+        }
+      }
+    }
+  } else if (response.ipv6 && code == CURLE_COULDNT_CONNECT) {
+    profile = this->profile(host);
+    if (profile != NULL && !profile->unreachable) {
+      profile->strategy.ipv4_only = true;
+      profile->slow_connects = 0;
+      return true;
+    }
+  } else if (response.ipv6 && response.connect_us >= slow_connect_us) {
+    profile = this->profile(host);
+    if (profile != NULL && ++profile->slow_connects >= SLOW_CONNECTS) {
+      profile->strategy.ipv4_only = true;
+      profile->slow_connects = 0;
+    }
+  } else if (response.connect_us >= 0 && profile != NULL) {
+    profile->slow_connects = 0;
+  }
+
+  bool http2_failed = code == CURLE_HTTP2 || code == CURLE_HTTP2_STREAM ||
+      (code == CURLE_OK && response.http2 && (response.status == 421 || response.status == 505));
+  if (!used.http1_only && http2_failed) {
+    profile = this->profile(host);
+    if (profile != NULL) {
+      profile->strategy.http1_only = true;
+      dirty = true;
+      return true;
+    }
+  }
+
+  if (code != CURLE_OK || is_throttled(response)) {
+    return false;
+  }
+  if (!response.redirect_url.empty()) {
+    if (profile == NULL) {
+      profile = this->profile(host);
+    }
+    if (profile != NULL) {
+      profile->redirects = std::min(profile->redirects + 1, REDIRECTOR_REDIRECTS);
+      if (profile->probing && used.browser_user_agent) {
+        profile->probing = false;
+        profile->browser_misses = 0;
+        dirty = true;
+      }
+    }
+    return false;
+  }
+  if (profile == NULL) {
+    return false;
+  }
+  if (profile->probing) {
+    if (used.browser_user_agent) {
+      profile->probing = false;
+      profile->strategy.browser_user_agent = false;
+      profile->browser_misses = std::min(profile->browser_misses + 1, MAX_BROWSER_MISSES);
+      profile->since_probe = 0;
+      dirty = true;
+    }
+    return false;
+  }
+  profile->since_probe++;
+  bool interstitial = response.status == 200 || response.status == 403;
+  if (interstitial && !used.browser_user_agent && !profile->strategy.browser_user_agent &&
+      profile->redirects >= REDIRECTOR_REDIRECTS &&
+      (profile->browser_misses == 0 ||
+          profile->since_probe >= BROWSER_RETRY_RESPONSES << (profile->browser_misses - 1))) {
+    profile->strategy.browser_user_agent = true;
+    profile->probing = true;
+    return true;
+  }
+  return false;
+}
+
+bool HostProfiles::load(const char* path)
+{
+  std::ifstream file(path);
+  if (!file) {
+    return false;
+  }
+  profiles.clear();
+  for (std::string line; std::getline(file, line);) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    std::string host;
+    int ipv4_only = 0;
+    int http1_only = 0;
+    int browser_user_agent = 0;
+    Profile profile;
+    if (!(fields >> host >> ipv4_only >> http1_only >> browser_user_agent >> profile.redirects >>
+        profile.browser_misses)) {
+      fprintf(stderr, "Skipping malformed host profile: %s\n", line.c_str());
+      continue;
+    }
+    if (profiles.size() >= max_hosts) {
+      break;
+    }
+    profile.strategy.ipv4_only = ipv4_only != 0;
+    profile.ipv4_confirmed = profile.strategy.ipv4_only;
+    profile.strategy.http1_only = http1_only != 0;
+    profile.strategy.browser_user_agent = browser_user_agent != 0;
+    profiles[host] = profile;
+  }
+  dirty = false;
+  return true;
+}
+
+bool HostProfiles::save(const char* path)
+{
+  std::string temporary_path = std::string(path) + ".tmp";
+  FILE* file = fopen(temporary_path.c_str(), "w");
+  if (file == NULL) {
+    return false;
+  }
+  fprintf(file, "# host ipv4_only http1_only browser_user_agent redirects browser_misses\n");
+  for (auto it = profiles.begin(); it != profiles.end(); ++it) {
+    const Profile& profile = it->second;
+    // Unconfirmed strategies are not saved yet.
+    bool ipv4_only = profile.strategy.ipv4_only && profile.ipv4_confirmed;
+    bool browser_user_agent = profile.strategy.browser_user_agent && !profile.probing;
+    fprintf(file, "%s %d %d %d %d %d\n", it->first.c_str(), ipv4_only,
+        profile.strategy.http1_only, browser_user_agent, profile.redirects, profile.browser_misses);
+  }
+  if (fclose(file) != 0 || rename(temporary_path.c_str(), path) != 0) {
+    remove(temporary_path.c_str());
+    return false;
+  }
+  dirty = false;
+  return true;
+}
+
+size_t HostProfiles::ipv4_only() const
+{
+  size_t count = 0;
+  for (auto it = profiles.begin(); it != profiles.end(); ++it) {
+    count += it->second.strategy.ipv4_only && it->second.ipv4_confirmed;
+  }
+  return count;
+}
+
+size_t HostProfiles::http1_only() const
+{
+  size_t count = 0;
+  for (auto it = profiles.begin(); it != profiles.end(); ++it) {
+    count += it->second.strategy.http1_only;
+  }
+  return count;
+}
+
+size_t HostProfiles::browser_user_agent() const
+{
+  size_t count = 0;
+  for (auto it = profiles.begin(); it != profiles.end(); ++it) {
+    count += it->second.strategy.browser_user_agent && !it->second.probing;
+  }
+  return count;
+}
@@ -0,0 +1,160 @@
+#ifndef URL_EXPANDER_HOST_PROFILES_H
+#define URL_EXPANDER_HOST_PROFILES_H
+
+#include "engine.h"
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Learns per host how to transfer hops to it, from the outcomes of hops that
+ * follow_redirects reports:
+ *   - IPv4 only, after a connect over IPv6 fails, or after two new
+ *     connections over IPv6 in a row take the slow connect time or longer.
+ *     It is kept once a connect over IPv4 succeeds. If IPv4 fails first, the
+ *     host is down rather than its IPv6, so the strategy is dropped and
+ *     IPv6 failures are not retried until the host connects again. IPv4
+ *     only is undone after three failures in a row over IPv4.
+ *   - HTTP/1.1 only, after an HTTP/2 framing or stream error, or a 421 or 505
+ *     over HTTP/2.
+ *   - A browser User-Agent, tried when a host that has redirected at least
+ *     three times answers a 200 or 403 without a redirect, as shorteners do
+ *     with interstitial pages for clients they do not recognize. Kept if the
+ *     retry redirects, and otherwise not tried again for 8 responses, twice
+ *     as many after every further miss.
+ * Failed connects over IPv6 and HTTP/2 errors retry the hop at once, as does
+ * trying the browser User-Agent.
+ *
+ * Profiles only exist for hosts that redirected or needed a strategy, up to
+ * a bound, and can be saved to and loaded from a file so that they outlive
+ * the process.
+ */
+class HostProfiles {
+ public:
+  HostProfiles();
+
+  /**
+   * The strategy for the next hop to host.
+   */
+  TransferStrategy strategy(const std::string& host) const;
+
+  /**
+   * Learn from a hop to host that was transferred with used. Returns whether
+   * the strategy changed in a way that makes retrying the hop worthwhile.
+   */
+  bool on_hop_complete(const std::string& host, const TransferStrategy& used, const HopResponse& response);
+
+  /**
+   * Count a hop that was retried for on_hop_complete.
+   */
+  void on_retried()
+  {
+    retry_count++;
+  }
+
+  /**
+   * New connections that take this long count as slow. Defaults to 250 ms,
+   * curl's Happy Eyeballs timeout.
+   */
+  void set_slow_connect(long long connect_us)
+  {
+    slow_connect_us = connect_us;
+  }
+
+  /**
+   * Keep profiles for at most this many hosts. Defaults to 10000.
+   */
+  void set_max_hosts(size_t max_hosts)
+  {
+    this->max_hosts = max_hosts;
+  }
+
+  /**
+   * Replace the profiles with those saved in path. Returns false if the file
+   * cannot be read, e.g. because it does not exist yet.
+   */
+  bool load(const char* path);
+
+  /**
+   * Save the profiles to path, replacing it atomically. Returns false if it
+   * cannot be written.
+   */
+  bool save(const char* path);
+
+  /**
+   * Whether a strategy changed since the profiles were last loaded or saved.
+   */
+  bool changed() const
+  {
+    return dirty;
+  }
+
+  size_t hosts() const
+  {
+    return profiles.size();
+  }
+
+  /**
+   * How many hosts have each part of their strategy set.
+   */
+  size_t ipv4_only() const;
+  size_t http1_only() const;
+  size_t browser_user_agent() const;
+
+  size_t retried() const
+  {
+    return retry_count;
+  }
+
+ private:
+  struct Profile {
+    TransferStrategy strategy;
+
+    /**
+     * Responses that redirected, up to the number that qualifies for the
+     * browser User-Agent.
+     */
+    int redirects = 0;
+
+    int slow_connects = 0;
+
+    /**
+     * Whether IPv4 only connected since it was set, which makes it part of
+     * the strategy that is saved, and failures since it last connected.
+     */
+    bool ipv4_confirmed = false;
+    int ipv4_failures = 0;
+
+    /**
+     * Whether connects failed over both address families since the host
+     * last connected.
+     */
+    bool unreachable = false;
+
+    /**
+     * Whether the browser User-Agent is being tried and not yet confirmed.
+     */
+    bool probing = false;
+
+    /**
+     * Times the browser User-Agent did not help, and responses without a
+     * redirect since it was last tried.
+     */
+    int browser_misses = 0;
+    int since_probe = 0;
+  };
+
+  /**
+   * The profile of host, created if there is room.
+   */
+  Profile* profile(const std::string& host);
+
+  std::unordered_map<std::string, Profile> profiles;
+  long long slow_connect_us;
+  size_t max_hosts;
+  size_t retry_count;
+  bool dirty;
+};
+
+#endif
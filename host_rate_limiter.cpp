@@ -0,0 +1,123 @@
+#include "host_rate_limiter.h"
+
+#include <algorithm>
+#include <iterator>
+
+/**
+ * How long a host that throttled without a Retry-After is left alone.
+ */
+static const long long DEFAULT_BLOCK_US = 1000000;
+
+/**
+ * Learned rates never go below this many requests per second.
+ */
+static const double MIN_LEARNED_RATE = 0.5;
+
+/**
+ * Drop all buckets that have no configured rate once there are this many.
+ */
+static const size_t MAX_HOSTS = 10000;
+
+HostRateLimiter::Bucket& HostRateLimiter::bucket(const std::string& host)
+{
+  auto it = buckets.find(host);
+  if (it != buckets.end()) {
+    return it->second;
+  }
+  if (buckets.size() >= MAX_HOSTS) {
+    for (auto stale = buckets.begin(); stale != buckets.end();) {
+      stale = stale->second.configured ? std::next(stale) : buckets.erase(stale);
+    }
+  }
+  Bucket& created = buckets[host];
+  created.rate = default_rate;
+  created.max_rate = default_rate;
+  created.tokens = std::max(default_rate, 1.0);
+  return created;
+}
+
+void HostRateLimiter::refill(Bucket& bucket, long long now_us)
+{
+  if (now_us <= bucket.refilled_us) {
+    return;
+  }
+  if (bucket.rate > 0) {
+    double burst = std::max(bucket.rate, 1.0);
+    bucket.tokens = std::min(burst, bucket.tokens + bucket.rate * (now_us - bucket.refilled_us) / 1e6);
+  }
+  bucket.refilled_us = now_us;
+}
+
+void HostRateLimiter::set_rate(const std::string& host, double per_second)
+{
+  Bucket& entry = bucket(host);
+  entry.rate = per_second;
+  entry.max_rate = per_second;
+  entry.configured = true;
+  entry.learned = false;
+  entry.tokens = std::max(per_second, 1.0);
+}
+
+long long HostRateLimiter::ready_us(const std::string& host, long long now_us)
+{
+  auto it = buckets.find(host);
+  if (it == buckets.end()) {
+    return now_us;
+  }
+  Bucket& entry = it->second;
+  refill(entry, now_us);
+  long long ready = entry.blocked_until_us;
+  if (entry.rate > 0 && entry.tokens < 1) {
+    ready = std::max(ready, now_us + static_cast<long long>((1 - entry.tokens) * 1e6 / entry.rate));
+  }
+  return ready;
+}
+
+void HostRateLimiter::on_request(const std::string& host, long long now_us)
+{
+  Bucket& entry = bucket(host);
+  refill(entry, now_us);
+  if (entry.rate > 0) {
+    entry.tokens--;
+  }
+  if (now_us - entry.window_start_us >= 1000000) {
+    entry.recent_rate = entry.window_requests * 1e6 / (now_us - entry.window_start_us);
+    entry.window_start_us = now_us;
+    entry.window_requests = 0;
+  }
+  entry.window_requests++;
+}
+
+void HostRateLimiter::on_response(const std::string& host)
+{
+  auto it = buckets.find(host);
+  if (it == buckets.end() || !it->second.learned) {
+    return;
+  }
+  Bucket& entry = it->second;
+  entry.rate += 1 / entry.rate;
+  if (entry.max_rate > 0 && entry.rate >= entry.max_rate) {
+    entry.rate = entry.max_rate;
+    entry.learned = false;
+  }
+}
+
+void HostRateLimiter::on_throttled(const std::string& host, long long retry_after_ms, long long now_us)
+{
+  throttled++;
+  Bucket& entry = bucket(host);
+  long long block_us = retry_after_ms >= 0 ? retry_after_ms * 1000 : DEFAULT_BLOCK_US;
+  entry.blocked_until_us = std::max(entry.blocked_until_us, now_us + block_us);
+  // The rate requests were sent at, over the last full window or the
+  // current one, whichever was faster.
+  long long elapsed_us = std::max(now_us - entry.window_start_us, 1LL);
+  double sent_rate = std::max(entry.recent_rate, entry.window_requests * 1e6 / std::max(elapsed_us, 1000000LL));
+  double learned = std::max(MIN_LEARNED_RATE, sent_rate / 2);
+  if (entry.rate == 0 || learned < entry.rate) {
+    entry.rate = learned;
+    entry.learned = true;
+  }
+  // One request may go once the block ends, and the rest at the new rate.
+  entry.tokens = 1;
+  entry.refilled_us = entry.blocked_until_us;
+}
@@ -0,0 +1,105 @@
+#ifndef URL_EXPANDER_HOST_RATE_LIMITER_H
+#define URL_EXPANDER_HOST_RATE_LIMITER_H
+
+#include <string>
+#include <unordered_map>
+
+/**
+ * Per-host token buckets that keep the expander from provoking throttling.
+ * Bulk runs send thousands of requests to the same shortener, which answers
+ * with 429s or temporary bans once they come too fast, wasting every request
+ * until the ban lifts.
+ *
+ * Hosts are unlimited unless a rate was configured for them or they
+ * throttled the expander. A host that throttles is blocked until its
+ * Retry-After has passed, or for a second if it gave none, and from then on
+ * limited to half the rate it was sent requests at, since that was too fast.
+ * Learned rates grow by about one request per second for every second of
+ * requests that go through, so they settle just below the host's limit.
+ */
+class HostRateLimiter {
+ public:
+  HostRateLimiter() : default_rate(0) {}
+
+  /**
+   * Limit hosts without a rate of their own to per_second requests, with
+   * bursts of up to a second's worth. 0, the default, leaves them unlimited
+   * until they throttle.
+   */
+  void set_default_rate(double per_second)
+  {
+    default_rate = per_second;
+  }
+
+  /**
+   * Limit host to per_second requests, or lift its limit if 0.
+   */
+  void set_rate(const std::string& host, double per_second);
+
+  /**
+   * When the next request to host may be sent, at or before now_us if it
+   * may be sent at once. now_us is a steady clock, as with all times here.
+   */
+  long long ready_us(const std::string& host, long long now_us);
+
+  /**
+   * Take a token for a request to host sent at now_us.
+   */
+  void on_request(const std::string& host, long long now_us);
+
+  /**
+   * Record a response from host that was not throttled.
+   */
+  void on_response(const std::string& host);
+
+  /**
+   * Record that host throttled a request, asking to retry after
+   * retry_after_ms, or -1 if it did not say.
+   */
+  void on_throttled(const std::string& host, long long retry_after_ms, long long now_us);
+
+  size_t throttled_count() const
+  {
+    return throttled;
+  }
+
+ private:
+  struct Bucket {
+    /**
+     * Requests per second, or 0 for no limit.
+     */
+    double rate = 0;
+
+    /**
+     * The configured rate, or the default one, which learned rates do not
+     * grow past. 0 for no limit.
+     */
+    double max_rate = 0;
+    bool configured = false;
+    bool learned = false;
+    double tokens = 0;
+    long long refilled_us = 0;
+    long long blocked_until_us = 0;
+
+    /**
+     * Requests sent since window_start_us, which starts over every second,
+     * and the rate of the last full window.
+     */
+    long long window_start_us = 0;
+    size_t window_requests = 0;
+    double recent_rate = 0;
+  };
+
+  Bucket& bucket(const std::string& host);
+
+  /**
+   * Add the tokens earned since the bucket was last refilled.
+   */
+  static void refill(Bucket& bucket, long long now_us);
+
+  double default_rate;
+  size_t throttled = 0;
+  std::unordered_map<std::string, Bucket> buckets;
+};
+
+#endif
@@ -1,9 +1,28 @@
 #include <aws/lambda-runtime/runtime.h>
 #include <aws/core/utils/json/JsonSerializer.h>
 #include <curl/curl.h>
+#include <openssl/ssl.h>
 
+#include "adaptive_policy.h"
+#include "clock.h"
+#include "engine.h"
+#include "head_client.h"
+#include "host.h"
+#include "host_profiles.h"
+#include "host_rate_limiter.h"
+#include "memory_governor.h"
+#include "request.h"
+#include "resource_governor.h"
+#include "retry_policy.h"
+#include "socket_profile.h"
+#include "tls_verify.h"
+#include "trace.h"
+
+#include <algorithm>
 #include <cstdlib>
+#include <random>
 #include <string>
+#include <thread>
 #include <vector>
 #include <iostream>
 
@@ -35,6 +54,29 @@ static CURL* curl;
  */
 static int max_connections = 500;
 
+/**
+ * Size in bytes of curl's receive buffer, or 0 to keep curl's default of 16
+ * KB. Overridable via BUFFER_SIZE env variable. There is one buffer per
+ * handle rather than per connection, so this barely moves the memory cost of
+ * the connection cache; bench/connection-footprint measures it.
+ */
+static long buffer_size = 0;
+
+/**
+ * Let OpenSSL free the read and write buffers of idle connections, which are
+ * most of the memory a cached TLS connection holds. Enabled by setting the
+ * TLS_RELEASE_BUFFERS env variable to 1.
+ */
+static bool tls_release_buffers = false;
+
+/**
+ * Options for the sockets of both clients. TCP_FAST_OPEN=1 enables TCP Fast
+ * Open, TCP_KEEPALIVE_IDLE overrides the seconds before keepalive probes, 0
+ * disabling them, and SOCKET_BUFFER_SIZE sets the send and receive buffer
+ * sizes in bytes.
+ */
+static SocketProfile socket_profile;
+
 /**
  * The maximum redirects curl should follow when the request does not override
  * this value. Overridable via DEFAULT_MAX_REDIRECTS env variable.
@@ -48,7 +90,268 @@ static long default_max_redirects = 5L;
 static long default_max_time_ms = 500L;
 
 /**
- * Expand the given URL. Returns true if the request completed without error.
+ * Records every hop of every expansion for offline replay. Enabled by setting
+ * the RECORD_TRACE env variable to the path of the trace file, and NULL
+ * otherwise.
+ */
+static TraceRecorder* recorder = NULL;
+
+/**
+ * Verifies peer certificates, caching successful verifications, when the
+ * TLS_VERIFY env variable is 1. NULL otherwise, in which case certificates
+ * are not verified, which saves CPU on every full handshake.
+ */
+static VerificationCache* verification_cache = NULL;
+
+/**
+ * CURLOPT_SSL_CTX_FUNCTION callback applying the TLS settings above to every
+ * new SSL context.
+ */
+static CURLcode configure_ssl_ctx(CURL* curl, void* ssl_ctx, void* userp)
+{
+  if (tls_release_buffers) {
+    SSL_CTX_set_mode(static_cast<SSL_CTX*>(ssl_ctx), SSL_MODE_RELEASE_BUFFERS);
+  }
+  if (verification_cache) {
+    verification_cache->install(static_cast<SSL_CTX*>(ssl_ctx));
+  }
+  return CURLE_OK;
+}
+
+/**
+ * The purpose-built HEAD client, sharing the curl handle for anything it does
+ * not handle itself. Used for every expansion when the HTTP_CLIENT env
+ * variable is "fast", and otherwise for requests that ask for it. Trace
+ * recording needs curl's header callback, so RECORD_TRACE disables it.
+ */
+static HeadClientTransport* head_client = NULL;
+static bool default_fast_client = false;
+
+/**
+ * Keeps the sockets of curl and head_client within the descriptor and local
+ * port limits.
+ */
+static ResourceGovernor resource_governor;
+
+/**
+ * curl's CURLOPT_MAXCONNECTS, which is lowered from max_connections while
+ * resource_governor runs short of descriptors.
+ */
+static long curl_max_connections = 0;
+
+/**
+ * Keeps caches, connections and batches within the memory limit, taken from
+ * MEMORY_LIMIT_MB if set and otherwise from Lambda's memory size or the
+ * cgroup.
+ */
+static MemoryGovernor memory_governor;
+
+/**
+ * Connections and handshakes of head_client, certificate verifications and
+ * connections the governor evicted or refused as of the last
+ * log_connection_stats.
+ */
+static size_t logged_connects = 0;
+static size_t logged_governed = 0;
+static size_t logged_memory_governed = 0;
+static size_t logged_handshakes = 0;
+static size_t logged_verifications = 0;
+
+/**
+ * Learns per host whether to connect over IPv4 only, avoid HTTP/2 or send a
+ * browser User-Agent. Loaded from HOST_PROFILES_FILE if it is set, and saved
+ * back to it on exit, and on Lambda after invocations that changed it, at
+ * most once a minute.
+ */
+static HostProfiles host_profiles;
+static const char* host_profiles_file = NULL;
+static long long host_profiles_saved_us = 0;
+static size_t logged_profile_retries = 0;
+
+/**
+ * Save host_profiles if they changed, unless they were saved within the last
+ * minute and force is not set.
+ */
+static void save_host_profiles(bool force)
+{
+  long long now = steady_now_us();
+  if (host_profiles_file == NULL || !host_profiles.changed() ||
+      (!force && now - host_profiles_saved_us < 60000000LL)) {
+    return;
+  }
+  host_profiles_saved_us = now;
+  if (!host_profiles.save(host_profiles_file)) {
+    fprintf(stderr, "Failed to save host profiles to %s\n", host_profiles_file);
+  }
+}
+
+/**
+ * Log what changed since the last call to stderr, which ends up in CloudWatch
+ * on Lambda:
+ *   - Descriptor and local port headroom, after new connections or ones
+ *     resource_governor evicted or refused.
+ *   - Memory usage, after memory_governor shrank caches or rejected urls.
+ *   - What host_profiles learned, after it retried hops.
+ *   - head_client's connects, Fast Open rate and failed attempts, after new
+ *     connections.
+ *   - TLS resumption and early data acceptance rates, and the hit rate of
+ *     verification_cache, after new handshakes or verifications.
+ */
+static void log_connection_stats()
+{
+  TlsStats stats;
+  ConnectStats connect_stats;
+  if (head_client != NULL) {
+    stats = head_client->tls_stats();
+    connect_stats = head_client->connect_stats();
+  }
+  size_t governed = resource_governor.evicted() + resource_governor.refused();
+  if (connect_stats.connects != logged_connects || governed != logged_governed) {
+    logged_governed = governed;
+    ResourceHeadroom headroom = resource_governor.headroom(steady_now_us());
+    fprintf(stderr, "Descriptors in use: %ld of %ld, local ports: %ld of %ld (%ld in TIME_WAIT), "
+        "connections evicted: %zu, refused: %zu\n", headroom.fds_in_use, headroom.fd_limit, headroom.ports_in_use,
+        headroom.port_limit, headroom.time_wait_sockets, resource_governor.evicted(), resource_governor.refused());
+  }
+  size_t memory_governed = memory_governor.shrunk() + memory_governor.refused();
+  if (memory_governed != logged_memory_governed) {
+    logged_memory_governed = memory_governed;
+    MemoryUsage usage = memory_governor.usage(steady_now_us());
+    fprintf(stderr, "Memory in use: %lld of %lld MB (resident %lld MB, caches %lld KB, connections %lld KB), "
+        "caches shrunk: %zu times, urls rejected: %zu\n", usage.in_use() >> 20, usage.limit >> 20,
+        usage.resident >> 20, usage.caches >> 10, usage.connections >> 10, memory_governor.shrunk(),
+        memory_governor.refused());
+  }
+  if (host_profiles.retried() != logged_profile_retries) {
+    logged_profile_retries = host_profiles.retried();
+    fprintf(stderr, "Host profiles: %zu hosts, IPv4 only: %zu, HTTP/1.1 only: %zu, browser user agent: %zu, "
+        "hops retried: %zu\n", host_profiles.hosts(), host_profiles.ipv4_only(), host_profiles.http1_only(),
+        host_profiles.browser_user_agent(), host_profiles.retried());
+  }
+  if (connect_stats.connects != logged_connects) {
+    logged_connects = connect_stats.connects;
+    fprintf(stderr, "TCP connects: %zu, fast open: %zu (%.1f%%), failed attempts: %zu\n", connect_stats.connects,
+        connect_stats.fast_open, 100.0 * connect_stats.fast_open / connect_stats.connects,
+        connect_stats.failed_attempts);
+  }
+  size_t verifications = verification_cache ? verification_cache->hits() + verification_cache->misses() : 0;
+  if (stats.handshakes == logged_handshakes && verifications == logged_verifications) {
+    return;
+  }
+  logged_handshakes = stats.handshakes;
+  logged_verifications = verifications;
+  fprintf(stderr, "TLS handshakes: %zu, resumed: %zu (%.1f%%), early data sent: %zu, accepted: %zu (%.1f%%)",
+      stats.handshakes, stats.resumed, stats.handshakes > 0 ? 100.0 * stats.resumed / stats.handshakes : 0.0,
+      stats.early_data_sent, stats.early_data_accepted,
+      stats.early_data_sent > 0 ? 100.0 * stats.early_data_accepted / stats.early_data_sent : 0.0);
+  if (verification_cache) {
+    fprintf(stderr, ", verification cache hits: %zu, misses: %zu", verification_cache->hits(),
+        verification_cache->misses());
+  }
+  fprintf(stderr, "\n");
+}
+
+/**
+ * Decides per-hop timeouts while following redirects. The same policy code
+ * runs in bench/network_simulator. Hops may use the whole remaining budget,
+ * or with ADAPTIVE_TIMEOUTS set to 1, about as long as their host usually
+ * takes.
+ */
+static ExpansionPolicy fixed_policy;
+static AdaptiveTimeoutPolicy adaptive_policy;
+static ExpansionPolicy* policy = &fixed_policy;
+
+/**
+ * Paces requests to hosts that throttle, or that HOST_RATE_LIMIT or
+ * HOST_RATE_LIMITS limit.
+ */
+static HostRateLimiter rate_limiter;
+
+/**
+ * Retries hops that failed or timed out on a stale connection, or failed at
+ * DNS, up to MAX_RETRIES (2 by default) per expansion, within its budget.
+ */
+static RetryPolicy retry_policy;
+
+/**
+ * Wait until rate_limiter lets a request go to host, a site as url_site
+ * returns it, unless that would take longer than max_wait_ms. Returns whether
+ * it does.
+ */
+static bool wait_for_host(const std::string& host, long max_wait_ms)
+{
+  long long now = steady_now_us();
+  long long wait_us = rate_limiter.ready_us(host, now) - now;
+  if (wait_us > max_wait_ms * 1000LL) {
+    return false;
+  }
+  if (wait_us > 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+  }
+  return true;
+}
+
+/**
+ * Close idle connections while resource_governor runs short of descriptors
+ * or memory_governor of memory: head_client's least recently used ones at
+ * once, and curl's by halving its cache size, which curl enforces as
+ * transfers end. The cache size is restored once there is headroom again. If
+ * closing head_client's connections does not free enough memory, its DNS and
+ * TLS session caches and the verification cache are emptied too.
+ */
+static void relieve_resource_pressure()
+{
+  long long now = steady_now_us();
+  long long cache_bytes = 0;
+  if (head_client != NULL) {
+    cache_bytes += head_client->cache_bytes();
+  }
+  if (verification_cache != NULL) {
+    cache_bytes += verification_cache->bytes();
+  }
+  memory_governor.set_tracked(cache_bytes, resource_governor.headroom(now).open_sockets);
+  long long memory_excess = memory_governor.excess(now);
+  long long connection_cost = memory_governor.connection_cost();
+  long excess = std::max(resource_governor.excess_connections(now),
+      static_cast<long>((memory_excess + connection_cost - 1) / connection_cost));
+  size_t evicted = 0;
+  if (excess > 0 && head_client != NULL) {
+    evicted = head_client->evict_idle(excess);
+    resource_governor.on_evicted(evicted);
+    excess -= evicted;
+  }
+  long limit = excess > 0 ? std::max(1L, curl_max_connections / 2) : max_connections;
+  bool shrunk = evicted > 0 || limit < curl_max_connections;
+  if (limit != curl_max_connections) {
+    curl_max_connections = limit;
+    curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, curl_max_connections);
+  }
+  if (memory_excess > static_cast<long long>(evicted) * connection_cost && cache_bytes > 0) {
+    if (head_client != NULL) {
+      head_client->clear_caches();
+    }
+    if (verification_cache != NULL) {
+      verification_cache->clear();
+    }
+    shrunk = true;
+  }
+  if (memory_excess > 0 && shrunk) {
+    memory_governor.on_shrunk();
+  }
+}
+
+/**
+ * Memory to reserve for the result of expanding url, which a batch keeps
+ * until it serializes the response, as a JSON object and then as text.
+ */
+static long long result_bytes(const std::string& url)
+{
+  return 1024 + 4 * static_cast<long long>(url.size());
+}
+
+/**
+ * Expand the given URL on the global curl handle. Returns CURLE_OK if the
+ * request completed without error.
  *
  * Output parameters
  *     output_url: The expanded URL, after following  redirects up to the
@@ -56,65 +359,57 @@ static long default_max_time_ms = 500L;
  *                 before it reaches max_redirects.
  *     reached_redirect_limit: True means that we do not know whether output_url has
  *                 further redirects.
+ *     retries: The number of failed hops that were retried.
  * Input parameters
  *     url: The URL to expand.
  *     max_time_ms: The total amount of time we are wlling to spend on the URL expansion.
  *     max_redirects: The maximum number of redirects we are willing to follow.
- * Returns the return value of curl_easy_perform. Will never return CURLE_TOO_MANY_REDIRECTS.
+ *     fast_client: Whether to use head_client rather than curl directly.
+ * Returns the return value of the first failed curl_easy_perform. Will never
+ * return CURLE_TOO_MANY_REDIRECTS.
  */
-CURLcode expand_url(std::string& output_url, bool& reached_redirect_limit, const char* url, long max_time_ms, long max_redirects) {
-  CURLcode res;
-  std::string output;
+CURLcode expand_url(std::string& output_url, bool& reached_redirect_limit, int& retries, const char* url,
+    long max_time_ms, long max_redirects, bool fast_client) {
+  CurlHopTransport curl_transport(curl);
+  HopTransport& transport = fast_client && head_client ? static_cast<HopTransport&>(*head_client) : curl_transport;
 
-  // Set request-specific options
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, max_time_ms);
-  if (max_redirects > 0) {
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(curl, CURLOPT_MAXREDIRS, max_redirects);
+  relieve_resource_pressure();
+  if (recorder) {
+    recorder->begin(url);
+  }
+  CURLcode res = follow_redirects(transport, *policy, output_url, reached_redirect_limit,
+      url, max_time_ms, max_redirects, &rate_limiter, &retry_policy, &retries, &host_profiles);
+  if (recorder) {
+    recorder->end(res);
   }
-
-  res = curl_easy_perform(curl);
-
-  // Restore request-specific options to defaults
-  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, max_time_ms);
-  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, max_time_ms);
-  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 0L);
-  curl_easy_setopt(curl, CURLOPT_MAXREDIRS, -1);
 
   if(res != CURLE_OK) {
     fprintf(stderr, "curl_easy_perform() failed: %d %s\n",
         res,
         curl_easy_strerror(res));
-    // We extract information when we reach the redirect limit but not the
-    // timeout limit, because we only know the original URL in that case.
-    if (res != CURLE_TOO_MANY_REDIRECTS) {
-      return res;
-    }
   }
+  return res;
+}
+
+/**
+ * Expand a single URL and pack the outcome into a JSON object using the output
+ * keys documented on expand_url_handler.
+ */
+static Aws::Utils::Json::JsonValue expand_url_to_json(const std::string& url, long max_time_ms, long max_redirects,
+    bool fast_client)
+{
+  // Output arguments
+  std::string expanded_url;
+  bool reached_redirect_limit;
+  int retries = 0;
+  auto before = Clock::now();
+  CURLcode res = expand_url(expanded_url, reached_redirect_limit, retries, url.c_str(), max_time_ms, max_redirects,
+      fast_client);
+  auto after = Clock::now();
+  auto duration = after - before;
 
-  // Extract URL.
-  // 1. We first check whether there is an additional redirect step because
-  //    we hit our limit and return that if there is one. In this scenario,
-  //    there could be additional hops but we do not know.
-  // 2. If there is no additional redirect, then we can be certain this is a
-  //    final URL.
-  char* extracted_url = NULL;
-  curl_easy_getinfo(curl, CURLINFO_REDIRECT_URL, &extracted_url);
-  if (extracted_url != NULL) {
-    output_url = extracted_url;
-    reached_redirect_limit = true;
-    return CURLE_OK;
-  }
-
-  curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &extracted_url);
-  if (extracted_url != NULL) {
-    output_url = extracted_url;
-    reached_redirect_limit = false;
-    return CURLE_OK;
-  }
-  // Arbitrary choice of error code here, but it's accurate enough to describe the problem.
-  return CURLE_FAILED_INIT;
+  return expansion_result_to_json(res, expanded_url, reached_redirect_limit,
+      std::chrono::duration_cast<std::chrono::milliseconds>(duration).count(), retries);
 }
 
 /**
@@ -123,23 +418,35 @@ CURLcode expand_url(std::string& output_url, bool& reached_redirect_limit, const
  *
  * Input keys:
  *     url: The initial url we want to expand / unshorten.
+ *     urls: Alternative to url. An array of urls to expand one after another
+ *           in this invocation, sharing its connection cache. Used by the
+ *           fan-out client to batch urls with the same host.
  *     max_time_ms: The maximum amount of time we want curl to spend on making
  *                  requests to expand the URL. This is best-effort, so callers
  *                  should set it but still timeout their lambda invocations
  *                  themselves. It is best-effort because even curl with
  *                  libc-ares sometimes fails to respect the timeout for DNS
- *                  queries.
+ *                  queries. Applies to each url of a batch separately.
  *     max_redirects: The maximum number of redirects curl should follow. This
  *                    should be set low enough to complete under the
  *                    max_time_ms for most urls because curl can still retrieve
  *                    the last url it followed when this is hit, while it
  *                    cannot do so on a timeout.
+ *     client: Optional. "fast" to use the purpose-built HEAD client, "curl"
+ *             to use curl only. Defaults to the HTTP_CLIENT env variable.
  * Output keys:
  *     error_code: Always present. This is set to 0 when the request finishes
  *                 successfully. Hitting a redirect limit is considered
  *                 success. In the case of failure, this is set to an integer
- *                 that corresponds to a CURLcode.
+ *                 that corresponds to a CURLcode. 22
+ *                 (CURLE_HTTP_RETURNED_ERROR) means that a host throttled the
+ *                 expansion, or would have kept it waiting for longer than
+ *                 max_time_ms. 27 (CURLE_OUT_OF_MEMORY) means that the
+ *                 expander was short of memory and did not try the url, which
+ *                 should be retried, e.g. in another invocation. The first url
+ *                 of an invocation is always tried.
  *     duration_ms: The amount of time the execution spent executing curl_easy_perform.
+ *     retries: Present iff failed hops were retried. The number of retries.
  *     expanded_url: Present iff error_code == 0. This is either the final URL
  *                   or the last URL we found before hitting the redirect limit.
  *     reached_redirect_limit: Present iff error_code == 0. True means that
@@ -148,73 +455,81 @@ CURLcode expand_url(std::string& output_url, bool& reached_redirect_limit, const
  *                             the redirect chain.
  *     error_message: Present iff error_code != 0. This is the string
  *                    description of the returned CURL error code.
+ *     results: Present instead of all the keys above iff urls was given. An
+ *              array with one object per input url, in input order. Each
+ *              object has the keys above plus url.
  */
 invocation_response expand_url_handler(invocation_request const& request)
 {
   using namespace Aws::Utils::Json;
-  // Validate request
-  JsonValue json(request.payload);
-  if (!json.WasParseSuccessful()) {
-    return invocation_response::failure("Failed to parse input JSON", "InvalidJSON");
-  }
-  auto v = json.View();
-  if (!v.ValueExists("url")) {
-    return invocation_response::failure("Missing URL argument", "InvalidJSON");
+  // Validate request and extract arguments
+  ExpansionRequest args;
+  std::string error = parse_request(request.payload, default_max_time_ms, default_max_redirects, args);
+  if (!error.empty()) {
+    return invocation_response::failure(error, "InvalidJSON");
   }
 
-  // Extract arguments
-  auto url = v.GetString("url");
-  long max_time_ms = default_max_time_ms;
-  int max_redirects = default_max_redirects;
-  if (v.ValueExists("max_time_ms")) {
-    max_time_ms = v.GetInt64("max_time_ms");
+  bool fast_client = args.client.empty() ? default_fast_client : args.client == "fast";
+  Aws::Utils::Array<JsonValue> results(args.urls.size());
+  // Expand the urls in order, except that those whose host throttled or is
+  // out of tokens wait while the others go ahead. Once only urls of such
+  // hosts are left, wait for the first host, unless that leaves too little
+  // time to expand its url, in which case the rest fail.
+  std::vector<size_t> waiting;
+  std::vector<std::string> hosts;
+  for (size_t i = 0; i < args.urls.size(); i++) {
+    waiting.push_back(i);
+    hosts.push_back(url_site(args.urls[i]));
   }
-  if (v.ValueExists("max_redirects")) {
-    max_redirects = v.GetInt64("max_redirects");
-  }
-
-  // Output arguments
-  std::string expanded_url;
-  bool reached_redirect_limit;
-  auto before = Clock::now();
-  CURLcode res = expand_url(expanded_url, reached_redirect_limit, url.c_str(), max_time_ms, max_redirects);
-  auto after = Clock::now();
-  auto duration = after - before;
-
-  // Construct response
-  JsonValue response;
-  response.WithInt64("duration_ms",
-      std::chrono::duration_cast<std::chrono::milliseconds>(duration).count());
-  if (res == CURLE_OK) {
-    response.WithInt64("error_code", 0);
-    response.WithString("expanded_url", expanded_url);
-    response.WithBool("reached_redirect_limit", reached_redirect_limit);
-  } else {
-    response.WithInt64("error_code", res);
-    response.WithString("error_message", curl_easy_strerror(res));
-  }
-
-  return invocation_response::success(response.View().WriteCompact(), "application/json");
-}
-
-/**
- * String split function that destroys its input. Only used for local testing.
- */
-static std::vector<std::string> split(std::string s, std::string delimiter = " ") {
-  std::vector<std::string> res;
-  size_t pos = 0;
-  std::string token;
-  while ((pos = s.find(delimiter)) != std::string::npos) {
-    token = s.substr(0, pos);
-    if (token.length() > 0) {
-      res.push_back(token);
+  // Urls are admitted one by one against the memory limit, after shrinking
+  // caches if need be. Once one does not fit, the rest of the batch is
+  // rejected as retryable rather than risk the whole invocation.
+  long long reserved = 0;
+  while (!waiting.empty()) {
+    long long now = steady_now_us();
+    long long first_ready = 0;
+    size_t next = waiting.size();
+    for (size_t i = 0; i < waiting.size() && next == waiting.size(); i++) {
+      long long ready = rate_limiter.ready_us(hosts[waiting[i]], now);
+      if (ready <= now) {
+        next = i;
+      } else if (i == 0 || ready < first_ready) {
+        first_ready = ready;
+      }
     }
-    s.erase(0, pos + delimiter.length());
-  }
-  if (s.length() > 0) {
-    res.push_back(s);
+    if (next == waiting.size()) {
+      long long wait_ms = (first_ready - now + 999) / 1000;
+      if (wait_ms > args.max_time_ms || wait_ms + args.max_time_ms > request.get_time_remaining().count()) {
+        for (size_t i = 0; i < waiting.size(); i++) {
+          results[waiting[i]] = expansion_result_to_json(CURLE_HTTP_RETURNED_ERROR, "", false, 0);
+        }
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+      continue;
+    }
+    size_t index = waiting[next];
+    long long bytes = result_bytes(args.urls[index]);
+    if (waiting.size() < args.urls.size() && !memory_governor.admit(bytes, now)) {
+      relieve_resource_pressure();
+      if (!memory_governor.admit(bytes, steady_now_us())) {
+        for (size_t i = 0; i < waiting.size(); i++) {
+          results[waiting[i]] = expansion_result_to_json(CURLE_OUT_OF_MEMORY, "", false, 0);
+        }
+        memory_governor.on_refused(waiting.size());
+        break;
+      }
+    }
+    memory_governor.reserve(bytes);
+    reserved += bytes;
+    waiting.erase(waiting.begin() + next);
+    results[index] = expand_url_to_json(args.urls[index], args.max_time_ms, args.max_redirects, fast_client);
   }
-  return res;
+  std::string response = serialize_response(args, std::move(results));
+  memory_governor.release(reserved);
+  log_connection_stats();
+  save_host_profiles(false);
+  return invocation_response::success(response, "application/json");
 }
 
 /**
@@ -242,6 +557,63 @@ int main()
   if (env_DEFAULT_MAX_REDIRECTS) {
     default_max_redirects = std::atoll(env_DEFAULT_MAX_REDIRECTS);
   }
+  const char* env_BUFFER_SIZE = std::getenv("BUFFER_SIZE");
+  if (env_BUFFER_SIZE) {
+    buffer_size = std::atol(env_BUFFER_SIZE);
+  }
+  const char* env_ADAPTIVE_TIMEOUTS = std::getenv("ADAPTIVE_TIMEOUTS");
+  if (env_ADAPTIVE_TIMEOUTS && std::string(env_ADAPTIVE_TIMEOUTS) == "1") {
+    policy = &adaptive_policy;
+  }
+  const char* env_MAX_RETRIES = std::getenv("MAX_RETRIES");
+  if (env_MAX_RETRIES) {
+    retry_policy.set_max_retries(std::atoi(env_MAX_RETRIES));
+  }
+  // Instances must not back off in lockstep.
+  retry_policy.seed(std::random_device()());
+  // Requests per second to allow per site, i.e. registrable domain, by default
+  // and for the sites of the hosts in HOST_RATE_LIMITS, e.g.
+  // "bit.ly=50,t.co=100". Sites that throttle are limited either way.
+  const char* env_HOST_RATE_LIMIT = std::getenv("HOST_RATE_LIMIT");
+  if (env_HOST_RATE_LIMIT) {
+    rate_limiter.set_default_rate(std::atof(env_HOST_RATE_LIMIT));
+  }
+  const char* env_HOST_RATE_LIMITS = std::getenv("HOST_RATE_LIMITS");
+  if (env_HOST_RATE_LIMITS) {
+    std::vector<std::string> limits = split(env_HOST_RATE_LIMITS, ",");
+    for (size_t i = 0; i < limits.size(); i++) {
+      size_t equals = limits[i].find('=');
+      if (equals == std::string::npos) {
+        fprintf(stderr, "Invalid HOST_RATE_LIMITS entry %s\n", limits[i].c_str());
+        exit(1);
+      }
+      rate_limiter.set_rate(registrable_domain(limits[i].substr(0, equals)), std::atof(limits[i].c_str() + equals + 1));
+    }
+  }
+  memory_governor.load_limit();
+  const char* env_MEMORY_LIMIT_MB = std::getenv("MEMORY_LIMIT_MB");
+  if (env_MEMORY_LIMIT_MB) {
+    memory_governor.set_limit(std::atoll(env_MEMORY_LIMIT_MB) * 1024 * 1024);
+  }
+  // Memory a kept-alive connection holds, as bench/connection-footprint
+  // measures it.
+  const char* env_CONNECTION_MEMORY_KB = std::getenv("CONNECTION_MEMORY_KB");
+  if (env_CONNECTION_MEMORY_KB) {
+    memory_governor.set_connection_bytes(std::atoll(env_CONNECTION_MEMORY_KB) * 1024);
+  }
+  const char* env_TCP_FAST_OPEN = std::getenv("TCP_FAST_OPEN");
+  socket_profile.fast_open = env_TCP_FAST_OPEN && std::string(env_TCP_FAST_OPEN) == "1";
+  const char* env_TCP_KEEPALIVE_IDLE = std::getenv("TCP_KEEPALIVE_IDLE");
+  if (env_TCP_KEEPALIVE_IDLE) {
+    socket_profile.keepalive_idle_s = std::atoi(env_TCP_KEEPALIVE_IDLE);
+  }
+  const char* env_SOCKET_BUFFER_SIZE = std::getenv("SOCKET_BUFFER_SIZE");
+  if (env_SOCKET_BUFFER_SIZE) {
+    socket_profile.send_buffer = std::atoi(env_SOCKET_BUFFER_SIZE);
+    socket_profile.receive_buffer = socket_profile.send_buffer;
+  }
+  const char* env_TLS_RELEASE_BUFFERS = std::getenv("TLS_RELEASE_BUFFERS");
+  tls_release_buffers = env_TLS_RELEASE_BUFFERS && std::string(env_TLS_RELEASE_BUFFERS) == "1";
 
   // Initialize curl
   CURLcode res = curl_global_init(CURL_GLOBAL_ALL);
@@ -255,9 +627,22 @@ int main()
     exit(1);
   }
 
-  // Ignore SSL errors. Equivalent to --insecure.
-  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+  // Ignore SSL errors unless TLS_VERIFY is 1. Equivalent to --insecure.
+  // Verification uses the CA bundle in TLS_CA_FILE, or curl's default, which
+  // curl 7.87 and later load once and keep for a day.
+  const char* env_TLS_VERIFY = std::getenv("TLS_VERIFY");
+  const char* env_TLS_CA_FILE = std::getenv("TLS_CA_FILE");
+  if (env_TLS_VERIFY && std::string(env_TLS_VERIFY) == "1") {
+    verification_cache = new VerificationCache();
+    const char* env_TLS_VERIFY_CACHE = std::getenv("TLS_VERIFY_CACHE");
+    verification_cache->set_enabled(!env_TLS_VERIFY_CACHE || std::string(env_TLS_VERIFY_CACHE) != "0");
+    if (env_TLS_CA_FILE) {
+      curl_easy_setopt(curl, CURLOPT_CAINFO, env_TLS_CA_FILE);
+    }
+  } else {
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+  }
 
   // Use HEAD request
   curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
@@ -266,14 +651,107 @@ int main()
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, do_nothing);
 
   // Increase connection cache
-  curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, max_connections);
+  curl_max_connections = max_connections;
+  curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, curl_max_connections);
+
+  // Count sockets against the descriptor limit, raised to the hard limit, and
+  // the local port range.
+  resource_governor.load_limits(true);
+  curl_easy_setopt(curl, CURLOPT_OPENSOCKETFUNCTION, curl_open_socket_callback);
+  curl_easy_setopt(curl, CURLOPT_OPENSOCKETDATA, &resource_governor);
+  curl_easy_setopt(curl, CURLOPT_CLOSESOCKETFUNCTION, curl_close_socket_callback);
+  curl_easy_setopt(curl, CURLOPT_CLOSESOCKETDATA, &resource_governor);
+
+  curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, curl_socket_profile_callback);
+  curl_easy_setopt(curl, CURLOPT_SOCKOPTDATA, &socket_profile);
+
+  // How long to wait for a connection attempt before also trying the next
+  // address, CONNECT_ATTEMPT_DELAY_MS. curl only races the second address
+  // family this way, the head client every address.
+  const char* env_CONNECT_ATTEMPT_DELAY_MS = std::getenv("CONNECT_ATTEMPT_DELAY_MS");
+  long connect_attempt_delay_ms = env_CONNECT_ATTEMPT_DELAY_MS ? std::atol(env_CONNECT_ATTEMPT_DELAY_MS) : 250;
+  curl_easy_setopt(curl, CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS, connect_attempt_delay_ms);
+
+  if (buffer_size > 0) {
+    curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, buffer_size);
+  }
+  curl_easy_setopt(curl, CURLOPT_SSL_CTX_FUNCTION, configure_ssl_ctx);
+
+  // Cap the TLS version when TLS_MAX_VERSION is set to 1.2, e.g. to compare
+  // the memory and handshake cost of TLS 1.2 and 1.3 sessions.
+  const char* env_TLS_MAX_VERSION = std::getenv("TLS_MAX_VERSION");
+  bool max_tls_1_2 = env_TLS_MAX_VERSION && std::string(env_TLS_MAX_VERSION) == "1.2";
+  if (max_tls_1_2) {
+    curl_easy_setopt(curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_MAX_TLSv1_2);
+  }
+
+  // Send all connections to a local stand-in such as bench/replay_server
+  // when CONNECT_TO is set, e.g. to "::127.0.0.1:8080". The format is that of
+  // curl's --connect-to option.
+  const char* env_CONNECT_TO = std::getenv("CONNECT_TO");
+  struct curl_slist* connect_to = NULL;
+  if (env_CONNECT_TO) {
+    connect_to = curl_slist_append(connect_to, env_CONNECT_TO);
+    curl_easy_setopt(curl, CURLOPT_CONNECT_TO, connect_to);
+  }
+
+  const char* env_RECORD_TRACE = std::getenv("RECORD_TRACE");
+  if (env_RECORD_TRACE) {
+    recorder = TraceRecorder::open(curl, env_RECORD_TRACE);
+    if (!recorder) {
+      fprintf(stderr, "Failed to open trace file %s\n", env_RECORD_TRACE);
+      exit(1);
+    }
+  } else {
+    head_client = new HeadClientTransport(curl, max_connections, env_CONNECT_TO);
+    if (verification_cache) {
+      // The head client keeps one SSL context, so the bundle is loaded once.
+      const char* ca_file = env_TLS_CA_FILE;
+#if LIBCURL_VERSION_NUM >= 0x075400
+      if (ca_file == NULL) {
+        curl_easy_getinfo(curl, CURLINFO_CAINFO, &ca_file);
+      }
+#endif
+      SSL_CTX* ssl_ctx = head_client->ssl_context();
+      if ((ca_file ? SSL_CTX_load_verify_locations(ssl_ctx, ca_file, NULL) :
+          SSL_CTX_set_default_verify_paths(ssl_ctx)) != 1) {
+        fprintf(stderr, "Failed to load the CA bundle %s\n", ca_file ? ca_file : "");
+        exit(1);
+      }
+    }
+    configure_ssl_ctx(curl, head_client->ssl_context(), NULL);
+    head_client->set_socket_profile(socket_profile);
+    head_client->set_attempt_delay(connect_attempt_delay_ms * 1000LL);
+    head_client->set_resource_governor(&resource_governor);
+    if (max_tls_1_2) {
+      SSL_CTX_set_max_proto_version(head_client->ssl_context(), TLS1_2_VERSION);
+    }
+    // Session resumption is on unless TLS_SESSION_CACHE is 0. TLS_EARLY_DATA
+    // set to 1 also sends requests as 0-RTT data on resumed connections.
+    const char* env_TLS_SESSION_CACHE = std::getenv("TLS_SESSION_CACHE");
+    const char* env_TLS_EARLY_DATA = std::getenv("TLS_EARLY_DATA");
+    head_client->set_session_cache(!env_TLS_SESSION_CACHE || std::string(env_TLS_SESSION_CACHE) != "0");
+    head_client->set_early_data(env_TLS_EARLY_DATA && std::string(env_TLS_EARLY_DATA) == "1");
+  }
+  // Connects that take longer than the attempt delay mean that curl's first
+  // address family lost the race.
+  host_profiles.set_slow_connect(connect_attempt_delay_ms * 1000LL);
+  host_profiles_file = std::getenv("HOST_PROFILES_FILE");
+  if (host_profiles_file && host_profiles.load(host_profiles_file)) {
+    fprintf(stderr, "Loaded %zu host profiles from %s\n", host_profiles.hosts(), host_profiles_file);
+  }
+  const char* env_HTTP_CLIENT = std::getenv("HTTP_CLIENT");
+  default_fast_client = env_HTTP_CLIENT && std::string(env_HTTP_CLIENT) == "fast";
 
   // Check if we are running in Lambda
   bool is_lambda = std::getenv("AWS_LAMBDA_FUNCTION_NAME") != NULL;
   if (is_lambda) {
     run_handler(expand_url_handler);
   } else {
-    // Read commands from stdin when running locally, and output times
+    // Read commands from stdin when running locally, and output times. Flush
+    // each result as soon as it is known, so drivers such as
+    // bench/load-generator can time them.
+    setvbuf(stdout, NULL, _IOLBF, 0);
     for (std::string line; std::getline(std::cin, line);) {
       std::vector<std::string> parts = split(line);
       if (parts.size() == 0) {
@@ -290,21 +768,38 @@ int main()
       }
       std::string expanded_url;
       bool reached_redirect_limit;
+      int retries = 0;
       auto before = Clock::now();
-      CURLcode res = expand_url(expanded_url, reached_redirect_limit, url, max_time_ms, max_redirects);
+      // URLs are expanded as they come in, so a throttled host is waited for
+      // rather than deferred.
+      CURLcode res = CURLE_HTTP_RETURNED_ERROR;
+      if (wait_for_host(url_site(url), max_time_ms)) {
+        res = expand_url(expanded_url, reached_redirect_limit, retries, url, max_time_ms, max_redirects,
+            default_fast_client);
+      }
       auto after = Clock::now();
+      char retried[32] = "";
+      if (retries > 0) {
+        snprintf(retried, sizeof(retried), " after %d retries", retries);
+      }
       if (res == CURLE_OK) {
-        printf("URL '%s': %s completed in %ld ms\n", url, expanded_url.c_str(),
-            std::chrono::duration_cast<std::chrono::milliseconds>(after - before).count());
+        printf("URL '%s': %s completed in %ld ms%s\n", url, expanded_url.c_str(),
+            std::chrono::duration_cast<std::chrono::milliseconds>(after - before).count(), retried);
       } else {
-        fprintf(stderr, "URL '%s': An error occurred while calling curl: %d %s. Error detected in %ld ms\n",
+        fprintf(stderr, "URL '%s': An error occurred while calling curl: %d %s. Error detected in %ld ms%s\n",
             url, res, curl_easy_strerror(res),
-            std::chrono::duration_cast<std::chrono::milliseconds>(after - before).count());
+            std::chrono::duration_cast<std::chrono::milliseconds>(after - before).count(), retried);
       }
     }
+    log_connection_stats();
+    save_host_profiles(true);
   }
   // Cleanup curl
+  delete head_client;
+  delete recorder;
+  delete verification_cache;
   curl_easy_cleanup(curl);
+  curl_slist_free_all(connect_to);
   curl_global_cleanup();
   return 0;
 }
@@ -0,0 +1,159 @@
+#include "memory_governor.h"
+
+#include <malloc.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+/**
+ * The reserve is this fraction of the limit.
+ */
+static const long long RESERVE_DIVISOR = 10;
+
+static const long long DEFAULT_CONNECTION_BYTES = 40 * 1024;
+
+/**
+ * cgroup v1 reports no limit as a number near 2^63.
+ */
+static const long long UNLIMITED_BYTES = 1LL << 60;
+
+/**
+ * The limit in the given cgroup file, or 0 if it is missing or unlimited.
+ */
+static long long read_cgroup_limit(const std::string& path)
+{
+  FILE* file = fopen(path.c_str(), "r");
+  if (file == NULL) {
+    return 0;
+  }
+  long long bytes = 0;
+  if (fscanf(file, "%lld", &bytes) != 1 || bytes >= UNLIMITED_BYTES) {
+    bytes = 0;
+  }
+  fclose(file);
+  return bytes;
+}
+
+/**
+ * The memory limit of the cgroup the process is in, from memory.max on
+ * cgroup v2 or memory.limit_in_bytes on v1, or 0.
+ */
+static long long cgroup_limit()
+{
+  FILE* cgroups = fopen("/proc/self/cgroup", "r");
+  if (cgroups == NULL) {
+    return 0;
+  }
+  long long bytes = 0;
+  char line[4096];
+  while (bytes == 0 && fgets(line, sizeof(line), cgroups) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    // Lines are "ID:CONTROLLERS:PATH", with no controllers on v2.
+    const char* controllers = strchr(line, ':');
+    const char* path = controllers ? strchr(controllers + 1, ':') : NULL;
+    if (path == NULL) {
+      continue;
+    }
+    std::string names(controllers + 1, path);
+    if (names.empty()) {
+      bytes = read_cgroup_limit(std::string("/sys/fs/cgroup") + (path + 1) + "/memory.max");
+    } else if (("," + names + ",").find(",memory,") != std::string::npos) {
+      bytes = read_cgroup_limit(std::string("/sys/fs/cgroup/memory") + (path + 1) + "/memory.limit_in_bytes");
+      if (bytes == 0) {
+        // Containers usually see their own cgroup as the root.
+        bytes = read_cgroup_limit("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+      }
+    }
+  }
+  fclose(cgroups);
+  return bytes;
+}
+
+MemoryGovernor::MemoryGovernor()
+  : limit(0)
+  , memory_reserve(0)
+  , connection_bytes(DEFAULT_CONNECTION_BYTES)
+  , cache_bytes(0)
+  , connection_count(0)
+  , reserved(0)
+  , resident(0)
+  , read_us(0)
+  , refusals(0)
+  , shrinks(0)
+{
+}
+
+void MemoryGovernor::load_limit()
+{
+  const char* lambda_mb = std::getenv("AWS_LAMBDA_FUNCTION_MEMORY_SIZE");
+  set_limit(lambda_mb ? std::atoll(lambda_mb) * 1024 * 1024 : cgroup_limit());
+}
+
+void MemoryGovernor::set_limit(long long bytes)
+{
+  limit = bytes;
+  memory_reserve = bytes / RESERVE_DIVISOR;
+  read_us = 0;
+}
+
+void MemoryGovernor::set_tracked(long long cache_bytes, long connections)
+{
+  this->cache_bytes = cache_bytes;
+  connection_count = connections;
+}
+
+void MemoryGovernor::refresh(long long now_us)
+{
+  if (limit == 0 || (read_us != 0 && now_us - read_us < 10000)) {
+    return;
+  }
+  read_us = now_us;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL) {
+    return;
+  }
+  long long pages = 0;
+  long long resident_pages = 0;
+  if (fscanf(statm, "%lld %lld", &pages, &resident_pages) == 2) {
+    resident = resident_pages * sysconf(_SC_PAGESIZE);
+  }
+  fclose(statm);
+}
+
+MemoryUsage MemoryGovernor::usage(long long now_us)
+{
+  refresh(now_us);
+  MemoryUsage usage;
+  usage.limit = limit;
+  usage.resident = resident;
+  usage.caches = cache_bytes;
+  usage.connections = connection_count * connection_bytes;
+  usage.in_flight = reserved;
+  return usage;
+}
+
+bool MemoryGovernor::admit(long long bytes, long long now_us)
+{
+  return limit == 0 || usage(now_us).available() - bytes >= memory_reserve;
+}
+
+long long MemoryGovernor::excess(long long now_us)
+{
+  if (limit == 0) {
+    return 0;
+  }
+  long long available = usage(now_us).available();
+  return available < 2 * memory_reserve ? 2 * memory_reserve - available : 0;
+}
+
+void MemoryGovernor::on_shrunk()
+{
+  shrinks++;
+  // glibc keeps freed memory for reuse, where it still counts as resident.
+  malloc_trim(0);
+  read_us = 0;
+}
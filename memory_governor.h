@@ -0,0 +1,150 @@
+#ifndef URL_EXPANDER_MEMORY_GOVERNOR_H
+#define URL_EXPANDER_MEMORY_GOVERNOR_H
+
+#include <cstddef>
+
+/**
+ * Where the process's memory goes, in bytes. A limit of 0 means unlimited.
+ */
+struct MemoryUsage {
+  long long limit = 0;
+
+  /**
+   * Resident set size, as of the last time it was read.
+   */
+  long long resident = 0;
+
+  /**
+   * Estimates of what caches and kept-alive connections hold. They are part
+   * of resident, and what shrinking caches can give back.
+   */
+  long long caches = 0;
+  long long connections = 0;
+
+  /**
+   * Reserved for buffers that are still to be allocated, such as the
+   * serialized response of a batch.
+   */
+  long long in_flight = 0;
+
+  long long in_use() const
+  {
+    long long tracked = caches + connections;
+    return (resident > tracked ? resident : tracked) + in_flight;
+  }
+
+  long long available() const
+  {
+    return limit - in_use();
+  }
+};
+
+/**
+ * Keeps the expander within its memory limit. Lambda kills a function that
+ * goes over its memory size and fails the whole invocation, batch and all,
+ * while caches and connections that grew over many invocations can be given
+ * back, and urls that do not fit can be retried elsewhere.
+ *
+ * Usage is the resident set size, read from /proc/self/statm at most every
+ * 10 ms, or the caches and connections callers report if they estimate more,
+ * plus reservations for buffers about to be allocated. Like ResourceGovernor,
+ * the last tenth of the limit is a reserve that work is only admitted outside
+ * of, and within twice the reserve, callers should shrink their caches.
+ */
+class MemoryGovernor {
+ public:
+  MemoryGovernor();
+
+  /**
+   * Read the limit from AWS_LAMBDA_FUNCTION_MEMORY_SIZE on Lambda, and
+   * otherwise from the cgroup, if the process is in one with a limit.
+   */
+  void load_limit();
+
+  void set_limit(long long bytes);
+
+  /**
+   * Bytes a kept-alive connection is estimated to hold. Defaults to 40 KB, as
+   * measured with bench/connection-footprint.
+   */
+  void set_connection_bytes(long long bytes)
+  {
+    connection_bytes = bytes > 0 ? bytes : 1;
+  }
+
+  long long connection_cost() const
+  {
+    return connection_bytes;
+  }
+
+  /**
+   * Report the current size of caches and the number of kept-alive
+   * connections.
+   */
+  void set_tracked(long long cache_bytes, long connections);
+
+  void reserve(long long bytes)
+  {
+    reserved += bytes;
+  }
+
+  void release(long long bytes)
+  {
+    reserved -= bytes;
+  }
+
+  /**
+   * Whether bytes more can be allocated now without going into the reserve.
+   */
+  bool admit(long long bytes, long long now_us);
+
+  /**
+   * Count work that was turned away because admit refused it.
+   */
+  void on_refused(size_t count)
+  {
+    refusals += count;
+  }
+
+  /**
+   * How many bytes callers should free to get out of memory pressure.
+   */
+  long long excess(long long now_us);
+
+  /**
+   * Count a round of shrinking for excess, after which the resident set size
+   * is read again and freed heap memory returned to the kernel.
+   */
+  void on_shrunk();
+
+  MemoryUsage usage(long long now_us);
+
+  size_t refused() const
+  {
+    return refusals;
+  }
+
+  size_t shrunk() const
+  {
+    return shrinks;
+  }
+
+ private:
+  /**
+   * Read the resident set size, at most every 10 ms.
+   */
+  void refresh(long long now_us);
+
+  long long limit;
+  long long memory_reserve;
+  long long connection_bytes;
+  long long cache_bytes;
+  long connection_count;
+  long long reserved;
+  long long resident;
+  long long read_us;
+  size_t refusals;
+  size_t shrinks;
+};
+
+#endif
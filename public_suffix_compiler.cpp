@@ -0,0 +1,293 @@
+/**
+ * Compiles the Public Suffix List into the packed trie that host.cpp looks
+ * up registrable domains in. Run by the build, not shipped.
+ *
+ * Usage: public-suffix-compiler public_suffix_list.dat public_suffix_data.inc
+ *
+ * Rules are stored by their labels from right to left, so a lookup walks a
+ * host's labels from its end. Each node is two 32-bit words:
+ *
+ *     label offset << 9 | label length << 3 | flags
+ *     first child << 12 | child count
+ *
+ * where the labels are in one string pool and the children of a node are
+ * consecutive and sorted bytewise, for a binary search. The flags mark nodes
+ * that end a rule, that end an exception rule ("!"), and that have a
+ * wildcard child ("*."), which the list only has as the leftmost label.
+ * Rules with non-ASCII labels are also stored in their Punycode form, in
+ * which hosts usually appear in urls.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+
+const uint32_t RULE = 1;
+const uint32_t EXCEPTION = 2;
+const uint32_t WILDCARD = 4;
+
+const size_t MAX_LABEL_OFFSET = 1 << 23;
+const size_t MAX_LABEL_LENGTH = 63;
+const size_t MAX_FIRST_CHILD = 1 << 20;
+const size_t MAX_CHILD_COUNT = (1 << 12) - 1;
+
+struct TrieNode {
+  uint32_t flags = 0;
+  std::map<std::string, TrieNode> children;
+};
+
+void fail(const std::string& message)
+{
+  fprintf(stderr, "%s\n", message.c_str());
+  exit(1);
+}
+
+/**
+ * Decode UTF-8 into code points.
+ */
+std::vector<uint32_t> decode_utf8(const std::string& s)
+{
+  std::vector<uint32_t> code_points;
+  for (size_t i = 0; i < s.size();) {
+    unsigned char c = s[i];
+    int length = c < 0x80 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+    uint32_t code_point = length == 1 ? c : c & (0x7f >> length);
+    if (i + length > s.size()) {
+      fail("Invalid UTF-8 in rule label " + s);
+    }
+    for (int j = 1; j < length; j++) {
+      code_point = code_point << 6 | (static_cast<unsigned char>(s[i + j]) & 0x3f);
+    }
+    code_points.push_back(code_point);
+    i += length;
+  }
+  return code_points;
+}
+
+/**
+ * The Punycode encoding of a label, as in RFC 3492, with the "xn--" prefix.
+ */
+std::string punycode(const std::string& label)
+{
+  const uint32_t base = 36, t_min = 1, t_max = 26, skew = 38, damp = 700;
+  std::vector<uint32_t> input = decode_utf8(label);
+  std::string output;
+  for (size_t i = 0; i < input.size(); i++) {
+    if (input[i] < 0x80) {
+      output.push_back(static_cast<char>(input[i]));
+    }
+  }
+  size_t basic = output.size();
+  size_t handled = basic;
+  if (basic > 0) {
+    output.push_back('-');
+  }
+  uint32_t n = 0x80;
+  uint32_t delta = 0;
+  uint32_t bias = 72;
+  auto digit = [](uint32_t d) {
+    return static_cast<char>(d < 26 ? 'a' + d : '0' + d - 26);
+  };
+  while (handled < input.size()) {
+    uint32_t m = UINT32_MAX;
+    for (size_t i = 0; i < input.size(); i++) {
+      if (input[i] >= n && input[i] < m) {
+        m = input[i];
+      }
+    }
+    delta += (m - n) * static_cast<uint32_t>(handled + 1);
+    n = m;
+    for (size_t i = 0; i < input.size(); i++) {
+      if (input[i] < n) {
+        delta++;
+      }
+      if (input[i] != n) {
+        continue;
+      }
+      uint32_t q = delta;
+      for (uint32_t k = base;; k += base) {
+        uint32_t t = k <= bias ? t_min : k >= bias + t_max ? t_max : k - bias;
+        if (q < t) {
+          break;
+        }
+        output.push_back(digit(t + (q - t) % (base - t)));
+        q = (q - t) / (base - t);
+      }
+      output.push_back(digit(q));
+      // Adapt the bias.
+      delta = handled == basic ? delta / damp : delta / 2;
+      delta += delta / static_cast<uint32_t>(handled + 1);
+      uint32_t k = 0;
+      for (; delta > ((base - t_min) * t_max) / 2; k += base) {
+        delta /= base - t_min;
+      }
+      bias = k + (base - t_min + 1) * delta / (delta + skew);
+      delta = 0;
+      handled++;
+    }
+    delta++;
+    n++;
+  }
+  return "xn--" + output;
+}
+
+std::vector<std::string> split_labels(const std::string& rule)
+{
+  std::vector<std::string> labels;
+  size_t start = 0;
+  for (;;) {
+    size_t dot = rule.find('.', start);
+    labels.push_back(rule.substr(start, dot == std::string::npos ? std::string::npos : dot - start));
+    if (dot == std::string::npos) {
+      return labels;
+    }
+    start = dot + 1;
+  }
+}
+
+void insert(TrieNode& root, const std::vector<std::string>& labels, bool exception)
+{
+  bool wildcard = labels[0] == "*";
+  TrieNode* node = &root;
+  for (size_t i = labels.size(); i-- > (wildcard ? 1 : 0);) {
+    if (labels[i].empty() || labels[i] == "*" || labels[i].size() > MAX_LABEL_LENGTH) {
+      fail("Unsupported rule label '" + labels[i] + "'");
+    }
+    node = &node->children[labels[i]];
+  }
+  node->flags |= wildcard ? WILDCARD : exception ? EXCEPTION : RULE;
+}
+
+/**
+ * Append s to out as the body of a C string literal.
+ */
+void append_escaped(std::string& out, const std::string& s)
+{
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\' || c == '?') {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\%03o", c);
+      out += escaped;
+    } else {
+      out.push_back(static_cast<char>(c));
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s public_suffix_list.dat public_suffix_data.inc\n", argv[0]);
+    return 1;
+  }
+  std::ifstream input(argv[1]);
+  if (!input) {
+    fail(std::string("Failed to open ") + argv[1]);
+  }
+  TrieNode root;
+  size_t rules = 0;
+  for (std::string line; std::getline(input, line);) {
+    // A rule is the first word of a line, and comments start with "//".
+    size_t end = line.find_first_of(" \t\r");
+    std::string rule = line.substr(0, end);
+    if (rule.empty() || rule.compare(0, 2, "//") == 0) {
+      continue;
+    }
+    bool exception = rule[0] == '!';
+    std::vector<std::string> labels = split_labels(exception ? rule.substr(1) : rule);
+    insert(root, labels, exception);
+    bool ascii = true;
+    for (size_t i = 0; i < labels.size(); i++) {
+      for (size_t j = 0; j < labels[i].size(); j++) {
+        if (static_cast<unsigned char>(labels[i][j]) >= 0x80) {
+          ascii = false;
+          labels[i] = punycode(labels[i]);
+          break;
+        }
+      }
+    }
+    if (!ascii) {
+      insert(root, labels, exception);
+    }
+    rules++;
+  }
+
+  // Number nodes breadth first, so that the children of a node are
+  // consecutive, in the map's bytewise order.
+  std::vector<const TrieNode*> nodes(1, &root);
+  std::vector<std::string> node_labels(1);
+  std::vector<uint32_t> first_child(1);
+  for (size_t i = 0; i < nodes.size(); i++) {
+    first_child[i] = static_cast<uint32_t>(nodes.size());
+    for (auto it = nodes[i]->children.begin(); it != nodes[i]->children.end(); ++it) {
+      nodes.push_back(&it->second);
+      node_labels.push_back(it->first);
+      first_child.push_back(0);
+    }
+    if (nodes[i]->children.size() > MAX_CHILD_COUNT) {
+      fail("Too many children under " + node_labels[i]);
+    }
+  }
+  if (nodes.size() > MAX_FIRST_CHILD) {
+    fail("Too many nodes");
+  }
+
+  // Longer labels go into the pool first, so that shorter ones can point
+  // into them, e.g. "co" into "com".
+  std::vector<std::string> by_length(node_labels.begin() + 1, node_labels.end());
+  std::stable_sort(by_length.begin(), by_length.end(), [](const std::string& a, const std::string& b) {
+    return a.size() > b.size();
+  });
+  std::string pool;
+  std::map<std::string, size_t> pool_offsets;
+  for (size_t i = 0; i < by_length.size(); i++) {
+    if (pool_offsets.count(by_length[i]) == 0) {
+      size_t offset = pool.find(by_length[i]);
+      if (offset == std::string::npos) {
+        offset = pool.size();
+        pool += by_length[i];
+      }
+      pool_offsets[by_length[i]] = offset;
+    }
+  }
+  if (pool.size() >= MAX_LABEL_OFFSET) {
+    fail("Label pool too large");
+  }
+  std::string node_words;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    size_t offset = i == 0 ? 0 : pool_offsets[node_labels[i]];
+    uint32_t label = static_cast<uint32_t>(offset) << 9 |
+        static_cast<uint32_t>(node_labels[i].size()) << 3 | nodes[i]->flags;
+    uint32_t children = first_child[i] << 12 | static_cast<uint32_t>(nodes[i]->children.size());
+    char words[32];
+    snprintf(words, sizeof(words), "{%uu, %uu},", label, children);
+    node_words += words;
+    node_words += i % 4 == 3 ? "\n" : " ";
+  }
+
+  FILE* out = fopen(argv[2], "w");
+  if (out == NULL) {
+    fail(std::string("Failed to open ") + argv[2]);
+  }
+  fprintf(out, "// Generated by public-suffix-compiler from %zu rules. Do not edit.\n\n", rules);
+  fprintf(out, "static const char PUBLIC_SUFFIX_LABELS[] =\n%s", pool.empty() ? "    \"\";\n" : "");
+  for (size_t i = 0; i < pool.size(); i += 96) {
+    std::string chunk;
+    append_escaped(chunk, pool.substr(i, 96));
+    fprintf(out, "    \"%s\"%s\n", chunk.c_str(), i + 96 >= pool.size() ? ";" : "");
+  }
+  fprintf(out, "\nstatic const uint32_t PUBLIC_SUFFIX_NODES[][2] = {\n%s};\n", node_words.c_str());
+  if (fclose(out) != 0) {
+    fail(std::string("Failed to write ") + argv[2]);
+  }
+  return 0;
+}
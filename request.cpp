@@ -0,0 +1,97 @@
+#include "request.h"
+
+using namespace Aws::Utils::Json;
+
+std::string parse_request(const std::string& payload, long default_max_time_ms,
+    long default_max_redirects, ExpansionRequest& request)
+{
+  JsonValue json(payload);
+  if (!json.WasParseSuccessful()) {
+    return "Failed to parse input JSON";
+  }
+  auto v = json.View();
+  request.is_batch = v.ValueExists("urls");
+  if (!v.ValueExists("url") && !request.is_batch) {
+    return "Missing URL argument";
+  }
+  if (request.is_batch && !v.GetObject("urls").IsListType()) {
+    return "urls must be an array";
+  }
+
+  request.max_time_ms = default_max_time_ms;
+  request.max_redirects = default_max_redirects;
+  if (v.ValueExists("max_time_ms")) {
+    request.max_time_ms = v.GetInt64("max_time_ms");
+  }
+  if (v.ValueExists("max_redirects")) {
+    request.max_redirects = v.GetInt64("max_redirects");
+  }
+  request.client.clear();
+  if (v.ValueExists("client")) {
+    request.client = v.GetString("client");
+    if (request.client != "fast" && request.client != "curl") {
+      return "client must be \"fast\" or \"curl\"";
+    }
+  }
+
+  request.urls.clear();
+  if (!request.is_batch) {
+    request.urls.push_back(v.GetString("url"));
+    return "";
+  }
+  auto urls = v.GetArray("urls");
+  request.urls.reserve(urls.GetLength());
+  for (size_t i = 0; i < urls.GetLength(); i++) {
+    request.urls.push_back(urls[i].AsString());
+  }
+  return "";
+}
+
+JsonValue expansion_result_to_json(CURLcode res, const std::string& expanded_url,
+    bool reached_redirect_limit, long long duration_ms, int retries)
+{
+  JsonValue response;
+  response.WithInt64("duration_ms", duration_ms);
+  if (retries > 0) {
+    response.WithInteger("retries", retries);
+  }
+  if (res == CURLE_OK) {
+    response.WithInt64("error_code", 0);
+    response.WithString("expanded_url", expanded_url);
+    response.WithBool("reached_redirect_limit", reached_redirect_limit);
+  } else {
+    response.WithInt64("error_code", res);
+    response.WithString("error_message", curl_easy_strerror(res));
+  }
+  return response;
+}
+
+std::string serialize_response(const ExpansionRequest& request, Aws::Utils::Array<JsonValue>&& results)
+{
+  if (!request.is_batch) {
+    return results[0].View().WriteCompact();
+  }
+  for (size_t i = 0; i < results.GetLength(); i++) {
+    results[i].WithString("url", request.urls[i]);
+  }
+  JsonValue response;
+  response.WithArray("results", std::move(results));
+  return response.View().WriteCompact();
+}
+
+std::vector<std::string> split(std::string s, std::string delimiter) {
+  std::vector<std::string> res;
+  size_t pos = 0;
+  std::string token;
+  while ((pos = s.find(delimiter)) != std::string::npos) {
+    token = s.substr(0, pos);
+    if (token.length() > 0) {
+      res.push_back(token);
+    }
+    s.erase(0, pos + delimiter.length());
+  }
+  if (s.length() > 0) {
+    res.push_back(s);
+  }
+  return res;
+}
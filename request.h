@@ -0,0 +1,57 @@
+#ifndef URL_EXPANDER_REQUEST_H
+#define URL_EXPANDER_REQUEST_H
+
+#include <aws/core/utils/json/JsonSerializer.h>
+#include <curl/curl.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * Arguments of one invocation, unpacked from the request JSON. The keys are
+ * documented on expand_url_handler.
+ */
+struct ExpansionRequest {
+  std::vector<std::string> urls;
+
+  /**
+   * True iff the request used the urls key rather than url.
+   */
+  bool is_batch = false;
+
+  long max_time_ms = 0;
+  long max_redirects = 0;
+
+  /**
+   * "fast" or "curl", or empty to use the configured default.
+   */
+  std::string client;
+};
+
+/**
+ * Unpack a request payload into request, using the given defaults for
+ * optional keys. Returns an empty string on success, or a description of why
+ * the payload is invalid.
+ */
+std::string parse_request(const std::string& payload, long default_max_time_ms,
+    long default_max_redirects, ExpansionRequest& request);
+
+/**
+ * Pack the outcome of one expansion into a JSON object with the output keys
+ * documented on expand_url_handler.
+ */
+Aws::Utils::Json::JsonValue expansion_result_to_json(CURLcode res, const std::string& expanded_url,
+    bool reached_redirect_limit, long long duration_ms, int retries = 0);
+
+/**
+ * Serialize the response to request given one result per url, in order.
+ */
+std::string serialize_response(const ExpansionRequest& request,
+    Aws::Utils::Array<Aws::Utils::Json::JsonValue>&& results);
+
+/**
+ * String split function that destroys its input. Only used for local testing.
+ */
+std::vector<std::string> split(std::string s, std::string delimiter = " ");
+
+#endif
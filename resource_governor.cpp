@@ -0,0 +1,174 @@
+#include "resource_governor.h"
+#include "clock.h"
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+
+/**
+ * The kernel's default net.ipv4.ip_local_port_range, 32768 to 60999.
+ */
+static const long DEFAULT_PORT_LIMIT = 28232;
+
+/**
+ * The reserve is this fraction of a limit, and at least MIN_RESERVE.
+ */
+static const long RESERVE_DIVISOR = 10;
+static const long MIN_RESERVE = 16;
+
+static long reserve_for(long limit)
+{
+  return limit > 0 ? std::max(MIN_RESERVE, limit / RESERVE_DIVISOR) : 0;
+}
+
+ResourceGovernor::ResourceGovernor()
+  : fd_limit(0)
+  , port_limit(0)
+  , fd_reserve(0)
+  , port_reserve(0)
+  , open_sockets(0)
+  , other_fds(0)
+  , counted_us(0)
+  , refusals(0)
+  , evictions(0)
+{
+  std::fill(closed, closed + TIME_WAIT_SECONDS, 0);
+  std::fill(closed_second, closed_second + TIME_WAIT_SECONDS, -1);
+}
+
+void ResourceGovernor::load_limits(bool raise_fd_limit)
+{
+  long fds = 0;
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    if (raise_fd_limit && limit.rlim_cur < limit.rlim_max) {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+      getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (limit.rlim_cur != RLIM_INFINITY) {
+      fds = static_cast<long>(limit.rlim_cur);
+    }
+  }
+  long ports = DEFAULT_PORT_LIMIT;
+  FILE* range = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+  if (range != NULL) {
+    long low = 0;
+    long high = 0;
+    if (fscanf(range, "%ld %ld", &low, &high) == 2 && high >= low) {
+      ports = high - low + 1;
+    }
+    fclose(range);
+  }
+  set_limits(fds, ports);
+}
+
+void ResourceGovernor::set_limits(long fd_limit, long port_limit)
+{
+  this->fd_limit = fd_limit;
+  this->port_limit = port_limit;
+  fd_reserve = reserve_for(fd_limit);
+  port_reserve = reserve_for(port_limit);
+  counted_us = 0;
+}
+
+void ResourceGovernor::on_socket_open()
+{
+  open_sockets++;
+}
+
+void ResourceGovernor::on_socket_close(long long now_us)
+{
+  open_sockets--;
+  long long second = now_us / 1000000;
+  int slot = static_cast<int>(second % TIME_WAIT_SECONDS);
+  if (closed_second[slot] != second) {
+    closed_second[slot] = second;
+    closed[slot] = 0;
+  }
+  closed[slot]++;
+}
+
+long ResourceGovernor::time_wait(long long now_us) const
+{
+  long long second = now_us / 1000000;
+  long sockets = 0;
+  for (int i = 0; i < TIME_WAIT_SECONDS; i++) {
+    if (closed_second[i] > second - TIME_WAIT_SECONDS) {
+      sockets += closed[i];
+    }
+  }
+  return sockets;
+}
+
+void ResourceGovernor::refresh(long long now_us)
+{
+  if (fd_limit == 0 || (counted_us != 0 && now_us - counted_us < 1000000)) {
+    return;
+  }
+  counted_us = now_us;
+  DIR* dir = opendir("/proc/self/fd");
+  if (dir == NULL) {
+    return;
+  }
+  long fds = 0;
+  while (readdir(dir) != NULL) {
+    fds++;
+  }
+  closedir(dir);
+  // Less ".", ".." and the directory's own descriptor.
+  other_fds = std::max(0L, fds - 3 - open_sockets);
+}
+
+ResourceHeadroom ResourceGovernor::headroom(long long now_us)
+{
+  refresh(now_us);
+  ResourceHeadroom headroom;
+  headroom.fd_limit = fd_limit;
+  headroom.fds_in_use = other_fds + open_sockets;
+  headroom.port_limit = port_limit;
+  headroom.time_wait_sockets = time_wait(now_us);
+  headroom.ports_in_use = open_sockets + headroom.time_wait_sockets;
+  headroom.open_sockets = open_sockets;
+  return headroom;
+}
+
+bool ResourceGovernor::admit(long sockets, long long now_us)
+{
+  ResourceHeadroom current = headroom(now_us);
+  return (fd_limit == 0 || current.fds() - sockets >= fd_reserve) &&
+      (port_limit == 0 || current.ports() - sockets >= port_reserve);
+}
+
+long ResourceGovernor::excess_connections(long long now_us)
+{
+  if (fd_limit == 0) {
+    return 0;
+  }
+  long fds = headroom(now_us).fds();
+  return fds < 2 * fd_reserve ? 2 * fd_reserve - fds : 0;
+}
+
+curl_socket_t curl_open_socket_callback(void* governor, curlsocktype purpose, struct curl_sockaddr* address)
+{
+  ResourceGovernor* resources = static_cast<ResourceGovernor*>(governor);
+  if (!resources->admit(1, steady_now_us())) {
+    resources->on_refused();
+    return CURL_SOCKET_BAD;
+  }
+  curl_socket_t fd = socket(address->family, address->socktype, address->protocol);
+  if (fd != CURL_SOCKET_BAD) {
+    resources->on_socket_open();
+  }
+  return fd;
+}
+
+int curl_close_socket_callback(void* governor, curl_socket_t fd)
+{
+  static_cast<ResourceGovernor*>(governor)->on_socket_close(steady_now_us());
+  return close(fd);
+}
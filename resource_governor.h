@@ -0,0 +1,148 @@
+#ifndef URL_EXPANDER_RESOURCE_GOVERNOR_H
+#define URL_EXPANDER_RESOURCE_GOVERNOR_H
+
+#include <curl/curl.h>
+
+#include <cstddef>
+
+/**
+ * How close the process is to running out of file descriptors or local
+ * ports. Limits of 0 mean unlimited.
+ */
+struct ResourceHeadroom {
+  long fd_limit = 0;
+  long fds_in_use = 0;
+  long port_limit = 0;
+  long ports_in_use = 0;
+  long open_sockets = 0;
+  long time_wait_sockets = 0;
+
+  long fds() const
+  {
+    return fd_limit - fds_in_use;
+  }
+
+  long ports() const
+  {
+    return port_limit - ports_in_use;
+  }
+};
+
+/**
+ * Keeps connection caches and concurrency within the process's file
+ * descriptors and local ports. Running out of either fails every connect at
+ * once, so expansions would fail in bursts instead of slowing down. Lambda
+ * allows 1024 descriptors, which two connection caches of 500 on top of
+ * in-flight transfers and racing connection attempts can use up.
+ *
+ * Sockets are counted as they are opened and closed, and the process's other
+ * descriptors by listing /proc/self/fd once a second. Local ports are in use
+ * by open sockets and, for a minute after we close them, by sockets in
+ * TIME_WAIT. That overestimates, since Linux shares a local port between
+ * connections to different servers, but the expander sends most of its
+ * traffic to a few shorteners.
+ *
+ * The last tenth of each limit, and at least 16, is a reserve. New
+ * connections are only admitted outside of it, and once descriptors come
+ * within twice the reserve, callers should close idle cached connections.
+ * Closing does not free ports, which stay in TIME_WAIT, so port pressure only
+ * limits admission.
+ */
+class ResourceGovernor {
+ public:
+  ResourceGovernor();
+
+  /**
+   * Read the limits from RLIMIT_NOFILE and net.ipv4.ip_local_port_range,
+   * first raising the soft descriptor limit to the hard one if raise_fd_limit
+   * is set.
+   */
+  void load_limits(bool raise_fd_limit);
+
+  void set_limits(long fd_limit, long port_limit);
+
+  void on_socket_open();
+  void on_socket_close(long long now_us);
+
+  /**
+   * Whether that many more sockets can be opened now without going into the
+   * reserve.
+   */
+  bool admit(long sockets, long long now_us);
+
+  /**
+   * Count a connection that was not opened because admit refused it.
+   */
+  void on_refused()
+  {
+    refusals++;
+  }
+
+  /**
+   * How many idle cached connections to close to get out of descriptor
+   * pressure.
+   */
+  long excess_connections(long long now_us);
+
+  /**
+   * Count connections that were closed for excess_connections.
+   */
+  void on_evicted(size_t connections)
+  {
+    evictions += connections;
+  }
+
+  ResourceHeadroom headroom(long long now_us);
+
+  size_t refused() const
+  {
+    return refusals;
+  }
+
+  size_t evicted() const
+  {
+    return evictions;
+  }
+
+ private:
+  static const int TIME_WAIT_SECONDS = 60;
+
+  /**
+   * Recount the descriptors that are not our sockets, at most once a second.
+   */
+  void refresh(long long now_us);
+  long time_wait(long long now_us) const;
+
+  long fd_limit;
+  long port_limit;
+  long fd_reserve;
+  long port_reserve;
+  long open_sockets;
+  long other_fds;
+  long long counted_us;
+
+  /**
+   * Sockets closed per second over the last TIME_WAIT_SECONDS, in a ring
+   * indexed by the second.
+   */
+  long closed[TIME_WAIT_SECONDS];
+  long long closed_second[TIME_WAIT_SECONDS];
+
+  size_t refusals;
+  size_t evictions;
+};
+
+/**
+ * CURLOPT_OPENSOCKETFUNCTION callback counting sockets of the
+ * ResourceGovernor passed as CURLOPT_OPENSOCKETDATA, and failing the
+ * connection attempt if the governor does not admit it.
+ */
+curl_socket_t curl_open_socket_callback(void* governor, curlsocktype purpose, struct curl_sockaddr* address);
+
+/**
+ * CURLOPT_CLOSESOCKETFUNCTION callback to go with curl_open_socket_callback,
+ * with the governor passed as CURLOPT_CLOSESOCKETDATA.
+ */
+int curl_close_socket_callback(void* governor, curl_socket_t fd);
+
+#endif
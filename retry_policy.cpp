@@ -0,0 +1,38 @@
+#include "retry_policy.h"
+
+#include <algorithm>
+
+bool RetryPolicy::is_retryable(CURLcode code, bool reused, bool timeout_capped)
+{
+  switch (code) {
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+      return reused;
+    case CURLE_OPERATION_TIMEDOUT:
+      return reused || timeout_capped;
+    case CURLE_COULDNT_RESOLVE_HOST:
+      return true;
+    default:
+      return false;
+  }
+}
+
+long long RetryPolicy::retry_delay_us(const HopResponse& response, int retries, long long remaining_us,
+    bool timeout_capped)
+{
+  if (!allows_retry(retries, remaining_us) ||
+      !is_retryable(response.code, response.reused_connection, timeout_capped)) {
+    return -1;
+  }
+  // A closed or silent connection is no reason to wait.
+  long long delay_us = 0;
+  if (response.code == CURLE_COULDNT_RESOLVE_HOST) {
+    long long backoff_us = std::min(max_delay_us, base_delay_us << std::min(retries, 20));
+    delay_us = std::uniform_int_distribution<long long>(0, backoff_us)(rng);
+  }
+  if (!allows_retry(retries, remaining_us - delay_us)) {
+    return -1;
+  }
+  return delay_us;
+}
@@ -0,0 +1,104 @@
+#ifndef URL_EXPANDER_RETRY_POLICY_H
+#define URL_EXPANDER_RETRY_POLICY_H
+
+#include "engine.h"
+
+#include <cstdint>
+#include <random>
+
+/**
+ * Decides which failed hops follow_redirects retries within the expansion's
+ * budget, instead of returning the error to a caller that would have to
+ * invoke the lambda again.
+ *
+ * Only failures that say nothing about the URL are retried:
+ *   - Send and receive errors and empty responses on a reused connection,
+ *     which the server most likely closed while it sat in the cache. These
+ *     are retried at once, on a new connection. On a new connection they
+ *     mean the server or the network failed, and are not retried.
+ *   - Timeouts on a reused connection, which most likely went silent, e.g.
+ *     because a NAT dropped it, and timeouts of hops whose timeout was
+ *     shorter than the budget that was left, as with AdaptiveTimeoutPolicy.
+ *     These are retried at once, on a new connection. A hop that was given
+ *     the whole budget on a new connection used up the time of a retry.
+ *   - Failed DNS lookups, which resolvers answer when they time out as well
+ *     as when the name does not exist. These are retried after an
+ *     exponential backoff with full jitter, so that the lambdas of a
+ *     fan-out do not retry in lockstep.
+ */
+class RetryPolicy {
+ public:
+  /**
+   * Retry up to max_retries hops per expansion. 0 disables retries.
+   */
+  explicit RetryPolicy(int max_retries = 2)
+    : max_retries(max_retries), base_delay_us(20000), max_delay_us(500000), min_attempt_us(50000)
+  {
+  }
+
+  /**
+   * How long to wait before retrying a hop that failed with response, after
+   * retries retries of the expansion, with remaining_us of its budget left.
+   * timeout_capped tells whether the hop's timeout was shorter than the
+   * budget that was left when it started. Returns -1 to give up, which it
+   * does when a retry would not start with min_attempt_us of the budget left.
+   */
+  long long retry_delay_us(const HopResponse& response, int retries, long long remaining_us,
+      bool timeout_capped = false);
+
+  /**
+   * Whether there is another retry left after retries retries, with
+   * remaining_us of the budget left.
+   */
+  bool allows_retry(int retries, long long remaining_us) const
+  {
+    return retries < max_retries && remaining_us >= min_attempt_us;
+  }
+
+  /**
+   * Whether a hop that failed with code is worth retrying. reused tells
+   * whether it failed on a reused connection, and timeout_capped whether
+   * its timeout was shorter than the budget that was left.
+   */
+  static bool is_retryable(CURLcode code, bool reused, bool timeout_capped = false);
+
+  void set_max_retries(int max_retries)
+  {
+    this->max_retries = max_retries;
+  }
+
+  /**
+   * Backoffs start at base_delay_us (20 ms) and double with every retry up
+   * to max_delay_us (500 ms), of which a uniformly random part is waited.
+   */
+  void set_backoff(long long base_delay_us, long long max_delay_us)
+  {
+    this->base_delay_us = base_delay_us;
+    this->max_delay_us = max_delay_us;
+  }
+
+  /**
+   * Retries need at least this much of the budget left. 50 ms by default.
+   */
+  void set_min_attempt(long long min_attempt_us)
+  {
+    this->min_attempt_us = min_attempt_us;
+  }
+
+  /**
+   * Seed the jitter, for reproducible simulations.
+   */
+  void seed(uint64_t seed)
+  {
+    rng.seed(seed);
+  }
+
+ private:
+  int max_retries;
+  long long base_delay_us;
+  long long max_delay_us;
+  long long min_attempt_us;
+  std::mt19937_64 rng;
+};
+
+#endif
@@ -0,0 +1,50 @@
+#include "socket_profile.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+void apply_socket_profile(int fd, const SocketProfile& profile)
+{
+  int one = 1;
+  if (profile.no_delay) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  if (profile.fast_open) {
+    // connect() then returns at once, and the first write goes out with the
+    // SYN.
+    setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+  }
+  if (profile.keepalive_idle_s > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &profile.keepalive_idle_s, sizeof(profile.keepalive_idle_s));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &profile.keepalive_interval_s,
+        sizeof(profile.keepalive_interval_s));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &profile.keepalive_count, sizeof(profile.keepalive_count));
+  }
+  if (profile.send_buffer > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &profile.send_buffer, sizeof(profile.send_buffer));
+  }
+  if (profile.receive_buffer > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &profile.receive_buffer, sizeof(profile.receive_buffer));
+  }
+}
+
+bool used_fast_open(int fd)
+{
+  struct tcp_info info;
+  socklen_t length = sizeof(info);
+  return getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0 && (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+}
+
+int curl_socket_profile_callback(void* profile, curl_socket_t fd, curlsocktype purpose)
+{
+  if (purpose == CURLSOCKTYPE_IPCXN) {
+    apply_socket_profile(fd, *static_cast<const SocketProfile*>(profile));
+  }
+  return CURL_SOCKOPT_OK;
+}
@@ -0,0 +1,66 @@
+#ifndef URL_EXPANDER_SOCKET_PROFILE_H
+#define URL_EXPANDER_SOCKET_PROFILE_H
+
+#include <curl/curl.h>
+
+/**
+ * Socket options for connections to shorteners, which exchange a request
+ * and a response head of a few hundred bytes each and then sit idle in the
+ * connection cache until the host comes up again. Applied to curl's sockets
+ * through CURLOPT_SOCKOPTFUNCTION and to the fast client's directly, before
+ * they connect.
+ */
+struct SocketProfile {
+  /**
+   * Send the first data, i.e. the TLS ClientHello or the HTTP request, in
+   * the SYN with TCP Fast Open. The kernel only does so for servers it has a
+   * cookie from, and otherwise connects as usual and asks for a cookie, so
+   * only the first connection to a server pays the round trip. Needs Linux
+   * 4.11 and the client bit (1) of net.ipv4.tcp_fastopen, which is set by
+   * default.
+   */
+  bool fast_open = false;
+
+  /**
+   * Disable Nagle's algorithm, so small writes are not held back.
+   */
+  bool no_delay = true;
+
+  /**
+   * Send keepalive probes after keepalive_idle_s seconds without traffic,
+   * every keepalive_interval_s seconds, giving up after keepalive_count
+   * unanswered probes, so NATs and load balancers do not drop cached
+   * connections while they are idle. 0 disables keepalive.
+   */
+  int keepalive_idle_s = 60;
+  int keepalive_interval_s = 20;
+  int keepalive_count = 3;
+
+  /**
+   * Socket send and receive buffer sizes in bytes, or 0 for the kernel's
+   * defaults. A header-only exchange fits in a few KB, while the kernel
+   * starts at 16 KB for sending and 128 KB for receiving.
+   */
+  int send_buffer = 0;
+  int receive_buffer = 0;
+};
+
+/**
+ * Apply profile to fd, a TCP socket that is not connected yet. Options the
+ * kernel does not support are skipped.
+ */
+void apply_socket_profile(int fd, const SocketProfile& profile);
+
+/**
+ * Whether the connection on fd sent data in its SYN that the server
+ * accepted.
+ */
+bool used_fast_open(int fd);
+
+/**
+ * CURLOPT_SOCKOPTFUNCTION callback applying the SocketProfile passed as
+ * CURLOPT_SOCKOPTDATA.
+ */
+int curl_socket_profile_callback(void* profile, curl_socket_t fd, curlsocktype purpose);
+
+#endif
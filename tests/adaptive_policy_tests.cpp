@@ -0,0 +1,107 @@
+#include "adaptive_policy.h"
+#include "check.h"
+
+static void add_hops(AdaptiveTimeoutPolicy& policy, const char* host, int hops, long long latency_us)
+{
+  for (int i = 0; i < hops; i++) {
+    policy.on_hop_complete(host, CURLE_OK, latency_us);
+  }
+}
+
+static void test_new_hosts_get_the_budget()
+{
+  AdaptiveTimeoutPolicy policy;
+  CHECK_EQ(policy.hop_timeout_ms("a.test", 1000), 1000);
+  add_hops(policy, "a.test", 19, 100000);
+  CHECK_EQ(policy.hop_timeout_ms("a.test", 1000), 1000);
+  add_hops(policy, "a.test", 1, 100000);
+  // 100 ms falls in the bucket up to 2^6.75 = 107.6 ms, so 107.6 * 1.5 + 20.
+  CHECK_EQ(policy.hop_timeout_ms("a.test", 1000), 181);
+  CHECK_EQ(policy.hop_timeout_ms("a.test", 150), 150);
+  CHECK_EQ(policy.hop_timeout_ms("b.test", 1000), 1000);
+
+  policy.set_min_samples(5);
+  add_hops(policy, "b.test", 5, 100000);
+  CHECK_EQ(policy.hop_timeout_ms("b.test", 1000), 181);
+}
+
+static void test_minimum_timeout()
+{
+  AdaptiveTimeoutPolicy policy;
+  add_hops(policy, "fast.test", 20, 2000);
+  CHECK_EQ(policy.hop_timeout_ms("fast.test", 1000), 50);
+  add_hops(policy, "instant.test", 20, 300);
+  CHECK_EQ(policy.hop_timeout_ms("instant.test", 1000), 50);
+  policy.set_timeout(0.99, 1.0, 0, 10);
+  // 2 ms falls in the bucket up to 2^(5/4) = 2.4 ms.
+  CHECK_EQ(policy.hop_timeout_ms("fast.test", 1000), 10);
+  CHECK_EQ(policy.hop_timeout_ms("instant.test", 1000), 10);
+}
+
+static void test_percentile()
+{
+  AdaptiveTimeoutPolicy policy;
+  policy.set_timeout(0.9, 1.0, 0, 0);
+  add_hops(policy, "a.test", 90, 10000);
+  add_hops(policy, "a.test", 10, 100000);
+  // 10 ms falls in the bucket up to 2^3.5 = 11.3 ms.
+  CHECK_EQ(policy.hop_timeout_ms("a.test", 1000), 11);
+  add_hops(policy, "a.test", 1, 100000);
+  CHECK_EQ(policy.hop_timeout_ms("a.test", 1000), 107);
+}
+
+static void test_timeouts_double_the_timeout()
+{
+  AdaptiveTimeoutPolicy policy;
+  add_hops(policy, "a.test", 20, 100000);
+  policy.on_hop_complete("a.test", CURLE_OPERATION_TIMEDOUT, 181000);
+  CHECK_EQ(policy.hop_timeout_ms("a.test", 100000), 362);
+  policy.on_hop_complete("a.test", CURLE_OPERATION_TIMEDOUT, 362000);
+  CHECK_EQ(policy.hop_timeout_ms("a.test", 100000), 725);
+  CHECK_EQ(policy.hop_timeout_ms("a.test", 500), 500);
+  // Up to six doublings.
+  for (int i = 0; i < 10; i++) {
+    policy.on_hop_complete("a.test", CURLE_OPERATION_TIMEDOUT, 1000000);
+  }
+  CHECK_EQ(policy.hop_timeout_ms("a.test", 100000), 11612);
+  // Timed out hops are not sketched, and one that succeeds ends the backoff.
+  policy.on_hop_complete("a.test", CURLE_OK, 100000);
+  CHECK_EQ(policy.hop_timeout_ms("a.test", 100000), 181);
+}
+
+static void test_other_failures_are_ignored()
+{
+  AdaptiveTimeoutPolicy policy;
+  add_hops(policy, "a.test", 20, 100000);
+  policy.on_hop_complete("a.test", CURLE_COULDNT_CONNECT, 5000000);
+  policy.on_hop_complete("a.test", CURLE_COULDNT_RESOLVE_HOST, 5000000);
+  CHECK_EQ(policy.hop_timeout_ms("a.test", 100000), 181);
+  for (int i = 0; i < 20; i++) {
+    policy.on_hop_complete("b.test", CURLE_RECV_ERROR, 1000);
+  }
+  CHECK_EQ(policy.hop_timeout_ms("b.test", 1000), 1000);
+}
+
+static void test_old_latencies_fade()
+{
+  AdaptiveTimeoutPolicy policy;
+  add_hops(policy, "a.test", 100, 1000000);
+  CHECK_EQ(policy.hop_timeout_ms("a.test", 100000), 1556);
+  // The host got faster: the slow samples are halved every 512 hops until
+  // they no longer reach the percentile.
+  add_hops(policy, "a.test", 500, 10000);
+  CHECK(policy.hop_timeout_ms("a.test", 100000) > 1000);
+  add_hops(policy, "a.test", 3000, 10000);
+  CHECK_EQ(policy.hop_timeout_ms("a.test", 100000), 50);
+}
+
+int main()
+{
+  test_new_hosts_get_the_budget();
+  test_minimum_timeout();
+  test_percentile();
+  test_timeouts_double_the_timeout();
+  test_other_failures_are_ignored();
+  test_old_latencies_fade();
+  return check_result();
+}
@@ -0,0 +1,55 @@
+#ifndef URL_EXPANDER_TESTS_CHECK_H
+#define URL_EXPANDER_TESTS_CHECK_H
+
+#include <cstdio>
+#include <sstream>
+
+/**
+ * Assertions for the unit tests, each of which is a plain executable that
+ * CTest runs. A failed check prints where it failed and the test goes on, so
+ * that one run reports every failure. main returns check_result().
+ */
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+#define CHECK_EQ(actual, expected) check_equal((actual), (expected), #actual, #expected, __FILE__, __LINE__)
+
+inline int& check_failures()
+{
+  static int failures = 0;
+  return failures;
+}
+
+inline void check(bool passed, const char* expression, const char* file, int line)
+{
+  if (!passed) {
+    fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, expression);
+    check_failures()++;
+  }
+}
+
+template <typename Actual, typename Expected>
+void check_equal(const Actual& actual, const Expected& expected, const char* actual_expression,
+    const char* expected_expression, const char* file, int line)
+{
+  if (actual == expected) {
+    return;
+  }
+  std::ostringstream values;
+  values << actual << " != " << expected;
+  fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %s\n", file, line, actual_expression, expected_expression,
+      values.str().c_str());
+  check_failures()++;
+}
+
+/**
+ * The exit code of a test: 0 if every check passed.
+ */
+inline int check_result()
+{
+  if (check_failures() > 0) {
+    fprintf(stderr, "%d checks failed\n", check_failures());
+    return 1;
+  }
+  return 0;
+}
+
+#endif
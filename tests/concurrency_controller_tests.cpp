@@ -0,0 +1,140 @@
+#include "check.h"
+#include "concurrency_controller.h"
+
+/**
+ * Drives a controller on a synthetic clock, one round trip per epoch.
+ */
+struct Simulation {
+  Simulation(size_t initial_window, size_t min_window, size_t max_window)
+    : controller(initial_window, min_window, max_window), now_us(0), cpu_us(0)
+  {
+  }
+
+  /**
+   * Complete a window of invocations of 10 urls each, timeouts of which
+   * timed out, that took latency_us while the client used cpu of a CPU.
+   */
+  void epoch(size_t timeouts, long long latency_us, double cpu = 0.1)
+  {
+    now_us += latency_us;
+    cpu_us += static_cast<long long>(cpu * latency_us);
+    for (size_t i = controller.window(); i > 0; i--) {
+      controller.on_invocation_complete(10, timeouts, latency_us, now_us, cpu_us);
+    }
+  }
+
+  ConcurrencyController controller;
+  long long now_us;
+  long long cpu_us;
+};
+
+static void test_window_bounds()
+{
+  CHECK_EQ(ConcurrencyController(0, 0, 0).window(), 1u);
+  CHECK_EQ(ConcurrencyController(100, 1, 32).window(), 32u);
+  CHECK_EQ(ConcurrencyController(2, 4, 32).window(), 4u);
+  CHECK_EQ(ConcurrencyController(8, 16, 4).window(), 16u);
+}
+
+static void test_slow_start()
+{
+  Simulation simulation(4, 1, 64);
+  size_t windows[] = {8, 16, 32, 64, 64};
+  for (size_t window : windows) {
+    simulation.epoch(0, 100000);
+    CHECK_EQ(simulation.controller.window(), window);
+  }
+  CHECK_EQ(simulation.controller.concurrency_stats().peak_window, 64u);
+  CHECK_EQ(simulation.controller.concurrency_stats().backoffs, 0u);
+}
+
+static void test_timeout_spike_backs_off()
+{
+  Simulation simulation(16, 1, 1000);
+  simulation.epoch(0, 100000);
+  CHECK_EQ(simulation.controller.window(), 32u);
+  simulation.epoch(3, 100000);
+  CHECK_EQ(simulation.controller.window(), 22u);
+  CHECK_EQ(simulation.controller.concurrency_stats().backoffs, 1u);
+  // The smaller window keeps up with less than the epoch before the
+  // backoff, so it holds for an epoch and then grows by one per epoch.
+  simulation.epoch(0, 100000);
+  CHECK_EQ(simulation.controller.window(), 22u);
+  simulation.epoch(0, 100000);
+  CHECK_EQ(simulation.controller.window(), 23u);
+  simulation.epoch(0, 100000);
+  CHECK_EQ(simulation.controller.window(), 24u);
+  CHECK_EQ(simulation.controller.concurrency_stats().peak_window, 32u);
+}
+
+static void test_usual_timeouts_do_not_back_off()
+{
+  // One url in ten always times out, e.g. because its host is dead.
+  Simulation simulation(4, 1, 64);
+  for (int i = 0; i < 6; i++) {
+    simulation.epoch(1, 100000);
+  }
+  CHECK_EQ(simulation.controller.window(), 64u);
+  CHECK_EQ(simulation.controller.concurrency_stats().backoffs, 0u);
+  // Twice the usual share plus a point is a spike.
+  simulation.epoch(3, 100000);
+  CHECK_EQ(simulation.controller.window(), 44u);
+  CHECK_EQ(simulation.controller.concurrency_stats().backoffs, 1u);
+}
+
+static void test_cpu_saturation_backs_off()
+{
+  Simulation simulation(10, 8, 64);
+  simulation.epoch(0, 100000, 0.5);
+  CHECK_EQ(simulation.controller.window(), 20u);
+  simulation.epoch(0, 100000, 0.95);
+  CHECK_EQ(simulation.controller.window(), 14u);
+  simulation.epoch(0, 100000, 0.95);
+  CHECK_EQ(simulation.controller.window(), 9u);
+  // Not below the minimum.
+  simulation.epoch(0, 100000, 0.95);
+  CHECK_EQ(simulation.controller.window(), 8u);
+  CHECK_EQ(simulation.controller.concurrency_stats().backoffs, 3u);
+  simulation.epoch(0, 100000, 0.5);
+  CHECK_EQ(simulation.controller.window(), 8u);
+  simulation.epoch(0, 100000, 0.5);
+  CHECK_EQ(simulation.controller.window(), 9u);
+}
+
+static void test_latency_rise_holds()
+{
+  Simulation simulation(4, 1, 64);
+  simulation.epoch(0, 100000);
+  CHECK_EQ(simulation.controller.window(), 8u);
+  simulation.epoch(0, 130000);
+  CHECK_EQ(simulation.controller.window(), 8u);
+  // Slow start ended, so the window grows by one once latency recovers.
+  simulation.epoch(0, 100000);
+  CHECK_EQ(simulation.controller.window(), 9u);
+  CHECK_EQ(simulation.controller.concurrency_stats().backoffs, 0u);
+}
+
+static void test_throughput_drop_holds()
+{
+  Simulation simulation(4, 1, 64);
+  simulation.epoch(0, 100000);
+  simulation.epoch(0, 100000);
+  CHECK_EQ(simulation.controller.window(), 16u);
+  // Latency per url holds but the epoch took four times as long, as when
+  // invocations queue behind one another.
+  simulation.now_us += 300000;
+  simulation.epoch(0, 100000);
+  CHECK_EQ(simulation.controller.window(), 16u);
+}
+
+int main()
+{
+  test_window_bounds();
+  test_slow_start();
+  test_timeout_spike_backs_off();
+  test_usual_timeouts_do_not_back_off();
+  test_cpu_saturation_backs_off();
+  test_latency_rise_holds();
+  test_throughput_drop_holds();
+  return check_result();
+}
@@ -0,0 +1,134 @@
+#include "check.h"
+#include "head_client.h"
+
+#include <cstring>
+#include <string>
+
+static int parse(const std::string& data, ResponseHead& head)
+{
+  return parse_response_head(data.data(), data.size(), head);
+}
+
+static std::string location(const ResponseHead& head)
+{
+  return head.location ? std::string(head.location, head.location_length) : "(none)";
+}
+
+static void test_complete_head()
+{
+  ResponseHead head;
+  std::string data = "HTTP/1.1 301 Moved Permanently\r\nLocation: https://example.com/a\r\n"
+      "Content-Length: 0\r\n\r\nbody";
+  CHECK_EQ(parse(data, head), 1);
+  CHECK_EQ(head.status, 301);
+  CHECK(head.keep_alive);
+  CHECK_EQ(location(head), "https://example.com/a");
+  CHECK_EQ(head.length, data.size() - 4);
+
+  CHECK_EQ(parse("HTTP/1.0 302 Found\nlocation: /b\n\n", head), 1);
+  CHECK_EQ(head.status, 302);
+  CHECK(!head.keep_alive);
+  CHECK_EQ(location(head), "/b");
+
+  CHECK_EQ(parse("HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n", head), 1);
+  CHECK(!head.keep_alive);
+  CHECK_EQ(parse("HTTP/1.0 200 OK\r\nConnection: Keep-Alive\r\n\r\n", head), 1);
+  CHECK(head.keep_alive);
+  CHECK_EQ(parse("HTTP/1.1 429\r\nRetry-After: 30\r\n\r\n", head), 1);
+  CHECK_EQ(std::string(head.retry_after, head.retry_after_length), "30");
+}
+
+static void test_truncated_head()
+{
+  ResponseHead head;
+  std::string data = "HTTP/1.1 301 Moved Permanently\r\nLocation: https://example.com/a\r\n\r\n";
+  // Every proper prefix needs more data.
+  for (size_t size = 0; size < data.size(); size++) {
+    CHECK_EQ(parse_response_head(data.data(), size, head), 0);
+  }
+}
+
+static void test_unsupported_heads()
+{
+  ResponseHead head;
+  // Interim responses are left to curl.
+  CHECK_EQ(parse("HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 301 Moved\r\nLocation: /a\r\n\r\n", head), -1);
+  CHECK_EQ(parse("HTTP/1.1 103 Early Hints\r\nLink: </style.css>\r\n\r\n", head), -1);
+  // Obsolete header folding.
+  CHECK_EQ(parse("HTTP/1.1 301 Moved\r\nLocation: /a\r\n /b\r\n\r\n", head), -1);
+  CHECK_EQ(parse("HTTP/1.1 301 Moved\r\nX-Folded: a\r\n\tb\r\nLocation: /a\r\n\r\n", head), -1);
+  // Malformed status lines and headers.
+  CHECK_EQ(parse("HTTP/2 301\r\n\r\n", head), -1);
+  CHECK_EQ(parse("HTTP/1.1 3x1 Moved\r\n\r\n", head), -1);
+  CHECK_EQ(parse("HTTP/1.1 301Moved\r\n\r\n", head), -1);
+  CHECK_EQ(parse("HTTP/1.1 \xb3\xb0\xb1 Moved\r\n\r\n", head), -1);
+  CHECK_EQ(parse("HTTP/1.1 301 Moved\r\nLocation /a\r\n\r\n", head), -1);
+}
+
+static void test_location_whitespace()
+{
+  ResponseHead head;
+  CHECK_EQ(parse("HTTP/1.1 301 Moved\r\nLocation: \t https://example.com/a \t\r\n\r\n", head), 1);
+  CHECK_EQ(location(head), "https://example.com/a");
+  CHECK_EQ(parse("HTTP/1.1 301 Moved\r\nLocation:/a\r\n\r\n", head), 1);
+  CHECK_EQ(location(head), "/a");
+  // Like curl, the first Location counts.
+  CHECK_EQ(parse("HTTP/1.1 301 Moved\r\nLocation: /a\r\nLocation: /b\r\n\r\n", head), 1);
+  CHECK_EQ(location(head), "/a");
+}
+
+static void test_missing_location()
+{
+  ResponseHead head;
+  CHECK_EQ(parse("HTTP/1.1 301 Moved\r\nContent-Length: 0\r\n\r\n", head), 1);
+  CHECK_EQ(head.status, 301);
+  CHECK(head.location == NULL);
+  CHECK_EQ(parse("HTTP/1.1 301 Moved\r\nX-Location: /a\r\n\r\n", head), 1);
+  CHECK(head.location == NULL);
+}
+
+static std::string resolve(const std::string& base, const char* location)
+{
+  // The path starts after the authority.
+  size_t path_start = base.find('/', base.find("//") + 2);
+  std::string resolved;
+  return resolve_location(base, path_start, location, strlen(location), resolved) ? resolved : "(curl)";
+}
+
+static void test_resolve_location()
+{
+  std::string base = "https://example.com/a/b?q=1";
+  CHECK_EQ(resolve(base, "http://other.com/x"), "http://other.com/x");
+  CHECK_EQ(resolve(base, "//other.com/x"), "https://other.com/x");
+  CHECK_EQ(resolve(base, "/x"), "https://example.com/x");
+  CHECK_EQ(resolve(base, "x"), "https://example.com/a/x");
+  CHECK_EQ(resolve(base, "x?y=2"), "https://example.com/a/x?y=2");
+  CHECK_EQ(resolve(base, "?y=2"), "https://example.com/a/b?y=2");
+  CHECK_EQ(resolve("https://example.com/", "x"), "https://example.com/x");
+  // Dots that are not whole segments need no normalizing.
+  CHECK_EQ(resolve(base, "x..y/.z"), "https://example.com/a/x..y/.z");
+
+  // Dot segments, fragments, characters curl escapes and empty references
+  // are left to curl.
+  CHECK_EQ(resolve(base, "../x"), "(curl)");
+  CHECK_EQ(resolve(base, "./x"), "(curl)");
+  CHECK_EQ(resolve(base, "/a/./x"), "(curl)");
+  CHECK_EQ(resolve(base, "/a/../x"), "(curl)");
+  CHECK_EQ(resolve(base, "x/.."), "(curl)");
+  CHECK_EQ(resolve(base, ".?y=2"), "(curl)");
+  CHECK_EQ(resolve(base, "x#top"), "(curl)");
+  CHECK_EQ(resolve(base, "x y"), "(curl)");
+  CHECK_EQ(resolve(base, ""), "(curl)");
+  CHECK_EQ(resolve(base, "http:x"), "(curl)");
+}
+
+int main()
+{
+  test_complete_head();
+  test_truncated_head();
+  test_unsupported_heads();
+  test_location_whitespace();
+  test_missing_location();
+  test_resolve_location();
+  return check_result();
+}
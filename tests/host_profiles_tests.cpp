@@ -0,0 +1,92 @@
+#include "check.h"
+#include "host_profiles.h"
+
+static HopResponse connect_failed(bool ipv6)
+{
+  HopResponse response;
+  response.code = CURLE_COULDNT_CONNECT;
+  response.ipv6 = ipv6;
+  return response;
+}
+
+static HopResponse connected(bool ipv6, long long connect_us)
+{
+  HopResponse response;
+  response.status = 200;
+  response.ipv6 = ipv6;
+  response.connect_us = connect_us;
+  return response;
+}
+
+static void test_ipv6_failure_falls_back_to_ipv4()
+{
+  HostProfiles profiles;
+  CHECK(profiles.on_hop_complete("a.test", TransferStrategy(), connect_failed(true)));
+  TransferStrategy strategy = profiles.strategy("a.test");
+  CHECK(strategy.ipv4_only);
+  // Not saved until IPv4 connects.
+  CHECK(!profiles.changed());
+  CHECK_EQ(profiles.ipv4_only(), 0u);
+  CHECK(!profiles.on_hop_complete("a.test", strategy, connected(false, 5000)));
+  CHECK(profiles.changed());
+  CHECK_EQ(profiles.ipv4_only(), 1u);
+
+  // Three failures in a row over IPv4 undo it.
+  for (int i = 0; i < 2; i++) {
+    CHECK(!profiles.on_hop_complete("a.test", strategy, connect_failed(false)));
+    CHECK(profiles.strategy("a.test").ipv4_only);
+  }
+  CHECK(!profiles.on_hop_complete("a.test", strategy, connect_failed(false)));
+  CHECK(!profiles.strategy("a.test").ipv4_only);
+}
+
+static void test_down_hosts_do_not_flap()
+{
+  HostProfiles profiles;
+  int retries = 0;
+  for (int i = 0; i < 5; i++) {
+    TransferStrategy strategy = profiles.strategy("down.test");
+    if (profiles.on_hop_complete("down.test", strategy, connect_failed(!strategy.ipv4_only))) {
+      retries++;
+      strategy = profiles.strategy("down.test");
+      CHECK(!profiles.on_hop_complete("down.test", strategy, connect_failed(!strategy.ipv4_only)));
+    }
+  }
+  CHECK_EQ(retries, 1);
+  CHECK(!profiles.strategy("down.test").ipv4_only);
+  CHECK(!profiles.changed());
+
+  // Once the host connects again, a failure over IPv6 is retried.
+  CHECK(!profiles.on_hop_complete("down.test", TransferStrategy(), connected(true, 5000)));
+  CHECK(profiles.on_hop_complete("down.test", TransferStrategy(), connect_failed(true)));
+}
+
+static void test_slow_ipv6_connects()
+{
+  HostProfiles profiles;
+  CHECK(!profiles.on_hop_complete("slow.test", TransferStrategy(), connected(true, 300000)));
+  CHECK(!profiles.strategy("slow.test").ipv4_only);
+  CHECK(!profiles.on_hop_complete("slow.test", TransferStrategy(), connected(true, 300000)));
+  CHECK(profiles.strategy("slow.test").ipv4_only);
+
+  // A fast connect in between resets the count.
+  CHECK(!profiles.on_hop_complete("mixed.test", TransferStrategy(), connected(true, 300000)));
+  CHECK(!profiles.on_hop_complete("mixed.test", TransferStrategy(), connected(true, 5000)));
+  CHECK(!profiles.on_hop_complete("mixed.test", TransferStrategy(), connected(true, 300000)));
+  CHECK(!profiles.strategy("mixed.test").ipv4_only);
+
+  // A far host that is slow over IPv4 has nothing to fall back to.
+  for (int i = 0; i < 3; i++) {
+    CHECK(!profiles.on_hop_complete("far.test", TransferStrategy(), connected(false, 400000)));
+  }
+  CHECK(!profiles.strategy("far.test").ipv4_only);
+  CHECK_EQ(profiles.hosts(), 2u);
+}
+
+int main()
+{
+  test_ipv6_failure_falls_back_to_ipv4();
+  test_down_hosts_do_not_flap();
+  test_slow_ipv6_connects();
+  return check_result();
+}
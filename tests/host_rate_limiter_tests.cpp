@@ -0,0 +1,131 @@
+#include "check.h"
+#include "host_rate_limiter.h"
+
+/**
+ * A steady clock reading well after 0, where windows start.
+ */
+static const long long T0 = 10000000;
+
+/**
+ * Send count requests to host, spaced by interval_us from start_us. Returns
+ * the time of the last one.
+ */
+static long long send(HostRateLimiter& limiter, const std::string& host, int count, long long start_us,
+    long long interval_us)
+{
+  long long now = start_us;
+  for (int i = 0; i < count; i++) {
+    now = start_us + i * interval_us;
+    limiter.on_request(host, now);
+  }
+  return now;
+}
+
+static void test_unlimited_by_default()
+{
+  HostRateLimiter limiter;
+  CHECK_EQ(limiter.ready_us("bit.ly", T0), T0);
+  send(limiter, "bit.ly", 100, T0, 0);
+  CHECK(limiter.ready_us("bit.ly", T0) <= T0);
+}
+
+static void test_configured_rate()
+{
+  HostRateLimiter limiter;
+  limiter.set_rate("bit.ly", 2);
+  // Bursts of up to a second's worth, then one request per 500 ms.
+  send(limiter, "bit.ly", 2, T0, 0);
+  CHECK_EQ(limiter.ready_us("bit.ly", T0), T0 + 500000);
+  CHECK(limiter.ready_us("bit.ly", T0 + 500000) <= T0 + 500000);
+  limiter.on_request("bit.ly", T0 + 500000);
+  CHECK_EQ(limiter.ready_us("bit.ly", T0 + 500000), T0 + 1000000);
+  // Other hosts are not affected.
+  CHECK_EQ(limiter.ready_us("t.co", T0), T0);
+
+  limiter.set_default_rate(1);
+  limiter.on_request("t.co", T0);
+  CHECK_EQ(limiter.ready_us("t.co", T0), T0 + 1000000);
+}
+
+static void test_throttled_with_retry_after()
+{
+  HostRateLimiter limiter;
+  // 10 requests per second, throttled with Retry-After: 2.
+  long long now = send(limiter, "bit.ly", 10, T0, 100000) + 50000;
+  limiter.on_throttled("bit.ly", 2000, now);
+  CHECK_EQ(limiter.throttled_count(), 1u);
+  // Blocked for 2 s, after which one request may go, and the rest at half
+  // the rate they were sent at.
+  long long unblocked = now + 2000000;
+  CHECK_EQ(limiter.ready_us("bit.ly", now), unblocked);
+  CHECK_EQ(limiter.ready_us("bit.ly", unblocked), unblocked);
+  limiter.on_request("bit.ly", unblocked);
+  CHECK_EQ(limiter.ready_us("bit.ly", unblocked), unblocked + 200000);
+}
+
+static void test_throttled_without_retry_after()
+{
+  HostRateLimiter limiter;
+  long long now = send(limiter, "bit.ly", 10, T0, 100000) + 50000;
+  limiter.on_throttled("bit.ly", -1, now);
+  CHECK_EQ(limiter.ready_us("bit.ly", now), now + 1000000);
+}
+
+static void test_learned_rate_grows_back()
+{
+  HostRateLimiter limiter;
+  limiter.set_rate("bit.ly", 8);
+  long long now = send(limiter, "bit.ly", 10, T0, 100000) + 50000;
+  limiter.on_throttled("bit.ly", 0, now);
+  limiter.on_request("bit.ly", now);
+  // The rate grows by 1 / rate per response, i.e. by about one request per
+  // second for every second of responses.
+  double rate = 5;
+  for (int i = 0; i < 5; i++) {
+    limiter.on_response("bit.ly");
+    rate += 1 / rate;
+  }
+  CHECK_EQ(limiter.ready_us("bit.ly", now), now + static_cast<long long>(1e6 / rate));
+  // But not past the configured rate.
+  for (int i = 0; i < 100; i++) {
+    limiter.on_response("bit.ly");
+  }
+  CHECK_EQ(limiter.ready_us("bit.ly", now), now + 125000);
+}
+
+static void test_configured_rate_is_not_raised()
+{
+  HostRateLimiter limiter;
+  limiter.set_rate("bit.ly", 4);
+  // Half the sent rate would be 5 per second, faster than configured.
+  long long now = send(limiter, "bit.ly", 10, T0, 100000) + 50000;
+  limiter.on_throttled("bit.ly", 0, now);
+  limiter.on_request("bit.ly", now);
+  CHECK_EQ(limiter.ready_us("bit.ly", now), now + 250000);
+}
+
+static void test_minimum_learned_rate()
+{
+  HostRateLimiter limiter;
+  limiter.on_request("bit.ly", T0);
+  limiter.on_throttled("bit.ly", 0, T0);
+  limiter.on_request("bit.ly", T0);
+  CHECK_EQ(limiter.ready_us("bit.ly", T0), T0 + 2000000);
+  // Repeated throttling does not go below it.
+  limiter.on_request("bit.ly", T0 + 2000000);
+  limiter.on_throttled("bit.ly", 0, T0 + 2000000);
+  limiter.on_request("bit.ly", T0 + 2000000);
+  CHECK_EQ(limiter.ready_us("bit.ly", T0 + 2000000), T0 + 4000000);
+}
+
+int main()
+{
+  test_unlimited_by_default();
+  test_configured_rate();
+  test_throttled_with_retry_after();
+  test_throttled_without_retry_after();
+  test_learned_rate_grows_back();
+  test_configured_rate_is_not_raised();
+  test_minimum_learned_rate();
+  return check_result();
+}
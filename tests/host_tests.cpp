@@ -0,0 +1,93 @@
+#include "check.h"
+#include "host.h"
+
+#include <cstring>
+#include <string>
+
+struct RegistrableDomainCase {
+  const char* host;
+  const char* registrable_domain;
+};
+
+static const RegistrableDomainCase REGISTRABLE_DOMAIN_CASES[] = {
+  // Plain and multi-label suffixes.
+  {"example.com", "example.com"},
+  {"www.example.com", "example.com"},
+  {"a.b.cdn.example.co.uk", "example.co.uk"},
+  {"com", "com"},
+  {"co.uk", "co.uk"},
+  // Hosts no rule matches end with a single-label suffix.
+  {"a.b.example.unlisted", "example.unlisted"},
+  // Wildcard rules: *.ck, *.kawasaki.jp.
+  {"bar.ck", "bar.ck"},
+  {"foo.bar.ck", "foo.bar.ck"},
+  {"a.foo.bar.ck", "foo.bar.ck"},
+  {"b.kawasaki.jp", "b.kawasaki.jp"},
+  {"a.b.kawasaki.jp", "a.b.kawasaki.jp"},
+  {"x.a.b.kawasaki.jp", "a.b.kawasaki.jp"},
+  {"kawasaki.jp", "kawasaki.jp"},
+  // Exception rules: !www.ck, !city.kawasaki.jp.
+  {"www.ck", "www.ck"},
+  {"a.www.ck", "www.ck"},
+  {"city.kawasaki.jp", "city.kawasaki.jp"},
+  {"www.city.kawasaki.jp", "city.kawasaki.jp"},
+  // Private section: github.io.
+  {"github.io", "github.io"},
+  {"user.github.io", "user.github.io"},
+  {"a.user.github.io", "user.github.io"},
+  // Rules with non-ASCII labels match their Punycode form: рф, 公司.cn.
+  {"a.b.xn--p1ai", "b.xn--p1ai"},
+  {"a.b.xn--55qx5d.cn", "b.xn--55qx5d.cn"},
+  // A trailing dot belongs to the suffix.
+  {"www.example.com.", "example.com."},
+  {"example.com.", "example.com."},
+  {"a.foo.bar.ck.", "foo.bar.ck."},
+  {"com.", "com."},
+  {".", "."},
+  // IP addresses are their own site.
+  {"192.168.0.1", "192.168.0.1"},
+  {"10.0.0.1.", "10.0.0.1."},
+  {"[::1]", "[::1]"},
+  {"[2001:db8::1]", "[2001:db8::1]"},
+  // Empty input.
+  {"", ""},
+};
+
+static void test_registrable_domain()
+{
+  for (size_t i = 0; i < sizeof(REGISTRABLE_DOMAIN_CASES) / sizeof(REGISTRABLE_DOMAIN_CASES[0]); i++) {
+    const RegistrableDomainCase& c = REGISTRABLE_DOMAIN_CASES[i];
+    std::string host = c.host;
+    CHECK_EQ(registrable_domain(host), c.registrable_domain);
+    size_t offset = registrable_domain_offset(c.host, strlen(c.host));
+    CHECK_EQ(host.substr(offset), c.registrable_domain);
+  }
+}
+
+static void test_public_suffix_length()
+{
+  CHECK_EQ(public_suffix_length("a.b.cdn.example.co.uk", 21), 5u);
+  CHECK_EQ(public_suffix_length("example.com", 11), 3u);
+  CHECK_EQ(public_suffix_length("example.com.", 12), 4u);
+  CHECK_EQ(public_suffix_length("foo.bar.ck", 10), 6u);
+  CHECK_EQ(public_suffix_length("www.ck", 6), 2u);
+  CHECK_EQ(public_suffix_length("user.github.io", 14), 9u);
+  CHECK_EQ(public_suffix_length("", 0), 0u);
+}
+
+static void test_url_site()
+{
+  CHECK_EQ(url_site("https://a.b.cdn.example.co.uk/path?q=1"), "example.co.uk");
+  CHECK_EQ(url_site("HTTP://WWW.Example.COM:8080/"), "example.com");
+  CHECK_EQ(url_site("bit.ly/abc"), "bit.ly");
+  CHECK_EQ(url_site("https://user.github.io/repo"), "user.github.io");
+  CHECK_EQ(url_site("http://127.0.0.1:8080/a"), "127.0.0.1");
+}
+
+int main()
+{
+  test_registrable_domain();
+  test_public_suffix_length();
+  test_url_site();
+  return check_result();
+}
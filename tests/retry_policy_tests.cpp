@@ -0,0 +1,245 @@
+#include "adaptive_policy.h"
+#include "check.h"
+#include "engine.h"
+#include "host.h"
+#include "retry_policy.h"
+
+#include <string>
+#include <vector>
+
+static HopResponse failed(CURLcode code, bool reused)
+{
+  HopResponse response;
+  response.code = code;
+  response.reused_connection = reused;
+  return response;
+}
+
+static void test_is_retryable()
+{
+  CHECK(RetryPolicy::is_retryable(CURLE_SEND_ERROR, true));
+  CHECK(RetryPolicy::is_retryable(CURLE_RECV_ERROR, true));
+  CHECK(RetryPolicy::is_retryable(CURLE_GOT_NOTHING, true));
+  CHECK(!RetryPolicy::is_retryable(CURLE_SEND_ERROR, false));
+  CHECK(!RetryPolicy::is_retryable(CURLE_RECV_ERROR, false));
+  CHECK(!RetryPolicy::is_retryable(CURLE_GOT_NOTHING, false));
+  CHECK(RetryPolicy::is_retryable(CURLE_COULDNT_RESOLVE_HOST, false));
+  CHECK(RetryPolicy::is_retryable(CURLE_OPERATION_TIMEDOUT, true));
+  CHECK(RetryPolicy::is_retryable(CURLE_OPERATION_TIMEDOUT, false, true));
+  CHECK(!RetryPolicy::is_retryable(CURLE_OPERATION_TIMEDOUT, false));
+  CHECK(!RetryPolicy::is_retryable(CURLE_RECV_ERROR, false, true));
+  CHECK(!RetryPolicy::is_retryable(CURLE_COULDNT_CONNECT, false));
+  CHECK(!RetryPolicy::is_retryable(CURLE_OK, true));
+}
+
+static void test_stale_connections_retry_at_once()
+{
+  RetryPolicy policy;
+  CHECK_EQ(policy.retry_delay_us(failed(CURLE_RECV_ERROR, true), 0, 400000), 0);
+  CHECK_EQ(policy.retry_delay_us(failed(CURLE_RECV_ERROR, false), 0, 400000), -1);
+}
+
+static void test_timeouts()
+{
+  RetryPolicy policy;
+  // A silent reused connection, or a hop cut short of the budget.
+  CHECK_EQ(policy.retry_delay_us(failed(CURLE_OPERATION_TIMEDOUT, true), 0, 400000), 0);
+  CHECK_EQ(policy.retry_delay_us(failed(CURLE_OPERATION_TIMEDOUT, false), 0, 400000, true), 0);
+  // A hop on a new connection that had the whole budget used it up.
+  CHECK_EQ(policy.retry_delay_us(failed(CURLE_OPERATION_TIMEDOUT, false), 0, 400000), -1);
+  CHECK_EQ(policy.retry_delay_us(failed(CURLE_OPERATION_TIMEDOUT, true), 0, 49999), -1);
+  CHECK_EQ(policy.retry_delay_us(failed(CURLE_OPERATION_TIMEDOUT, true), 2, 400000), -1);
+}
+
+static void test_retry_limits()
+{
+  RetryPolicy policy;
+  HopResponse stale = failed(CURLE_GOT_NOTHING, true);
+  CHECK_EQ(policy.retry_delay_us(stale, 1, 400000), 0);
+  CHECK_EQ(policy.retry_delay_us(stale, 2, 400000), -1);
+  // A retry needs 50 ms of the budget.
+  CHECK_EQ(policy.retry_delay_us(stale, 0, 50000), 0);
+  CHECK_EQ(policy.retry_delay_us(stale, 0, 49999), -1);
+  CHECK(policy.allows_retry(1, 50000));
+  CHECK(!policy.allows_retry(2, 50000));
+  CHECK(!policy.allows_retry(0, 49999));
+
+  policy.set_max_retries(0);
+  CHECK_EQ(policy.retry_delay_us(stale, 0, 400000), -1);
+  policy.set_max_retries(5);
+  policy.set_min_attempt(10000);
+  CHECK_EQ(policy.retry_delay_us(stale, 4, 10000), 0);
+}
+
+static void test_dns_backoff()
+{
+  RetryPolicy policy(10);
+  HopResponse dns = failed(CURLE_COULDNT_RESOLVE_HOST, false);
+  // Full jitter over 20 ms doubling per retry, up to 500 ms.
+  long long caps[] = {20000, 40000, 80000, 160000, 320000, 500000, 500000};
+  for (int retries = 0; retries < 7; retries++) {
+    long long longest = 0;
+    for (uint64_t seed = 0; seed < 200; seed++) {
+      policy.seed(seed);
+      long long delay = policy.retry_delay_us(dns, retries, 10000000);
+      CHECK(delay >= 0 && delay <= caps[retries]);
+      longest = delay > longest ? delay : longest;
+    }
+    // The jitter spreads over the whole range.
+    CHECK(longest > caps[retries] / 2);
+  }
+  // The same seed waits the same.
+  policy.seed(7);
+  long long first = policy.retry_delay_us(dns, 3, 10000000);
+  policy.seed(7);
+  CHECK_EQ(policy.retry_delay_us(dns, 3, 10000000), first);
+  // Backoffs that would leave less than 50 ms are not waited.
+  policy.set_backoff(100000, 100000);
+  for (uint64_t seed = 0; seed < 50; seed++) {
+    policy.seed(seed);
+    long long delay = policy.retry_delay_us(dns, 0, 120000);
+    CHECK(delay == -1 || delay <= 70000);
+  }
+}
+
+/**
+ * Transport that answers hops from a script in virtual time, recording how
+ * they were requested.
+ */
+class ScriptedTransport : public HopTransport {
+ public:
+  ScriptedTransport() : clock_us(0), waited_us(0) {}
+
+  void perform(const std::string& url, long timeout_ms, bool fresh_connection, const TransferStrategy& strategy,
+      HopResponse& response)
+  {
+    urls.push_back(url);
+    fresh.push_back(fresh_connection);
+    timeouts_ms.push_back(timeout_ms);
+    response = script[urls.size() - 1];
+    response.effective_url = url;
+    clock_us += response.code == CURLE_OPERATION_TIMEDOUT ? timeout_ms * 1000LL : 10000;
+  }
+
+  long long now_us()
+  {
+    return clock_us;
+  }
+
+  void wait_us(long long us)
+  {
+    waited_us += us;
+    clock_us += us;
+  }
+
+  std::vector<HopResponse> script;
+  std::vector<std::string> urls;
+  std::vector<bool> fresh;
+  std::vector<long> timeouts_ms;
+  long long clock_us;
+  long long waited_us;
+};
+
+static HopResponse redirect(const std::string& url)
+{
+  HopResponse response;
+  response.status = 301;
+  response.redirect_url = url;
+  return response;
+}
+
+static void test_follow_redirects_retries()
+{
+  ScriptedTransport transport;
+  transport.script.push_back(redirect("http://b.test/"));
+  transport.script.push_back(failed(CURLE_RECV_ERROR, true));
+  transport.script.push_back(failed(CURLE_COULDNT_RESOLVE_HOST, false));
+  transport.script.push_back(HopResponse());
+  ExpansionPolicy policy;
+  RetryPolicy retry_policy;
+  std::string output_url;
+  bool reached_redirect_limit = true;
+  int retries = 0;
+  CURLcode code = follow_redirects(transport, policy, output_url, reached_redirect_limit, "http://a.test/", 1000, 5,
+      NULL, &retry_policy, &retries);
+  CHECK_EQ(code, CURLE_OK);
+  CHECK_EQ(output_url, "http://b.test/");
+  CHECK(!reached_redirect_limit);
+  CHECK_EQ(retries, 2);
+  CHECK_EQ(transport.urls.size(), 4u);
+  // The stale connection is retried on a new one, and the DNS failure after
+  // a backoff.
+  CHECK(transport.fresh[2]);
+  CHECK(!transport.fresh[3]);
+  CHECK(transport.waited_us <= 40000);
+
+  // Without a retry policy, the first failure is returned.
+  ScriptedTransport once;
+  once.script.push_back(failed(CURLE_RECV_ERROR, true));
+  code = follow_redirects(once, policy, output_url, reached_redirect_limit, "http://a.test/", 1000, 5);
+  CHECK_EQ(code, CURLE_RECV_ERROR);
+  CHECK_EQ(once.urls.size(), 1u);
+}
+
+static void test_adaptive_timeouts_retry()
+{
+  AdaptiveTimeoutPolicy policy;
+  policy.set_min_samples(5);
+  for (int i = 0; i < 5; i++) {
+    policy.on_hop_complete(url_site("http://a.test/"), CURLE_OK, 10000);
+  }
+  RetryPolicy retry_policy;
+  std::string output_url;
+  bool reached_redirect_limit = true;
+  int retries = 0;
+
+  // A kept-alive connection went silent: the hop times out after the host's
+  // usual 50 ms, and the retry on a new connection succeeds.
+  ScriptedTransport silent;
+  silent.script.push_back(failed(CURLE_OPERATION_TIMEDOUT, true));
+  silent.script.push_back(HopResponse());
+  CURLcode code = follow_redirects(silent, policy, output_url, reached_redirect_limit, "http://a.test/", 500, 5,
+      NULL, &retry_policy, &retries);
+  CHECK_EQ(code, CURLE_OK);
+  CHECK_EQ(output_url, "http://a.test/");
+  CHECK_EQ(retries, 1);
+  CHECK_EQ(silent.timeouts_ms[0], 50);
+  CHECK(silent.fresh[1]);
+  CHECK(silent.clock_us < 500000);
+
+  // A hop cut short on a new connection is retried too, with a doubled
+  // timeout, until the retries run out.
+  ScriptedTransport hanging;
+  for (int i = 0; i < 3; i++) {
+    hanging.script.push_back(failed(CURLE_OPERATION_TIMEDOUT, false));
+  }
+  code = follow_redirects(hanging, policy, output_url, reached_redirect_limit, "http://a.test/", 500, 5, NULL,
+      &retry_policy, &retries);
+  CHECK_EQ(code, CURLE_OPERATION_TIMEDOUT);
+  CHECK_EQ(retries, 2);
+  CHECK_EQ(hanging.timeouts_ms[0], 50);
+  CHECK_EQ(hanging.timeouts_ms[1], 100);
+  CHECK_EQ(hanging.timeouts_ms[2], 200);
+
+  // A hop given the whole budget is not retried.
+  ExpansionPolicy fixed_policy;
+  ScriptedTransport slow;
+  slow.script.push_back(failed(CURLE_OPERATION_TIMEDOUT, false));
+  code = follow_redirects(slow, fixed_policy, output_url, reached_redirect_limit, "http://a.test/", 500, 5, NULL,
+      &retry_policy, &retries);
+  CHECK_EQ(code, CURLE_OPERATION_TIMEDOUT);
+  CHECK_EQ(retries, 0);
+  CHECK_EQ(slow.urls.size(), 1u);
+}
+
+int main()
+{
+  test_is_retryable();
+  test_stale_connections_retry_at_once();
+  test_timeouts();
+  test_retry_limits();
+  test_dns_backoff();
+  test_follow_redirects_retries();
+  test_adaptive_timeouts_retry();
+  return check_result();
+}
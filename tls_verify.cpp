@@ -0,0 +1,84 @@
+#include "tls_verify.h"
+
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include <ctime>
+
+/**
+ * How long a verification is reused at most, so that a certificate the CA
+ * store stopped trusting is not accepted for long.
+ */
+static const long long VERIFICATION_CACHE_SECONDS = 3600;
+
+/**
+ * Drop the whole cache once it holds this many certificates.
+ */
+static const size_t VERIFICATION_CACHE_MAX_ENTRIES = 10000;
+
+/**
+ * Rough size of an entry: the key of host and fingerprint, the expiry and
+ * the hash table node.
+ */
+static const size_t VERIFICATION_ENTRY_BYTES = 128;
+
+void VerificationCache::install(SSL_CTX* ctx)
+{
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  SSL_CTX_set_cert_verify_callback(ctx, verify, this);
+}
+
+void VerificationCache::set_enabled(bool enabled)
+{
+  this->enabled = enabled;
+  if (!enabled) {
+    verified.clear();
+  }
+}
+
+size_t VerificationCache::bytes() const
+{
+  return verified.size() * VERIFICATION_ENTRY_BYTES;
+}
+
+int VerificationCache::verify(X509_STORE_CTX* store_ctx, void* arg)
+{
+  VerificationCache* cache = static_cast<VerificationCache*>(arg);
+  X509* leaf = X509_STORE_CTX_get0_cert(store_ctx);
+  // The host OpenSSL checks, or else the one the client asked for, which
+  // the caller checks itself.
+  const char* host = X509_VERIFY_PARAM_get0_host(X509_STORE_CTX_get0_param(store_ctx), 0);
+  if (host == NULL) {
+    SSL* ssl = static_cast<SSL*>(X509_STORE_CTX_get_ex_data(store_ctx, SSL_get_ex_data_X509_STORE_CTX_idx()));
+    host = ssl != NULL ? SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name) : NULL;
+  }
+  unsigned char fingerprint[EVP_MAX_MD_SIZE];
+  unsigned int fingerprint_length = 0;
+  if (!cache->enabled || leaf == NULL || host == NULL ||
+      X509_digest(leaf, EVP_sha256(), fingerprint, &fingerprint_length) != 1) {
+    return X509_verify_cert(store_ctx);
+  }
+
+  std::string key(host);
+  key.push_back('\0');
+  key.append(reinterpret_cast<const char*>(fingerprint), fingerprint_length);
+  long long now = time(NULL);
+  auto it = cache->verified.find(key);
+  if (it != cache->verified.end() && it->second > now) {
+    cache->cache_hits++;
+    X509_STORE_CTX_set_error(store_ctx, X509_V_OK);
+    return 1;
+  }
+  cache->cache_misses++;
+  int result = X509_verify_cert(store_ctx);
+  int days = 0;
+  int seconds = 0;
+  if (result == 1 && ASN1_TIME_diff(&days, &seconds, NULL, X509_get0_notAfter(leaf)) == 1) {
+    long long remaining = days * 86400LL + seconds;
+    if (it == cache->verified.end() && cache->verified.size() >= VERIFICATION_CACHE_MAX_ENTRIES) {
+      cache->verified.clear();
+    }
+    cache->verified[key] = now + (remaining < VERIFICATION_CACHE_SECONDS ? remaining : VERIFICATION_CACHE_SECONDS);
+  }
+  return result;
+}
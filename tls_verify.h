@@ -0,0 +1,72 @@
+#ifndef URL_EXPANDER_TLS_VERIFY_H
+#define URL_EXPANDER_TLS_VERIFY_H
+
+#include <openssl/ssl.h>
+
+#include <string>
+#include <unordered_map>
+
+/**
+ * Certificate chain verification that remembers its successes. The
+ * expander reconnects to the same few shorteners over and over, and on every
+ * full handshake OpenSSL would build and check the same chain again. Once a
+ * leaf certificate has been verified for a host, later handshakes presenting
+ * it for that host are accepted after hashing it, until the entry expires or
+ * the certificate does. Failures are not cached.
+ *
+ * The handshake itself still proves that the server holds the leaf's private
+ * key, so only path building and signature checks of the chain are skipped.
+ * Revocation is not checked either way.
+ */
+class VerificationCache {
+ public:
+  VerificationCache() : enabled(true), cache_hits(0), cache_misses(0) {}
+
+  /**
+   * Verify peers of connections made from ctx, through this cache. The
+   * trusted certificates are those of ctx's store. Hostnames are checked
+   * by OpenSSL if set on the connection with SSL_set1_host, or otherwise by
+   * the caller after the handshake, as curl does.
+   */
+  void install(SSL_CTX* ctx);
+
+  /**
+   * Whether to cache successful verifications. Enabled by default.
+   */
+  void set_enabled(bool enabled);
+
+  size_t hits() const
+  {
+    return cache_hits;
+  }
+
+  size_t misses() const
+  {
+    return cache_misses;
+  }
+
+  /**
+   * Estimated bytes held by cached verifications.
+   */
+  size_t bytes() const;
+
+  void clear()
+  {
+    verified.clear();
+  }
+
+ private:
+  static int verify(X509_STORE_CTX* store_ctx, void* arg);
+
+  bool enabled;
+  size_t cache_hits;
+  size_t cache_misses;
+
+  /**
+   * Expiry of verified leaf certificates, keyed by host and SHA-256
+   * fingerprint.
+   */
+  std::unordered_map<std::string, long long> verified;
+};
+
+#endif
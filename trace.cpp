@@ -0,0 +1,144 @@
+#include "trace.h"
+
+#include <aws/core/utils/json/JsonSerializer.h>
+
+#include <cstdlib>
+
+using namespace Aws::Utils::Json;
+
+std::string trace_entry_to_json(const TraceEntry& entry)
+{
+  Aws::Utils::Array<JsonValue> hops(entry.hops.size());
+  for (size_t i = 0; i < entry.hops.size(); i++) {
+    const TraceHop& hop = entry.hops[i];
+    Aws::Utils::Array<JsonValue> headers(hop.headers.size());
+    for (size_t j = 0; j < hop.headers.size(); j++) {
+      headers[j].WithString("name", hop.headers[j].first);
+      headers[j].WithString("value", hop.headers[j].second);
+    }
+    hops[i].WithString("url", hop.url);
+    hops[i].WithString("protocol", hop.protocol);
+    hops[i].WithInt64("status", hop.status);
+    hops[i].WithInt64("latency_us", hop.latency_us);
+    hops[i].WithArray("headers", std::move(headers));
+  }
+  JsonValue json;
+  json.WithString("url", entry.url);
+  json.WithInt64("error_code", entry.error_code);
+  json.WithArray("hops", std::move(hops));
+  return json.View().WriteCompact();
+}
+
+bool trace_entry_from_json(const std::string& line, TraceEntry& entry)
+{
+  JsonValue json(line);
+  if (!json.WasParseSuccessful()) {
+    return false;
+  }
+  auto v = json.View();
+  if (!v.ValueExists("url") || !v.ValueExists("hops")) {
+    return false;
+  }
+  entry.url = v.GetString("url");
+  entry.error_code = v.ValueExists("error_code") ? v.GetInt64("error_code") : 0;
+  auto hops = v.GetArray("hops");
+  entry.hops.resize(hops.GetLength());
+  for (size_t i = 0; i < hops.GetLength(); i++) {
+    TraceHop& hop = entry.hops[i];
+    hop.url = hops[i].GetString("url");
+    hop.protocol = hops[i].GetString("protocol");
+    hop.status = hops[i].GetInt64("status");
+    hop.latency_us = hops[i].GetInt64("latency_us");
+    auto headers = hops[i].GetArray("headers");
+    hop.headers.clear();
+    for (size_t j = 0; j < headers.GetLength(); j++) {
+      hop.headers.push_back(std::make_pair(headers[j].GetString("name"), headers[j].GetString("value")));
+    }
+  }
+  return true;
+}
+
+TraceRecorder* TraceRecorder::open(CURL* curl, const char* path)
+{
+  FILE* file = fopen(path, "a");
+  if (file == NULL) {
+    return NULL;
+  }
+  return new TraceRecorder(curl, file);
+}
+
+TraceRecorder::TraceRecorder(CURL* curl, FILE* file)
+  : curl(curl)
+  , file(file)
+{
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, this);
+}
+
+TraceRecorder::~TraceRecorder()
+{
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
+  fclose(file);
+}
+
+void TraceRecorder::begin(const char* url)
+{
+  entry = TraceEntry();
+  entry.url = url;
+  hop_start = std::chrono::steady_clock::now();
+}
+
+void TraceRecorder::end(CURLcode res)
+{
+  entry.error_code = res;
+  std::string line = trace_entry_to_json(entry);
+  fprintf(file, "%s\n", line.c_str());
+  fflush(file);
+}
+
+/**
+ * curl calls this once per header line of every response, including the
+ * status line and the blank line that ends the headers.
+ */
+size_t TraceRecorder::header_callback(char* buffer, size_t size, size_t nitems, void* userdata)
+{
+  TraceRecorder* recorder = static_cast<TraceRecorder*>(userdata);
+  size_t length = size * nitems;
+  std::string line(buffer, length);
+  while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+    line.pop_back();
+  }
+
+  if (line.compare(0, 5, "HTTP/") == 0) {
+    // Status line, which starts a new hop. curl has already switched the
+    // effective URL to the URL of this hop.
+    TraceHop hop;
+    char* url = NULL;
+    curl_easy_getinfo(recorder->curl, CURLINFO_EFFECTIVE_URL, &url);
+    if (url != NULL) {
+      hop.url = url;
+    }
+    size_t space = line.find(' ');
+    hop.protocol = line.substr(0, space);
+    if (space != std::string::npos) {
+      hop.status = std::atol(line.c_str() + space + 1);
+    }
+    recorder->entry.hops.push_back(hop);
+  } else if (recorder->entry.hops.empty()) {
+    return length;
+  } else if (line.empty()) {
+    auto now = std::chrono::steady_clock::now();
+    recorder->entry.hops.back().latency_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(now - recorder->hop_start).count();
+    recorder->hop_start = now;
+  } else {
+    size_t colon = line.find(':');
+    if (colon != std::string::npos) {
+      size_t value = line.find_first_not_of(" \t", colon + 1);
+      recorder->entry.hops.back().headers.push_back(std::make_pair(
+            line.substr(0, colon), value == std::string::npos ? "" : line.substr(value)));
+    }
+  }
+  return length;
+}
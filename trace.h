@@ -0,0 +1,95 @@
+#ifndef URL_EXPANDER_TRACE_H
+#define URL_EXPANDER_TRACE_H
+
+#include <curl/curl.h>
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * One HTTP response observed while following redirects.
+ */
+struct TraceHop {
+  /**
+   * The absolute URL that was requested.
+   */
+  std::string url;
+
+  /**
+   * The protocol from the status line, e.g. HTTP/1.1 or HTTP/2.
+   */
+  std::string protocol;
+
+  long status = 0;
+
+  /**
+   * Response headers in the order received, with names as sent by the server.
+   */
+  std::vector<std::pair<std::string, std::string> > headers;
+
+  /**
+   * Time from the end of the previous hop (or the start of the expansion) to
+   * the end of this hop's response headers. Includes DNS, connect and TLS
+   * time when the hop needed a new connection.
+   */
+  long latency_us = 0;
+};
+
+/**
+ * Every hop of one expansion, in order.
+ */
+struct TraceEntry {
+  std::string url;
+  long error_code = 0;
+  std::vector<TraceHop> hops;
+};
+
+/**
+ * Trace files contain one JSON object per line, each one a TraceEntry:
+ *     {"url": "...", "error_code": 0, "hops": [{"url": "...",
+ *      "protocol": "HTTP/1.1", "status": 301, "latency_us": 1234,
+ *      "headers": [{"name": "Location", "value": "..."}, ...]}, ...]}
+ */
+std::string trace_entry_to_json(const TraceEntry& entry);
+
+/**
+ * Parse one line of a trace file. Returns false if the line is malformed.
+ */
+bool trace_entry_from_json(const std::string& line, TraceEntry& entry);
+
+/**
+ * Captures the hops of expansions performed on a curl handle and appends them
+ * to a trace file. Installs itself as the handle's header callback.
+ */
+class TraceRecorder {
+ public:
+  /**
+   * Open path for appending. Returns NULL if the file cannot be opened.
+   */
+  static TraceRecorder* open(CURL* curl, const char* path);
+  ~TraceRecorder();
+
+  /**
+   * Call immediately before curl_easy_perform.
+   */
+  void begin(const char* url);
+
+  /**
+   * Call immediately after curl_easy_perform. Writes the entry to the file.
+   */
+  void end(CURLcode res);
+
+ private:
+  TraceRecorder(CURL* curl, FILE* file);
+  static size_t header_callback(char* buffer, size_t size, size_t nitems, void* userdata);
+
+  CURL* curl;
+  FILE* file;
+  TraceEntry entry;
+  std::chrono::steady_clock::time_point hop_start;
+};
+
+#endif